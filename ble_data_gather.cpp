@@ -30,7 +30,128 @@
  * of discoverable BLE devices around us, not just the wanted
  * ones.  And there are loads of these things about.
  */
-#define MAX_NUM_BLE_DEVICES 100
+#define MAX_NUM_BLE_DEVICES 250
+
+/** The number of entries in each of the hash indexes into
+ * the BLE device list; must be a power of two and should be
+ * at least twice MAX_NUM_BLE_DEVICES to keep probe sequences
+ * short.
+ */
+#define BLE_DEVICE_INDEX_SIZE 512
+
+/** Marker for an empty entry in a hash index.
+ */
+#define BLE_DEVICE_INDEX_EMPTY -1
+
+/** The number of readings that may be waiting to be moved from
+ * the BLE callbacks into the data stores; must be a power of two.
+ */
+#define BLE_READING_QUEUE_SIZE 32
+
+/** The maximum number of rejected BLE devices to remember;
+ * should be no more than half of BLE_DEVICE_INDEX_SIZE.
+ */
+#define MAX_NUM_BLE_REJECTED_DEVICES 120
+
+/** How long to remember that a device is not one of ours
+ * before looking at it again.
+ */
+#define BLE_REJECTED_EXPIRY_SECONDS 3600
+
+/** How long to leave a device alone after a transient
+ * failure (e.g. it kept dropping the connection during
+ * discovery), doubled each time it fails again, up to
+ * BLE_REJECTED_EXPIRY_SECONDS.
+ */
+#define BLE_REJECTED_RETRY_SECONDS 60
+
+/** The maximum number of BLE devices that are not (yet) wanted
+ * which may be connected to at once, e.g. for discovery.
+ */
+#define MAX_NUM_BLE_DISCOVERING_DEVICES 4
+
+/** The maximum size of a single data item read from a BLE
+ * device; longer readings are not stored.
+ */
+#define BLE_MAX_DATA_ITEM_SIZE 8
+
+/** The number of bytes of data store allowed per device for
+ * each data item asked for in bleInit(): enough for a data item
+ * with a timestamp, were it not packed, see BleDataStore.
+ */
+#define BLE_DATA_STORE_BYTES_PER_ITEM sizeof(BleDataSlot)
+
+/** The number of bytes of the memory budget, see
+ * bleSetMemoryBudget(), kept back from the data stores for
+ * each Device Name.
+ */
+#define BLE_MEMORY_BUDGET_BYTES_PER_NAME 24
+
+/** The maximum number of characteristics to read from each
+ * wanted device, see bleSetWantedCharacteristicUuids().
+ */
+#define MAX_NUM_BLE_WANTED_CHARACTERISTICS 4
+
+/** The number of bits of the delta timestamp of a packed data
+ * item used to hold the index of the characteristic it is from.
+ */
+#define BLE_CHARACTERISTIC_INDEX_BITS 2
+
+/** The flag in the delta timestamp of a packed data item which
+ * says that a repeat count follows, see BleDataStore.
+ */
+#define BLE_DATA_ITEM_FLAG_REPEATS (1 << BLE_CHARACTERISTIC_INDEX_BITS)
+
+/** The number of bits that the delta timestamp of a packed
+ * data item is shifted up by.
+ */
+#define BLE_DATA_ITEM_DELTA_SHIFT (BLE_CHARACTERISTIC_INDEX_BITS + 1)
+
+/** The most readings that can be counted as repeats of a
+ * stored data item, see bleSetDeadband().
+ */
+#define BLE_MAX_NUM_REPEATS 0xFFFF
+
+/** The maximum number of bytes of a varint holding an int.
+ */
+#define BLE_MAX_VARINT_SIZE 5
+
+/** The maximum number of entries in the discovery cache.
+ */
+#define MAX_NUM_BLE_DISCOVERY_CACHE_ENTRIES 50
+
+/** The maximum length of a device name in the discovery
+ * cache, that of the longest name an advertisement can carry,
+ * which is longer than a single read of the Device Name returns;
+ * a wanted device with a longer name is left out of the cache,
+ * so that its name is read again rather than cut short.
+ */
+#define BLE_DISCOVERY_CACHE_DEVICE_NAME_LENGTH 29
+
+/** The number of successive runs of BLE that a device in
+ * the discovery cache may go unseen before it is dropped from
+ * the discovery cache.
+ */
+#define BLE_DISCOVERY_CACHE_MAX_MISSED_CYCLES 5
+
+/** Flag in a discovery cache entry to indicate that readings
+ * are taken from the device's advertisements.
+ */
+#define BLE_DISCOVERY_CACHE_FLAG_OBSERVED 0x01
+
+/** Magic number at the start of the discovery cache in flash,
+ * changed whenever BleDiscoveryCacheEntry changes.
+ */
+#define BLE_DISCOVERY_CACHE_MAGIC 0x0B1EDCB0
+
+/** The size of the header written by bleDrainAll().
+ */
+#define BLE_DRAIN_HEADER_SIZE 4
+
+/** The flag in the length byte of a record written by
+ * bleDrainAll() which says that a repeat count follows.
+ */
+#define BLE_DRAIN_FLAG_REPEATS 0x80
 
 /** Storage required for a BLE address.
  */
@@ -49,11 +170,76 @@
  */
 #define BLE_CONNECTION_TIMEOUT_SECONDS 1
 
-/** The period at which to obtain readings (should be longer than
- * the connection time-out).
+/** The default period at which to obtain readings from
+ * each wanted device (should be longer than the connection
+ * time-out).
  */
 #define BLE_READ_INTERVAL_SECONDS 2
 
+/** The interval at which the read scheduler checks for
+ * devices that have become due; it is also run whenever a
+ * connection comes up or goes down.
+ */
+#define BLE_READ_SCHEDULER_TICK_MS 250
+
+/** The scan interval; this is also the period at which the
+ * adaptive scan controller looks at what scanning has found,
+ * see bleSetAdaptiveScan().
+ */
+#define BLE_SCAN_INTERVAL_MS 1000
+
+/** The scan window used when scanning is not adaptive, or when
+ * new advertisers are turning up.
+ */
+#define BLE_SCAN_WINDOW_MAX_MS 500
+
+/** The scan window that the adaptive scan controller will not
+ * go below.
+ */
+#define BLE_SCAN_WINDOW_MIN_MS 50
+
+/** The number of scan intervals in a row without anything new
+ * after which the adaptive scan controller halves the scan window.
+ */
+#define BLE_SCAN_STABLE_INTERVALS 5
+
+/** The delay before retrying a device after a failed reading,
+ * doubled for each further consecutive failure.
+ */
+#define BLE_READ_RETRY_MS 1000
+
+/** The maximum delay before retrying a device after failed
+ * readings.
+ */
+#define BLE_MAX_READ_RETRY_SECONDS 30
+
+/** A read of the wanted characteristic made straight after
+ * connecting may return all zeroes; the number of times to
+ * read again before believing it.
+ */
+#define BLE_MAX_NUM_ZERO_READ_RETRIES 3
+
+/** The delay before reading again after an all-zero read.
+ */
+#define BLE_ZERO_READ_RETRY_MS 20
+
+/** The default maximum number of connections to be
+ * connecting or connected at any one time (not counting
+ * those held open for notifications).
+ */
+#define BLE_DEFAULT_MAX_NUM_CONNECTIONS 1
+
+/** The longest a connection for discovery or for a reading
+ * may stay up before we give up on it and disconnect.
+ */
+#define BLE_LINK_TIMEOUT_SECONDS 5
+
+/** The minimum period between readings taken from the
+ * advertisements of a device in observer mode; devices
+ * usually advertise far more often than this.
+ */
+#define BLE_OBSERVER_READ_INTERVAL_SECONDS BLE_READ_INTERVAL_SECONDS
+
 /**************************************************************************
  * TYPES
  *************************************************************************/
@@ -67,6 +253,14 @@ typedef enum {
     MAX_NUM_BLE_CONNECTION_STATES
 } BleConnectionState;
 
+/** Why a connection or a reading failed.
+ */
+typedef enum {
+    BLE_FAILURE_DISCONNECT,
+    BLE_FAILURE_TIMEOUT,
+    BLE_FAILURE_GATT_ERROR
+} BleFailure;
+
 /** The states that a BLE device can be in.
  */
 typedef enum {
@@ -77,31 +271,167 @@ typedef enum {
     MAX_NUM_BLE_DEVICE_STATES
 } BleDeviceState;
 
-/** Structure to contain some data read from a BLE peer.
+/** How well a name matches the Device Name prefix.
  */
-typedef struct BleDataContainerTag {
-    BleData dataStruct;
-    BleDataContainerTag *pPrevious;
-    BleDataContainerTag *pNext;
-} BleDataContainer;
+typedef enum {
+    BLE_NAME_MATCH_NO,
+    BLE_NAME_MATCH_MAYBE,
+    BLE_NAME_MATCH_YES
+} BleNameMatch;
 
-/** Structure defining a BLE device.
+/** Structure to contain a single data item read from a BLE peer,
+ * unpacked from a data store.
  */
 typedef struct {
-    char address[BLE_ADDRESS_SIZE];
-    int addressType;
-    BleDeviceState deviceState;
-    BleConnectionState connectionState;
+    int timestamp;
+    uint8_t characteristicIndex; /// Index into gWantedCharacteristic.
+    char dataLen;
+    char data[BLE_MAX_DATA_ITEM_SIZE];
+    uint16_t numRepeats; /// See BleData.
+} BleDataSlot;
+
+/** A position in the data items of a data store.
+ */
+typedef struct {
+    int index; /// The number of data items before this one.
+    int offset; /// The offset in bytes from the oldest data item.
+    int timestamp; /// The timestamp of the data item before this one.
+} BleDataCursor;
+
+/** A ring buffer of packed data items for a wanted BLE device.
+ * Each data item is the number of seconds since the data item
+ * before it (ignored for the oldest data item, whose timestamp is
+ * kept in oldestTimestamp), shifted up by BLE_DATA_ITEM_DELTA_SHIFT
+ * with BLE_DATA_ITEM_FLAG_REPEATS and the index of the
+ * characteristic in the bottom bits, as an unsigned varint, then,
+ * if the flag is set, the repeat count as an unsigned varint, then,
+ * unless gBleFixedDataLen is non-zero, one byte of length, then the
+ * data.  lastStored holds the data item last stored for each
+ * characteristic, with the number of readings since that were
+ * just like it and lastRepeatTimestamp the timestamp of the
+ * last of those, for bleSetDeadband().
+ * The ring buffer is gBleDataStoreSize bytes long and is part of
+ * the block allocated in bleInit(); when it is full the oldest
+ * data items are overwritten.  inUse, pArena and generation are
+ * written by the BLE callbacks, the rest only by the consumer,
+ * see gBleReadingQueue.
+ */
+typedef struct {
+    volatile bool inUse;
+    volatile uint8_t generation; /// Incremented each time the data store is allocated.
+    uint8_t consumerGeneration; /// The generation the consumer last emptied the data store for.
+    char *pArena;
+    int oldest; /// Index of the first byte of the oldest data item in pArena.
+    int numBytes;
+    int numItems;
+    int oldestTimestamp;
+    int newestTimestamp;
+    BleDataCursor nextItemToRead;
+    int deadband; /// See bleSetDeadband(), negative for off.
+    int maxSilentSeconds; /// See bleSetDeadband(), 0 for no limit.
+    bool lastStoredValid[MAX_NUM_BLE_WANTED_CHARACTERISTICS];
+    BleDataSlot lastStored[MAX_NUM_BLE_WANTED_CHARACTERISTICS];
+    int lastRepeatTimestamp[MAX_NUM_BLE_WANTED_CHARACTERISTICS];
+    int numBytesStored; /// Bytes written since bleStart(), see BleDeviceStats.
+} BleDataStore;
+
+/** The parts of a BLE device that are only needed while it is
+ * being connected to or once it is wanted, kept apart from the
+ * BleDevice so that the devices which are neither cost little.
+ */
+typedef struct {
+    bool inUse;
     Gap::Handle_t connectionHandle;
-    int discoveryAttempts;
     int numCharacteristics;
-    DiscoveredCharacteristic *pDeviceNameCharacteristic;
-    DiscoveredCharacteristic *pWantedCharacteristic;
+    GattAttribute::Handle_t deviceNameHandle; /// Value handle, zero if not known.
+    GattAttribute::Handle_t wantedHandle[MAX_NUM_BLE_WANTED_CHARACTERISTICS]; /// Value handles, zero if not known.
     char *pDeviceName;
-    BleDataContainer *pDataContainer;
-    BleDataContainer *pNextDataItemToRead;
+    BleDataStore *pDataStore;
+    bool isObserved; /// True if readings are taken from advertisements.
+    GattAttribute::Handle_t cccdHandle; /// Handle of the CCCD of the first wanted characteristic, zero if it has none or it is not known.
+    bool isHeld; /// True if the connection is being held open for notifications.
+    int connectionStateMs; /// The time at which connectionState last changed.
+    int readPeriodMs; /// The period at which to take readings from this device.
+    int nextReadMs; /// The time at which the next reading is due.
+    int readStartMs; /// The time at which the current or last reading was started.
+    int lastReadDurationMs; /// How long the last successful reading took, connection included.
+    int numConsecutiveReadFailures; /// The number of readings that have failed in a row.
+    bool readInProgress; /// True if a reading has been started but not completed.
+    int readingCharacteristic; /// The index of the wanted characteristic being read.
+    bool readReturnedData; /// True if any wanted characteristic has returned data during this reading.
+    bool discoveringWantedService; /// True once targeted discovery has moved on from the GAP service.
+    int numZeroReadRetries; /// The number of times an all-zero read has been retried on this connection.
+    int eventId; /// The ID of a one-shot event queued for this connection, 0 if there is none, see cancelBleEvent().
+    int lastReadingTime; /// The time at which the last reading was queued, zero if there has been none.
+    BleFailure failure; /// What to blame if the connection to the device ends before its work is done.
+    BleDeviceStats stats; /// Counters kept since bleStart().
+} BleDeviceDetail;
+
+/** Structure defining a BLE device; the list holds every
+ * device that has been seen, most of which turn out not to be
+ * wanted, so this is kept to 16 bytes (on a 32-bit target).
+ */
+typedef struct {
+    int lastSeenTime; /// The time at which the device was last seen.
+    BleDeviceDetail *pDetail; /// NULL unless the device is wanted or is being connected to.
+    char address[BLE_ADDRESS_SIZE];
+    uint8_t addressType : 2;
+    uint8_t deviceState : 2; /// A BleDeviceState.
+    uint8_t connectionState : 2; /// A BleConnectionState.
+    uint8_t seen : 1; /// True if the device has been seen during this run of BLE.
+    uint8_t notWantedForNow : 1; /// True if deviceState is NOT_WANTED because of a transient failure.
+    uint8_t discoveryAttempts : 4; /// No more than BLE_MAX_DISCOVERY_ATTEMPTS.
+    uint8_t missedCycles : 4; /// The number of runs of BLE in which the device was not seen, see BLE_DISCOVERY_CACHE_MAX_MISSED_CYCLES.
 } BleDevice;
 
+/** A reading on its way from the BLE callbacks to the data
+ * store of a device, see gBleReadingQueue.
+ */
+typedef struct {
+    int timestamp;
+    uint8_t dataStoreIndex; /// The index of the data store in gpBleDataStore.
+    uint8_t generation; /// The generation of the data store when the reading was queued.
+    uint8_t characteristicIndex; /// Index into gWantedCharacteristic.
+    char dataLen;
+    char data[BLE_MAX_DATA_ITEM_SIZE];
+} BleReading;
+
+/** A device that has been rejected, kept in the negative
+ * cache in place of a BleDevice.
+ */
+typedef struct {
+    int expiryTime; /// The time at which to forget the rejection.
+    char address[BLE_ADDRESS_SIZE];
+    uint8_t addressType;
+    uint8_t numRejections; /// The number of times the device has been rejected.
+    bool isTransient; /// True if the rejection was because of a transient failure.
+} BleRejectedDevice;
+
+/** An entry in the discovery cache.
+ */
+typedef struct {
+    char address[BLE_ADDRESS_SIZE];
+    uint8_t addressType;
+    uint8_t deviceState;
+    GattAttribute::Handle_t wantedHandle[MAX_NUM_BLE_WANTED_CHARACTERISTICS];
+    GattAttribute::Handle_t cccdHandle;
+    uint8_t flags;
+    char deviceName[BLE_DISCOVERY_CACHE_DEVICE_NAME_LENGTH]; /// Not NULL terminated if full.
+} BleDiscoveryCacheEntry;
+
+/** The discovery cache: what is known about the devices
+ * from previous runs of BLE.  This is the image that is
+ * stored in flash.
+ */
+typedef struct {
+    uint32_t magic;
+    uint32_t numEntries;
+    uint32_t uuidChecksum;   /// Checksum of the wanted UUIDs that the entries were found with, see bleWantedUuidChecksum().
+    uint32_t wantedChecksum; /// Checksum of the wanted entries only.
+    uint32_t checksum;       /// Checksum of all the entries.
+    BleDiscoveryCacheEntry entry[MAX_NUM_BLE_DISCOVERY_CACHE_ENTRIES];
+} BleDiscoveryCache;
+
 /**************************************************************************
  * VARIABLES
  *************************************************************************/
@@ -114,39 +444,302 @@ EventQueue *gpBleEventQueue = NULL;
  */
 BleDevice gBleDeviceList[MAX_NUM_BLE_DEVICES];
 
-/** Mutex to protect the list.
+/** The details of the BLE devices in gBleDeviceList that are
+ * wanted or are being connected to, gNumBleDeviceDetails of
+ * them, malloc()ed in bleInit().
+ */
+static BleDeviceDetail *gpBleDeviceDetail = NULL;
+
+/** The number of sets of details in gpBleDeviceDetail: one
+ * for each wanted device plus MAX_NUM_BLE_DISCOVERING_DEVICES.
+ */
+static int gNumBleDeviceDetails = 0;
+
+/** Hash index into gBleDeviceList by BLE address, see
+ * bleAddressHash().  Each entry is the index of a device in
+ * gBleDeviceList or BLE_DEVICE_INDEX_EMPTY.
+ */
+static int16_t gBleAddressIndex[BLE_DEVICE_INDEX_SIZE];
+
+/** Hash index into gBleDeviceList by connection handle,
+ * containing only the devices that are connected.
+ */
+static int16_t gBleConnectionIndex[BLE_DEVICE_INDEX_SIZE];
+
+/** The negative cache: devices that are not wanted, so
+ * that they do not take up space in gBleDeviceList; survives
+ * bleDeinit().
+ */
+static BleRejectedDevice gBleRejectedList[MAX_NUM_BLE_REJECTED_DEVICES];
+
+/** The number of devices in gBleRejectedList.
+ */
+static int gNumBleRejectedDevices = 0;
+
+/** Hash index into gBleRejectedList by BLE address, rebuilt
+ * by bleInit().
+ */
+static int16_t gBleRejectedIndex[BLE_DEVICE_INDEX_SIZE];
+
+/** The discovery cache, survives bleDeinit().
+ */
+static BleDiscoveryCache gBleDiscoveryCache;
+
+/** The number of runs of BLE that each discovery cache
+ * entry has gone unseen for; not stored in flash.
+ */
+static uint8_t gBleDiscoveryCacheMissedCycles[MAX_NUM_BLE_DISCOVERY_CACHE_ENTRIES];
+
+/** The maximum number of wanted BLE devices that we can store
+ * data for, as given to bleInit().
+ */
+static int gMaxNumBleWantedDevices = 0;
+
+/** The data stores for wanted BLE devices,
+ * gMaxNumBleWantedDevices of them, malloc()ed in bleInit().
+ */
+static BleDataStore *gpBleDataStore = NULL;
+
+/** The block of memory used by gpBleDataStore, malloc()ed in
+ * bleInit().
+ */
+static char *gpBleDataArena = NULL;
+
+/** The size of the ring buffer of each data store in bytes.
+ */
+static int gBleDataStoreSize = 0;
+
+/** The size of the ring buffer of each data store asked
+ * for in bleInit(), before any memory budget is applied.
+ */
+static int gBleDataStoreInitSize = 0;
+
+/** The most memory, in bytes, that this module may have
+ * malloc()ed at any one time, 0 for no limit.
+ */
+static int gBleMemoryBudget = 0;
+
+/** The memory, in bytes, that this module has malloc()ed.
+ */
+static int gBleMemoryUsed = 0;
+
+/** If non-zero, all data items are stored with this length,
+ * without a length byte, see bleSetFixedDataLength().
+ */
+static int gBleFixedDataLen = 0;
+
+/** The deadband and maximum silent interval given to data
+ * stores when they are emptied, see bleSetDeadband(); these
+ * belong to the consumer.
+ */
+static int gBleDeadband = -1;
+static int gBleMaxSilentSeconds = 0;
+
+/** Single-producer, single-consumer queue of readings: the BLE
+ * callbacks (the producer) put readings in here and whoever
+ * holds gDataMtx (the consumer) moves them into the data
+ * stores, so that the BLE callbacks need never wait for the
+ * data functions of the API.
+ */
+static BleReading gBleReadingQueue[BLE_READING_QUEUE_SIZE];
+
+/** The number of readings ever put into gBleReadingQueue;
+ * written only by the producer.
+ */
+static volatile uint32_t gBleReadingQueueHead = 0;
+
+/** The number of readings ever taken from gBleReadingQueue;
+ * written only by the consumer.
+ */
+static volatile uint32_t gBleReadingQueueTail = 0;
+
+/** Mutex to protect the list; the data stores are not
+ * protected by it, see gBleReadingQueue.
  */
 Mutex gMtx;
 
+/** Mutex to protect the data stores: the data functions of the
+ * API hold it while they use the data stores and the BLE
+ * callbacks take it, only if it is free, to empty
+ * gBleReadingQueue when the API is not being called often
+ * enough to do so.  Where both are needed gDataMtx is locked
+ * before gMtx.
+ */
+static Mutex gDataMtx;
+
 /** Helper to make sure that lock unlock pair is always balanced.
  */
-#define LOCK()         { gMtx.lock()
+#define LOCK()         { gMtx.lock(); bleLocked()
 
 /** Helper to make sure that lock unlock pair is always balanced.
  */
-#define UNLOCK()       } gMtx.unlock()
+#define UNLOCK()       bleUnlocking(); } gMtx.unlock()
+
+/** Helper to make sure that data lock unlock pair is always balanced.
+ */
+#define DATA_LOCK()    { gDataMtx.lock()
+
+/** Helper to make sure that data lock unlock pair is always balanced.
+ */
+#define DATA_UNLOCK()  } gDataMtx.unlock()
+
+/** How deeply gMtx is locked, and when it was first locked,
+ * for the lock hold time counters in gBleStats.
+ */
+static int gLockDepth = 0;
+static int gLockStartUs = 0;
 
 /** The Device Name prefix to look for.
  */
 static const char *gpDeviceNamePrefix = NULL;
 
-/** The characteristic to read from a device.
+/** The characteristics to read from a device; if there is only
+ * one it may be a 128-bit UUID, see bleSetWantedLongUuids(), in
+ * which case its 16-bit alias is what is reported as its UUID.
+ */
+static UUID gWantedCharacteristic[MAX_NUM_BLE_WANTED_CHARACTERISTICS];
+
+/** The number of entries in gWantedCharacteristic.
+ */
+static int gNumWantedCharacteristics = 1;
+
+/** The service containing the wanted characteristic, used to
+ * target service discovery, BLE_UUID_UNKNOWN to discover all
+ * services.
+ */
+static UUID gWantedService;
+
+/** The first wanted characteristic as last found by service
+ * discovery, kept so that its descriptors can be discovered once
+ * service discovery is over, to find its CCCD.
  */
-static int gWantedCharacteristicUuid = 0;
+static DiscoveredCharacteristic gBleNotifyCharacteristic;
 
-/** The maximum number of data items to store per device.
+/** The service UUID to look for in advertisements in observer
+ * mode, zero if observer mode is off.
  */
-static int gMaxNumDataItemsPerDevice = 0;
+static int gObserverUuid = 0;
+
 
 /** The number of devices in the list.
  */
 static int gNumBleDevicesInList = 0;
 
-/** The next device in the list to take a reading from.
+/** The maximum number of connections to hold open for
+ * notifications, zero to always poll.
+ */
+static int gMaxNumHeldConnections = 0;
+
+/** The number of connections currently held open for
+ * notifications.
+ */
+static int gNumHeldConnections = 0;
+
+/** The maximum number of connections that may be connecting
+ * or connected at any one time, not counting those held open
+ * for notifications.
+ */
+static int gMaxNumConnections = BLE_DEFAULT_MAX_NUM_CONNECTIONS;
+
+/** The number of devices that are not disconnected, including
+ * those held open for notifications.
+ */
+static int gNumConnections = 0;
+
+/** The number of devices that we are connecting to; only
+ * one connection may be initiated at a time.
+ */
+static int gNumConnecting = 0;
+
+/** Timer used to time out connections.
+ */
+static Timer gBleTimer;
+
+/** The period at which to take readings from a newly
+ * found wanted device.
+ */
+static int gDefaultReadPeriodMs = BLE_READ_INTERVAL_SECONDS * 1000;
+
+/** Counters for BLE as a whole during this run of BLE,
+ * see bleGetStats().
+ */
+static BleStats gBleStats;
+
+/** True between bleStart() and bleStop().
+ */
+static bool gBleRunning = false;
+
+/** True once the device list has been populated from the
+ * discovery cache, which is done by the first bleStart() after
+ * bleInit() so that the wanted UUIDs have been set by then.
+ */
+static bool gBleDiscoveryCacheRestored = false;
+
+/** The IDs of the events that BLE has put on the event queue
+ * and which must be cancelled by bleStop(), 0 if there are none.
+ */
+static int gBleStopEventId = 0;
+static int gBleReadingsEventId = 0;
+static int gBleScanEventId = 0;
+
+/** The callback to call, and its context, when BLE is stopped.
+ */
+static BleDoneCallback gpBleDoneCallback = NULL;
+static void *gpBleDoneCallbackContext = NULL;
+
+/** True if the scan window is adapted to how much scanning is
+ * finding, see bleSetAdaptiveScan().
+ */
+static bool gAdaptiveScanOn = false;
+
+/** The scan window in use.
+ */
+static int gScanWindowMs = BLE_SCAN_WINDOW_MAX_MS;
+
+/** The number of new devices, and of wanted devices seen for the
+ * first time during this run of BLE, since the adaptive scan
+ * controller last looked.
+ */
+static int gScanYield = 0;
+
+/** The number of scan intervals in a row in which gScanYield
+ * has been zero.
+ */
+static int gNumScanIntervalsWithoutYield = 0;
+
+/** The radio-on time saved during this run of BLE by scanning
+ * with less than BLE_SCAN_WINDOW_MAX_MS.
+ */
+static int gScanTimeSavedMs = 0;
+
+/** The number of readings that every wanted device must have
+ * given for a run of BLE to end early, 0 if this should not end
+ * a run early, see bleSetEarlyStop().
+ */
+static int gEarlyStopNumReadings = 0;
+
+/** The period without a new device appearing, or a wanted
+ * device appearing for the first time, after which a run of
+ * BLE ends early, 0 if this should not end a run early, see
+ * bleSetEarlyStop().
+ */
+static int gEarlyStopQuietPeriodMs = 0;
+
+/** The time at which a new device last appeared, or a wanted
+ * device appeared for the first time, during this run of BLE.
+ */
+static int gLastNewDeviceMs = 0;
+
+/** The time at which this run of BLE started and, once it has
+ * stopped, how long it lasted, -1 while it is running.
  */
-static int gNextBleDeviceToRead = 0;
+static int gBleRunStartMs = 0;
+static int gBleRunDurationMs = 0;
 
-/** Index into the device list for pBleGetNextDeviceName().
+/** Index into gpBleDeviceDetail for pBleGetNextDeviceName();
+ * the details, unlike the entries of the device list, stay where
+ * they are while devices come and go, so no device is skipped or
+ * returned twice if the list changes between calls.
  */
 static int gBleGetNextDeviceIndex = 0;
 
@@ -212,6 +805,82 @@ static char *pPrintBleAddress(const char *pAddress, char *pBuf);
  */
 static bool bleAddressTypesMatch(int addressType1, int addressType2);
 
+/** Determine if a BLE address type is a random one.
+ *
+ * @param addressType the address type.
+ * @return            true if the address type is random.
+ */
+static bool bleAddressTypeIsRandom(int addressType);
+
+/** Hash a BLE address and address type, consistent with
+ * bleAddressTypesMatch().
+ *
+ * @param  pAddress    a pointer to a BLE_ADDRESS_SIZE byte address.
+ * @param  addressType the address type.
+ * @return             the hash.
+ */
+static unsigned int bleAddressHash(const char *pAddress, int addressType);
+
+/** Hash a connection handle.
+ *
+ * @param  connectionHandle the connection handle.
+ * @return                  the hash.
+ */
+static unsigned int bleConnectionHash(Gap::Handle_t connectionHandle);
+
+/** Add a device to a hash index.
+ * Note that this does NOT lock the BLE list.
+ *
+ * @param pIndex      a pointer to the hash index.
+ * @param hash        the hash of the device's key.
+ * @param deviceIndex the index of the device in gBleDeviceList.
+ */
+static void addToBleDeviceIndex(int16_t *pIndex, unsigned int hash, int deviceIndex);
+
+/** Remove a device from a hash index.
+ * Note that this does NOT lock the BLE list.
+ *
+ * @param pIndex      a pointer to the hash index.
+ * @param pHash       a pointer to the function that hashes
+ *                    the key of a device in gBleDeviceList.
+ * @param deviceIndex the index of the device in gBleDeviceList.
+ */
+static void removeFromBleDeviceIndex(int16_t *pIndex, unsigned int (*pHash)(int),
+                                     int deviceIndex);
+
+/** Hash the address of a device in gBleDeviceList.
+ *
+ * @param  deviceIndex the index of the device in gBleDeviceList.
+ * @return             the hash.
+ */
+static unsigned int bleDeviceAddressHash(int deviceIndex);
+
+/** Hash the connection handle of a device in gBleDeviceList.
+ *
+ * @param  deviceIndex the index of the device in gBleDeviceList.
+ * @return             the hash.
+ */
+static unsigned int bleDeviceConnectionHash(int deviceIndex);
+
+/** Add a device to the connection index; the connection
+ * handle of the device must have been set.
+ * Note that this does NOT lock the BLE list.
+ *
+ * @param pBleDevice a pointer to the BLE device.
+ */
+static void addBleConnectionToIndex(BleDevice *pBleDevice);
+
+/** Remove a device from the connection index.
+ * Note that this does NOT lock the BLE list.
+ *
+ * @param pBleDevice a pointer to the BLE device.
+ */
+static void removeBleConnectionFromIndex(BleDevice *pBleDevice);
+
+/** Empty the hash indexes.
+ */
+static void clearBleDeviceIndexes();
+
 /** Find a BLE device in the list by its address.
  * Note that this does NOT lock the BLE list.
  *
@@ -240,13 +909,58 @@ static BleDevice *pFindBleDeviceInListByDeviceNamePtr(const char *pDeviceName);
  */
 static BleDevice *pFindBleConnectionInList(Gap::Handle_t connectionHandle);
 
-/** Find the first connected BLE device (there should be only one anyway).
+/** Find the BLE device that we are connecting to (there should
+ * be only one).
  * Note that this does NOT lock the BLE list.
  *
  * @return                 a pointer to the device entry or NULL if
- *                         no connected device is found.
+ *                         no connecting device is found.
+ */
+static BleDevice *pFindBleConnectingInList();
+
+/** Set the connection state of a BLE device, keeping count
+ * of the connections that are in flight.
+ * Note that this does NOT lock the BLE list.
+ *
+ * @param pBleDevice a pointer to the BLE device.
+ * @param state      the new connection state.
+ */
+static void setBleConnectionState(BleDevice *pBleDevice, BleConnectionState state);
+
+/** Count the taking of the lock on the BLE list; called by LOCK().
+ */
+static void bleLocked();
+
+/** Count the time the BLE list was locked for; called by UNLOCK().
+ */
+static void bleUnlocking();
+
+/** Count the failure of a connection or a reading.
+ * Note that this does NOT lock the BLE list.
+ *
+ * @param pBleDevice a pointer to the device.
  */
-static BleDevice *pFindBleNotDisconnectedInList();
+static void countBleFailure(BleDevice *pBleDevice);
+
+/** Determine whether a new connection may be initiated: only one
+ * connection may be initiated at a time and no more than
+ * gMaxNumConnections (plus any held open for notifications) may
+ * be in flight.
+ * Note that this does NOT lock the BLE list.
+ *
+ * @return true if a new connection may be initiated.
+ */
+static bool bleCanConnect();
+
+/** Determine whether service discovery is under way, or may be,
+ * on a connection: the stack can only discover one device at a
+ * time, so a connection made to discover another device while
+ * it is busy would be wasted.
+ * Note that this does NOT lock the BLE list.
+ *
+ * @return true if a device that is not yet known is connected.
+ */
+static bool bleIsDiscovering();
 
 /** Add a BLE device to the list.  If the device is already in
  * the list a pointer is returned to the (unmodified) existing
@@ -262,6 +976,7 @@ static BleDevice *pFindBleNotDisconnectedInList();
 static BleDevice *pAddBleDeviceToList(const char *pAddress, int addressType);
 
 /** Remove a BLE device from the list, including its data.
+ * The last device in the list is moved into the space freed up.
  * Note that this does NOT lock the BLE list.
  *
  * @param  pAddress    a pointer to the BLS address of the device.
@@ -271,59 +986,476 @@ static BleDevice *pAddBleDeviceToList(const char *pAddress, int addressType);
  */
 static int freeBleDevice(const char *pAddress, int addressType);
 
-/** Clear the BLE device list.
+/** Give a BLE device its details, if it does not have them
+ * already; a device must have its details before it is
+ * connected to and for as long as it is wanted.
+ * Note that this does NOT lock the BLE list.
+ *
+ * @param  pBleDevice a pointer to the device.
+ * @return            true if the device has its details, false
+ *                    if there are no free details.
  */
-static void clearBleDeviceList();
+static bool allocBleDeviceDetail(BleDevice *pBleDevice);
 
-/** Callback to obtain a reading from a BLE peer.
+/** Free the details of a BLE device, including its Device
+ * Name and its data store.
+ * Note that this does NOT lock the BLE list.
+ *
+ * @param pBleDevice a pointer to the device.
  */
-static void getBleReadingsCallback();
+static void freeBleDeviceDetail(BleDevice *pBleDevice);
 
-/** Add a data entry for a BLE device.
+/** Free the details of a BLE device if it has no more need of
+ * them: it is not connected, not wanted and has no data store.
+ * Note that this does NOT lock the BLE list.
+ *
+ * @param pBleDevice a pointer to the device.
+ */
+static void releaseUnusedBleDeviceDetail(BleDevice *pBleDevice);
+
+/** Allocate memory, keeping count of it and within the memory
+ * budget if there is one.
+ *
+ * @param  size the number of bytes to allocate.
+ * @return      a pointer to the memory or NULL if it could
+ *              not be allocated.
+ */
+static void *pBleMalloc(int size);
+
+/** Free memory allocated with pBleMalloc().
+ *
+ * @param pMem a pointer to the memory, may be NULL.
+ * @param size the number of bytes that were allocated.
+ */
+static void bleFree(void *pMem, int size);
+
+/** Free the data stores, the storage for their data items and
+ * the details of the devices, all allocated by bleInit().  BLE
+ * must not be running and the devices in the list must not be
+ * used afterwards, since they point at their details.
+ */
+static void freeBleStorage();
+
+/** Make a copy of the Device Name of a BLE device, within the
+ * memory budget.  Nothing is freed to make room: only devices
+ * with a data store are given a Device Name and those are
+ * never evicted, while the details of devices that are
+ * discovered or not wanted, the only other per-device
+ * information, are released as soon as those devices disconnect
+ * and hold nothing that counts against the budget.
+ *
+ * @param  pName   the name, which need not be terminated.
+ * @param  nameLen the length of the name.
+ * @return         a pointer to the terminated copy or NULL if
+ *                 there is no room.
+ */
+static char *pAllocBleDeviceName(const char *pName, int nameLen);
+
+/** Clear the BLE device list.
+ */
+static void clearBleDeviceList();
+
+/** Find the BLE device in the list that has gone unseen for
+ * longest and may be evicted to make room for another: one
+ * that is not wanted, is not connected and has no data store
+ * (which would hold readings and a Device Name that may have
+ * been handed out).
+ * Note that this does NOT lock the BLE list.
+ *
+ * @return a pointer to the device or NULL if there is none.
+ */
+static BleDevice *pFindLeastRecentlySeenBleDevice();
+
+/** Hash the address of a device in gBleRejectedList.
+ *
+ * @param  rejectedIndex the index of the device in gBleRejectedList.
+ * @return               the hash.
+ */
+static unsigned int bleRejectedDeviceAddressHash(int rejectedIndex);
+
+/** Rebuild the hash index into gBleRejectedList.
+ * Note that this does NOT lock the BLE list.
+ */
+static void rebuildBleRejectedIndex();
+
+/** Find a device in the negative cache, whether or not its
+ * rejection has expired.
+ * Note that this does NOT lock the BLE list.
+ *
+ * @param  pAddress    a pointer to the BLE address of the device.
+ * @param  addressType the address type of the device.
+ * @return             a pointer to the entry or NULL if the
+ *                     device is not found.
+ */
+static BleRejectedDevice *pFindBleRejectedDevice(const char *pAddress, int addressType);
+
+/** Determine whether a device is in the negative cache and
+ * its rejection has not yet expired.
+ * Note that this does NOT lock the BLE list.
  *
  * @param  pAddress    a pointer to the BLE address of the device.
  * @param  addressType the address type of the device.
- * @param  pData       a pointer to the data to add (which will be
- *                     copied into the list).
- * @param  dataLen     the length of the data pointed to by pData.
- * @return             the number of items now in the data list for the
- *                     device.
+ * @return             true if the device should be ignored.
+ */
+static bool bleDeviceIsRejected(const char *pAddress, int addressType);
+
+/** Remove a device from the negative cache.
+ * Note that this does NOT lock the BLE list.
+ *
+ * @param pAddress    a pointer to the BLE address of the device.
+ * @param addressType the address type of the device.
+ */
+static void forgetBleRejectedDevice(const char *pAddress, int addressType);
+
+/** Add a device to the negative cache or, if it is already
+ * there, renew its rejection.  A permanent rejection expires
+ * after BLE_REJECTED_EXPIRY_SECONDS, a transient one after
+ * a delay that starts at BLE_REJECTED_RETRY_SECONDS and doubles
+ * with each rejection.  If the negative cache is full, the
+ * entry that expires soonest is dropped to make room.
+ * Note that this does NOT lock the BLE list.
+ *
+ * @param pAddress    a pointer to the BLE address of the device.
+ * @param addressType the address type of the device.
+ * @param isTransient true if the rejection is because of a
+ *                    transient failure.
+ */
+static void rejectBleDevice(const char *pAddress, int addressType, bool isTransient);
+
+/** Move a device that has been marked as not wanted from the
+ * list into the negative cache.  The device must not be
+ * connected and pBleDevice must not be used afterwards.
+ * Note that this does NOT lock the BLE list.
+ *
+ * @param pBleDevice a pointer to the BLE device.
+ */
+static void releaseNotWantedBleDevice(BleDevice *pBleDevice);
+
+/** Checksum a block of memory.
+ *
+ * @param  pData   a pointer to the memory.
+ * @param  dataLen the length of the memory.
+ * @param  hash    the checksum to start from.
+ * @return         the checksum.
+ */
+static uint32_t bleChecksum(const char *pData, int dataLen, uint32_t hash);
+
+/** Add a BLE device to the discovery cache.
+ * Note that this does NOT lock the BLE list.
+ *
+ * @param pBleDevice a pointer to the BLE device.
+ * @return           true if the device was added, false if
+ *                   the discovery cache is full.
+ */
+static bool addBleDeviceToDiscoveryCache(BleDevice *pBleDevice);
+
+/** Write what has been learnt about the devices in the list
+ * to the discovery cache: wanted devices first, then those
+ * that are not wanted, dropping any that have gone unseen for
+ * more than BLE_DISCOVERY_CACHE_MAX_MISSED_CYCLES.
+ * Note that this does NOT lock the BLE list.
+ */
+static void saveBleDeviceListToDiscoveryCache();
+
+/** Populate the BLE device list from the discovery cache,
+ * unless the discovery cache was written for other wanted
+ * UUIDs, in which case its handles and its idea of which
+ * devices are wanted are of no use and it is ignored.
+ * Note that this does NOT lock the BLE list.
+ */
+static void restoreBleDeviceListFromDiscoveryCache();
+
+/** Checksum the wanted service and characteristic UUIDs, so
+ * that the discovery cache is only used with the UUIDs it was
+ * written for.
+ * Note that this does NOT lock the BLE list.
+ *
+ * @return the checksum.
+ */
+static uint32_t bleWantedUuidChecksum();
+
+/** Find the BLE device that should be read from next: of
+ * the wanted, polled devices that are not connected, the one
+ * whose reading must be started soonest in order to complete
+ * by the time it is due, allowing for how long its last
+ * reading took.
+ * Note that this does NOT lock the BLE list.
+ *
+ * @param nowMs the current time.
+ * @return      a pointer to the device or NULL if no device
+ *              needs to be started yet.
+ */
+static BleDevice *pFindNextBleDeviceToRead(int nowMs);
+
+/** Note the outcome of a reading from a BLE device and work
+ * out when the next reading is due: one period after the
+ * start of this reading if it succeeded, otherwise after an
+ * exponentially increasing retry delay.
+ * Note that this does NOT lock the BLE list.
+ *
+ * @param pBleDevice a pointer to the BLE device.
+ * @param success    true if the reading succeeded.
+ */
+static void endBleRead(BleDevice *pBleDevice, bool success);
+
+/** Callback to obtain readings from BLE peers that are due,
+ * starting as many connections as are allowed.
+ */
+static void getBleReadingsCallback();
+
+/** Callback, once every scan interval, to adapt the scan window
+ * to how much scanning is finding: halve it once nothing new
+ * has turned up for BLE_SCAN_STABLE_INTERVALS, go straight back
+ * to BLE_SCAN_WINDOW_MAX_MS when something does.
+ */
+static void adaptBleScanCallback();
+
+/** Disconnect any connection for discovery or for a reading
+ * that has been up for longer than BLE_LINK_TIMEOUT_SECONDS.
+ * Connections held open for notifications are left alone.
+ * Note that this does NOT lock the BLE list.
+ */
+static void checkBleConnectionTimeouts();
+
+/** Queue a reading from a BLE device, to be moved into the
+ * data store of the device by drainBleReadingQueue().  This is
+ * the producer side of gBleReadingQueue and must only be called
+ * from BLE callbacks.
+ * Note that this does NOT lock the BLE list.
+ *
+ * @param pAddress            a pointer to the address of the BLE device.
+ * @param addressType         the address type of the BLE device.
+ * @param characteristicIndex the index in gWantedCharacteristic of
+ *                            the characteristic the reading is from.
+ * @param pData               a pointer to the data.
+ * @param dataLen             the length of the data; a reading longer
+ *                            than BLE_MAX_DATA_ITEM_SIZE is not queued,
+ *                            as part of it would be lost.
+ * @return                    the number of readings now in the queue,
+ *                            zero if the reading could not be queued.
+ */
+static int addBleData(const char *pAddress, int addressType, int characteristicIndex,
+                      const char *pData, int dataLen);
+
+/** Move all the readings in gBleReadingQueue into their data
+ * stores, dropping the oldest data item of a store if it is
+ * full.  This is the consumer side of gBleReadingQueue and must
+ * only be called with gDataMtx locked.
+ *
+ * @param andEndRepeats true to then write a summary of the
+ *                      readings counted as repeats so far, see
+ *                      writeBleRepeats(); this is done when data
+ *                      items are about to be read or BLE stops,
+ *                      not each time the queue is emptied, else
+ *                      there would be a summary for every few
+ *                      repeats.
+ */
+static void drainBleReadingQueue(bool andEndRepeats);
+
+/** Empty gBleReadingQueue from the BLE side: unless a data
+ * function of the API is using the data stores, in which case
+ * it will empty the queue itself, call drainBleReadingQueue().
+ * Never blocks.
+ *
+ * @param andEndRepeats see drainBleReadingQueue().
+ */
+static void tryDrainBleReadingQueue(bool andEndRepeats);
+
+/** Write the summary data item for the readings from a
+ * characteristic that were counted as repeats of the data item
+ * last stored from it, if there are any: the data of that data
+ * item, the timestamp of the last repeat and the number of
+ * repeats, see numRepeats in BleData.  Must only be called with
+ * gDataMtx locked.
+ *
+ * @param pDataStore          a pointer to the data store.
+ * @param characteristicIndex the index in gWantedCharacteristic of
+ *                            the characteristic.
+ */
+static void writeBleRepeats(BleDataStore *pDataStore, int characteristicIndex);
+
+/** Find the data store of a device by its name; takes the lock
+ * as it searches the BLE device list.
+ *
+ * @param  pDeviceName  the pointer to the Device Name to find.
+ * @param  ppDataStore  a place to put a pointer to the data
+ *                      store, NULL if the device has none.
+ * @return              true if the device was found.
+ */
+static bool findBleDataStoreByDeviceName(const char *pDeviceName, BleDataStore **ppDataStore);
+
+/** Allocate a data store for a wanted BLE device.
+ * Note that this does NOT lock the BLE list.
+ *
+ * @return a pointer to the data store or NULL if
+ *         there are no free data stores.
  */
-static int addBleData(const char *pAddress, int addressType, const char *pData, int dataLen);
+static BleDataStore *pAllocBleDataStore();
 
-/** Return the BleData for a given device and increment its
- * pNextDataItemToRead pointer.
+/** Free a data store; its data is thrown away by the consumer,
+ * see checkBleDataStore().
  * Note that this does NOT lock the BLE list.
  *
- * @param  pBleDevice  a pointer to the BLE device in the device list.
+ * @param pDataStore a pointer to the data store, may be NULL.
+ */
+static void freeBleDataStore(BleDataStore *pDataStore);
+
+/** Empty a data store if it has been allocated again since the
+ * consumer last looked at it; must only be called by the
+ * consumer, with gDataMtx locked.
+ *
+ * @param pDataStore a pointer to the data store.
+ */
+static void checkBleDataStore(BleDataStore *pDataStore);
+
+/** Point a cursor at the oldest data item of a data store.
+ *
+ * @param pDataStore a pointer to the data store.
+ * @param pCursor    a pointer to the cursor.
+ */
+static void startBleDataCursor(BleDataStore *pDataStore, BleDataCursor *pCursor);
+
+/** Read an unsigned varint from a data store.
+ *
+ * @param  pDataStore a pointer to the data store.
+ * @param  pOffset    a pointer to the offset in bytes from the
+ *                    oldest data item, moved on past the varint.
+ * @return            the value of the varint.
+ */
+static unsigned int readBleDataStoreVarint(BleDataStore *pDataStore, int *pOffset);
+
+/** Unpack the data item at a cursor and move the cursor on to
+ * the next data item.
+ *
+ * @param  pDataStore a pointer to the data store.
+ * @param  pCursor    a pointer to the cursor, which must be
+ *                    at a data item.
+ * @param  pSlot      a place to put the unpacked data item.
+ * @return            the number of bytes the data item occupies
+ *                    in the data store.
+ */
+static int readBleDataItem(BleDataStore *pDataStore, BleDataCursor *pCursor, BleDataSlot *pSlot);
+
+/** Pack a data item into a data store, removing the oldest data
+ * items to make room for it if required.
+ *
+ * @param pDataStore          a pointer to the data store.
+ * @param timestamp           the timestamp of the data item.
+ * @param characteristicIndex the index in gWantedCharacteristic of
+ *                            the characteristic the data is from.
+ * @param pData               a pointer to the data.
+ * @param dataLen             the length of the data.
+ * @param numRepeats          zero for a reading, else this is the
+ *                            summary data item written by
+ *                            writeBleRepeats() and this is the
+ *                            number of repeats.
+ */
+static void writeBleDataItem(BleDataStore *pDataStore, int timestamp, int characteristicIndex,
+                             const char *pData, int dataLen, int numRepeats);
+
+/** Determine whether a reading need not be stored because it is
+ * within the deadband of the data item last stored for its
+ * characteristic, see bleSetDeadband(); must only be called by
+ * the consumer.
+ *
+ * @param  pDataStore a pointer to the data store.
+ * @param  pReading   a pointer to the reading.
+ * @return            true if the reading is a repeat.
+ */
+static bool bleReadingIsRepeat(BleDataStore *pDataStore, const BleReading *pReading);
+
+/** Return the BleData for a given data store and move its
+ * nextItemToRead cursor on.
+ *
+ * @param  pDataStore  a pointer to the data store.
  * @return             a pointer to a copy of the BleData (malloc()ed
  *                     for the purpose, as is also the pData item inside
  *                     it).
  */
-static BleData *pGetNextDataItemCopy(BleDevice *pBleDevice);
+static BleData *pGetNextDataItemCopy(BleDataStore *pDataStore);
 
-/** Remove a single item of data from a BLE device.  This
- * may result in pNextDataItemToRead being invalid: it is up
- * to the caller to sort this out.
+/** Remove the oldest item of data from a data store.
  * Note that this does NOT lock the BLE list.
  *
- * @param pDataContainer a pointer to the entry in the list
- *                       to remove.
+ * @param pDataStore a pointer to the data store.
+ */
+static void freeOldestBleDataItem(BleDataStore *pDataStore);
+
+/** Write an unsigned varint into a buffer.
+ *
+ * @param  pBuf   a pointer to the buffer.
+ * @param  lenBuf the length of the buffer.
+ * @param  value  the value to write.
+ * @return        the number of bytes written or zero
+ *                if the value would not fit.
+ */
+static int writeVarint(char *pBuf, int lenBuf, unsigned int value);
+
+/** Get the next record from BLE advertising data.
+ *
+ * @param  pData     a pointer to the advertising data.
+ * @param  dataLen   the length of the advertising data.
+ * @param  offset    the offset of the record in pData.
+ * @param  pType     a place to put the type of the record.
+ * @param  ppValue   a place to put a pointer to the value of
+ *                   the record.
+ * @param  pValueLen a place to put the length of the value.
+ * @return           the offset of the record after this one
+ *                   or -1 if there are no more (valid) records.
+ */
+static int nextAdRecord(const uint8_t *pData, int dataLen, int offset,
+                        int *pType, const char **ppValue, int *pValueLen);
+
+/** Determine whether a name, e.g. the local name from an
+ * advertisement, matches the Device Name prefix.
+ *
+ * @param  pName      a pointer to the name (need not be
+ *                    NULL terminated), NULL if there is
+ *                    no name.
+ * @param  nameLen    the length of the name.
+ * @param  isComplete true if this is the complete name,
+ *                    false if it may have been shortened.
+ * @return            BLE_NAME_MATCH_YES if the name definitely
+ *                    matches, BLE_NAME_MATCH_NO if it definitely
+ *                    does not and BLE_NAME_MATCH_MAYBE if there
+ *                    is no name or a shortened name is too short
+ *                    to tell.
  */
-static void freeBleDataItem(BleDataContainer *pDataContainer);
+static BleNameMatch bleNameMatchesPrefix(const char *pName, int nameLen, bool isComplete);
 
-/** Clear the data for a BLE device from the given entry
- * in its data list onwards.
+/** Find the reading for gObserverUuid in an advertising data
+ * record, if it is there.
+ *
+ * @param  type      the type of the advertising data record.
+ * @param  pValue    a pointer to the value of the record.
+ * @param  valueLen  the length of the value.
+ * @param  pDataLen  a place to put the length of the reading.
+ * @return           a pointer to the reading or NULL if there
+ *                   is no reading in the record.
+ */
+static const char *pFindObservedData(int type, const char *pValue, int valueLen, int *pDataLen);
+
+/** Act on a reading found in the advertisement of a device
+ * in observer mode.
  * Note that this does NOT lock the BLE list.
  *
- * @param pDataContainer a pointer to the entry in the list
- *                       to start deleting from.
+ * @param pParams        the advertisement parameters.
+ * @param pName          a pointer to the local name from the
+ *                       advertisement, NULL if there is none.
+ * @param nameLen        the length of the name.
+ * @param nameIsComplete true if the name is the complete local
+ *                       name rather than a shortened one.
+ * @param pData          a pointer to the reading.
+ * @param dataLen        the length of the reading.
  */
-static void clearBleDeviceData(BleDataContainer *pDataContainer);
+static void actOnObservedData(const Gap::AdvertisementCallbackParams_t *pParams,
+                              const char *pName, int nameLen, bool nameIsComplete,
+                              const char *pData, int dataLen);
 
 /** Callback to process a BLE advertisement.  This method will
  * connect to the device if it is one that we want and don't already
- * know about.
+ * know about or, in observer mode, take a reading from the
+ * advertisement.
  *
  * @param pParams the advertisement parameters.
  */
@@ -340,6 +1472,76 @@ static void serviceDiscoveryCallback(const DiscoveredService *pService);
  */
 static void characteristicDiscoveryCallback(const DiscoveredCharacteristic *pCharacteristic);
 
+/** Determine whether service discovery is targeted, i.e.
+ * whether the service containing the wanted characteristic
+ * is known.
+ *
+ * @return true if service discovery is targeted.
+ */
+static bool bleDiscoveryIsTargeted();
+
+/** Launch service discovery on a connection.  If discovery
+ * is targeted it is carried out in two passes, the first
+ * looking only for the Device Name characteristic in the GAP
+ * service, the second only for the wanted characteristic in
+ * the wanted service; otherwise all services and
+ * characteristics are discovered in one pass.
+ *
+ * @param connectionHandle the connection handle.
+ * @param wantedService    true for the second pass of
+ *                         targeted discovery.
+ * @return                 the result of launchServiceDiscovery().
+ */
+static ble_error_t launchBleServiceDiscovery(Gap::Handle_t connectionHandle, bool wantedService);
+
+/** Callback to launch the second pass of targeted service
+ * discovery, disconnecting if that is not possible.
+ *
+ * @param connectionHandle the connection handle.
+ */
+static void discoverWantedServiceCallback(Gap::Handle_t connectionHandle);
+
+/** Determine whether the first wanted characteristic of a device
+ * that has just been discovered, as kept in
+ * gBleNotifyCharacteristic, supports notifications and so has
+ * a CCCD to look for among its descriptors.
+ * Note that this does NOT lock the BLE list.
+ *
+ * @param pBleDevice a pointer to the connected BLE device.
+ * @return           true if there is a CCCD to look for.
+ */
+static bool bleNotifyCharacteristicHasCccd(const BleDevice *pBleDevice);
+
+/** Read the Device Name of a BLE device, to see if we want it.
+ * Note that this does NOT lock the BLE list.
+ *
+ * @param pBleDevice a pointer to the connected BLE device.
+ * @return           the result of the read.
+ */
+static ble_error_t startBleDeviceNameRead(BleDevice *pBleDevice);
+
+/** Callback to launch the discovery of the descriptors of
+ * gBleNotifyCharacteristic, reading the Device Name straight
+ * away if that is not possible.
+ *
+ * @param connectionHandle the connection handle.
+ */
+static void discoverBleCccdCallback(Gap::Handle_t connectionHandle);
+
+/** Callback to keep the handle of the CCCD when it turns up
+ * among the descriptors of gBleNotifyCharacteristic.
+ *
+ * @param pParams a pointer to the descriptor discovered.
+ */
+static void cccdDiscoveryCallback(const CharacteristicDescriptorDiscovery::DiscoveryCallbackParams_t *pParams);
+
+/** Callback to act on the end of descriptor discovery, going
+ * on to read the Device Name.
+ *
+ * @param pParams a pointer to the termination parameters.
+ */
+static void cccdDiscoveryTerminationCallback(const CharacteristicDescriptorDiscovery::TerminationCallbackParams_t *pParams);
+
 /** Callback to act on the end of service/characteristic discovery.
  *
  * @param connectionHandle the connection handle.
@@ -372,20 +1574,119 @@ static void timeoutCallback(Gap::TimeoutSource_t reason);
  */
 static void disconnectionCallback(const Gap::DisconnectionCallbackParams_t *pParams);
 
-/** Check if the device name is one we want.
+/** Check if the device name is one we want and, if it is,
+ * go on to take the first reading over the same connection.
  *
  * @param pResponse  a pointer to the GATT read callback parameters
  *                   for the Device Name characteristic.
  */
 static void checkDeviceNameCallback(const GattReadCallbackParams *pResponse);
 
+/** Callback for the completion of all GATT reads, passes
+ * the response on to checkDeviceNameCallback() or
+ * readWantedValueCallback() depending on the handle read.
+ * A failed read is dealt with here, disconnecting so that
+ * the device can be tried again later.
+ *
+ * @param pResponse  a pointer to the GATT read callback parameters.
+ */
+static void readCallback(const GattReadCallbackParams *pResponse);
+
+/** Find which of the wanted characteristics of a BLE device a
+ * value handle belongs to.
+ * Note that this does NOT lock the BLE list.
+ *
+ * @param  pBleDevice a pointer to the BLE device.
+ * @param  handle     the value handle.
+ * @return            the index of the characteristic in
+ *                    gWantedCharacteristic, -1 if it is not
+ *                    a wanted characteristic.
+ */
+static int bleWantedCharacteristicIndex(const BleDevice *pBleDevice, GattAttribute::Handle_t handle);
+
+/** Find the next wanted characteristic of a BLE device whose
+ * value handle is known.
+ * Note that this does NOT lock the BLE list.
+ *
+ * @param  pBleDevice a pointer to the BLE device.
+ * @param  index      the index in gWantedCharacteristic to
+ *                    start looking from.
+ * @return            the index of the characteristic, -1 if
+ *                    there are no more.
+ */
+static int nextBleWantedCharacteristic(const BleDevice *pBleDevice, int index);
+
+/** Forget the value handles of the wanted characteristics of a
+ * BLE device.
+ * Note that this does NOT lock the BLE list.
+ *
+ * @param pBleDevice a pointer to the BLE device.
+ */
+static void clearBleWantedHandles(BleDevice *pBleDevice);
+
+/** Start a reading of the wanted characteristics of a connected
+ * BLE device, reading the first of them.
+ * Note that this does NOT lock the BLE list.
+ *
+ * @param pBleDevice a pointer to the connected BLE device.
+ * @return           the result of GattClient::read().
+ */
+static ble_error_t startBleWantedRead(BleDevice *pBleDevice);
+
+/** Read the wanted characteristic given by readingCharacteristic
+ * of a connected BLE device.
+ * Note that this does NOT lock the BLE list.
+ *
+ * @param pBleDevice a pointer to the connected BLE device.
+ * @return           the result of GattClient::read().
+ */
+static ble_error_t startBleCharacteristicRead(BleDevice *pBleDevice);
+
+/** Callback to read the wanted characteristic again after an
+ * all-zero read, disconnecting if that is not possible.
+ *
+ * @param connectionHandle the connection handle.
+ */
+static void retryBleWantedReadCallback(Gap::Handle_t connectionHandle);
+
 /** Take a reading from the wanted characteristic of a BLE peer.
+ * If the value read is all zeroes, which is what some peers
+ * return when read too soon after connecting, it is read again
+ * a little later, up to BLE_MAX_NUM_ZERO_READ_RETRIES times.
  *
  * @param pResponse  a pointer to the GATT read callback parameters
  *                   for the wanted characteristic.
  */
 static void readWantedValueCallback(const GattReadCallbackParams *pResponse);
 
+/** Subscribe to notifications of the wanted characteristic of
+ * a device, if it supports them and fewer than
+ * gMaxNumHeldConnections connections are already held open,
+ * by writing to its CCCD; writeCallback() holds the connection
+ * open once the write has succeeded.
+ * Note that this does NOT lock the BLE list.
+ *
+ * @param pBleDevice a pointer to the connected BLE device.
+ * @return           true if the write was sent, in which case
+ *                   the connection must be left open for its
+ *                   response.
+ */
+static bool subscribeToBleNotifications(BleDevice *pBleDevice);
+
+/** Callback for the response to a GATT write, which can only be
+ * to a CCCD: hold the connection open if the subscription
+ * succeeded, otherwise disconnect.
+ *
+ * @param pParams a pointer to the GATT write callback parameters.
+ */
+static void writeCallback(const GattWriteCallbackParams *pParams);
+
+/** Take a reading from a notification from a BLE peer.
+ *
+ * @param pParams  a pointer to the notification parameters.
+ */
+static void hvxCallback(const GattHVXCallbackParams *pParams);
+
 /** Callback to handle a BLE initialisation error.
  *
  * @param ble   the BLE instance.
@@ -406,6 +1707,15 @@ static void bleInitComplete(BLE::InitializationCompleteCallbackContext *pParams)
  */
 static void scheduleBleEventsProcessing(BLE::OnEventsToProcessCallbackContext* pContext);
 
+/** Cancel an event that BLE has put on the event queue; this
+ * is done for every event that would otherwise run after
+ * bleStop(), or act on a connection that has gone.
+ *
+ * @param pEventId a pointer to the ID of the event, 0 if there
+ *                 is none; set to 0.
+ */
+static void cancelBleEvent(int *pEventId);
+
 /**************************************************************************
  * STATIC FUNCTIONS
  *************************************************************************/
@@ -420,16 +1730,20 @@ void printBleDeviceList()
     for (int x = 0; (x < gNumBleDevicesInList); x++) {
         pBleDevice = &(gBleDeviceList[x]);
         BLE_DEBUG_PRINTF("%d: %s", x, pPrintBleAddress(pBleDevice->address, addressString));
-        if (pBleDevice->pDeviceName != NULL) {
-            BLE_DEBUG_PRINTF(" \"%s\"", pBleDevice->pDeviceName);
+        if ((pBleDevice->pDetail != NULL) && (pBleDevice->pDetail->pDeviceName != NULL)) {
+            BLE_DEBUG_PRINTF(" \"%s\"", pBleDevice->pDetail->pDeviceName);
         }
         BLE_DEBUG_PRINTF(", device state %d, connect state %d", pBleDevice->deviceState, pBleDevice->connectionState);
-        BLE_DEBUG_PRINTF(" (handle 0x%02x), connection attempt(s) %d", pBleDevice->connectionHandle,
-                         pBleDevice->discoveryAttempts);
-        BLE_DEBUG_PRINTF(", DeviceName* 0x%08x, Wanted* 0x%08x", (int) pBleDevice->pDeviceNameCharacteristic,
-                         (int) pBleDevice->pWantedCharacteristic);
-        if (pBleDevice->pDataContainer != NULL) {
-            BLE_DEBUG_PRINTF(", has data");
+        BLE_DEBUG_PRINTF(", connection attempt(s) %d", pBleDevice->discoveryAttempts);
+        if (pBleDevice->pDetail != NULL) {
+            BLE_DEBUG_PRINTF(", handle 0x%02x", pBleDevice->pDetail->connectionHandle);
+            BLE_DEBUG_PRINTF(", DeviceName handle %u, Wanted handle(s)", pBleDevice->pDetail->deviceNameHandle);
+            for (int y = 0; y < gNumWantedCharacteristics; y++) {
+                BLE_DEBUG_PRINTF(" %u", pBleDevice->pDetail->wantedHandle[y]);
+            }
+            if ((pBleDevice->pDetail->pDataStore != NULL) && (pBleDevice->pDetail->pDataStore->numItems > 0)) {
+                BLE_DEBUG_PRINTF(", has %d data item(s)", pBleDevice->pDetail->pDataStore->numItems);
+            }
         }
         BLE_DEBUG_PRINTF(".\n");
     }
@@ -443,7 +1757,7 @@ static char *pPrintBleAddress(const char *pAddress, char *pBuf)
     int x = 0;
 
     for (int i = (BLE_ADDRESS_SIZE - 1); i >= 0; i--) {
-        sprintf(pBuf + x, "%02x:", *(pAddress + i));
+        sprintf(pBuf + x, "%02x:", (unsigned char) *(pAddress + i));
         x += 3;
     }
     *(pBuf + x - 1) = 0; // Remove the final ':'
@@ -454,14 +1768,117 @@ static char *pPrintBleAddress(const char *pAddress, char *pBuf)
 // Determine if two BLE address types match.
 static bool bleAddressTypesMatch(int addressType1, int addressType2)
 {
-    bool addressType1IsRandom = (addressType1 == BLEProtocol::AddressType::RANDOM_STATIC) ||
-                                (addressType1 == BLEProtocol::AddressType::RANDOM_PRIVATE_RESOLVABLE) ||
-                                (addressType1 == BLEProtocol::AddressType::RANDOM_PRIVATE_NON_RESOLVABLE);
-    bool addressType2IsRandom = (addressType2 == BLEProtocol::AddressType::RANDOM_STATIC) ||
-                                (addressType2 == BLEProtocol::AddressType::RANDOM_PRIVATE_RESOLVABLE) ||
-                                (addressType2 == BLEProtocol::AddressType::RANDOM_PRIVATE_NON_RESOLVABLE);
+    return bleAddressTypeIsRandom(addressType1) == bleAddressTypeIsRandom(addressType2);
+}
+
+// Determine if a BLE address type is a random one.
+static bool bleAddressTypeIsRandom(int addressType)
+{
+    return (addressType == BLEProtocol::AddressType::RANDOM_STATIC) ||
+           (addressType == BLEProtocol::AddressType::RANDOM_PRIVATE_RESOLVABLE) ||
+           (addressType == BLEProtocol::AddressType::RANDOM_PRIVATE_NON_RESOLVABLE);
+}
+
+// Hash a BLE address (FNV-1a), including only whether the address
+// type is random or not so that it is consistent with
+// bleAddressTypesMatch().
+static unsigned int bleAddressHash(const char *pAddress, int addressType)
+{
+    uint32_t hash = 2166136261UL;
+
+    for (int x = 0; x < BLE_ADDRESS_SIZE; x++) {
+        hash = (hash ^ (uint8_t) *(pAddress + x)) * 16777619UL;
+    }
+    if (bleAddressTypeIsRandom(addressType)) {
+        hash = (hash ^ 0xFF) * 16777619UL;
+    }
+
+    return (unsigned int) hash;
+}
+
+// Hash a connection handle (Fibonacci hashing).
+static unsigned int bleConnectionHash(Gap::Handle_t connectionHandle)
+{
+    return (unsigned int) ((connectionHandle * 2654435769UL) >> 16);
+}
+
+// Add a device to a hash index using linear probing.
+// Note that this does NOT lock the BLE list.
+static void addToBleDeviceIndex(int16_t *pIndex, unsigned int hash, int deviceIndex)
+{
+    unsigned int x = hash & (BLE_DEVICE_INDEX_SIZE - 1);
+
+    while (*(pIndex + x) != BLE_DEVICE_INDEX_EMPTY) {
+        x = (x + 1) & (BLE_DEVICE_INDEX_SIZE - 1);
+    }
+    *(pIndex + x) = deviceIndex;
+}
+
+// Remove a device from a hash index, shifting back any
+// subsequent entries in the same probe sequence so that
+// no "deleted" markers are required.
+// Note that this does NOT lock the BLE list.
+static void removeFromBleDeviceIndex(int16_t *pIndex, unsigned int (*pHash)(int),
+                                     int deviceIndex)
+{
+    unsigned int x = pHash(deviceIndex) & (BLE_DEVICE_INDEX_SIZE - 1);
+    unsigned int y;
+    unsigned int home;
 
-    return addressType1IsRandom == addressType2IsRandom;
+    // Find the entry
+    while ((*(pIndex + x) != BLE_DEVICE_INDEX_EMPTY) && (*(pIndex + x) != deviceIndex)) {
+        x = (x + 1) & (BLE_DEVICE_INDEX_SIZE - 1);
+    }
+
+    if (*(pIndex + x) == deviceIndex) {
+        *(pIndex + x) = BLE_DEVICE_INDEX_EMPTY;
+        // Move back any entries that would no longer be found
+        y = (x + 1) & (BLE_DEVICE_INDEX_SIZE - 1);
+        while (*(pIndex + y) != BLE_DEVICE_INDEX_EMPTY) {
+            home = pHash(*(pIndex + y)) & (BLE_DEVICE_INDEX_SIZE - 1);
+            if (((y - home) & (BLE_DEVICE_INDEX_SIZE - 1)) >= ((y - x) & (BLE_DEVICE_INDEX_SIZE - 1))) {
+                *(pIndex + x) = *(pIndex + y);
+                *(pIndex + y) = BLE_DEVICE_INDEX_EMPTY;
+                x = y;
+            }
+            y = (y + 1) & (BLE_DEVICE_INDEX_SIZE - 1);
+        }
+    }
+}
+
+// Hash the address of a device in the list.
+static unsigned int bleDeviceAddressHash(int deviceIndex)
+{
+    return bleAddressHash(gBleDeviceList[deviceIndex].address, gBleDeviceList[deviceIndex].addressType);
+}
+
+// Hash the connection handle of a device in the list.
+static unsigned int bleDeviceConnectionHash(int deviceIndex)
+{
+    return bleConnectionHash(gBleDeviceList[deviceIndex].pDetail->connectionHandle);
+}
+
+// Add a device to the connection index.
+// Note that this does NOT lock the BLE list.
+static void addBleConnectionToIndex(BleDevice *pBleDevice)
+{
+    addToBleDeviceIndex(gBleConnectionIndex, bleConnectionHash(pBleDevice->pDetail->connectionHandle),
+                        pBleDevice - gBleDeviceList);
+}
+
+// Remove a device from the connection index.
+// Note that this does NOT lock the BLE list.
+static void removeBleConnectionFromIndex(BleDevice *pBleDevice)
+{
+    removeFromBleDeviceIndex(gBleConnectionIndex, bleDeviceConnectionHash,
+                             pBleDevice - gBleDeviceList);
+}
+
+// Empty the hash indexes.
+static void clearBleDeviceIndexes()
+{
+    memset(gBleAddressIndex, BLE_DEVICE_INDEX_EMPTY, sizeof(gBleAddressIndex));
+    memset(gBleConnectionIndex, BLE_DEVICE_INDEX_EMPTY, sizeof(gBleConnectionIndex));
 }
 
 // Find a BLE device in the list by its address.
@@ -469,12 +1886,15 @@ static bool bleAddressTypesMatch(int addressType1, int addressType2)
 static BleDevice *pFindBleDeviceInListByAddress(const char *pAddress, int addressType)
 {
     BleDevice *pBleDevice = NULL;
+    unsigned int x = bleAddressHash(pAddress, addressType) & (BLE_DEVICE_INDEX_SIZE - 1);
+    int y;
 
-    for (int x = 0; (x < gNumBleDevicesInList) && (pBleDevice == NULL); x++) {
-        if (bleAddressTypesMatch(gBleDeviceList[x].addressType, addressType) &&
-           (memcmp (pAddress, gBleDeviceList[x].address, sizeof (gBleDeviceList[x].address)) == 0)) {
-            pBleDevice = &(gBleDeviceList[x]);
+    while ((pBleDevice == NULL) && ((y = gBleAddressIndex[x]) != BLE_DEVICE_INDEX_EMPTY)) {
+        if (bleAddressTypesMatch(gBleDeviceList[y].addressType, addressType) &&
+           (memcmp (pAddress, gBleDeviceList[y].address, sizeof (gBleDeviceList[y].address)) == 0)) {
+            pBleDevice = &(gBleDeviceList[y]);
         }
+        x = (x + 1) & (BLE_DEVICE_INDEX_SIZE - 1);
     }
 
     return pBleDevice;
@@ -487,7 +1907,7 @@ static BleDevice *pFindBleDeviceInListByDeviceNamePtr(const char *pDeviceName)
     BleDevice *pBleDevice = NULL;
 
     for (int x = 0; (x < gNumBleDevicesInList) && (pBleDevice == NULL); x++) {
-        if (pDeviceName == gBleDeviceList[x].pDeviceName) {
+        if ((gBleDeviceList[x].pDetail != NULL) && (pDeviceName == gBleDeviceList[x].pDetail->pDeviceName)) {
             pBleDevice = &(gBleDeviceList[x]);
         }
     }
@@ -500,25 +1920,28 @@ static BleDevice *pFindBleDeviceInListByDeviceNamePtr(const char *pDeviceName)
 static BleDevice *pFindBleConnectionInList(Gap::Handle_t connectionHandle)
 {
     BleDevice *pBleDevice = NULL;
+    unsigned int x = bleConnectionHash(connectionHandle) & (BLE_DEVICE_INDEX_SIZE - 1);
+    int y;
 
-    for (int x = 0; (x < gNumBleDevicesInList) && (pBleDevice == NULL); x++) {
-        if ((gBleDeviceList[x].connectionState == BLE_CONNECTION_STATE_CONNECTED) &&
-            (gBleDeviceList[x].connectionHandle == connectionHandle)) {
-            pBleDevice = &(gBleDeviceList[x]);
+    while ((pBleDevice == NULL) && ((y = gBleConnectionIndex[x]) != BLE_DEVICE_INDEX_EMPTY)) {
+        if ((gBleDeviceList[y].connectionState == BLE_CONNECTION_STATE_CONNECTED) &&
+            (gBleDeviceList[y].pDetail->connectionHandle == connectionHandle)) {
+            pBleDevice = &(gBleDeviceList[y]);
         }
+        x = (x + 1) & (BLE_DEVICE_INDEX_SIZE - 1);
     }
 
     return pBleDevice;
 }
 
-// Find the first connected device (there should be only one anyway).
+// Find the device we are connecting to (there should be only one).
 // Note that this does NOT lock the BLE list.
-static BleDevice *pFindBleNotDisconnectedInList()
+static BleDevice *pFindBleConnectingInList()
 {
     BleDevice *pBleDevice = NULL;
 
     for (int x = 0; (x < gNumBleDevicesInList) && (pBleDevice == NULL); x++) {
-        if (gBleDeviceList[x].connectionState != BLE_CONNECTION_STATE_DISCONNECTED) {
+        if (gBleDeviceList[x].connectionState == BLE_CONNECTION_STATE_CONNECTING) {
             pBleDevice = &(gBleDeviceList[x]);
         }
     }
@@ -526,32 +1949,151 @@ static BleDevice *pFindBleNotDisconnectedInList()
     return pBleDevice;
 }
 
-// Add a BLE device to the list, returning a pointer
-// to the new entry.  If the device is already in the list
-// a pointer is returned to the (unmodified) existing entry.
-// If the list is already full then NULL is returned.
+// Set the connection state of a BLE device.
 // Note that this does NOT lock the BLE list.
-static BleDevice *pAddBleDeviceToList(const char *pAddress, int addressType)
+static void setBleConnectionState(BleDevice *pBleDevice, BleConnectionState state)
 {
-    BleDevice *pBleDevice;
+    int nowMs = gBleTimer.read_ms();
+
+    // A device must have its details to be connected to,
+    // see allocBleDeviceDetail()
+    MBED_ASSERT((state == BLE_CONNECTION_STATE_DISCONNECTED) || (pBleDevice->pDetail != NULL));
+    if (pBleDevice->connectionState == BLE_CONNECTION_STATE_CONNECTING) {
+        gNumConnecting--;
+        if (state == BLE_CONNECTION_STATE_CONNECTED) {
+            pBleDevice->pDetail->stats.numConnects++;
+            pBleDevice->pDetail->stats.totalConnectLatencyMs += nowMs - pBleDevice->pDetail->connectionStateMs;
+        }
+    }
+    if (pBleDevice->connectionState != BLE_CONNECTION_STATE_DISCONNECTED) {
+        gNumConnections--;
+    }
+    pBleDevice->connectionState = state;
+    if (pBleDevice->pDetail != NULL) {
+        pBleDevice->pDetail->connectionStateMs = nowMs;
+    }
+    if (state == BLE_CONNECTION_STATE_CONNECTING) {
+        gNumConnecting++;
+        pBleDevice->pDetail->stats.numConnectAttempts++;
+    }
+    if (state != BLE_CONNECTION_STATE_DISCONNECTED) {
+        gNumConnections++;
+    }
+}
+
+// Count the taking of the lock.
+static void bleLocked()
+{
+    gLockDepth++;
+    if (gLockDepth == 1) {
+        gLockStartUs = gBleTimer.read_us();
+        gBleStats.numLocks++;
+    }
+}
+
+// Count the time the lock was held for.
+static void bleUnlocking()
+{
+    int holdUs;
+
+    if (gLockDepth == 1) {
+        holdUs = gBleTimer.read_us() - gLockStartUs;
+        // The timer is reset by bleInit(), which may be
+        // with the lock held
+        if (holdUs > 0) {
+            gBleStats.totalLockHoldUs += holdUs;
+            if (holdUs > gBleStats.maxLockHoldUs) {
+                gBleStats.maxLockHoldUs = holdUs;
+            }
+        }
+    }
+    gLockDepth--;
+}
+
+// Count the failure of a connection or a reading.
+// Note that this does NOT lock the BLE list.
+static void countBleFailure(BleDevice *pBleDevice)
+{
+    switch (pBleDevice->pDetail->failure) {
+        case BLE_FAILURE_TIMEOUT:
+            pBleDevice->pDetail->stats.numTimeoutFailures++;
+        break;
+        case BLE_FAILURE_GATT_ERROR:
+            pBleDevice->pDetail->stats.numGattErrorFailures++;
+        break;
+        default:
+            pBleDevice->pDetail->stats.numDisconnectFailures++;
+        break;
+    }
+}
+
+// Determine whether a new connection may be initiated.
+// Note that this does NOT lock the BLE list.
+static bool bleCanConnect()
+{
+    return (gNumConnecting == 0) && (gNumConnections - gNumHeldConnections < gMaxNumConnections);
+}
+
+// Determine whether service discovery is under way.
+// Note that this does NOT lock the BLE list.
+static bool bleIsDiscovering()
+{
+    bool isDiscovering = false;
+
+    for (int x = 0; (x < gNumBleDevicesInList) && !isDiscovering; x++) {
+        isDiscovering = (gBleDeviceList[x].deviceState == BLE_DEVICE_STATE_UNKNOWN) &&
+                        (gBleDeviceList[x].connectionState == BLE_CONNECTION_STATE_CONNECTED);
+    }
+
+    return isDiscovering;
+}
+
+// Add a BLE device to the list, returning a pointer
+// to the new entry.  If the device is already in the list
+// a pointer is returned to the (unmodified) existing entry.
+// If the list is already full then NULL is returned.
+// Note that this does NOT lock the BLE list.
+static BleDevice *pAddBleDeviceToList(const char *pAddress, int addressType)
+{
+    BleDevice *pBleDevice;
 
     pBleDevice = pFindBleDeviceInListByAddress(pAddress, addressType);
     if (pBleDevice == NULL) {
+        if (gNumBleDevicesInList >= (int) (sizeof(gBleDeviceList) / sizeof (gBleDeviceList[0]))) {
+            // Make room by evicting whatever has gone unseen for longest,
+            // never a wanted device
+            pBleDevice = pFindLeastRecentlySeenBleDevice();
+            if (pBleDevice != NULL) {
+                freeBleDevice(pBleDevice->address, pBleDevice->addressType);
+                pBleDevice = NULL;
+            }
+        }
         if (gNumBleDevicesInList < (int) (sizeof(gBleDeviceList) / sizeof (gBleDeviceList[0]))) {
             pBleDevice = &(gBleDeviceList[gNumBleDevicesInList]);
             memcpy (pBleDevice->address, pAddress, sizeof (pBleDevice->address));
             pBleDevice->addressType = addressType;
             pBleDevice->discoveryAttempts = 0;
-            pBleDevice->numCharacteristics = 0;
             pBleDevice->deviceState = BLE_DEVICE_STATE_UNKNOWN;
             pBleDevice->connectionState = BLE_CONNECTION_STATE_DISCONNECTED;
-            pBleDevice->pDeviceNameCharacteristic = NULL;
-            pBleDevice->pWantedCharacteristic = NULL;
-            pBleDevice->pDeviceName = NULL;
-            pBleDevice->pDataContainer = NULL;
-            pBleDevice->pNextDataItemToRead = pBleDevice->pDataContainer;
+            pBleDevice->pDetail = NULL;
+            pBleDevice->missedCycles = 0;
+            pBleDevice->notWantedForNow = false;
+            addToBleDeviceIndex(gBleAddressIndex, bleAddressHash(pAddress, addressType),
+                                gNumBleDevicesInList);
             gNumBleDevicesInList++;
+            gScanYield++;
+            gLastNewDeviceMs = gBleTimer.read_ms();
+        } else {
+            gBleStats.numListFullRejections++;
         }
+    } else if (!pBleDevice->seen && (pBleDevice->deviceState == BLE_DEVICE_STATE_IS_WANTED)) {
+        // A wanted device turning up again is as good as a new one
+        gScanYield++;
+        gLastNewDeviceMs = gBleTimer.read_ms();
+    }
+    if (pBleDevice != NULL) {
+        pBleDevice->seen = true;
+        pBleDevice->lastSeenTime = time(NULL);
     }
 
     return pBleDevice;
@@ -563,690 +2105,2881 @@ static BleDevice *pAddBleDeviceToList(const char *pAddress, int addressType)
 static int freeBleDevice(const char *pAddress, int addressType)
 {
     BleDevice *pBleDevice;
+    BleDevice *pLastBleDevice;
 
     pBleDevice = pFindBleDeviceInListByAddress(pAddress, addressType);
     if (pBleDevice != NULL) {
+        removeFromBleDeviceIndex(gBleAddressIndex, bleDeviceAddressHash, pBleDevice - gBleDeviceList);
+        if (pBleDevice->connectionState == BLE_CONNECTION_STATE_CONNECTED) {
+            removeBleConnectionFromIndex(pBleDevice);
+        }
         pBleDevice->deviceState = BLE_DEVICE_STATE_UNKNOWN;
         if (pBleDevice->connectionState != BLE_CONNECTION_STATE_DISCONNECTED) {
             // No point in trapping any errors here as there's nothing we can do about them
-            BLE::Instance().gap().disconnect(pBleDevice->connectionHandle, Gap::LOCAL_HOST_TERMINATED_CONNECTION);
+            BLE::Instance().gap().disconnect(pBleDevice->pDetail->connectionHandle, Gap::LOCAL_HOST_TERMINATED_CONNECTION);
         }
-        pBleDevice->connectionState = BLE_CONNECTION_STATE_DISCONNECTED;
+        setBleConnectionState(pBleDevice, BLE_CONNECTION_STATE_DISCONNECTED);
         pBleDevice->discoveryAttempts = 0;
-        if (pBleDevice->pDeviceNameCharacteristic != NULL) {
-            free (pBleDevice->pDeviceNameCharacteristic);
-        }
-        if (pBleDevice->pWantedCharacteristic != NULL) {
-            free (pBleDevice->pWantedCharacteristic);
-        }
-        if (pBleDevice->pDeviceName != NULL) {
-            free (pBleDevice->pDeviceName);
-        }
-        clearBleDeviceData(pBleDevice->pDataContainer);
-        pBleDevice->pDataContainer = NULL;
-        pBleDevice->pNextDataItemToRead = pBleDevice->pDataContainer;
+        freeBleDeviceDetail(pBleDevice);
         gNumBleDevicesInList--;
+        // Keep the list contiguous by moving the last device
+        // into the gap
+        pLastBleDevice = &(gBleDeviceList[gNumBleDevicesInList]);
+        if (pBleDevice != pLastBleDevice) {
+            removeFromBleDeviceIndex(gBleAddressIndex, bleDeviceAddressHash, gNumBleDevicesInList);
+            if (pLastBleDevice->connectionState == BLE_CONNECTION_STATE_CONNECTED) {
+                removeBleConnectionFromIndex(pLastBleDevice);
+            }
+            memcpy(pBleDevice, pLastBleDevice, sizeof(*pBleDevice));
+            addToBleDeviceIndex(gBleAddressIndex, bleDeviceAddressHash(pBleDevice - gBleDeviceList),
+                                pBleDevice - gBleDeviceList);
+            if (pBleDevice->connectionState == BLE_CONNECTION_STATE_CONNECTED) {
+                addBleConnectionToIndex(pBleDevice);
+            }
+        }
     }
 
     return gNumBleDevicesInList;
 }
 
-// Clear the BLE device list.
-static void clearBleDeviceList()
+// Give a BLE device its details.
+// Note that this does NOT lock the BLE list.
+static bool allocBleDeviceDetail(BleDevice *pBleDevice)
 {
-    LOCK();
-    while (freeBleDevice(gBleDeviceList[gNumBleDevicesInList - 1].address,
-                         gBleDeviceList[gNumBleDevicesInList - 1].addressType) > 0) {}
-    UNLOCK();
+    BleDeviceDetail *pDetail;
+
+    for (int x = 0; (x < gNumBleDeviceDetails) && (pBleDevice->pDetail == NULL); x++) {
+        pDetail = &(gpBleDeviceDetail[x]);
+        if (!pDetail->inUse) {
+            memset(pDetail, 0, sizeof(*pDetail));
+            pDetail->inUse = true;
+            pDetail->readPeriodMs = gDefaultReadPeriodMs;
+            pDetail->nextReadMs = gBleTimer.read_ms();
+            pDetail->failure = BLE_FAILURE_DISCONNECT;
+            pBleDevice->pDetail = pDetail;
+        }
+    }
+
+    return (pBleDevice->pDetail != NULL);
 }
 
-// Callback to get BLE readings.
-static void getBleReadingsCallback()
+// Free the details of a BLE device.
+// Note that this does NOT lock the BLE list.
+static void freeBleDeviceDetail(BleDevice *pBleDevice)
 {
-    BleDevice *pBleDevice = NULL;
-    char addressString[BLE_ADDRESS_STRING_SIZE];
-    bool deviceRead = false;
-    ble_error_t bleError;
-    int x;
+    BleDeviceDetail *pDetail = pBleDevice->pDetail;
 
-    LOCK();
-    // Go around the list of devices, starting reading at 
-    // gNextBleDeviceToRead, and read from the next device in
-    // the list which is marked as wanted
-    for (x = 0; (x < gNumBleDevicesInList) && !deviceRead; x++) {
-        pBleDevice = &(gBleDeviceList[(gNextBleDeviceToRead + x) % gNumBleDevicesInList]);
-        if (pBleDevice->deviceState == BLE_DEVICE_STATE_IS_WANTED) {
-            bleError = BLE::Instance().gap().connect((const uint8_t *) pBleDevice->address,
-                                                     (BLEProtocol::AddressType_t) pBleDevice->addressType,
-                                                     &gConnectionParams, &gConnectionScanParams);
-            if (bleError == BLE_ERROR_NONE) {
-                BLE_DEBUG_PRINTF("Connecting to BLE device %s for a reading...\n", pPrintBleAddress(pBleDevice->address, addressString));
-                //BLE_DEBUG_PRINTF("## WANTED: gNextBleDeviceToRead %d, x %d, index %d.\n", gNextBleDeviceToRead, x,
-                //                (gNextBleDeviceToRead + x) % gNumBleDevicesInList);
-                pBleDevice->connectionState = BLE_CONNECTION_STATE_CONNECTING;
-                deviceRead = true;
-            } else {
-                //BLE_DEBUG_PRINTF("## Unable to read from WANTED gNextBleDeviceToRead %d, x %d, index %d (error %d).\n",
-                //                  gNextBleDeviceToRead, x, (gNextBleDeviceToRead + x) % gNumBleDevicesInList, bleError);
-            }
-        } else {
-            //BLE_DEBUG_PRINTF("## NOT WANTED: gNextBleDeviceToRead %d, x %d, index %d.\n", gNextBleDeviceToRead, x,
-            //                (gNextBleDeviceToRead + x) % gNumBleDevicesInList);
+    if (pDetail != NULL) {
+        cancelBleEvent(&(pDetail->eventId));
+        if (pDetail->isHeld) {
+            gNumHeldConnections--;
         }
+        if (pDetail->pDeviceName != NULL) {
+            bleFree(pDetail->pDeviceName, strlen(pDetail->pDeviceName) + 1);
+        }
+        freeBleDataStore(pDetail->pDataStore);
+        pDetail->inUse = false;
+        pBleDevice->pDetail = NULL;
     }
+}
 
-    gNextBleDeviceToRead++;
-    if (gNextBleDeviceToRead >= gNumBleDevicesInList) {
-        gNextBleDeviceToRead = 0;
+// Free the details of a BLE device if they are no longer needed.
+// Note that this does NOT lock the BLE list.
+static void releaseUnusedBleDeviceDetail(BleDevice *pBleDevice)
+{
+    if ((pBleDevice->pDetail != NULL) &&
+        (pBleDevice->connectionState == BLE_CONNECTION_STATE_DISCONNECTED) &&
+        (pBleDevice->deviceState != BLE_DEVICE_STATE_IS_WANTED) &&
+        (pBleDevice->pDetail->pDataStore == NULL)) {
+        freeBleDeviceDetail(pBleDevice);
     }
-    //BLE_DEBUG_PRINTF("## gNextBleDeviceToRead is now %d.\n", gNextBleDeviceToRead);
-
-    UNLOCK();
 }
 
-// Add a data entry for a BLE device
-static int addBleData(const char *pAddress, int addressType, const char *pData, int dataLen)
+// Allocate memory, within the memory budget.
+static void *pBleMalloc(int size)
 {
-    BleDevice *pBleDevice = NULL;
-    BleDataContainer **ppThis;
-    BleDataContainer *pPrevious = NULL;
-    //char addressString[BLE_ADDRESS_STRING_SIZE];
-    int numItems = 0;
+    void *pMem = NULL;
 
     LOCK();
-    // Find the device
-    pBleDevice = pFindBleDeviceInListByAddress(pAddress, addressType);
-    if (pBleDevice != NULL) {
-        //BLE_DEBUG_PRINTF("Adding data of length %d to device %s.\n", dataLen, pPrintBleAddress(pAddress, addressString));
-        // Find the end of the data list
-        ppThis = &(pBleDevice->pDataContainer);
-        while (*ppThis != NULL) {
-            //BLE_DEBUG_PRINTF("%d  pThis 0x%08x, pThis->pPrevious 0x%08x, pThis->pNext 0x%08x.\n", numItems, (int) *ppThis, (int) (*ppThis)->pPrevious, (int) (*ppThis)->pNext);
-            pPrevious = *ppThis;
-            ppThis = &((*ppThis)->pNext);
-            numItems++;
-        }
-
-        //BLE_DEBUG_PRINTF("  %d data item(s) already in the list.\n", numItems);
-        // Add the new container
-        *ppThis = (BleDataContainer *) malloc(sizeof(BleDataContainer));
-        if (*ppThis != NULL) {
-            //BLE_DEBUG_PRINTF("  allocated %d byte(s) for the data container at time %d.\n", sizeof(BleDataContainer), (int) time(NULL));
-            (*ppThis)->dataStruct.timestamp = time(NULL);
-            (*ppThis)->pPrevious = pPrevious;
-            (*ppThis)->pNext = NULL;
-            //BLE_DEBUG_PRINTF("New pThis 0x%08x, pThis->pPrevious 0x%08x, pThis->pNext 0x%08x.\n", (int) *ppThis, (int) (*ppThis)->pPrevious, (int) (*ppThis)->pNext);
-            // Add the data to the container
-            (*ppThis)->dataStruct.pData = (char *) malloc(dataLen);
-            if ((*ppThis)->dataStruct.pData != NULL) {
-                //BLE_DEBUG_PRINTF("  allocated %d byte(s) for the data.\n", dataLen);
-                memcpy ((*ppThis)->dataStruct.pData, pData, dataLen);
-                (*ppThis)->dataStruct.dataLen = dataLen;
-                // Connect this item into the rest of the list
-                if (pPrevious != NULL) {
-                    pPrevious->pNext = *ppThis;
-                    //BLE_DEBUG_PRINTF("  pPrevious 0x%08x", (int) pPrevious);
-                    //if (pPrevious != NULL) {
-                    //    BLE_DEBUG_PRINTF(", pPrevious->pPrevious 0x%08x, pPrevious->pNext 0x%08x.\n", (int) pPrevious->pPrevious, (int) pPrevious->pNext);
-                    //}
-                    //BLE_DEBUG_PRINTF(".\n");
-                }
-                numItems++;
-                //BLE_DEBUG_PRINTF("  data addition complete.\n");
-            } else {
-                //BLE_DEBUG_PRINTF("  unable to allocate %d byte(s) for the data.\n", dataLen);
-                // If we can't allocate space for the data, go back
-                // and delete the container
-                free (*ppThis);
-                *ppThis = NULL;
-            }
-        } else {
-            //BLE_DEBUG_PRINTF("  unable to allocate %d byte(s) for the data container.\n", sizeof(BleDataContainer));
+    if ((gBleMemoryBudget == 0) || (gBleMemoryUsed + size <= gBleMemoryBudget)) {
+        pMem = malloc(size);
+    }
+    if (pMem != NULL) {
+        gBleMemoryUsed += size;
+        if (gBleMemoryUsed > gBleStats.maxMemoryBytes) {
+            gBleStats.maxMemoryBytes = gBleMemoryUsed;
         }
+    } else {
+        gBleStats.numAllocationFailures++;
     }
     UNLOCK();
 
-    return numItems;
+    return pMem;
 }
 
-// Get the given data item from the given BLE device
-// and increment the pNextDataItemToRead for that device.
+// Free memory allocated with pBleMalloc().
+static void bleFree(void *pMem, int size)
+{
+    if (pMem != NULL) {
+        free(pMem);
+        LOCK();
+        gBleMemoryUsed -= size;
+        UNLOCK();
+    }
+}
+
+// Free what bleInit() allocated.
+static void freeBleStorage()
+{
+    DATA_LOCK();
+    // Any readings still queued are for data stores that are
+    // about to go
+    gBleReadingQueueTail = gBleReadingQueueHead;
+    bleFree(gpBleDataArena, gMaxNumBleWantedDevices * gBleDataStoreSize);
+    gpBleDataArena = NULL;
+    bleFree(gpBleDataStore, gMaxNumBleWantedDevices * sizeof(BleDataStore));
+    gpBleDataStore = NULL;
+    gMaxNumBleWantedDevices = 0;
+    DATA_UNLOCK();
+    bleFree(gpBleDeviceDetail, gNumBleDeviceDetails * sizeof(BleDeviceDetail));
+    gpBleDeviceDetail = NULL;
+    gNumBleDeviceDetails = 0;
+}
+
+// Make a copy of the Device Name of a BLE device.
+static char *pAllocBleDeviceName(const char *pName, int nameLen)
+{
+    char *pDeviceName = (char *) pBleMalloc(nameLen + 1);
+
+    if (pDeviceName != NULL) {
+        memcpy(pDeviceName, pName, nameLen);
+        *(pDeviceName + nameLen) = 0;  // Add terminator
+    }
+
+    return pDeviceName;
+}
+
+// Clear the BLE device list.
+static void clearBleDeviceList()
+{
+    LOCK();
+    while ((gNumBleDevicesInList > 0) &&
+           (freeBleDevice(gBleDeviceList[gNumBleDevicesInList - 1].address,
+                          gBleDeviceList[gNumBleDevicesInList - 1].addressType) > 0)) {}
+    clearBleDeviceIndexes();
+    UNLOCK();
+}
+
+// Find the device that has gone unseen for longest and may be evicted.
 // Note that this does NOT lock the BLE list.
-static BleData *pGetNextDataItemCopy(BleDevice *pBleDevice)
+static BleDevice *pFindLeastRecentlySeenBleDevice()
 {
-    BleData *pDataStruct = NULL;
-    const char *pTmp;
-    BleDataContainer *pThis = pBleDevice->pNextDataItemToRead;
+    BleDevice *pBleDevice;
+    BleDevice *pOldestBleDevice = NULL;
 
-    if (pThis != NULL) {
-        pDataStruct = (BleData *) malloc(sizeof(BleData));
-        if (pDataStruct != NULL) {
-            memcpy(pDataStruct, &(pThis->dataStruct), sizeof (*pDataStruct));
-            // Also make a copy of the malloc()ed pData
-            // in the copied structure pDataStruct to give it complete
-            // safety
-            if (pDataStruct->dataLen > 0) {
-                pTmp = pDataStruct->pData;
-                pDataStruct->pData = (char *) malloc(pDataStruct->dataLen);
-                if (pDataStruct->pData != NULL) {
-                    memcpy (pDataStruct->pData, pTmp, pDataStruct->dataLen);
-                } else {
-                    // If that malloc() failed, reverse the first one
-                    free(pDataStruct);
-                    pDataStruct = NULL;
-                }
-            }
+    for (int x = 0; x < gNumBleDevicesInList; x++) {
+        pBleDevice = &(gBleDeviceList[x]);
+        if ((pBleDevice->deviceState != BLE_DEVICE_STATE_IS_WANTED) &&
+            (pBleDevice->connectionState == BLE_CONNECTION_STATE_DISCONNECTED) &&
+            ((pBleDevice->pDetail == NULL) || (pBleDevice->pDetail->pDataStore == NULL)) &&
+            ((pOldestBleDevice == NULL) || (pBleDevice->lastSeenTime < pOldestBleDevice->lastSeenTime))) {
+            pOldestBleDevice = pBleDevice;
         }
-        pBleDevice->pNextDataItemToRead = pThis->pNext;
     }
 
-    return pDataStruct;
+    return pOldestBleDevice;
+}
+
+// Hash the address of a device in the negative cache.
+static unsigned int bleRejectedDeviceAddressHash(int rejectedIndex)
+{
+    return bleAddressHash(gBleRejectedList[rejectedIndex].address, gBleRejectedList[rejectedIndex].addressType);
 }
 
-// Remove a BLE data item from the list
+// Rebuild the hash index into the negative cache.
 // Note that this does NOT lock the BLE list.
-static void freeBleDataItem(BleDataContainer *pDataContainer)
+static void rebuildBleRejectedIndex()
 {
-    // Free the data for this entry
-    if (pDataContainer->dataStruct.pData != NULL) {
-        free (pDataContainer->dataStruct.pData);
-    }
-    // Seal up the list
-    if (pDataContainer->pPrevious != NULL) {
-        pDataContainer->pPrevious->pNext = pDataContainer->pNext;
-    }
-    if (pDataContainer->pNext != NULL) {
-        pDataContainer->pNext->pPrevious = pDataContainer->pPrevious;
+    memset(gBleRejectedIndex, BLE_DEVICE_INDEX_EMPTY, sizeof(gBleRejectedIndex));
+    for (int x = 0; x < gNumBleRejectedDevices; x++) {
+        addToBleDeviceIndex(gBleRejectedIndex, bleRejectedDeviceAddressHash(x), x);
     }
-    // Free this container
-    free (pDataContainer);
 }
 
-// Clear the data for a BLE device from the given entry onwards.
+// Find a device in the negative cache.
 // Note that this does NOT lock the BLE list.
-static void clearBleDeviceData(BleDataContainer *pDataContainer)
+static BleRejectedDevice *pFindBleRejectedDevice(const char *pAddress, int addressType)
 {
-    BleDataContainer *pTmp;
-    
-    while (pDataContainer != NULL) {
-        pTmp = pDataContainer->pNext;
-        freeBleDataItem(pDataContainer);
-        pDataContainer = pTmp;
+    BleRejectedDevice *pRejectedDevice = NULL;
+    unsigned int x = bleAddressHash(pAddress, addressType) & (BLE_DEVICE_INDEX_SIZE - 1);
+    int y;
+
+    while ((pRejectedDevice == NULL) && ((y = gBleRejectedIndex[x]) != BLE_DEVICE_INDEX_EMPTY)) {
+        if (bleAddressTypesMatch(gBleRejectedList[y].addressType, addressType) &&
+           (memcmp (pAddress, gBleRejectedList[y].address, sizeof (gBleRejectedList[y].address)) == 0)) {
+            pRejectedDevice = &(gBleRejectedList[y]);
+        }
+        x = (x + 1) & (BLE_DEVICE_INDEX_SIZE - 1);
     }
+
+    return pRejectedDevice;
 }
 
-// Process an advertisement and connect to the device if
-// it is one that we want.
-static void advertisementCallback(const Gap::AdvertisementCallbackParams_t *pParams)
+// Determine whether a device is rejected.
+// Note that this does NOT lock the BLE list.
+static bool bleDeviceIsRejected(const char *pAddress, int addressType)
 {
-    char buf[BLE_ADDRESS_STRING_SIZE + 32];
-    BleDevice *pBleDevice;
-    ble_error_t bleError;
-    int recordLength;
-    int x = 0;
-    bool discoverable = false;
+    BleRejectedDevice *pRejectedDevice = pFindBleRejectedDevice(pAddress, addressType);
 
-    BLE_DEBUG_PRINTF("BLE device %s is visible, has a %s address",
-                     pPrintBleAddress((char *) pParams->peerAddr, buf), gpAddressTypeString[pParams->addressType]);
-    // Check if the device is discoverable
-    while ((x < pParams->advertisingDataLen) && !discoverable) {
-        /* The advertising payload is a collection of key/value records where
-         * byte 0: length of the record excluding this byte but including the "type" byte
-         * byte 1: The key, it is the type of the data
-         * byte [2..N] The value. N is equal to byte0 - 1 */
-        recordLength = pParams->advertisingData[x];
-        if ((recordLength > 0) && (pParams->advertisingData[x + 1] != 0)) {  // Type of 0 is not allowed
-            const int type = pParams->advertisingData[x + 1];
-            const char *pValue = (const char *) pParams->advertisingData + x + 2;
-            //BLE_DEBUG_PRINTF("  Advertising payload type 0x%02x", type);
-            //if (type < (int) (sizeof(gapAdvertisingDataTypeString) / sizeof(gapAdvertisingDataTypeString[0]))) {
-            //    BLE_DEBUG_PRINTF(" (%s)", gapAdvertisingDataTypeString[type]);
-            //}
-            //BLE_DEBUG_PRINTF(" (%d byte(s)): 0x%.*s.\n", recordLength - 1,
-            //                 bytesToHexString(pValue, recordLength - 1, buf, sizeof(buf)), buf);
-            if ((type == GapAdvertisingData::FLAGS) &&
-                (*pValue & (GapAdvertisingData::LE_GENERAL_DISCOVERABLE | GapAdvertisingData::LE_LIMITED_DISCOVERABLE))) {
-                discoverable = true;
-            }
-            x += recordLength + 1;
-        } else {
-            x++;
+    return (pRejectedDevice != NULL) && (pRejectedDevice->expiryTime - (int) time(NULL) > 0);
+}
+
+// Remove a device from the negative cache.
+// Note that this does NOT lock the BLE list.
+static void forgetBleRejectedDevice(const char *pAddress, int addressType)
+{
+    BleRejectedDevice *pRejectedDevice = pFindBleRejectedDevice(pAddress, addressType);
+    int x;
+
+    if (pRejectedDevice != NULL) {
+        x = pRejectedDevice - gBleRejectedList;
+        removeFromBleDeviceIndex(gBleRejectedIndex, bleRejectedDeviceAddressHash, x);
+        gNumBleRejectedDevices--;
+        // Keep the list contiguous by moving the last entry
+        // into the gap
+        if (x != gNumBleRejectedDevices) {
+            removeFromBleDeviceIndex(gBleRejectedIndex, bleRejectedDeviceAddressHash, gNumBleRejectedDevices);
+            memcpy(pRejectedDevice, &(gBleRejectedList[gNumBleRejectedDevices]), sizeof(*pRejectedDevice));
+            addToBleDeviceIndex(gBleRejectedIndex, bleRejectedDeviceAddressHash(x), x);
         }
     }
+}
 
-    if (discoverable) {
-        BLE_DEBUG_PRINTF(" and is discoverable");
-        LOCK();
-        pBleDevice = pAddBleDeviceToList((const char *) pParams->peerAddr, (int) pParams->addressType);
-        if (pBleDevice != NULL) {
-            if (pBleDevice->deviceState == BLE_DEVICE_STATE_UNKNOWN) {
-                if ((pBleDevice->connectionState != BLE_CONNECTION_STATE_CONNECTED) ||
-                    (pBleDevice->connectionState != BLE_CONNECTION_STATE_CONNECTING)) {
-                    BLE_DEBUG_PRINTF(", attempting to connect to it");
-                    bleError = BLE::Instance().gap().connect(pParams->peerAddr, pParams->addressType, &gConnectionParams, &gConnectionScanParams);
-                    if (bleError == BLE_ERROR_NONE) {
-                        pBleDevice->connectionState = BLE_CONNECTION_STATE_CONNECTING;
-                        pBleDevice->discoveryAttempts++;
-                       BLE_DEBUG_PRINTF(", connect() successfully issued.\n");
-                    } else if (bleError == BLE_ERROR_INVALID_STATE) {
-                        BLE_DEBUG_PRINTF(" but CAN'T as BLE is in an invalid state (may already be connecting?).\n");
-                    } else {
-                        BLE_DEBUG_PRINTF(" but unable to issue connect (error %d \"%s\").\n", bleError, BLE::Instance().errorToString(bleError));
-                    }
-                } else {
-                    BLE_DEBUG_PRINTF(" but we are already connected to it (or attempting to do so).\n");
+// Add a device to the negative cache or renew its rejection.
+// Note that this does NOT lock the BLE list.
+static void rejectBleDevice(const char *pAddress, int addressType, bool isTransient)
+{
+    BleRejectedDevice *pRejectedDevice = pFindBleRejectedDevice(pAddress, addressType);
+    int expirySeconds = BLE_REJECTED_EXPIRY_SECONDS;
+    int y = 0;
+
+    if (pRejectedDevice == NULL) {
+        if (gNumBleRejectedDevices >= MAX_NUM_BLE_REJECTED_DEVICES) {
+            // Make room by dropping the entry that would expire soonest
+            for (int x = 1; x < gNumBleRejectedDevices; x++) {
+                if (gBleRejectedList[x].expiryTime - gBleRejectedList[y].expiryTime < 0) {
+                    y = x;
                 }
-            } else {
-                BLE_DEBUG_PRINTF(" but we already know about it so there is nothing to do.\n");
             }
-        } else {
-            BLE_DEBUG_PRINTF(" but the BLE device list is full (%d device(s))!\n", gNumBleDevicesInList);
+            forgetBleRejectedDevice(gBleRejectedList[y].address, gBleRejectedList[y].addressType);
+        }
+        pRejectedDevice = &(gBleRejectedList[gNumBleRejectedDevices]);
+        memcpy(pRejectedDevice->address, pAddress, sizeof(pRejectedDevice->address));
+        pRejectedDevice->addressType = addressType;
+        pRejectedDevice->numRejections = 0;
+        addToBleDeviceIndex(gBleRejectedIndex, bleAddressHash(pAddress, addressType), gNumBleRejectedDevices);
+        gNumBleRejectedDevices++;
+    }
+
+    if (pRejectedDevice->numRejections < 0xFF) {
+        pRejectedDevice->numRejections++;
+    }
+    pRejectedDevice->isTransient = isTransient;
+    if (isTransient) {
+        expirySeconds = BLE_REJECTED_RETRY_SECONDS;
+        for (int x = 1; (x < pRejectedDevice->numRejections) && (expirySeconds < BLE_REJECTED_EXPIRY_SECONDS); x++) {
+            expirySeconds <<= 1;
+        }
+        if (expirySeconds > BLE_REJECTED_EXPIRY_SECONDS) {
+            expirySeconds = BLE_REJECTED_EXPIRY_SECONDS;
         }
-        UNLOCK();
-    } else {
-        BLE_DEBUG_PRINTF(" but is not discoverable.\n");
     }
+    pRejectedDevice->expiryTime = time(NULL) + expirySeconds;
 }
 
-// Act on the discovery of a service.
-static void serviceDiscoveryCallback(const DiscoveredService *pService)
+// Move a device that is not wanted into the negative cache.
+// Note that this does NOT lock the BLE list.
+static void releaseNotWantedBleDevice(BleDevice *pBleDevice)
 {
-    if (pService->getUUID().shortOrLong() == UUID::UUID_TYPE_SHORT) {
-        BLE_DEBUG_PRINTF("Service 0x%x attrs[%u %u].\n", pService->getUUID().getShortUUID(),
-                         pService->getStartHandle(), pService->getEndHandle());
-    } else {
-        BLE_DEBUG_PRINTF("Service 0x");
-        const char *pLongUUIDBytes = (char *) pService->getUUID().getBaseUUID();
-        for (unsigned int i = 0; i < UUID::LENGTH_OF_LONG_UUID; i++) {
-            BLE_DEBUG_PRINTF("%02x", *(pLongUUIDBytes + i));
+    char addressString[BLE_ADDRESS_STRING_SIZE];
+
+    BLE_DEBUG_PRINTF("Moving BLE device %s to the negative cache (%s).\n",
+                     pPrintBleAddress(pBleDevice->address, addressString),
+                     pBleDevice->notWantedForNow ? "for now" : "not one of ours");
+    rejectBleDevice(pBleDevice->address, pBleDevice->addressType, pBleDevice->notWantedForNow);
+    freeBleDevice(pBleDevice->address, pBleDevice->addressType);
+}
+
+// Checksum a block of memory (FNV-1a).
+static uint32_t bleChecksum(const char *pData, int dataLen, uint32_t hash)
+{
+    for (int x = 0; x < dataLen; x++) {
+        hash = (hash ^ (uint8_t) *(pData + x)) * 16777619UL;
+    }
+
+    return hash;
+}
+
+// Add a BLE device to the discovery cache.
+// Note that this does NOT lock the BLE list.
+static bool addBleDeviceToDiscoveryCache(BleDevice *pBleDevice)
+{
+    BleDiscoveryCacheEntry *pEntry;
+    int x = gBleDiscoveryCache.numEntries;
+
+    if (x >= MAX_NUM_BLE_DISCOVERY_CACHE_ENTRIES) {
+        return false;
+    }
+    if ((pBleDevice->pDetail != NULL) && (pBleDevice->pDetail->pDeviceName != NULL) &&
+        (strlen(pBleDevice->pDetail->pDeviceName) > BLE_DISCOVERY_CACHE_DEVICE_NAME_LENGTH)) {
+        BLE_DEBUG_PRINTF("Name \"%s\" is too long for the discovery cache, leaving it out.\n",
+                         pBleDevice->pDetail->pDeviceName);
+        return true;
+    }
+
+    pEntry = &(gBleDiscoveryCache.entry[x]);
+    memset(pEntry, 0, sizeof(*pEntry));
+    memcpy(pEntry->address, pBleDevice->address, sizeof(pEntry->address));
+    pEntry->addressType = pBleDevice->addressType;
+    pEntry->deviceState = pBleDevice->deviceState;
+    if (pBleDevice->pDetail != NULL) {
+        memcpy(pEntry->wantedHandle, pBleDevice->pDetail->wantedHandle, sizeof(pEntry->wantedHandle));
+        if (pBleDevice->pDetail->isObserved) {
+            pEntry->flags |= BLE_DISCOVERY_CACHE_FLAG_OBSERVED;
+        }
+        pEntry->cccdHandle = pBleDevice->pDetail->cccdHandle;
+        if (pBleDevice->pDetail->pDeviceName != NULL) {
+            strncpy(pEntry->deviceName, pBleDevice->pDetail->pDeviceName, sizeof(pEntry->deviceName));
         }
-        BLE_DEBUG_PRINTF(" attrs[%u %u].\n", pService->getStartHandle(), pService->getEndHandle());
     }
+    gBleDiscoveryCacheMissedCycles[x] = pBleDevice->missedCycles;
+    gBleDiscoveryCache.numEntries++;
+
+    return true;
 }
 
-// Act on the discovery of a characteristic.
-static void characteristicDiscoveryCallback(const DiscoveredCharacteristic *pCharacteristic)
+// Write what has been learnt about the devices in the list
+// to the discovery cache.
+// Note that this does NOT lock the BLE list.
+static void saveBleDeviceListToDiscoveryCache()
 {
-    char addressString[BLE_ADDRESS_STRING_SIZE];
-    UUID::ShortUUIDBytes_t uuid = pCharacteristic->getUUID().getShortUUID();
-    DiscoveredCharacteristic **ppStoredCharacteristic = NULL;
     BleDevice *pBleDevice;
+    BleRejectedDevice *pRejectedDevice;
+    BleDiscoveryCacheEntry *pEntry;
+    int numWantedEntries;
+    bool keepGoing = true;
 
-    BLE_DEBUG_PRINTF("  Characteristic 0x%x valueAttr[%u] props[0x%x].\n", pCharacteristic->getUUID().getShortUUID(),
-                     pCharacteristic->getValueHandle(), (uint8_t) pCharacteristic->getProperties().broadcast());
-
-    LOCK();
-    pBleDevice = pFindBleConnectionInList(pCharacteristic->getConnectionHandle());
-    if (pBleDevice != NULL) {
-        pBleDevice->numCharacteristics++;
-        // If this device isn't marked as "not wanted" and if we're not already
-        // reading from it...
-        if (uuid == BLE_UUID_GAP_CHARACTERISTIC_DEVICE_NAME) {
-            ppStoredCharacteristic = &(pBleDevice->pDeviceNameCharacteristic);
-        } else if (uuid == gWantedCharacteristicUuid) {
-            ppStoredCharacteristic = &(pBleDevice->pWantedCharacteristic);
+    gBleDiscoveryCache.numEntries = 0;
+    for (int x = 0; x < gNumBleDevicesInList; x++) {
+        pBleDevice = &(gBleDeviceList[x]);
+        if (pBleDevice->seen) {
+            pBleDevice->missedCycles = 0;
+        } else if (pBleDevice->missedCycles <= BLE_DISCOVERY_CACHE_MAX_MISSED_CYCLES) {
+            pBleDevice->missedCycles++;
         }
+    }
 
-        if (ppStoredCharacteristic != NULL) {
-            // Take a copy of the characteristic so that we can read it once service discovery has ended
-            BLE_DEBUG_PRINTF("  BLE device %s has a characteristic we want to read (0x%04x).\n", pPrintBleAddress(pBleDevice->address, addressString), uuid);
-            if (*ppStoredCharacteristic != NULL) {
-                free(*ppStoredCharacteristic);
-            }
-            *ppStoredCharacteristic = (DiscoveredCharacteristic *) malloc(sizeof (*pCharacteristic));
-            if (*ppStoredCharacteristic != NULL) {
-                memcpy(*ppStoredCharacteristic, pCharacteristic, sizeof (*pCharacteristic));
+    // Wanted devices first, so that they are the last to be lost
+    for (int x = 0; (x < gNumBleDevicesInList) && keepGoing; x++) {
+        pBleDevice = &(gBleDeviceList[x]);
+        if ((pBleDevice->deviceState == BLE_DEVICE_STATE_IS_WANTED) &&
+            (pBleDevice->missedCycles <= BLE_DISCOVERY_CACHE_MAX_MISSED_CYCLES)) {
+            keepGoing = addBleDeviceToDiscoveryCache(pBleDevice);
+        }
+    }
+    numWantedEntries = gBleDiscoveryCache.numEntries;
+    for (int x = 0; (x < gNumBleDevicesInList) && keepGoing; x++) {
+        pBleDevice = &(gBleDeviceList[x]);
+        if ((pBleDevice->deviceState == BLE_DEVICE_STATE_NOT_WANTED) && !pBleDevice->notWantedForNow &&
+            (pBleDevice->missedCycles <= BLE_DISCOVERY_CACHE_MAX_MISSED_CYCLES)) {
+            keepGoing = addBleDeviceToDiscoveryCache(pBleDevice);
+        }
+    }
+    // Then the devices in the negative cache that are not ours,
+    // so that they are still known after a reset
+    for (int x = 0; (x < gNumBleRejectedDevices) && keepGoing; x++) {
+        pRejectedDevice = &(gBleRejectedList[x]);
+        if (!pRejectedDevice->isTransient && (pRejectedDevice->expiryTime - (int) time(NULL) > 0)) {
+            keepGoing = (gBleDiscoveryCache.numEntries < MAX_NUM_BLE_DISCOVERY_CACHE_ENTRIES);
+            if (keepGoing) {
+                pEntry = &(gBleDiscoveryCache.entry[gBleDiscoveryCache.numEntries]);
+                memset(pEntry, 0, sizeof(*pEntry));
+                memcpy(pEntry->address, pRejectedDevice->address, sizeof(pEntry->address));
+                pEntry->addressType = pRejectedDevice->addressType;
+                pEntry->deviceState = BLE_DEVICE_STATE_NOT_WANTED;
+                gBleDiscoveryCacheMissedCycles[gBleDiscoveryCache.numEntries] = 0;
+                gBleDiscoveryCache.numEntries++;
             }
         }
     }
-    UNLOCK();
+
+    gBleDiscoveryCache.magic = BLE_DISCOVERY_CACHE_MAGIC;
+    gBleDiscoveryCache.uuidChecksum = bleWantedUuidChecksum();
+    gBleDiscoveryCache.wantedChecksum = bleChecksum((const char *) gBleDiscoveryCache.entry,
+                                                    numWantedEntries * sizeof(gBleDiscoveryCache.entry[0]),
+                                                    2166136261UL);
+    gBleDiscoveryCache.checksum = bleChecksum((const char *) gBleDiscoveryCache.entry,
+                                              gBleDiscoveryCache.numEntries * sizeof(gBleDiscoveryCache.entry[0]),
+                                              2166136261UL);
 }
 
-// Handle end of service discovery.
-static void discoveryTerminationCallback(Gap::Handle_t connectionHandle)
+// Populate the BLE device list from the discovery cache.
+// Note that this does NOT lock the BLE list.
+static void restoreBleDeviceListFromDiscoveryCache()
 {
-    char addressString[BLE_ADDRESS_STRING_SIZE];
+    BleDiscoveryCacheEntry *pEntry;
     BleDevice *pBleDevice;
-    ble_error_t bleError;
+    int nameLen;
 
-    LOCK();
-    pBleDevice = pFindBleConnectionInList(connectionHandle);
-    BLE_DEBUG_PRINTF("Terminated service discovery for handle %u", connectionHandle);
-    if (pBleDevice != NULL) {
-        BLE_DEBUG_PRINTF(", BLE device %s, %d characteristic(s) found",
-                         pPrintBleAddress(pBleDevice->address, addressString),
-                         pBleDevice->numCharacteristics);
-        if (pBleDevice->numCharacteristics == 0) {
-            BLE_DEBUG_PRINTF(", dropping it");
-            pBleDevice->deviceState = BLE_DEVICE_STATE_NOT_WANTED;
+    if ((gBleDiscoveryCache.numEntries > 0) && (gBleDiscoveryCache.uuidChecksum != bleWantedUuidChecksum())) {
+        BLE_DEBUG_PRINTF("Ignoring the discovery cache as it is for other wanted UUIDs.\n");
+        gBleDiscoveryCache.numEntries = 0;
+    }
+
+    for (unsigned int x = 0; x < gBleDiscoveryCache.numEntries; x++) {
+        pEntry = &(gBleDiscoveryCache.entry[x]);
+        if (pEntry->deviceState == BLE_DEVICE_STATE_NOT_WANTED) {
+            // Devices that are not ours go into the negative cache,
+            // unless it already knows about them
+            if (pFindBleRejectedDevice(pEntry->address, pEntry->addressType) == NULL) {
+                rejectBleDevice(pEntry->address, pEntry->addressType, false);
+            }
         } else {
-            pBleDevice->deviceState = BLE_DEVICE_STATE_DISCOVERED;
-            if (pBleDevice->pDeviceNameCharacteristic != NULL) {
-                if (pBleDevice->pWantedCharacteristic != NULL) {
-                    // Read the device's name characteristic to see if we want it
-                    BLE_DEBUG_PRINTF(", reading the DeviceName characteristic");
-                    bleError = pBleDevice->pDeviceNameCharacteristic->read(0, checkDeviceNameCallback);
-                    if (bleError != BLE_ERROR_NONE) {
-                        BLE_DEBUG_PRINTF(" but unable to do so (error %d)", bleError);
+            pBleDevice = pAddBleDeviceToList(pEntry->address, pEntry->addressType);
+            if (pBleDevice != NULL) {
+                pBleDevice->seen = false;
+                pBleDevice->missedCycles = gBleDiscoveryCacheMissedCycles[x];
+                if (allocBleDeviceDetail(pBleDevice)) {
+                    pBleDevice->pDetail->pDataStore = pAllocBleDataStore();
+                    if (pBleDevice->pDetail->pDataStore != NULL) {
+                        nameLen = strnlen(pEntry->deviceName, sizeof(pEntry->deviceName));
+                        pBleDevice->pDetail->pDeviceName = pAllocBleDeviceName(pEntry->deviceName, nameLen);
+                        if (pBleDevice->pDetail->pDeviceName != NULL) {
+                            memcpy(pBleDevice->pDetail->wantedHandle, pEntry->wantedHandle, sizeof(pBleDevice->pDetail->wantedHandle));
+                            pBleDevice->pDetail->isObserved = ((pEntry->flags & BLE_DISCOVERY_CACHE_FLAG_OBSERVED) != 0);
+                            pBleDevice->pDetail->cccdHandle = pEntry->cccdHandle;
+                            pBleDevice->deviceState = BLE_DEVICE_STATE_IS_WANTED;
+                        }
+                    }
+                    if (pBleDevice->deviceState != BLE_DEVICE_STATE_IS_WANTED) {
+                        // Leave it to be discovered again
+                        freeBleDeviceDetail(pBleDevice);
                     }
-                } else {
-                    BLE_DEBUG_PRINTF(" but dropping it as the wanted characteristic (0x%04x) was not found",
-                                     gWantedCharacteristicUuid);
-                    pBleDevice->deviceState = BLE_DEVICE_STATE_NOT_WANTED;
-                    // Free up the Device Name characteristic to save RAM
-                    free(pBleDevice->pDeviceNameCharacteristic);
-                    pBleDevice->pDeviceNameCharacteristic = NULL;
                 }
-            } else {
-                BLE_DEBUG_PRINTF(" but dropping it as no DeviceName characteristic was found");
-                pBleDevice->deviceState = BLE_DEVICE_STATE_NOT_WANTED;
-                // Free up the wanted characteristic if it was there to save RAM
-                if (pBleDevice->pWantedCharacteristic != NULL) {
-                    free(pBleDevice->pWantedCharacteristic);
-                    pBleDevice->pWantedCharacteristic = NULL;
+            }
+        }
+    }
+}
+
+// Checksum the wanted service and characteristic UUIDs.
+// Note that this does NOT lock the BLE list.
+static uint32_t bleWantedUuidChecksum()
+{
+    uint32_t hash = 2166136261UL;
+
+    hash = bleChecksum((const char *) gWantedService.getBaseUUID(), gWantedService.getLen(), hash);
+    for (int x = 0; x < gNumWantedCharacteristics; x++) {
+        hash = bleChecksum((const char *) gWantedCharacteristic[x].getBaseUUID(),
+                           gWantedCharacteristic[x].getLen(), hash);
+    }
+
+    return hash;
+}
+
+// Find the BLE device that should be read from next.
+// Note that this does NOT lock the BLE list.
+static BleDevice *pFindNextBleDeviceToRead(int nowMs)
+{
+    BleDevice *pBleDevice;
+    BleDevice *pNextBleDevice = NULL;
+    int startByMs;
+    int nextStartByMs = 0;
+
+    for (int x = 0; x < gNumBleDevicesInList; x++) {
+        pBleDevice = &(gBleDeviceList[x]);
+        if ((pBleDevice->deviceState == BLE_DEVICE_STATE_IS_WANTED) && !pBleDevice->pDetail->isObserved &&
+            (pBleDevice->connectionState == BLE_CONNECTION_STATE_DISCONNECTED)) {
+            startByMs = pBleDevice->pDetail->nextReadMs - pBleDevice->pDetail->lastReadDurationMs;
+            if ((startByMs - nowMs <= 0) &&
+                ((pNextBleDevice == NULL) || (startByMs - nextStartByMs < 0))) {
+                pNextBleDevice = pBleDevice;
+                nextStartByMs = startByMs;
+            }
+        }
+    }
+
+    return pNextBleDevice;
+}
+
+// Note the outcome of a reading and work out when the next is due.
+// Note that this does NOT lock the BLE list.
+static void endBleRead(BleDevice *pBleDevice, bool success)
+{
+    int nowMs = gBleTimer.read_ms();
+    int retryMs;
+
+    if (pBleDevice->pDetail->readInProgress) {
+        pBleDevice->pDetail->readInProgress = false;
+        if (success) {
+            pBleDevice->pDetail->lastReadDurationMs = nowMs - pBleDevice->pDetail->readStartMs;
+            pBleDevice->pDetail->stats.numReadings++;
+            pBleDevice->pDetail->stats.numConnectedReadings++;
+            pBleDevice->pDetail->stats.totalReadLatencyMs += pBleDevice->pDetail->lastReadDurationMs;
+            pBleDevice->pDetail->numConsecutiveReadFailures = 0;
+            pBleDevice->pDetail->nextReadMs = pBleDevice->pDetail->readStartMs + pBleDevice->pDetail->readPeriodMs;
+        } else {
+            pBleDevice->pDetail->numConsecutiveReadFailures++;
+            retryMs = BLE_MAX_READ_RETRY_SECONDS * 1000;
+            if (pBleDevice->pDetail->numConsecutiveReadFailures <= 5) {
+                retryMs = BLE_READ_RETRY_MS << (pBleDevice->pDetail->numConsecutiveReadFailures - 1);
+            }
+            if (retryMs > BLE_MAX_READ_RETRY_SECONDS * 1000) {
+                retryMs = BLE_MAX_READ_RETRY_SECONDS * 1000;
+            }
+            pBleDevice->pDetail->nextReadMs = nowMs + retryMs;
+        }
+    }
+}
+
+// Determine whether this run of BLE has done all it needs to.
+// Note that this does NOT lock the BLE list.
+static bool bleRunIsComplete(int nowMs)
+{
+    bool isComplete = false;
+    int numWanted = 0;
+    int numWantedDone = 0;
+
+    if ((gEarlyStopQuietPeriodMs > 0) &&
+        (nowMs - gLastNewDeviceMs >= gEarlyStopQuietPeriodMs)) {
+        BLE_DEBUG_PRINTF("No new BLE devices for %d ms.\n", nowMs - gLastNewDeviceMs);
+        isComplete = true;
+    }
+    if (!isComplete && (gEarlyStopNumReadings > 0)) {
+        for (int x = 0; x < gNumBleDevicesInList; x++) {
+            if (gBleDeviceList[x].deviceState == BLE_DEVICE_STATE_IS_WANTED) {
+                numWanted++;
+                if (gBleDeviceList[x].pDetail->stats.numReadings >= gEarlyStopNumReadings) {
+                    numWantedDone++;
                 }
             }
         }
+        if ((numWanted > 0) && (numWantedDone == numWanted)) {
+            BLE_DEBUG_PRINTF("All %d wanted BLE device(s) have given %d reading(s).\n",
+                             numWanted, gEarlyStopNumReadings);
+            isComplete = true;
+        }
     }
-    BLE_DEBUG_PRINTF(".\n");
-    UNLOCK();
 
-    // Disconnect immediately to save time if we can, noting that
-    // this might fail if we're already disconnecting anyway
-    BLE::Instance().gap().disconnect(connectionHandle, Gap::LOCAL_HOST_TERMINATED_CONNECTION);
+    return isComplete;
 }
 
-// When a connection has been made, find out what services are available
-// and their characteristics.
-static void connectionCallback(const Gap::ConnectionCallbackParams_t *pParams)
+// Callback to get BLE readings.
+static void getBleReadingsCallback()
 {
-    char addressString[BLE_ADDRESS_STRING_SIZE];
     BleDevice *pBleDevice;
-    ble_error_t bleError;
+    char addressString[BLE_ADDRESS_STRING_SIZE];
+    ble_error_t bleError = BLE_ERROR_NONE;
+    bool isComplete = true;
+    int nowMs = 0;
 
     LOCK();
-    pBleDevice = pFindBleDeviceInListByAddress((char *) pParams->peerAddr, (int) pParams->peerAddrType);
-    BLE_DEBUG_PRINTF("BLE device %s (address type %s) is connected (handle %u).\n",
-                     pPrintBleAddress((char *) pParams->peerAddr, addressString), gpAddressTypeString[pParams->peerAddrType],
-                     pParams->handle);
-    if (pBleDevice != NULL) {
-        pBleDevice->connectionHandle = pParams->handle;
-        pBleDevice->connectionState = BLE_CONNECTION_STATE_CONNECTED;
-        if (pParams->role == Gap::CENTRAL) {
-            // If we're not reading the device already, find out about it first,
-            // otherwise just read it straight away
-            if (pBleDevice->deviceState != BLE_DEVICE_STATE_IS_WANTED) {
-                pBleDevice->numCharacteristics = 0;
-                BLE_DEBUG_PRINTF("  Attempting to discover its services and characteristics...\n");
-                BLE &ble = BLE::Instance();
-                ble.gattClient().onServiceDiscoveryTermination(discoveryTerminationCallback);
-                bleError = ble.gattClient().launchServiceDiscovery(pParams->handle, serviceDiscoveryCallback,
-                                                                   characteristicDiscoveryCallback,
-                                                                   BLE_UUID_UNKNOWN, BLE_UUID_UNKNOWN);
-                if (bleError != BLE_ERROR_NONE) {
-                    BLE_DEBUG_PRINTF("  !!! Unable to launch service discovery (error %d, \"%s\") !!!!\n", bleError, ble.errorToString(bleError));
-                }
-            } else {
-                MBED_ASSERT(pBleDevice->pWantedCharacteristic != NULL);
-                // By experiment, if there is no delay here then the data returned by the read() is all 0x00, go figure...
-                wait_ms(50);
-                BLE_DEBUG_PRINTF("  Reading the wanted characteristic (0x%04x) of BLE device %s.\n",
-                                 pBleDevice->pWantedCharacteristic->getUUID().getShortUUID(),
-                                 pPrintBleAddress(pBleDevice->address, addressString));
-                bleError = pBleDevice->pWantedCharacteristic->read(0, readWantedValueCallback);
-                if (bleError != BLE_ERROR_NONE) {
-                    BLE_DEBUG_PRINTF("  Unable to start read of wanted characteristic (error %d).\n", bleError);
+    // This is also queued as a one-shot, to read straight away,
+    // which may not run until after bleStop() or bleDeinit()
+    if (gBleRunning) {
+        // Keep the reading queue from filling up if the data
+        // functions of the API are not being called
+        tryDrainBleReadingQueue(false);
+        checkBleConnectionTimeouts();
+        nowMs = gBleTimer.read_ms();
+        isComplete = bleRunIsComplete(nowMs);
+        if (isComplete) {
+            // Stop from the event queue rather than from in here as
+            // the done callback will probably call bleDeinit()
+            gpBleEventQueue->call(bleStop);
+        }
+    }
+    // Start connections to the devices that are due, most
+    // urgent first, for as long as we are allowed to
+    while (gBleRunning && !isComplete && (bleError == BLE_ERROR_NONE) && bleCanConnect() &&
+           ((pBleDevice = pFindNextBleDeviceToRead(nowMs)) != NULL)) {
+        bleError = BLE::Instance().gap().connect((const uint8_t *) pBleDevice->address,
+                                                 (BLEProtocol::AddressType_t) pBleDevice->addressType,
+                                                 &gConnectionParams, &gConnectionScanParams);
+        if (bleError == BLE_ERROR_NONE) {
+            BLE_DEBUG_PRINTF("Connecting to BLE device %s for a reading (%d ms late)...\n",
+                             pPrintBleAddress(pBleDevice->address, addressString),
+                             nowMs - pBleDevice->pDetail->nextReadMs);
+            setBleConnectionState(pBleDevice, BLE_CONNECTION_STATE_CONNECTING);
+            pBleDevice->pDetail->readInProgress = true;
+            pBleDevice->pDetail->readStartMs = nowMs;
+        }
+    }
+    UNLOCK();
+}
+
+// Adapt the scan window to how much scanning is finding.
+static void adaptBleScanCallback()
+{
+    int scanWindowMs;
+
+    LOCK();
+    scanWindowMs = BLE_SCAN_WINDOW_MAX_MS;
+    if (gAdaptiveScanOn) {
+        scanWindowMs = gScanWindowMs;
+        if (gScanYield > 0) {
+            gNumScanIntervalsWithoutYield = 0;
+            scanWindowMs = BLE_SCAN_WINDOW_MAX_MS;
+        } else {
+            gNumScanIntervalsWithoutYield++;
+            if (gNumScanIntervalsWithoutYield >= BLE_SCAN_STABLE_INTERVALS) {
+                gNumScanIntervalsWithoutYield = 0;
+                scanWindowMs /= 2;
+                if (scanWindowMs < BLE_SCAN_WINDOW_MIN_MS) {
+                    scanWindowMs = BLE_SCAN_WINDOW_MIN_MS;
                 }
             }
         }
     }
+    gScanYield = 0;
+
+    if (scanWindowMs != gScanWindowMs) {
+        BLE_DEBUG_PRINTF("Scan window %d ms -> %d ms (every %d ms).\n", gScanWindowMs,
+                         scanWindowMs, BLE_SCAN_INTERVAL_MS);
+        gScanWindowMs = scanWindowMs;
+        BLE::Instance().gap().setScanParams(BLE_SCAN_INTERVAL_MS, gScanWindowMs);
+        // Scanning is stopped while a connection is being made and
+        // restarted afterwards, with the new parameters, so only
+        // restart it here if it is running
+        if (gNumConnecting == 0) {
+            BLE::Instance().gap().stopScan();
+            BLE::Instance().gap().startScan(advertisementCallback);
+        }
+    }
+    // This is called once per scan interval
+    gScanTimeSavedMs += BLE_SCAN_WINDOW_MAX_MS - gScanWindowMs;
     UNLOCK();
 }
 
-// Do disconnection actions, may be called as a result
-// of a disconnection or a time-out.
-static void actOnDisconnect(BleDevice *pBleDevice)
+// Disconnect any connection for discovery or for a reading
+// that has been up for too long.
+// Note that this does NOT lock the BLE list.
+static void checkBleConnectionTimeouts()
 {
+    BleDevice *pBleDevice;
     char addressString[BLE_ADDRESS_STRING_SIZE];
+    int nowMs = gBleTimer.read_ms();
 
-    BLE_DEBUG_PRINTF("Disconnected from device %s", pPrintBleAddress(pBleDevice->address, addressString));
-    if ((pBleDevice->connectionState == BLE_CONNECTION_STATE_CONNECTING) &&
-        ((pBleDevice->deviceState == BLE_DEVICE_STATE_UNKNOWN) ||
-         (pBleDevice->deviceState == BLE_DEVICE_STATE_DISCOVERED))) {
-        if (pBleDevice->discoveryAttempts >= BLE_MAX_DISCOVERY_ATTEMPTS) {
-            // If we were discovering this device and it's rudely bounced us too
-            // many times then it probably doesn't want to know about us so cross it
-            // off our Christmas list
-            pBleDevice->deviceState = BLE_DEVICE_STATE_NOT_WANTED;
-            BLE_DEBUG_PRINTF(" too many times while attempting discovery, so dropping it");
+    for (int x = 0; x < gNumBleDevicesInList; x++) {
+        pBleDevice = &(gBleDeviceList[x]);
+        if ((pBleDevice->connectionState == BLE_CONNECTION_STATE_CONNECTED) && !pBleDevice->pDetail->isHeld &&
+            (nowMs - pBleDevice->pDetail->connectionStateMs > BLE_LINK_TIMEOUT_SECONDS * 1000)) {
+            BLE_DEBUG_PRINTF("Connection to BLE device %s (handle %u) has been up for too long, disconnecting.\n",
+                             pPrintBleAddress(pBleDevice->address, addressString),
+                             pBleDevice->pDetail->connectionHandle);
+            pBleDevice->pDetail->failure = BLE_FAILURE_TIMEOUT;
+            BLE::Instance().gap().disconnect(pBleDevice->pDetail->connectionHandle, Gap::LOCAL_HOST_TERMINATED_CONNECTION);
+        }
+    }
+}
+
+// Allocate a data store for a wanted BLE device.
+// Note that this does NOT lock the BLE list.
+static BleDataStore *pAllocBleDataStore()
+{
+    BleDataStore *pDataStore = NULL;
+
+    if (gpBleDataArena != NULL) {
+        for (int x = 0; (x < gMaxNumBleWantedDevices) && (pDataStore == NULL); x++) {
+            if (!gpBleDataStore[x].inUse) {
+                pDataStore = &(gpBleDataStore[x]);
+                pDataStore->pArena = gpBleDataArena + (x * gBleDataStoreSize);
+                pDataStore->generation++;
+                // The consumer must see the new generation before inUse
+                __DMB();
+                pDataStore->inUse = true;
+            }
+        }
+    }
+
+    return pDataStore;
+}
+
+// Free a data store.
+// Note that this does NOT lock the BLE list.
+static void freeBleDataStore(BleDataStore *pDataStore)
+{
+    if (pDataStore != NULL) {
+        pDataStore->inUse = false;
+    }
+}
+
+// Empty a data store if it has been allocated again.
+static void checkBleDataStore(BleDataStore *pDataStore)
+{
+    if (pDataStore->consumerGeneration != pDataStore->generation) {
+        pDataStore->oldest = 0;
+        pDataStore->numBytes = 0;
+        pDataStore->numItems = 0;
+        startBleDataCursor(pDataStore, &(pDataStore->nextItemToRead));
+        pDataStore->deadband = gBleDeadband;
+        pDataStore->maxSilentSeconds = gBleMaxSilentSeconds;
+        memset(pDataStore->lastStoredValid, 0, sizeof(pDataStore->lastStoredValid));
+        pDataStore->numBytesStored = 0;
+        pDataStore->consumerGeneration = pDataStore->generation;
+    }
+}
+
+// Point a cursor at the oldest data item of a data store.
+static void startBleDataCursor(BleDataStore *pDataStore, BleDataCursor *pCursor)
+{
+    pCursor->index = 0;
+    pCursor->offset = 0;
+    pCursor->timestamp = pDataStore->oldestTimestamp;
+}
+
+// Read an unsigned varint from a data store.
+static unsigned int readBleDataStoreVarint(BleDataStore *pDataStore, int *pOffset)
+{
+    unsigned int value = 0;
+    char byte;
+    int x = 0;
+
+    do {
+        byte = *(pDataStore->pArena + ((pDataStore->oldest + *pOffset) % gBleDataStoreSize));
+        value |= (unsigned int) (byte & 0x7F) << (x * 7);
+        (*pOffset)++;
+        x++;
+    } while ((byte & 0x80) && (x < BLE_MAX_VARINT_SIZE));
+
+    return value;
+}
+
+// Unpack the data item at a cursor and move the cursor on.
+static int readBleDataItem(BleDataStore *pDataStore, BleDataCursor *pCursor, BleDataSlot *pSlot)
+{
+    int offset = pCursor->offset;
+    unsigned int delta;
+
+    delta = readBleDataStoreVarint(pDataStore, &offset);
+    pSlot->characteristicIndex = delta & ((1 << BLE_CHARACTERISTIC_INDEX_BITS) - 1);
+    pSlot->timestamp = pDataStore->oldestTimestamp;
+    if (pCursor->index > 0) {
+        pSlot->timestamp = pCursor->timestamp + (delta >> BLE_DATA_ITEM_DELTA_SHIFT);
+    }
+    pSlot->numRepeats = 0;
+    if (delta & BLE_DATA_ITEM_FLAG_REPEATS) {
+        pSlot->numRepeats = readBleDataStoreVarint(pDataStore, &offset);
+    }
+    pSlot->dataLen = gBleFixedDataLen;
+    if (gBleFixedDataLen == 0) {
+        pSlot->dataLen = *(pDataStore->pArena + ((pDataStore->oldest + offset) % gBleDataStoreSize));
+        offset++;
+    }
+    for (int x = 0; x < pSlot->dataLen; x++) {
+        pSlot->data[x] = *(pDataStore->pArena + ((pDataStore->oldest + offset) % gBleDataStoreSize));
+        offset++;
+    }
+
+    delta = offset - pCursor->offset;
+    pCursor->index++;
+    pCursor->offset = offset;
+    pCursor->timestamp = pSlot->timestamp;
+
+    return delta;
+}
+
+// Pack a data item into a data store.
+static void writeBleDataItem(BleDataStore *pDataStore, int timestamp, int characteristicIndex,
+                             const char *pData, int dataLen, int numRepeats)
+{
+    char buf[BLE_MAX_VARINT_SIZE + BLE_MAX_VARINT_SIZE + 1 + BLE_MAX_DATA_ITEM_SIZE];
+    unsigned int header;
+    int delta = 0;
+    int x;
+
+    if (pDataStore->numItems > 0) {
+        delta = timestamp - pDataStore->newestTimestamp;
+        if (delta < 0) {
+            // Time went backwards, keep the timestamps in order
+            delta = 0;
+        }
+    }
+
+    // Pack the data item into buf first to find its length
+    header = ((unsigned int) delta << BLE_DATA_ITEM_DELTA_SHIFT) | characteristicIndex;
+    if (numRepeats > 0) {
+        header |= BLE_DATA_ITEM_FLAG_REPEATS;
+    }
+    x = writeVarint(buf, BLE_MAX_VARINT_SIZE, header);
+    if (numRepeats > 0) {
+        x += writeVarint(buf + x, BLE_MAX_VARINT_SIZE, numRepeats);
+    }
+    if (gBleFixedDataLen == 0) {
+        buf[x] = dataLen;
+        x++;
+    } else {
+        memset(buf + x, 0, gBleFixedDataLen);
+        if (dataLen > gBleFixedDataLen) {
+            dataLen = gBleFixedDataLen;
+        }
+    }
+    memcpy(buf + x, pData, dataLen);
+    if (gBleFixedDataLen == 0) {
+        x += dataLen;
+    } else {
+        x += gBleFixedDataLen;
+    }
+
+    if (x <= gBleDataStoreSize) {
+        while (gBleDataStoreSize - pDataStore->numBytes < x) {
+            // Full, lose the oldest data item
+            freeOldestBleDataItem(pDataStore);
+        }
+        if (pDataStore->numItems == 0) {
+            pDataStore->oldestTimestamp = timestamp;
+            pDataStore->newestTimestamp = timestamp;
+            startBleDataCursor(pDataStore, &(pDataStore->nextItemToRead));
         } else {
-            BLE_DEBUG_PRINTF(" on discovery attempt %d", pBleDevice->discoveryAttempts);
+            pDataStore->newestTimestamp += delta;
+        }
+        for (int y = 0; y < x; y++) {
+            *(pDataStore->pArena + ((pDataStore->oldest + pDataStore->numBytes) % gBleDataStoreSize)) = buf[y];
+            pDataStore->numBytes++;
         }
+        pDataStore->numItems++;
+        pDataStore->numBytesStored += x;
     }
-    pBleDevice->connectionState = BLE_CONNECTION_STATE_DISCONNECTED;
-    BLE_DEBUG_PRINTF(".\n");
+}
 
-    /* Start scanning again */
-    BLE::Instance().gap().startScan(advertisementCallback);
+// Add a data entry for a BLE device, overwriting the oldest
+// data entry if the device's data store is full.
+static int addBleData(const char *pAddress, int addressType, int characteristicIndex,
+                      const char *pData, int dataLen)
+{
+    BleDevice *pBleDevice = NULL;
+    BleReading *pReading;
+    uint32_t head = gBleReadingQueueHead;
+    int numReadings = 0;
+
+    // Find the device
+    pBleDevice = pFindBleDeviceInListByAddress(pAddress, addressType);
+    if ((pBleDevice != NULL) && (pBleDevice->pDetail != NULL) && (pBleDevice->pDetail->pDataStore != NULL)) {
+        if (dataLen > BLE_MAX_DATA_ITEM_SIZE) {
+            // Storing part of a reading would be storing a wrong one
+            BLE_DEBUG_PRINTF("Data of length %d is longer than the %d byte(s) of a data item, not stored.\n",
+                             dataLen, BLE_MAX_DATA_ITEM_SIZE);
+            gBleStats.numReadingsTooLong++;
+        } else {
+            if (head - gBleReadingQueueTail >= BLE_READING_QUEUE_SIZE) {
+                // Full, make room if the consumer is not busy
+                tryDrainBleReadingQueue(false);
+            }
+            if (head - gBleReadingQueueTail < BLE_READING_QUEUE_SIZE) {
+                pReading = &(gBleReadingQueue[head & (BLE_READING_QUEUE_SIZE - 1)]);
+                pReading->timestamp = time(NULL);
+                pReading->dataStoreIndex = pBleDevice->pDetail->pDataStore - gpBleDataStore;
+                pReading->generation = pBleDevice->pDetail->pDataStore->generation;
+                pReading->characteristicIndex = characteristicIndex;
+                pReading->dataLen = dataLen;
+                memcpy (pReading->data, pData, dataLen);
+                pBleDevice->pDetail->lastReadingTime = pReading->timestamp;
+                // Count before publishing: once the consumer can see the
+                // reading it may empty the queue, which must not read as
+                // the reading not having been queued
+                numReadings = head + 1 - gBleReadingQueueTail;
+                // The reading must be complete before the consumer can see it
+                __DMB();
+                gBleReadingQueueHead = head + 1;
+            } else {
+                gBleStats.numReadingsDropped++;
+            }
+        }
+    }
+
+    return numReadings;
 }
 
-// When a time-out has occurred, determine what to do.
-static void timeoutCallback(Gap::TimeoutSource_t reason)
+// Move the queued readings into the data stores.
+static void drainBleReadingQueue(bool andEndRepeats)
 {
-    BleDevice *pBleDevice;
+    uint32_t tail = gBleReadingQueueTail;
+    BleReading *pReading;
+    BleDataStore *pDataStore;
+    BleDataSlot *pLastStored;
 
-    switch (reason) {
-        case Gap::TIMEOUT_SRC_ADVERTISING:
-            BLE_DEBUG_PRINTF("Time-out while advertising.\n");
-        break;
-        case Gap::TIMEOUT_SRC_SECURITY_REQUEST:
-            BLE_DEBUG_PRINTF("Time-out on a security request.\n");
-        break;
-        case Gap::TIMEOUT_SRC_SCAN:
-            // Connection timeouts can appear as scan timeouts
-            // because of the way they are done
-            BLE_DEBUG_PRINTF("Time-out while scanning or connecting.\n");
-            LOCK();
-            pBleDevice = pFindBleNotDisconnectedInList();
-            if (pBleDevice != NULL) {
-                actOnDisconnect(pBleDevice);
+    for (int x = 0; x < gMaxNumBleWantedDevices; x++) {
+        checkBleDataStore(&(gpBleDataStore[x]));
+    }
+
+    while (tail != gBleReadingQueueHead) {
+        // Only look at the reading once the head has been seen to move
+        __DMB();
+        pReading = &(gBleReadingQueue[tail & (BLE_READING_QUEUE_SIZE - 1)]);
+        pDataStore = &(gpBleDataStore[pReading->dataStoreIndex]);
+        checkBleDataStore(pDataStore);
+        // Drop readings for a data store that has since been freed
+        if (pDataStore->inUse && (pReading->generation == pDataStore->generation)) {
+            pLastStored = &(pDataStore->lastStored[pReading->characteristicIndex]);
+            if (bleReadingIsRepeat(pDataStore, pReading)) {
+                pLastStored->numRepeats++;
+                pDataStore->lastRepeatTimestamp[pReading->characteristicIndex] = pReading->timestamp;
+            } else {
+                // The repeats of the data item before this one go
+                // in the data store before it
+                writeBleRepeats(pDataStore, pReading->characteristicIndex);
+                writeBleDataItem(pDataStore, pReading->timestamp, pReading->characteristicIndex,
+                                 pReading->data, pReading->dataLen, 0);
+                pLastStored->timestamp = pReading->timestamp;
+                pLastStored->dataLen = pReading->dataLen;
+                memcpy(pLastStored->data, pReading->data, pReading->dataLen);
+                pLastStored->numRepeats = 0;
+                pDataStore->lastStoredValid[pReading->characteristicIndex] = true;
             }
-            UNLOCK();
-        break;
-        case Gap::TIMEOUT_SRC_CONN:
-            BLE_DEBUG_PRINTF("Time-out of connection [attempt].\n");
-            LOCK();
-            pBleDevice = pFindBleNotDisconnectedInList();
-            if (pBleDevice != NULL) {
-                actOnDisconnect(pBleDevice);
+        }
+        // Finish with the reading before handing its slot back
+        __DMB();
+        tail++;
+        gBleReadingQueueTail = tail;
+    }
+
+    if (andEndRepeats) {
+        for (int x = 0; x < gMaxNumBleWantedDevices; x++) {
+            if (gpBleDataStore[x].inUse) {
+                for (int y = 0; y < MAX_NUM_BLE_WANTED_CHARACTERISTICS; y++) {
+                    writeBleRepeats(&(gpBleDataStore[x]), y);
+                }
             }
-            UNLOCK();
-        break;
-        default:
-            BLE_DEBUG_PRINTF("Time-out, type unknown (%d).\n", reason);
-        break;
+        }
+    }
+}
+
+// Move the queued readings into the data stores from the BLE side.
+static void tryDrainBleReadingQueue(bool andEndRepeats)
+{
+    if (gDataMtx.trylock()) {
+        drainBleReadingQueue(andEndRepeats);
+        gDataMtx.unlock();
+    }
+}
+
+// Write the summary data item for the repeats of the data item
+// last stored from a characteristic.
+static void writeBleRepeats(BleDataStore *pDataStore, int characteristicIndex)
+{
+    BleDataSlot *pLastStored = &(pDataStore->lastStored[characteristicIndex]);
+
+    if (pDataStore->lastStoredValid[characteristicIndex] && (pLastStored->numRepeats > 0)) {
+        writeBleDataItem(pDataStore, pDataStore->lastRepeatTimestamp[characteristicIndex], characteristicIndex,
+                         pLastStored->data, pLastStored->dataLen, pLastStored->numRepeats);
+        pLastStored->numRepeats = 0;
+    }
+}
+
+// Determine whether a reading is within the deadband of the
+// data item last stored for its characteristic.
+static bool bleReadingIsRepeat(BleDataStore *pDataStore, const BleReading *pReading)
+{
+    const BleDataSlot *pLastStored = &(pDataStore->lastStored[pReading->characteristicIndex]);
+    bool isRepeat = false;
+    int value;
+    int lastValue;
+
+    if ((pDataStore->deadband >= 0) && pDataStore->lastStoredValid[pReading->characteristicIndex] &&
+        (pLastStored->dataLen == pReading->dataLen) &&
+        (pLastStored->numRepeats < BLE_MAX_NUM_REPEATS) &&
+        ((pDataStore->maxSilentSeconds == 0) ||
+         (pReading->timestamp - pLastStored->timestamp < pDataStore->maxSilentSeconds))) {
+        isRepeat = true;
+        // Compare the data as little-endian signed 16-bit values,
+        // the last byte on its own if there is an odd one
+        for (int x = 0; (x < pReading->dataLen) && isRepeat; x += 2) {
+            value = (int8_t) pReading->data[x];
+            lastValue = (int8_t) pLastStored->data[x];
+            if (x + 1 < pReading->dataLen) {
+                value = (int16_t) ((uint8_t) pReading->data[x] | ((uint8_t) pReading->data[x + 1] << 8));
+                lastValue = (int16_t) ((uint8_t) pLastStored->data[x] | ((uint8_t) pLastStored->data[x + 1] << 8));
+            }
+            if ((value - lastValue > pDataStore->deadband) || (lastValue - value > pDataStore->deadband)) {
+                isRepeat = false;
+            }
+        }
+    }
+
+    return isRepeat;
+}
+
+// Find the data store of a device by its name.
+static bool findBleDataStoreByDeviceName(const char *pDeviceName, BleDataStore **ppDataStore)
+{
+    BleDevice *pBleDevice;
+
+    *ppDataStore = NULL;
+    LOCK();
+    pBleDevice = pFindBleDeviceInListByDeviceNamePtr(pDeviceName);
+    if (pBleDevice != NULL) {
+        *ppDataStore = pBleDevice->pDetail->pDataStore;
+    }
+    UNLOCK();
+
+    if (*ppDataStore != NULL) {
+        checkBleDataStore(*ppDataStore);
+    }
+
+    return (pBleDevice != NULL);
+}
+
+// Get the given data item from the given data store
+// and move its nextItemToRead cursor on.
+static BleData *pGetNextDataItemCopy(BleDataStore *pDataStore)
+{
+    BleData *pDataStruct = NULL;
+    BleDataSlot slot;
+    BleDataSlot *pSlot = &slot;
+
+    if ((pDataStore != NULL) && (pDataStore->nextItemToRead.index < pDataStore->numItems)) {
+        readBleDataItem(pDataStore, &(pDataStore->nextItemToRead), pSlot);
+        pDataStruct = (BleData *) malloc(sizeof(BleData));
+        if (pDataStruct != NULL) {
+            pDataStruct->timestamp = pSlot->timestamp;
+            pDataStruct->characteristicUuid = gWantedCharacteristic[pSlot->characteristicIndex].getShortUUID();
+            pDataStruct->dataLen = pSlot->dataLen;
+            pDataStruct->numRepeats = pSlot->numRepeats;
+            pDataStruct->pData = NULL;
+            if (pDataStruct->dataLen > 0) {
+                pDataStruct->pData = (char *) malloc(pDataStruct->dataLen);
+                if (pDataStruct->pData != NULL) {
+                    memcpy (pDataStruct->pData, pSlot->data, pDataStruct->dataLen);
+                } else {
+                    // If that malloc() failed, reverse the first one
+                    free(pDataStruct);
+                    pDataStruct = NULL;
+                }
+            }
+        }
+    }
+
+    return pDataStruct;
+}
+
+// Remove the oldest data item from a data store.
+// Note that this does NOT lock the BLE list.
+static void freeOldestBleDataItem(BleDataStore *pDataStore)
+{
+    BleDataCursor cursor;
+    BleDataSlot slot;
+    int size;
+    int offset = 0;
+
+    if (pDataStore->numItems > 0) {
+        startBleDataCursor(pDataStore, &cursor);
+        size = readBleDataItem(pDataStore, &cursor, &slot);
+        pDataStore->oldest = (pDataStore->oldest + size) % gBleDataStoreSize;
+        pDataStore->numBytes -= size;
+        pDataStore->numItems--;
+        if (pDataStore->numItems > 0) {
+            // The timestamp of the new oldest data item
+            pDataStore->oldestTimestamp += readBleDataStoreVarint(pDataStore, &offset) >> BLE_DATA_ITEM_DELTA_SHIFT;
+        }
+        if (pDataStore->nextItemToRead.index > 0) {
+            pDataStore->nextItemToRead.index--;
+            pDataStore->nextItemToRead.offset -= size;
+        } else {
+            startBleDataCursor(pDataStore, &(pDataStore->nextItemToRead));
+        }
+    }
+}
+
+// Write an unsigned varint into a buffer, 7 bits at a time,
+// least significant first.
+static int writeVarint(char *pBuf, int lenBuf, unsigned int value)
+{
+    int x = 0;
+
+    do {
+        if (x >= lenBuf) {
+            return 0;
+        }
+        *(pBuf + x) = value & 0x7F;
+        value >>= 7;
+        if (value > 0) {
+            *(pBuf + x) |= 0x80;
+        }
+        x++;
+    } while (value > 0);
+
+    return x;
+}
+
+// Get the next record from BLE advertising data.
+static int nextAdRecord(const uint8_t *pData, int dataLen, int offset,
+                        int *pType, const char **ppValue, int *pValueLen)
+{
+    int recordLength;
+
+    /* The advertising payload is a collection of key/value records where
+     * byte 0: length of the record excluding this byte but including the "type" byte
+     * byte 1: The key, it is the type of the data
+     * byte [2..N] The value. N is equal to byte0 - 1 */
+    while (offset < dataLen) {
+        recordLength = pData[offset];
+        if (offset + recordLength >= dataLen) {
+            // Malformed: runs off the end
+            return -1;
+        }
+        if ((recordLength > 0) && (pData[offset + 1] != 0)) {  // Type of 0 is not allowed
+            *pType = pData[offset + 1];
+            *ppValue = (const char *) pData + offset + 2;
+            *pValueLen = recordLength - 1;
+            return offset + recordLength + 1;
+        }
+        offset++;
+    }
+
+    return -1;
+}
+
+// Determine whether a name matches the Device Name prefix.
+static BleNameMatch bleNameMatchesPrefix(const char *pName, int nameLen, bool isComplete)
+{
+    BleNameMatch match = BLE_NAME_MATCH_MAYBE;
+    int prefixLen = strlen(gpDeviceNamePrefix);
+
+    if (pName != NULL) {
+        if (nameLen >= prefixLen) {
+            match = BLE_NAME_MATCH_NO;
+            if (memcmp(pName, gpDeviceNamePrefix, prefixLen) == 0) {
+                match = BLE_NAME_MATCH_YES;
+            }
+        } else {
+            // Too short to match unless it has been shortened
+            // and what there is matches
+            match = BLE_NAME_MATCH_NO;
+            if (!isComplete && (memcmp(pName, gpDeviceNamePrefix, nameLen) == 0)) {
+                match = BLE_NAME_MATCH_MAYBE;
+            }
+        }
+    }
+
+    return match;
+}
+
+// Find the reading for gObserverUuid in an advertising data record:
+// this is either SERVICE_DATA for the UUID or MANUFACTURER_SPECIFIC_DATA
+// where the UUID follows the two-byte company identifier.  In both
+// cases the UUID is little-endian and the reading follows it.
+static const char *pFindObservedData(int type, const char *pValue, int valueLen, int *pDataLen)
+{
+    const char *pData = NULL;
+
+    if (type == GapAdvertisingData::MANUFACTURER_SPECIFIC_DATA) {
+        // Skip the company identifier
+        pValue += 2;
+        valueLen -= 2;
+    } else if (type != GapAdvertisingData::SERVICE_DATA) {
+        valueLen = 0;
+    }
+
+    if ((valueLen > 2) &&
+        ((((uint8_t) *pValue) | (((uint8_t) *(pValue + 1)) << 8)) == gObserverUuid)) {
+        pData = pValue + 2;
+        *pDataLen = valueLen - 2;
+    }
+
+    return pData;
+}
+
+// Act on a reading found in the advertisement of a device
+// in observer mode.
+// Note that this does NOT lock the BLE list.
+static void actOnObservedData(const Gap::AdvertisementCallbackParams_t *pParams,
+                              const char *pName, int nameLen, bool nameIsComplete,
+                              const char *pData, int dataLen)
+{
+    char addressString[BLE_ADDRESS_STRING_SIZE];
+    BleDevice *pBleDevice;
+    int numItems;
+
+    pBleDevice = pAddBleDeviceToList((const char *) pParams->peerAddr, (int) pParams->addressType);
+    if (pBleDevice != NULL) {
+        if ((pBleDevice->deviceState != BLE_DEVICE_STATE_IS_WANTED) &&
+            (pBleDevice->deviceState != BLE_DEVICE_STATE_NOT_WANTED)) {
+            // If it has a name, it has to be one of ours
+            if (bleNameMatchesPrefix(pName, nameLen, nameIsComplete) == BLE_NAME_MATCH_NO) {
+                BLE_DEBUG_PRINTF(", has data for service 0x%04x but is not one of ours", gObserverUuid);
+            } else {
+                if (allocBleDeviceDetail(pBleDevice)) {
+                    pBleDevice->pDetail->pDataStore = pAllocBleDataStore();
+                }
+                if ((pBleDevice->pDetail != NULL) && (pBleDevice->pDetail->pDataStore != NULL)) {
+                    // Name it, using the address if it has no name
+                    if (pName == NULL) {
+                        pName = pPrintBleAddress((const char *) pParams->peerAddr, addressString);
+                        nameLen = strlen(pName);
+                    }
+                    pBleDevice->pDetail->pDeviceName = pAllocBleDeviceName(pName, nameLen);
+                    if (pBleDevice->pDetail->pDeviceName == NULL) {
+                        // Without a name it can't be wanted; try again
+                        // next time it advertises
+                        freeBleDataStore(pBleDevice->pDetail->pDataStore);
+                        pBleDevice->pDetail->pDataStore = NULL;
+                    }
+                }
+                if ((pBleDevice->pDetail != NULL) && (pBleDevice->pDetail->pDeviceName != NULL)) {
+                    pBleDevice->deviceState = BLE_DEVICE_STATE_IS_WANTED;
+                    pBleDevice->pDetail->isObserved = true;
+                    forgetBleRejectedDevice(pBleDevice->address, pBleDevice->addressType);
+                    BLE_DEBUG_PRINTF(", observing it");
+                } else {
+                    BLE_DEBUG_PRINTF(", has data for service 0x%04x but there is no room to store it", gObserverUuid);
+                    releaseUnusedBleDeviceDetail(pBleDevice);
+                }
+            }
+        }
+        if (pBleDevice->deviceState == BLE_DEVICE_STATE_IS_WANTED) {
+            // No need to connect to a device that advertises its readings
+            pBleDevice->pDetail->isObserved = true;
+            if ((pBleDevice->pDetail->pDataStore != NULL) &&
+                ((pBleDevice->pDetail->lastReadingTime == 0) ||
+                 (time(NULL) - pBleDevice->pDetail->lastReadingTime >= BLE_OBSERVER_READ_INTERVAL_SECONDS))) {
+                numItems = addBleData(pBleDevice->address, pBleDevice->addressType, 0, pData, dataLen);
+                if (numItems > 0) {
+                    pBleDevice->pDetail->stats.numReadings++;
+                }
+                BLE_DEBUG_PRINTF(", reading of %d byte(s) taken from its advertisement, %d reading(s) now queued",
+                                 dataLen, numItems);
+            }
+        }
+    } else {
+        BLE_DEBUG_PRINTF(", has data for service 0x%04x but the BLE device list is full (%d device(s))", gObserverUuid,
+                         gNumBleDevicesInList);
+    }
+}
+
+// Process an advertisement and connect to the device if
+// it is one that we want or, in observer mode, take a reading
+// from the advertisement.
+static void advertisementCallback(const Gap::AdvertisementCallbackParams_t *pParams)
+{
+    char buf[BLE_ADDRESS_STRING_SIZE + 32];
+    BleDevice *pBleDevice;
+    ble_error_t bleError;
+    int type;
+    const char *pValue;
+    int valueLen;
+    const char *pName = NULL;
+    int nameLen = 0;
+    bool nameIsComplete = false;
+    const char *pObservedData = NULL;
+    int observedDataLen = 0;
+    int x = 0;
+    bool discoverable = false;
+    bool rejected;
+
+    BLE_DEBUG_PRINTF("BLE device %s is visible, has a %s address",
+                     pPrintBleAddress((char *) pParams->peerAddr, buf), gpAddressTypeString[pParams->addressType]);
+    // Check if the device is discoverable and pick out the things we need
+    while ((x = nextAdRecord(pParams->advertisingData, pParams->advertisingDataLen, x,
+                             &type, &pValue, &valueLen)) >= 0) {
+        //BLE_DEBUG_PRINTF("  Advertising payload type 0x%02x", type);
+        //if (type < (int) (sizeof(gapAdvertisingDataTypeString) / sizeof(gapAdvertisingDataTypeString[0]))) {
+        //    BLE_DEBUG_PRINTF(" (%s)", gapAdvertisingDataTypeString[type]);
+        //}
+        //BLE_DEBUG_PRINTF(" (%d byte(s)): 0x%.*s.\n", valueLen,
+        //                 bytesToHexString(pValue, valueLen, buf, sizeof(buf)), buf);
+        if ((type == GapAdvertisingData::FLAGS) && (valueLen > 0) &&
+            (*pValue & (GapAdvertisingData::LE_GENERAL_DISCOVERABLE | GapAdvertisingData::LE_LIMITED_DISCOVERABLE))) {
+            discoverable = true;
+        } else if ((type == GapAdvertisingData::COMPLETE_LOCAL_NAME) ||
+                   ((type == GapAdvertisingData::SHORTENED_LOCAL_NAME) && (pName == NULL))) {
+            pName = pValue;
+            nameLen = valueLen;
+            nameIsComplete = (type == GapAdvertisingData::COMPLETE_LOCAL_NAME);
+        } else if ((gObserverUuid != 0) && (pObservedData == NULL)) {
+            pObservedData = pFindObservedData(type, pValue, valueLen, &observedDataLen);
+        }
+    }
+
+    LOCK();
+    gBleStats.numAdvertisements++;
+    rejected = bleDeviceIsRejected((const char *) pParams->peerAddr, (int) pParams->addressType);
+    pBleDevice = pFindBleDeviceInListByAddress((const char *) pParams->peerAddr, (int) pParams->addressType);
+    if ((pBleDevice != NULL) && (pBleDevice->pDetail != NULL)) {
+        pBleDevice->pDetail->stats.numAdvertisements++;
+    }
+    UNLOCK();
+
+    if (rejected) {
+        BLE_DEBUG_PRINTF(" but we have already rejected it.\n");
+    } else if (pObservedData != NULL) {
+        LOCK();
+        actOnObservedData(pParams, pName, nameLen, nameIsComplete, pObservedData, observedDataLen);
+        UNLOCK();
+    }
+
+    if (rejected) {
+        // Nothing to do
+    } else if (discoverable) {
+        BLE_DEBUG_PRINTF(" and is discoverable");
+        LOCK();
+        pBleDevice = pFindBleDeviceInListByAddress((const char *) pParams->peerAddr, (int) pParams->addressType);
+        if (((pBleDevice == NULL) ||
+             ((pBleDevice->deviceState == BLE_DEVICE_STATE_UNKNOWN) &&
+              (pBleDevice->connectionState == BLE_CONNECTION_STATE_DISCONNECTED))) &&
+            (bleNameMatchesPrefix(pName, nameLen, nameIsComplete) == BLE_NAME_MATCH_NO)) {
+            // No need to connect to find out its Device Name, nor to
+            // give it a place in the list
+            BLE_DEBUG_PRINTF(" but its name, \"%.*s\", shows that it is not one of ours.\n", nameLen, pName);
+            if (pBleDevice != NULL) {
+                pBleDevice->deviceState = BLE_DEVICE_STATE_NOT_WANTED;
+                releaseNotWantedBleDevice(pBleDevice);
+            } else {
+                rejectBleDevice((const char *) pParams->peerAddr, (int) pParams->addressType, false);
+            }
+            gBleStats.numConnectionsSaved++;
+            pBleDevice = NULL;
+        } else {
+            pBleDevice = pAddBleDeviceToList((const char *) pParams->peerAddr, (int) pParams->addressType);
+            if (pBleDevice == NULL) {
+                BLE_DEBUG_PRINTF(" but the BLE device list is full (%d device(s))!\n", gNumBleDevicesInList);
+            }
+        }
+        if (pBleDevice != NULL) {
+            if (pBleDevice->deviceState == BLE_DEVICE_STATE_UNKNOWN) {
+                if (pBleDevice->connectionState != BLE_CONNECTION_STATE_DISCONNECTED) {
+                    BLE_DEBUG_PRINTF(" but we are already connected to it (or attempting to do so).\n");
+                } else if (!bleCanConnect()) {
+                    BLE_DEBUG_PRINTF(" but we are busy with other connections (%d in flight, %d connecting).\n",
+                                     gNumConnections - gNumHeldConnections, gNumConnecting);
+                } else if (bleIsDiscovering()) {
+                    BLE_DEBUG_PRINTF(" but we are busy discovering another device.\n");
+                } else if (!allocBleDeviceDetail(pBleDevice)) {
+                    BLE_DEBUG_PRINTF(" but we are busy with other devices (all %d sets of details are in use).\n",
+                                     gNumBleDeviceDetails);
+                } else {
+                    BLE_DEBUG_PRINTF(", attempting to connect to it");
+                    bleError = BLE::Instance().gap().connect(pParams->peerAddr, pParams->addressType, &gConnectionParams, &gConnectionScanParams);
+                    if (bleError == BLE_ERROR_NONE) {
+                        setBleConnectionState(pBleDevice, BLE_CONNECTION_STATE_CONNECTING);
+                        pBleDevice->discoveryAttempts++;
+                       BLE_DEBUG_PRINTF(", connect() successfully issued.\n");
+                    } else if (bleError == BLE_ERROR_INVALID_STATE) {
+                        BLE_DEBUG_PRINTF(" but CAN'T as BLE is in an invalid state (may already be connecting?).\n");
+                    } else {
+                        BLE_DEBUG_PRINTF(" but unable to issue connect (error %d \"%s\").\n", bleError, BLE::Instance().errorToString(bleError));
+                    }
+                    releaseUnusedBleDeviceDetail(pBleDevice);
+                }
+            } else {
+                BLE_DEBUG_PRINTF(" but we already know about it so there is nothing to do.\n");
+            }
+        }
+        UNLOCK();
+    } else {
+        BLE_DEBUG_PRINTF(" but is not discoverable.\n");
+    }
+}
+
+// Act on the discovery of a service.
+static void serviceDiscoveryCallback(const DiscoveredService *pService)
+{
+    if (pService->getUUID().shortOrLong() == UUID::UUID_TYPE_SHORT) {
+        BLE_DEBUG_PRINTF("Service 0x%x attrs[%u %u].\n", pService->getUUID().getShortUUID(),
+                         pService->getStartHandle(), pService->getEndHandle());
+    } else {
+        BLE_DEBUG_PRINTF("Service 0x");
+        const char *pLongUUIDBytes = (char *) pService->getUUID().getBaseUUID();
+        for (unsigned int i = 0; i < UUID::LENGTH_OF_LONG_UUID; i++) {
+            BLE_DEBUG_PRINTF("%02x", *(pLongUUIDBytes + i));
+        }
+        BLE_DEBUG_PRINTF(" attrs[%u %u].\n", pService->getStartHandle(), pService->getEndHandle());
+    }
+}
+
+// Act on the discovery of a characteristic.
+static void characteristicDiscoveryCallback(const DiscoveredCharacteristic *pCharacteristic)
+{
+    char addressString[BLE_ADDRESS_STRING_SIZE];
+    const UUID &uuid = pCharacteristic->getUUID();
+    GattAttribute::Handle_t *pStoredHandle = NULL;
+    BleDevice *pBleDevice;
+    bool discoveryDone = false;
+    bool haveAllWanted = true;
+
+    if (uuid.shortOrLong() == UUID::UUID_TYPE_SHORT) {
+        BLE_DEBUG_PRINTF("  Characteristic 0x%x", uuid.getShortUUID());
+    } else {
+        BLE_DEBUG_PRINTF("  Characteristic 0x");
+        for (unsigned int i = 0; i < UUID::LENGTH_OF_LONG_UUID; i++) {
+            BLE_DEBUG_PRINTF("%02x", *(uuid.getBaseUUID() + i));
+        }
+    }
+    BLE_DEBUG_PRINTF(" valueAttr[%u] props[0x%x].\n", pCharacteristic->getValueHandle(),
+                     (uint8_t) pCharacteristic->getProperties().broadcast());
+
+    LOCK();
+    pBleDevice = pFindBleConnectionInList(pCharacteristic->getConnectionHandle());
+    if (pBleDevice != NULL) {
+        pBleDevice->pDetail->numCharacteristics++;
+        // If this device isn't marked as "not wanted" and if we're not already
+        // reading from it...
+        if (uuid == UUID((UUID::ShortUUIDBytes_t) BLE_UUID_GAP_CHARACTERISTIC_DEVICE_NAME)) {
+            pStoredHandle = &(pBleDevice->pDetail->deviceNameHandle);
+        } else {
+            for (int x = 0; (x < gNumWantedCharacteristics) && (pStoredHandle == NULL); x++) {
+                if (uuid == gWantedCharacteristic[x]) {
+                    pStoredHandle = &(pBleDevice->pDetail->wantedHandle[x]);
+                }
+            }
+        }
+
+        if (pStoredHandle != NULL) {
+            // Keep the value handle so that we can read it once service
+            // discovery has ended (and on later connections)
+            BLE_DEBUG_PRINTF("  BLE device %s has a characteristic we want to read.\n", pPrintBleAddress(pBleDevice->address, addressString));
+            *pStoredHandle = pCharacteristic->getValueHandle();
+            if (pStoredHandle == &(pBleDevice->pDetail->wantedHandle[0])) {
+                // Notifications need a CCCD, which is one of the
+                // descriptors after the value, see discoverBleCccdCallback()
+                gBleNotifyCharacteristic = *pCharacteristic;
+                pBleDevice->pDetail->cccdHandle = 0;
+            }
+            for (int x = 0; x < gNumWantedCharacteristics; x++) {
+                if (pBleDevice->pDetail->wantedHandle[x] == 0) {
+                    haveAllWanted = false;
+                }
+            }
+            // No need to carry on once we have what we came for
+            discoveryDone = (pBleDevice->pDetail->deviceNameHandle != 0) &&
+                            (haveAllWanted ||
+                             (bleDiscoveryIsTargeted() && !pBleDevice->pDetail->discoveringWantedService));
+        }
+    }
+    UNLOCK();
+
+    if (discoveryDone) {
+        // This will lead to discoveryTerminationCallback()
+        BLE::Instance().gattClient().terminateServiceDiscovery();
+    }
+}
+
+// Determine whether service discovery is targeted.
+static bool bleDiscoveryIsTargeted()
+{
+    return gWantedService != UUID((UUID::ShortUUIDBytes_t) BLE_UUID_UNKNOWN);
+}
+
+// Launch service discovery on a connection.
+static ble_error_t launchBleServiceDiscovery(Gap::Handle_t connectionHandle, bool wantedService)
+{
+    BLE &ble = BLE::Instance();
+    UUID serviceUuid((UUID::ShortUUIDBytes_t) BLE_UUID_UNKNOWN);
+    UUID characteristicUuid((UUID::ShortUUIDBytes_t) BLE_UUID_UNKNOWN);
+
+    if (bleDiscoveryIsTargeted()) {
+        if (wantedService) {
+            serviceUuid = gWantedService;
+            // Discovery can only be narrowed down to one characteristic
+            if (gNumWantedCharacteristics == 1) {
+                characteristicUuid = gWantedCharacteristic[0];
+            }
+        } else {
+            serviceUuid = UUID((UUID::ShortUUIDBytes_t) BLE_UUID_GAP);
+            characteristicUuid = UUID((UUID::ShortUUIDBytes_t) BLE_UUID_GAP_CHARACTERISTIC_DEVICE_NAME);
+        }
+    }
+
+    ble.gattClient().onServiceDiscoveryTermination(discoveryTerminationCallback);
+    return ble.gattClient().launchServiceDiscovery(connectionHandle, serviceDiscoveryCallback,
+                                                   characteristicDiscoveryCallback,
+                                                   serviceUuid, characteristicUuid);
+}
+
+// Launch the second pass of targeted service discovery.
+static void discoverWantedServiceCallback(Gap::Handle_t connectionHandle)
+{
+    BleDevice *pBleDevice;
+    ble_error_t bleError = BLE_ERROR_INVALID_STATE;
+
+    LOCK();
+    pBleDevice = pFindBleConnectionInList(connectionHandle);
+    if (pBleDevice != NULL) {
+        pBleDevice->pDetail->eventId = 0;
+        bleError = launchBleServiceDiscovery(connectionHandle, true);
+    }
+    UNLOCK();
+    if (bleError != BLE_ERROR_NONE) {
+        BLE_DEBUG_PRINTF("Unable to launch discovery of the wanted service for handle %u (error %d).\n",
+                         connectionHandle, bleError);
+        BLE::Instance().gap().disconnect(connectionHandle, Gap::LOCAL_HOST_TERMINATED_CONNECTION);
+    }
+}
+
+// Determine whether there is a CCCD to look for.
+// Note that this does NOT lock the BLE list.
+static bool bleNotifyCharacteristicHasCccd(const BleDevice *pBleDevice)
+{
+    return (pBleDevice->pDetail->wantedHandle[0] != 0) &&
+           (gBleNotifyCharacteristic.getConnectionHandle() == pBleDevice->pDetail->connectionHandle) &&
+           (gBleNotifyCharacteristic.getValueHandle() == pBleDevice->pDetail->wantedHandle[0]) &&
+           gBleNotifyCharacteristic.getProperties().notify() &&
+           (gBleNotifyCharacteristic.getLastHandle() > gBleNotifyCharacteristic.getValueHandle());
+}
+
+// Read the Device Name of a BLE device.
+// Note that this does NOT lock the BLE list.
+static ble_error_t startBleDeviceNameRead(BleDevice *pBleDevice)
+{
+    ble_error_t bleError;
+
+    BLE_DEBUG_PRINTF(", reading the DeviceName characteristic");
+    bleError = BLE::Instance().gattClient().read(pBleDevice->pDetail->connectionHandle,
+                                                 pBleDevice->pDetail->deviceNameHandle, 0);
+    if (bleError != BLE_ERROR_NONE) {
+        BLE_DEBUG_PRINTF(" but unable to do so (error %d)", bleError);
+    }
+
+    return bleError;
+}
+
+// Launch the discovery of the descriptors of the wanted characteristic.
+static void discoverBleCccdCallback(Gap::Handle_t connectionHandle)
+{
+    char addressString[BLE_ADDRESS_STRING_SIZE];
+    BleDevice *pBleDevice;
+    ble_error_t bleError = BLE_ERROR_INVALID_STATE;
+
+    LOCK();
+    pBleDevice = pFindBleConnectionInList(connectionHandle);
+    if (pBleDevice != NULL) {
+        pBleDevice->pDetail->eventId = 0;
+        bleError = gBleNotifyCharacteristic.discoverDescriptors(cccdDiscoveryCallback,
+                                                                cccdDiscoveryTerminationCallback);
+        if (bleError != BLE_ERROR_NONE) {
+            // Not being able to subscribe to it is no reason not to read it
+            BLE_DEBUG_PRINTF("Unable to discover the descriptors of BLE device %s (error %d)",
+                             pPrintBleAddress(pBleDevice->address, addressString), bleError);
+            bleError = startBleDeviceNameRead(pBleDevice);
+            BLE_DEBUG_PRINTF(".\n");
+        }
+    }
+    UNLOCK();
+
+    if (bleError != BLE_ERROR_NONE) {
+        BLE::Instance().gap().disconnect(connectionHandle, Gap::LOCAL_HOST_TERMINATED_CONNECTION);
+    }
+}
+
+// Keep the handle of the CCCD.
+static void cccdDiscoveryCallback(const CharacteristicDescriptorDiscovery::DiscoveryCallbackParams_t *pParams)
+{
+    BleDevice *pBleDevice;
+
+    if (pParams->descriptor.getUUID() == UUID((UUID::ShortUUIDBytes_t) BLE_UUID_DESCRIPTOR_CLIENT_CHAR_CONFIG)) {
+        LOCK();
+        pBleDevice = pFindBleConnectionInList(pParams->descriptor.getConnectionHandle());
+        if (pBleDevice != NULL) {
+            pBleDevice->pDetail->cccdHandle = pParams->descriptor.getAttributeHandle();
+        }
+        UNLOCK();
+    }
+}
+
+// Handle the end of descriptor discovery.
+static void cccdDiscoveryTerminationCallback(const CharacteristicDescriptorDiscovery::TerminationCallbackParams_t *pParams)
+{
+    char addressString[BLE_ADDRESS_STRING_SIZE];
+    Gap::Handle_t connectionHandle = pParams->characteristic.getConnectionHandle();
+    BleDevice *pBleDevice;
+    ble_error_t bleError = BLE_ERROR_INVALID_STATE;
+
+    LOCK();
+    pBleDevice = pFindBleConnectionInList(connectionHandle);
+    if (pBleDevice != NULL) {
+        BLE_DEBUG_PRINTF("Descriptor discovery of BLE device %s ended (status %d), CCCD handle %u",
+                         pPrintBleAddress(pBleDevice->address, addressString), pParams->status,
+                         pBleDevice->pDetail->cccdHandle);
+        bleError = startBleDeviceNameRead(pBleDevice);
+        BLE_DEBUG_PRINTF(".\n");
+    }
+    UNLOCK();
+
+    if (bleError != BLE_ERROR_NONE) {
+        BLE::Instance().gap().disconnect(connectionHandle, Gap::LOCAL_HOST_TERMINATED_CONNECTION);
+    }
+}
+
+// Handle end of service discovery.
+static void discoveryTerminationCallback(Gap::Handle_t connectionHandle)
+{
+    char addressString[BLE_ADDRESS_STRING_SIZE];
+    BleDevice *pBleDevice;
+    ble_error_t bleError = BLE_ERROR_INVALID_STATE;
+
+    LOCK();
+    pBleDevice = pFindBleConnectionInList(connectionHandle);
+    BLE_DEBUG_PRINTF("Terminated service discovery for handle %u", connectionHandle);
+    if ((pBleDevice != NULL) && bleDiscoveryIsTargeted() && !pBleDevice->pDetail->discoveringWantedService &&
+        (pBleDevice->pDetail->deviceNameHandle != 0)) {
+        // Found the Device Name in the GAP service, now look in
+        // the wanted service; this is launched from the event queue
+        // as the stack may not yet be ready for another discovery
+        BLE_DEBUG_PRINTF(", BLE device %s, moving on to the wanted service",
+                         pPrintBleAddress(pBleDevice->address, addressString));
+        pBleDevice->pDetail->discoveringWantedService = true;
+        MBED_ASSERT(gpBleEventQueue != NULL);
+        pBleDevice->pDetail->eventId = gpBleEventQueue->call(discoverWantedServiceCallback, connectionHandle);
+        if (pBleDevice->pDetail->eventId != 0) {
+            bleError = BLE_ERROR_NONE;
+        }
+    } else if (pBleDevice != NULL) {
+        BLE_DEBUG_PRINTF(", BLE device %s, %d characteristic(s) found",
+                         pPrintBleAddress(pBleDevice->address, addressString),
+                         pBleDevice->pDetail->numCharacteristics);
+        pBleDevice->pDetail->stats.numDiscoveries++;
+        pBleDevice->pDetail->stats.totalDiscoveryMs += gBleTimer.read_ms() - pBleDevice->pDetail->connectionStateMs;
+        if (pBleDevice->pDetail->numCharacteristics == 0) {
+            BLE_DEBUG_PRINTF(", dropping it");
+            pBleDevice->deviceState = BLE_DEVICE_STATE_NOT_WANTED;
+        } else {
+            pBleDevice->deviceState = BLE_DEVICE_STATE_DISCOVERED;
+            if (pBleDevice->pDetail->deviceNameHandle != 0) {
+                if (bleNotifyCharacteristicHasCccd(pBleDevice)) {
+                    // Find the CCCD before going on to the name; this
+                    // is launched from the event queue as the stack may
+                    // not yet be ready for another discovery
+                    BLE_DEBUG_PRINTF(", looking for the CCCD of its wanted characteristic");
+                    MBED_ASSERT(gpBleEventQueue != NULL);
+                    pBleDevice->pDetail->eventId = gpBleEventQueue->call(discoverBleCccdCallback, connectionHandle);
+                    if (pBleDevice->pDetail->eventId != 0) {
+                        bleError = BLE_ERROR_NONE;
+                    }
+                } else if (nextBleWantedCharacteristic(pBleDevice, 0) >= 0) {
+                    bleError = startBleDeviceNameRead(pBleDevice);
+                } else {
+                    BLE_DEBUG_PRINTF(" but dropping it as no wanted characteristic (0x%04x...) was found",
+                                     gWantedCharacteristic[0].getShortUUID());
+                    pBleDevice->deviceState = BLE_DEVICE_STATE_NOT_WANTED;
+                    pBleDevice->pDetail->deviceNameHandle = 0;
+                }
+            } else {
+                BLE_DEBUG_PRINTF(" but dropping it as no DeviceName characteristic was found");
+                pBleDevice->deviceState = BLE_DEVICE_STATE_NOT_WANTED;
+                clearBleWantedHandles(pBleDevice);
+            }
+        }
+    }
+    BLE_DEBUG_PRINTF(".\n");
+    UNLOCK();
+
+    // Unless we're going on to check its name, disconnect
+    // immediately to save time if we can, noting that
+    // this might fail if we're already disconnecting anyway
+    if (bleError != BLE_ERROR_NONE) {
+        BLE::Instance().gap().disconnect(connectionHandle, Gap::LOCAL_HOST_TERMINATED_CONNECTION);
+    }
+}
+
+// When a connection has been made, find out what services are available
+// and their characteristics.
+static void connectionCallback(const Gap::ConnectionCallbackParams_t *pParams)
+{
+    char addressString[BLE_ADDRESS_STRING_SIZE];
+    BleDevice *pBleDevice;
+    ble_error_t bleError;
+
+    LOCK();
+    pBleDevice = pFindBleDeviceInListByAddress((char *) pParams->peerAddr, (int) pParams->peerAddrType);
+    BLE_DEBUG_PRINTF("BLE device %s (address type %s) is connected (handle %u).\n",
+                     pPrintBleAddress((char *) pParams->peerAddr, addressString), gpAddressTypeString[pParams->peerAddrType],
+                     pParams->handle);
+    if ((pBleDevice != NULL) && !allocBleDeviceDetail(pBleDevice)) {
+        // Only possible if the connection was not initiated by us
+        BLE_DEBUG_PRINTF("  There is no room for its details, disconnecting.\n");
+        BLE::Instance().gap().disconnect(pParams->handle, Gap::LOCAL_HOST_TERMINATED_CONNECTION);
+        pBleDevice = NULL;
+    }
+    if (pBleDevice != NULL) {
+        if (pBleDevice->connectionState == BLE_CONNECTION_STATE_CONNECTED) {
+            removeBleConnectionFromIndex(pBleDevice);
+        }
+        pBleDevice->seen = true;
+        pBleDevice->lastSeenTime = time(NULL);
+        pBleDevice->pDetail->numZeroReadRetries = 0;
+        pBleDevice->pDetail->connectionHandle = pParams->handle;
+        setBleConnectionState(pBleDevice, BLE_CONNECTION_STATE_CONNECTED);
+        addBleConnectionToIndex(pBleDevice);
+        if (pParams->role == Gap::CENTRAL) {
+            // If we're not reading the device already, or no longer know
+            // where to read it, find out about it first, otherwise just
+            // read it straight away
+            if ((pBleDevice->deviceState != BLE_DEVICE_STATE_IS_WANTED) ||
+                (nextBleWantedCharacteristic(pBleDevice, 0) < 0)) {
+                pBleDevice->pDetail->numCharacteristics = 0;
+                pBleDevice->pDetail->discoveringWantedService = false;
+                BLE_DEBUG_PRINTF("  Attempting to discover its services and characteristics...\n");
+                bleError = launchBleServiceDiscovery(pParams->handle, false);
+                if (bleError != BLE_ERROR_NONE) {
+                    // This can happen if discovery is already in progress
+                    // on another connection; try again next time
+                    BLE_DEBUG_PRINTF("  !!! Unable to launch service discovery (error %d, \"%s\") !!!!\n", bleError, BLE::Instance().errorToString(bleError));
+                    BLE::Instance().gap().disconnect(pParams->handle, Gap::LOCAL_HOST_TERMINATED_CONNECTION);
+                }
+            } else {
+                MBED_ASSERT(nextBleWantedCharacteristic(pBleDevice, 0) >= 0);
+                // No delay here: an all-zero result is dealt with
+                // by readWantedValueCallback()
+                startBleWantedRead(pBleDevice);
+            }
+
+            // Now that the link is up we are free to scan and to
+            // initiate the next connection
+            if (gBleRunning) {
+                BLE::Instance().gap().startScan(advertisementCallback);
+                MBED_ASSERT(gpBleEventQueue != NULL);
+                gpBleEventQueue->call(getBleReadingsCallback);
+            }
+        }
+    }
+    UNLOCK();
+}
+
+// Do disconnection actions, may be called as a result
+// of a disconnection or a time-out.
+static void actOnDisconnect(BleDevice *pBleDevice)
+{
+    char addressString[BLE_ADDRESS_STRING_SIZE];
+
+    BLE_DEBUG_PRINTF("Disconnected from device %s", pPrintBleAddress(pBleDevice->address, addressString));
+    if ((pBleDevice->connectionState == BLE_CONNECTION_STATE_CONNECTING) &&
+        ((pBleDevice->deviceState == BLE_DEVICE_STATE_UNKNOWN) ||
+         (pBleDevice->deviceState == BLE_DEVICE_STATE_DISCOVERED))) {
+        if (pBleDevice->discoveryAttempts >= BLE_MAX_DISCOVERY_ATTEMPTS) {
+            // If we were discovering this device and it's rudely bounced us too
+            // many times then it probably doesn't want to know about us so cross it
+            // off our Christmas list
+            pBleDevice->deviceState = BLE_DEVICE_STATE_NOT_WANTED;
+            pBleDevice->notWantedForNow = true;
+            BLE_DEBUG_PRINTF(" too many times while attempting discovery, so dropping it for now");
+        } else {
+            BLE_DEBUG_PRINTF(" on discovery attempt %d", pBleDevice->discoveryAttempts);
+        }
+    }
+    if ((pBleDevice->connectionState == BLE_CONNECTION_STATE_CONNECTING) || pBleDevice->pDetail->readInProgress) {
+        countBleFailure(pBleDevice);
+    }
+    pBleDevice->pDetail->failure = BLE_FAILURE_DISCONNECT;
+    cancelBleEvent(&(pBleDevice->pDetail->eventId));
+    if (pBleDevice->connectionState == BLE_CONNECTION_STATE_CONNECTED) {
+        removeBleConnectionFromIndex(pBleDevice);
+    }
+    if (pBleDevice->pDetail->isHeld) {
+        pBleDevice->pDetail->isHeld = false;
+        gNumHeldConnections--;
+        BLE_DEBUG_PRINTF(", it was held open for notifications");
+    }
+    if (pBleDevice->pDetail->readInProgress) {
+        endBleRead(pBleDevice, false);
+        BLE_DEBUG_PRINTF(", reading failed (%d in a row)", pBleDevice->pDetail->numConsecutiveReadFailures);
+    }
+    setBleConnectionState(pBleDevice, BLE_CONNECTION_STATE_DISCONNECTED);
+    BLE_DEBUG_PRINTF(".\n");
+
+    // Start scanning again and, since the link is free,
+    // start the next reading straight away
+    if (gBleRunning) {
+        BLE::Instance().gap().startScan(advertisementCallback);
+        if (gpBleEventQueue != NULL) {
+            gpBleEventQueue->call(getBleReadingsCallback);
+        }
+    }
+
+    // A device we don't want need no longer take up space in the
+    // list and one we don't (yet) know we want needs no details
+    if (pBleDevice->deviceState == BLE_DEVICE_STATE_NOT_WANTED) {
+        releaseNotWantedBleDevice(pBleDevice);
+    } else {
+        releaseUnusedBleDeviceDetail(pBleDevice);
+    }
+}
+
+// When a time-out has occurred, determine what to do.
+static void timeoutCallback(Gap::TimeoutSource_t reason)
+{
+    BleDevice *pBleDevice;
+
+    switch (reason) {
+        case Gap::TIMEOUT_SRC_ADVERTISING:
+            BLE_DEBUG_PRINTF("Time-out while advertising.\n");
+        break;
+        case Gap::TIMEOUT_SRC_SECURITY_REQUEST:
+            BLE_DEBUG_PRINTF("Time-out on a security request.\n");
+        break;
+        case Gap::TIMEOUT_SRC_SCAN:
+            // Connection timeouts can appear as scan timeouts
+            // because of the way they are done
+            BLE_DEBUG_PRINTF("Time-out while scanning or connecting.\n");
+            LOCK();
+            pBleDevice = pFindBleConnectingInList();
+            if (pBleDevice != NULL) {
+                pBleDevice->pDetail->failure = BLE_FAILURE_TIMEOUT;
+                actOnDisconnect(pBleDevice);
+            }
+            UNLOCK();
+        break;
+        case Gap::TIMEOUT_SRC_CONN:
+            BLE_DEBUG_PRINTF("Time-out of connection [attempt].\n");
+            LOCK();
+            pBleDevice = pFindBleConnectingInList();
+            if (pBleDevice != NULL) {
+                pBleDevice->pDetail->failure = BLE_FAILURE_TIMEOUT;
+                actOnDisconnect(pBleDevice);
+            }
+            UNLOCK();
+        break;
+        default:
+            BLE_DEBUG_PRINTF("Time-out, type unknown (%d).\n", reason);
+        break;
+    }
+}
+
+// Handle BLE peer disconnection.
+static void disconnectionCallback(const Gap::DisconnectionCallbackParams_t *pParams)
+{
+    BleDevice *pBleDevice;
+
+    LOCK();
+    pBleDevice = pFindBleConnectionInList(pParams->handle);
+    BLE_DEBUG_PRINTF("Disconnected (handle %d).\n", pParams->handle);
+    if (pBleDevice != NULL) {
+        actOnDisconnect(pBleDevice);
+    }
+    UNLOCK();
+}
+
+
+// Check if the device is an interesting one.
+static void checkDeviceNameCallback(const GattReadCallbackParams *pResponse)
+{
+    BleDevice *pBleDevice;
+    char addressString[BLE_ADDRESS_STRING_SIZE];
+    ble_error_t bleError = BLE_ERROR_INVALID_STATE;
+
+    // See if the prefix on the data (which will be the device name), is
+    // not one we are interested in then don't bother with this device again
+    LOCK();
+    pBleDevice = pFindBleConnectionInList(pResponse->connHandle);
+    if (pBleDevice != NULL) {
+        if (bleNameMatchesPrefix((const char *) pResponse->data, pResponse->len, true) != BLE_NAME_MATCH_YES) {
+            pBleDevice->deviceState = BLE_DEVICE_STATE_NOT_WANTED;
+            BLE_DEBUG_PRINTF("BLE device %s (with name \"%.*s\") is not one of ours, dropping it.\n",
+                             pPrintBleAddress(pBleDevice->address, addressString),
+                             pResponse->len, pResponse->data);
+        } else {
+            // Give it somewhere to put its data and save its
+            // name, unless it has them already (since the
+            // pointer to the name may have been handed out)
+            if (pBleDevice->pDetail->pDataStore == NULL) {
+                pBleDevice->pDetail->pDataStore = pAllocBleDataStore();
+            }
+            if ((pBleDevice->pDetail->pDataStore != NULL) && (pBleDevice->pDetail->pDeviceName == NULL)) {
+                pBleDevice->pDetail->pDeviceName = pAllocBleDeviceName((const char *) pResponse->data,
+                                                                       pResponse->len);
+            }
+        }
+        if (pBleDevice->deviceState == BLE_DEVICE_STATE_NOT_WANTED) {
+            // Nothing more to do
+        } else if (pBleDevice->pDetail->pDataStore == NULL) {
+            pBleDevice->deviceState = BLE_DEVICE_STATE_NOT_WANTED;
+            pBleDevice->notWantedForNow = true;
+            BLE_DEBUG_PRINTF("BLE device %s (with name \"%.*s\") is one of ours but there is no room to store its data (%d wanted device(s) already), dropping it.\n",
+                             pPrintBleAddress(pBleDevice->address, addressString),
+                             pResponse->len, pResponse->data, gMaxNumBleWantedDevices);
+        } else if (pBleDevice->pDetail->pDeviceName == NULL) {
+            // Its data store goes when it is released, on disconnection
+            pBleDevice->deviceState = BLE_DEVICE_STATE_NOT_WANTED;
+            pBleDevice->notWantedForNow = true;
+            BLE_DEBUG_PRINTF("BLE device %s (with name \"%.*s\") is one of ours but the memory budget leaves no room for its name, dropping it.\n",
+                             pPrintBleAddress(pBleDevice->address, addressString),
+                             pResponse->len, pResponse->data);
+        } else {
+            BLE_DEBUG_PRINTF("Found one of our BLE devices: %s, with name \"%.*s\".\n",
+                             pPrintBleAddress(pBleDevice->address, addressString),
+                             pResponse->len, pResponse->data);
+            // In case it failed before, it need no longer be remembered
+            forgetBleRejectedDevice(pBleDevice->address, pBleDevice->addressType);
+            pBleDevice->deviceState = BLE_DEVICE_STATE_IS_WANTED;
+            // Take the first reading over this same connection rather
+            // than waiting to connect again; readWantedValueCallback()
+            // will disconnect
+            bleError = startBleWantedRead(pBleDevice);
+            if (bleError == BLE_ERROR_NONE) {
+                pBleDevice->pDetail->readInProgress = true;
+                pBleDevice->pDetail->readStartMs = gBleTimer.read_ms();
+            }
+        }
+    }
+    UNLOCK();
+
+    // Unless we're now reading from it, disconnect immediately
+    // to save time if we can, noting that this might fail if
+    // we're already disconnecting anyway
+    if (bleError != BLE_ERROR_NONE) {
+        BLE::Instance().gap().disconnect(pResponse->connHandle, Gap::LOCAL_HOST_TERMINATED_CONNECTION);
+    }
+}
+
+// Pass the response to a GATT read on to the right place.
+static void readCallback(const GattReadCallbackParams *pResponse)
+{
+    BleDevice *pBleDevice;
+    char addressString[BLE_ADDRESS_STRING_SIZE];
+    bool isDeviceName = false;
+    bool isWanted = false;
+
+    LOCK();
+    pBleDevice = pFindBleConnectionInList(pResponse->connHandle);
+    if (pBleDevice != NULL) {
+        isDeviceName = (pResponse->handle == pBleDevice->pDetail->deviceNameHandle);
+        isWanted = (bleWantedCharacteristicIndex(pBleDevice, pResponse->handle) >= 0);
+        if ((pResponse->status != BLE_ERROR_NONE) && isWanted) {
+            // The handle may have come from the discovery cache and
+            // be out of date: forget the handles so that the device
+            // is discovered again the next time it is read, keeping
+            // it wanted as it still has its data and its name
+            BLE_DEBUG_PRINTF("Read of handle %u from BLE device %s failed (error %d), will rediscover it.\n",
+                             pResponse->handle, pPrintBleAddress(pBleDevice->address, addressString),
+                             pResponse->status);
+            pBleDevice->pDetail->deviceNameHandle = 0;
+            clearBleWantedHandles(pBleDevice);
+            pBleDevice->discoveryAttempts = 0;
+            pBleDevice->pDetail->failure = BLE_FAILURE_GATT_ERROR;
+            isWanted = false;
+            BLE::Instance().gap().disconnect(pResponse->connHandle, Gap::LOCAL_HOST_TERMINATED_CONNECTION);
+        } else if ((pResponse->status != BLE_ERROR_NONE) && isDeviceName) {
+            // There is no name to check, which says nothing about
+            // whether the device is one of ours: discover it again
+            // the next time it is heard, unless that has failed too
+            // many times, in which case leave it until the next run
+            BLE_DEBUG_PRINTF("Read of the DeviceName of BLE device %s failed (error %d)",
+                             pPrintBleAddress(pBleDevice->address, addressString), pResponse->status);
+            if (pBleDevice->discoveryAttempts >= BLE_MAX_DISCOVERY_ATTEMPTS) {
+                pBleDevice->deviceState = BLE_DEVICE_STATE_NOT_WANTED;
+                pBleDevice->notWantedForNow = true;
+                BLE_DEBUG_PRINTF(", dropping it for now.\n");
+            } else {
+                pBleDevice->deviceState = BLE_DEVICE_STATE_UNKNOWN;
+                BLE_DEBUG_PRINTF(", will discover it again.\n");
+            }
+            pBleDevice->pDetail->deviceNameHandle = 0;
+            clearBleWantedHandles(pBleDevice);
+            pBleDevice->pDetail->failure = BLE_FAILURE_GATT_ERROR;
+            isDeviceName = false;
+            BLE::Instance().gap().disconnect(pResponse->connHandle, Gap::LOCAL_HOST_TERMINATED_CONNECTION);
+        }
+    }
+    UNLOCK();
+
+    if (isDeviceName) {
+        checkDeviceNameCallback(pResponse);
+    } else if (isWanted) {
+        readWantedValueCallback(pResponse);
+    }
+}
+
+// Find which wanted characteristic a value handle belongs to.
+// Note that this does NOT lock the BLE list.
+static int bleWantedCharacteristicIndex(const BleDevice *pBleDevice, GattAttribute::Handle_t handle)
+{
+    int index = -1;
+
+    for (int x = 0; (x < gNumWantedCharacteristics) && (index < 0); x++) {
+        if ((handle != 0) && (pBleDevice->pDetail->wantedHandle[x] == handle)) {
+            index = x;
+        }
+    }
+
+    return index;
+}
+
+// Find the next wanted characteristic whose handle is known.
+// Note that this does NOT lock the BLE list.
+static int nextBleWantedCharacteristic(const BleDevice *pBleDevice, int index)
+{
+    int nextIndex = -1;
+
+    for (int x = index; (x < gNumWantedCharacteristics) && (nextIndex < 0); x++) {
+        if (pBleDevice->pDetail->wantedHandle[x] != 0) {
+            nextIndex = x;
+        }
+    }
+
+    return nextIndex;
+}
+
+// Forget the wanted characteristic handles of a device.
+// Note that this does NOT lock the BLE list.
+static void clearBleWantedHandles(BleDevice *pBleDevice)
+{
+    for (int x = 0; x < MAX_NUM_BLE_WANTED_CHARACTERISTICS; x++) {
+        pBleDevice->pDetail->wantedHandle[x] = 0;
+    }
+    pBleDevice->pDetail->cccdHandle = 0;
+}
+
+// Start a reading of the wanted characteristics.
+// Note that this does NOT lock the BLE list.
+static ble_error_t startBleWantedRead(BleDevice *pBleDevice)
+{
+    pBleDevice->pDetail->readingCharacteristic = nextBleWantedCharacteristic(pBleDevice, 0);
+    pBleDevice->pDetail->readReturnedData = false;
+
+    return startBleCharacteristicRead(pBleDevice);
+}
+
+// Read the wanted characteristic given by readingCharacteristic.
+// Note that this does NOT lock the BLE list.
+static ble_error_t startBleCharacteristicRead(BleDevice *pBleDevice)
+{
+    char addressString[BLE_ADDRESS_STRING_SIZE];
+    ble_error_t bleError = BLE_ERROR_INVALID_STATE;
+    int x = pBleDevice->pDetail->readingCharacteristic;
+
+    if (x >= 0) {
+        BLE_DEBUG_PRINTF("  Reading wanted characteristic 0x%04x (handle %u) of BLE device %s.\n",
+                         gWantedCharacteristic[x].getShortUUID(), pBleDevice->pDetail->wantedHandle[x],
+                         pPrintBleAddress(pBleDevice->address, addressString));
+        bleError = BLE::Instance().gattClient().read(pBleDevice->pDetail->connectionHandle, pBleDevice->pDetail->wantedHandle[x], 0);
+    }
+    if (bleError != BLE_ERROR_NONE) {
+        BLE_DEBUG_PRINTF("  Unable to start read of wanted characteristic (error %d).\n", bleError);
+    }
+
+    return bleError;
+}
+
+// Read the wanted characteristic again after an all-zero read.
+static void retryBleWantedReadCallback(Gap::Handle_t connectionHandle)
+{
+    BleDevice *pBleDevice;
+    ble_error_t bleError = BLE_ERROR_INVALID_STATE;
+
+    LOCK();
+    pBleDevice = pFindBleConnectionInList(connectionHandle);
+    if (pBleDevice != NULL) {
+        pBleDevice->pDetail->eventId = 0;
+        bleError = startBleCharacteristicRead(pBleDevice);
+    }
+    UNLOCK();
+
+    if (bleError != BLE_ERROR_NONE) {
+        BLE::Instance().gap().disconnect(connectionHandle, Gap::LOCAL_HOST_TERMINATED_CONNECTION);
+    }
+}
+
+// Take a reading from a wanted characteristic and move on
+// to the next one.
+static void readWantedValueCallback(const GattReadCallbackParams *pResponse)
+{
+    BleDevice *pBleDevice;
+    char buf[32];
+    int numItems;
+    int index = -1;
+    bool allZero = true;
+    bool readingNext = false;
+
+    LOCK();
+    pBleDevice = pFindBleConnectionInList(pResponse->connHandle);
+    for (int x = 0; (x < pResponse->len) && allZero; x++) {
+        allZero = (pResponse->data[x] == 0);
+    }
+    if ((pBleDevice != NULL) && (pResponse->len > 0) && allZero &&
+        (pBleDevice->pDetail->numZeroReadRetries < BLE_MAX_NUM_ZERO_READ_RETRIES) &&
+        (gpBleEventQueue != NULL)) {
+        pBleDevice->pDetail->eventId = gpBleEventQueue->call_in(BLE_ZERO_READ_RETRY_MS, retryBleWantedReadCallback,
+                                                                pResponse->connHandle);
+    }
+    if ((pBleDevice != NULL) && (pBleDevice->pDetail->eventId != 0)) {
+        // Probably read too soon after connecting, try again shortly
+        pBleDevice->pDetail->numZeroReadRetries++;
+        BLE_DEBUG_PRINTF("Read from BLE device %s returned all zeroes, will read again (retry %d).\n",
+                         pPrintBleAddress(pBleDevice->address, buf), pBleDevice->pDetail->numZeroReadRetries);
+    } else if (pBleDevice != NULL) {
+        index = bleWantedCharacteristicIndex(pBleDevice, pResponse->handle);
+        BLE_DEBUG_PRINTF("Read from BLE device %s of characteristic 0x%04x",
+                         pPrintBleAddress(pBleDevice->address, buf), gWantedCharacteristic[index].getShortUUID());
+        if (pResponse->len > 0) {
+            BLE_DEBUG_PRINTF(" returned %d byte(s): 0x%.*s", pResponse->len,
+                             bytesToHexString((const char *) pResponse->data, pResponse->len, buf, sizeof(buf)), buf);
+            numItems = addBleData(pBleDevice->address, pBleDevice->addressType, index,
+                                  (const char *) pResponse->data, pResponse->len);
+            BLE_DEBUG_PRINTF(", %d reading(s) now queued.\n", numItems);
+            pBleDevice->pDetail->readReturnedData = true;
+        } else {
+            BLE_DEBUG_PRINTF(" returned 0 byte(s) of data.\n");
+        }
+
+        // Read the rest of the wanted characteristics back-to-back
+        // over this same connection
+        pBleDevice->pDetail->readingCharacteristic = nextBleWantedCharacteristic(pBleDevice, index + 1);
+        if (pBleDevice->pDetail->readingCharacteristic >= 0) {
+            pBleDevice->pDetail->numZeroReadRetries = 0;
+            readingNext = (startBleCharacteristicRead(pBleDevice) == BLE_ERROR_NONE);
+        }
+        if (!readingNext && pBleDevice->pDetail->readReturnedData) {
+            endBleRead(pBleDevice, true);
+        }
+
+        if (readingNext) {
+            // Nothing more to do until that read completes
+        } else if (!pBleDevice->pDetail->isHeld && !subscribeToBleNotifications(pBleDevice)) {
+            // Disconnect immediately to save time if we can, noting that
+            // this might fail if we're already disconnecting anyway
+            BLE::Instance().gap().disconnect(pResponse->connHandle, Gap::LOCAL_HOST_TERMINATED_CONNECTION);
+        }
+    }
+    UNLOCK();
+}
+
+// Hold the connection to a device open and subscribe to
+// notifications of its wanted characteristic, if allowed.
+// Note that this does NOT lock the BLE list.
+static bool subscribeToBleNotifications(BleDevice *pBleDevice)
+{
+    char addressString[BLE_ADDRESS_STRING_SIZE];
+    uint16_t cccdValue = BLE_HVX_NOTIFICATION;
+    ble_error_t bleError;
+    bool subscribed = false;
+
+    if ((pBleDevice->pDetail->cccdHandle != 0) && (gNumHeldConnections < gMaxNumHeldConnections)) {
+        bleError = BLE::Instance().gattClient().write(GattClient::GATT_OP_WRITE_REQ,
+                                                      pBleDevice->pDetail->connectionHandle,
+                                                      pBleDevice->pDetail->cccdHandle,
+                                                      sizeof(cccdValue), (const uint8_t *) &cccdValue);
+        if (bleError == BLE_ERROR_NONE) {
+            subscribed = true;
+            BLE_DEBUG_PRINTF("Subscribing to notifications from BLE device %s (CCCD handle %u).\n",
+                             pPrintBleAddress(pBleDevice->address, addressString),
+                             pBleDevice->pDetail->cccdHandle);
+        } else {
+            BLE_DEBUG_PRINTF("Unable to subscribe to notifications from BLE device %s (error %d).\n",
+                             pPrintBleAddress(pBleDevice->address, addressString), bleError);
+        }
+    }
+
+    return subscribed;
+}
+
+// Hold the connection open once subscribed to notifications.
+static void writeCallback(const GattWriteCallbackParams *pParams)
+{
+    char addressString[BLE_ADDRESS_STRING_SIZE];
+    BleDevice *pBleDevice;
+    bool failed = false;
+
+    LOCK();
+    pBleDevice = pFindBleConnectionInList(pParams->connHandle);
+    if ((pBleDevice != NULL) && (pParams->handle == pBleDevice->pDetail->cccdHandle) &&
+        !pBleDevice->pDetail->isHeld) {
+        if ((pParams->status == BLE_ERROR_NONE) && (gNumHeldConnections < gMaxNumHeldConnections)) {
+            pBleDevice->pDetail->isHeld = true;
+            gNumHeldConnections++;
+            BLE_DEBUG_PRINTF("Subscribed to notifications from BLE device %s, holding the connection open (%d of %d).\n",
+                             pPrintBleAddress(pBleDevice->address, addressString),
+                             gNumHeldConnections, gMaxNumHeldConnections);
+        } else {
+            failed = true;
+            BLE_DEBUG_PRINTF("Subscription to notifications from BLE device %s failed (error %d, ATT error 0x%02x)"
+                             " or no more connections may be held open.\n",
+                             pPrintBleAddress(pBleDevice->address, addressString),
+                             pParams->status, pParams->error_code);
+        }
+    }
+    UNLOCK();
+
+    // Nothing more to do over the connection
+    if (failed) {
+        BLE::Instance().gap().disconnect(pParams->connHandle, Gap::LOCAL_HOST_TERMINATED_CONNECTION);
+    }
+}
+
+// Take a reading from a notification.
+static void hvxCallback(const GattHVXCallbackParams *pParams)
+{
+    BleDevice *pBleDevice;
+    char buf[32];
+    int numItems;
+    int index = -1;
+
+    LOCK();
+    pBleDevice = pFindBleConnectionInList(pParams->connHandle);
+    if (pBleDevice != NULL) {
+        index = bleWantedCharacteristicIndex(pBleDevice, pParams->handle);
+    }
+    if ((index >= 0) && (pParams->len > 0)) {
+        numItems = addBleData(pBleDevice->address, pBleDevice->addressType, index,
+                              (const char *) pParams->data, pParams->len);
+        if (numItems > 0) {
+            pBleDevice->pDetail->stats.numReadings++;
+        }
+        BLE_DEBUG_PRINTF("Notification from BLE device %s",
+                         pPrintBleAddress(pBleDevice->address, buf));
+        BLE_DEBUG_PRINTF(" of %d byte(s): 0x%.*s, %d reading(s) now queued.\n", pParams->len,
+                         bytesToHexString((const char *) pParams->data, pParams->len, buf, sizeof(buf)), buf,
+                         numItems);
+    }
+    UNLOCK();
+}
+
+// Handle BLE initialisation error.
+static void onBleInitError(BLE &ble, ble_error_t error)
+{
+   BLE_DEBUG_PRINTF("!!! BLE Error %d !!!\n", error);
+}
+
+// Handle BLE being initialised, finish configuration here.
+static void bleInitComplete(BLE::InitializationCompleteCallbackContext *pParams)
+{
+    BLE& ble = pParams->ble;
+    ble_error_t error = pParams->error;
+    Gap::AddressType_t addr_type;
+    Gap::Address_t address;
+    BLE::Instance().gap().getAddress(&addr_type, address);
+    char addressString[BLE_ADDRESS_STRING_SIZE];
+
+    if (error != BLE_ERROR_NONE) {
+        /* In case of error, forward the error handling to onBleInitError */
+        onBleInitError(ble, error);
+        return;
+    }
+
+    /* Ensure that it is the default instance of BLE */
+    if (ble.getInstanceID() != BLE::DEFAULT_INSTANCE) {
+        return;
+    }
+
+    /* bleStop() may have been called before we got here */
+    if (!gBleRunning) {
+        return;
+    }
+
+    BLE_DEBUG_PRINTF("This device's BLE address is %s.\n", pPrintBleAddress((char *) address, addressString));
+
+    ble.gap().onDisconnection(disconnectionCallback);
+    ble.gap().onConnection(connectionCallback);
+    ble.gap().onTimeout(timeoutCallback);
+    ble.gattClient().onDataRead(readCallback);
+    ble.gattClient().onDataWritten(writeCallback);
+    ble.gattClient().onHVX(hvxCallback);
+
+    // Every BLE_SCAN_INTERVAL_MS the device will scan for
+    // gScanWindowMs, see adaptBleScanCallback()
+    gScanWindowMs = BLE_SCAN_WINDOW_MAX_MS;
+    ble.gap().setScanParams(BLE_SCAN_INTERVAL_MS, gScanWindowMs);
+    ble.gap().startScan(advertisementCallback);
+
+    // Try to get readings.
+    MBED_ASSERT(gpBleEventQueue != NULL);
+    gBleReadingsEventId = gpBleEventQueue->call_every(BLE_READ_SCHEDULER_TICK_MS, getBleReadingsCallback);
+    gBleScanEventId = gpBleEventQueue->call_every(BLE_SCAN_INTERVAL_MS, adaptBleScanCallback);
+}
+
+// Done callback for bleRun(), so that it returns as soon as
+// BLE has stopped, e.g. because of bleSetEarlyStop().
+static void bleRunDoneCallback(void *pContext)
+{
+    (void) pContext;
+    if (gpBleEventQueue != NULL) {
+        gpBleEventQueue->break_dispatch();
+    }
+}
+
+// Cancel an event that BLE put on the event queue, if there is one.
+static void cancelBleEvent(int *pEventId)
+{
+    if (*pEventId != 0) {
+        if (gpBleEventQueue != NULL) {
+            gpBleEventQueue->cancel(*pEventId);
+        }
+        *pEventId = 0;
+    }
+}
+
+// Throw a BLE event onto the BLE event queue.
+static void scheduleBleEventsProcessing(BLE::OnEventsToProcessCallbackContext* pContext)
+{
+    BLE &ble = BLE::Instance();
+    MBED_ASSERT(gpBleEventQueue != NULL);
+    gpBleEventQueue->call(Callback<void()>(&ble, &BLE::processEvents));
+}
+
+/**************************************************************************
+ * PUBLIC FUNCTIONS
+ *************************************************************************/
+
+// Initialise.
+void bleInit(const char *pDeviceNamePrefix, int wantedCharacteristicUuid,
+             int maxNumWantedDevices, int maxNumDataItemsPerDevice,
+             EventQueue *pEventQueue, bool debugOn)
+{
+    if (maxNumWantedDevices < 0) {
+        maxNumWantedDevices = 0;
+    }
+    // A wanted device never leaves the device list
+    if (maxNumWantedDevices > MAX_NUM_BLE_DEVICES) {
+        maxNumWantedDevices = MAX_NUM_BLE_DEVICES;
+    }
+
+    // Free the storage of any previous bleInit() while
+    // its size is still known
+    freeBleStorage();
+
+    gpDeviceNamePrefix = pDeviceNamePrefix;
+    gWantedCharacteristic[0] = UUID((UUID::ShortUUIDBytes_t) wantedCharacteristicUuid);
+    gNumWantedCharacteristics = 1;
+    gWantedService = UUID((UUID::ShortUUIDBytes_t) BLE_UUID_UNKNOWN);
+    gBleDataStoreInitSize = maxNumDataItemsPerDevice * BLE_DATA_STORE_BYTES_PER_ITEM;
+    gBleDataStoreSize = gBleDataStoreInitSize;
+    gBleMemoryBudget = 0;
+    gBleFixedDataLen = 0;
+    gBleDeadband = -1;
+    gBleMaxSilentSeconds = 0;
+    gpBleEventQueue = pEventQueue;
+    gDebugOn = debugOn;
+    gObserverUuid = 0;
+    gMaxNumHeldConnections = 0;
+    gNumHeldConnections = 0;
+    gMaxNumConnections = BLE_DEFAULT_MAX_NUM_CONNECTIONS;
+    gNumConnections = 0;
+    gNumConnecting = 0;
+    gDefaultReadPeriodMs = BLE_READ_INTERVAL_SECONDS * 1000;
+    gAdaptiveScanOn = false;
+    gEarlyStopNumReadings = 0;
+    gEarlyStopQuietPeriodMs = 0;
+    gBleTimer.reset();
+    gBleTimer.start();
+    gNumBleDevicesInList = 0;
+    gBleGetNextDeviceIndex = 0;
+    clearBleDeviceIndexes();
+    rebuildBleRejectedIndex();
+
+    // Allocate the details and data stores of all wanted
+    // devices, and storage for their data items, here so that
+    // there is no need to allocate memory while data is being
+    // gathered
+    gpBleDeviceDetail = (BleDeviceDetail *) pBleMalloc((maxNumWantedDevices + MAX_NUM_BLE_DISCOVERING_DEVICES) *
+                                                        sizeof(BleDeviceDetail));
+    if (gpBleDeviceDetail != NULL) {
+        gNumBleDeviceDetails = maxNumWantedDevices + MAX_NUM_BLE_DISCOVERING_DEVICES;
+        memset(gpBleDeviceDetail, 0, gNumBleDeviceDetails * sizeof(BleDeviceDetail));
+    }
+    DATA_LOCK();
+    if (maxNumWantedDevices > 0) {
+        gpBleDataStore = (BleDataStore *) pBleMalloc(maxNumWantedDevices * sizeof(BleDataStore));
+    }
+    if (gpBleDataStore != NULL) {
+        gMaxNumBleWantedDevices = maxNumWantedDevices;
+        if (gBleDataStoreSize > 0) {
+            gpBleDataArena = (char *) pBleMalloc(gMaxNumBleWantedDevices * gBleDataStoreSize);
+        }
+    }
+    for (int x = 0; x < gMaxNumBleWantedDevices; x++) {
+        gpBleDataStore[x].inUse = false;
+        gpBleDataStore[x].generation = 0;
+        gpBleDataStore[x].consumerGeneration = 0;
+        gpBleDataStore[x].oldest = 0;
+        gpBleDataStore[x].numBytes = 0;
+        gpBleDataStore[x].numItems = 0;
+        gpBleDataStore[x].oldestTimestamp = 0;
+        startBleDataCursor(&(gpBleDataStore[x]), &(gpBleDataStore[x].nextItemToRead));
+        gpBleDataStore[x].deadband = gBleDeadband;
+        gpBleDataStore[x].maxSilentSeconds = gBleMaxSilentSeconds;
+        memset(gpBleDataStore[x].lastStoredValid, 0, sizeof(gpBleDataStore[x].lastStoredValid));
+        gpBleDataStore[x].numBytesStored = 0;
+    }
+    gBleReadingQueueHead = 0;
+    gBleReadingQueueTail = 0;
+    DATA_UNLOCK();
+    memset(&gBleStats, 0, sizeof(gBleStats));
+    gBleStats.maxMemoryBytes = gBleMemoryUsed;
+    gBleDiscoveryCacheRestored = false;
+}
+
+// Switch observer mode on or off.
+void bleSetObserverUuid(int serviceUuid)
+{
+    LOCK();
+    gObserverUuid = serviceUuid;
+    UNLOCK();
+}
+
+// Set the length of all data items.
+void bleSetFixedDataLength(int dataLen)
+{
+    if (dataLen < 0) {
+        dataLen = 0;
+    }
+    if (dataLen > BLE_MAX_DATA_ITEM_SIZE) {
+        dataLen = BLE_MAX_DATA_ITEM_SIZE;
+    }
+    if (dataLen != gBleFixedDataLen) {
+        DATA_LOCK();
+        // What is stored can no longer be unpacked
+        for (int x = 0; x < gMaxNumBleWantedDevices; x++) {
+            gpBleDataStore[x].oldest = 0;
+            gpBleDataStore[x].numBytes = 0;
+            gpBleDataStore[x].numItems = 0;
+            memset(gpBleDataStore[x].lastStoredValid, 0, sizeof(gpBleDataStore[x].lastStoredValid));
+            startBleDataCursor(&(gpBleDataStore[x]), &(gpBleDataStore[x].nextItemToRead));
+        }
+        gBleFixedDataLen = dataLen;
+        DATA_UNLOCK();
+    }
+}
+
+// Set the service that contains the wanted characteristic.
+void bleSetWantedServiceUuid(int serviceUuid)
+{
+    LOCK();
+    gWantedService = UUID((UUID::ShortUUIDBytes_t) serviceUuid);
+    UNLOCK();
+}
+
+// Set the characteristics to read from each wanted device.
+void bleSetWantedCharacteristicUuids(const int *pCharacteristicUuids, int numCharacteristicUuids)
+{
+    if (numCharacteristicUuids > MAX_NUM_BLE_WANTED_CHARACTERISTICS) {
+        numCharacteristicUuids = MAX_NUM_BLE_WANTED_CHARACTERISTICS;
+    }
+    if (numCharacteristicUuids > 0) {
+        LOCK();
+        for (int x = 0; x < numCharacteristicUuids; x++) {
+            gWantedCharacteristic[x] = UUID((UUID::ShortUUIDBytes_t) *(pCharacteristicUuids + x));
+        }
+        gNumWantedCharacteristics = numCharacteristicUuids;
+        UNLOCK();
+    }
+}
+
+// Set 128-bit UUIDs for the wanted service and characteristic.
+void bleSetWantedLongUuids(const uint8_t *pServiceUuid, const uint8_t *pCharacteristicUuid)
+{
+    LOCK();
+    if (pServiceUuid != NULL) {
+        gWantedService = UUID(pServiceUuid, UUID::MSB);
+    } else {
+        gWantedService = UUID((UUID::ShortUUIDBytes_t) BLE_UUID_UNKNOWN);
+    }
+    if (pCharacteristicUuid != NULL) {
+        // Replaces any list from bleSetWantedCharacteristicUuids()
+        gWantedCharacteristic[0] = UUID(pCharacteristicUuid, UUID::MSB);
+        gNumWantedCharacteristics = 1;
+    }
+    UNLOCK();
+}
+
+// Switch adaptive scanning on or off.
+void bleSetAdaptiveScan(bool onNotOff)
+{
+    LOCK();
+    gAdaptiveScanOn = onNotOff;
+    UNLOCK();
+}
+
+// Set when a run of BLE may end early.
+void bleSetEarlyStop(int minNumReadings, int quietPeriodMs)
+{
+    LOCK();
+    gEarlyStopNumReadings = minNumReadings;
+    gEarlyStopQuietPeriodMs = quietPeriodMs;
+    UNLOCK();
+}
+
+// Set the number of connections to hold open for notifications.
+void bleSetMaxNumHeldConnections(int maxNumHeldConnections)
+{
+    LOCK();
+    gMaxNumHeldConnections = maxNumHeldConnections;
+    UNLOCK();
+}
+
+// Set the number of connections that may be in flight at once.
+void bleSetMaxNumConnections(int maxNumConnections)
+{
+    LOCK();
+    if (maxNumConnections < 1) {
+        maxNumConnections = 1;
+    }
+    gMaxNumConnections = maxNumConnections;
+    UNLOCK();
+}
+
+// Set the memory budget.
+bool bleSetMemoryBudget(int maxBytes)
+{
+    bool success = false;
+    int dataStoreSize = gBleDataStoreInitSize;
+    int arenaSize;
+
+    if (maxBytes < 0) {
+        maxBytes = 0;
+    }
+    if ((maxBytes > 0) && (gMaxNumBleWantedDevices > 0)) {
+        // Leave room for the details, the data stores themselves
+        // and the Device Names
+        arenaSize = maxBytes - (gNumBleDeviceDetails * (sizeof(BleDeviceDetail) + BLE_MEMORY_BUDGET_BYTES_PER_NAME)) -
+                    (gMaxNumBleWantedDevices * sizeof(BleDataStore));
+        if (dataStoreSize > arenaSize / gMaxNumBleWantedDevices) {
+            dataStoreSize = arenaSize / gMaxNumBleWantedDevices;
+        }
+    }
+
+    if (!gBleRunning && ((dataStoreSize == gBleDataStoreInitSize) ||
+                         (dataStoreSize >= (int) BLE_DATA_STORE_BYTES_PER_ITEM))) {
+        success = true;
+        if (dataStoreSize != gBleDataStoreSize) {
+            DATA_LOCK();
+            // Free the old storage before allocating the new, so
+            // that the two are never held at once, and point
+            // the data stores at the new storage; what is stored
+            // is lost
+            bleFree(gpBleDataArena, gMaxNumBleWantedDevices * gBleDataStoreSize);
+            gBleMemoryBudget = 0;
+            gpBleDataArena = (char *) pBleMalloc(gMaxNumBleWantedDevices * dataStoreSize);
+            gBleDataStoreSize = 0;
+            if (gpBleDataArena != NULL) {
+                gBleDataStoreSize = dataStoreSize;
+            } else {
+                success = false;
+            }
+            for (int x = 0; x < gMaxNumBleWantedDevices; x++) {
+                gpBleDataStore[x].pArena = gpBleDataArena + (x * gBleDataStoreSize);
+                gpBleDataStore[x].oldest = 0;
+                gpBleDataStore[x].numBytes = 0;
+                gpBleDataStore[x].numItems = 0;
+                startBleDataCursor(&(gpBleDataStore[x]), &(gpBleDataStore[x].nextItemToRead));
+            }
+            DATA_UNLOCK();
+        }
+        gBleMemoryBudget = maxBytes;
     }
+
+    return success;
 }
 
-// Handle BLE peer disconnection.
-static void disconnectionCallback(const Gap::DisconnectionCallbackParams_t *pParams)
+// Set the deadband for storing readings.
+bool bleSetDeadband(const char *pDeviceName, int deadband, int maxSilentSeconds)
 {
-    BleDevice *pBleDevice;
+    BleDataStore *pDataStore = NULL;
+    bool success = false;
 
-    LOCK();
-    pBleDevice = pFindBleConnectionInList(pParams->handle);
-    BLE_DEBUG_PRINTF("Disconnected (handle %d).\n", pParams->handle);
-    if (pBleDevice != NULL) {
-        actOnDisconnect(pBleDevice);
+    if (maxSilentSeconds < 0) {
+        maxSilentSeconds = 0;
     }
-    UNLOCK();
-}
+    DATA_LOCK();
+    // Bring the data stores up to date first so that
+    // what is set here is not lost when they are emptied
+    drainBleReadingQueue(true);
+    if (pDeviceName == NULL) {
+        gBleDeadband = deadband;
+        gBleMaxSilentSeconds = maxSilentSeconds;
+        for (int x = 0; x < gMaxNumBleWantedDevices; x++) {
+            gpBleDataStore[x].deadband = deadband;
+            gpBleDataStore[x].maxSilentSeconds = maxSilentSeconds;
+        }
+        success = true;
+    } else if (findBleDataStoreByDeviceName(pDeviceName, &pDataStore) && (pDataStore != NULL)) {
+        pDataStore->deadband = deadband;
+        pDataStore->maxSilentSeconds = maxSilentSeconds;
+        success = true;
+    }
+    DATA_UNLOCK();
 
+    return success;
+}
 
-// Check if the device is an interesting one.
-static void checkDeviceNameCallback(const GattReadCallbackParams *pResponse)
+// Set the period at which readings are taken.
+bool bleSetReadPeriod(const char *pDeviceName, int periodMs)
 {
     BleDevice *pBleDevice;
-    char addressString[BLE_ADDRESS_STRING_SIZE];
+    bool success = false;
 
-    // See if the prefix on the data (which will be the device name), is
-    // not one we are interested in then don't bother with this device again
     LOCK();
-    pBleDevice = pFindBleConnectionInList(pResponse->connHandle);
-    if (pBleDevice != NULL) {
-        if ((pResponse->len < strlen(gpDeviceNamePrefix)) ||
-            (memcmp(pResponse->data, gpDeviceNamePrefix, strlen(gpDeviceNamePrefix)) != 0)) {
-            pBleDevice->deviceState = BLE_DEVICE_STATE_NOT_WANTED;
-            BLE_DEBUG_PRINTF("BLE device %s (with name \"%.*s\") is not one of ours, dropping it.\n",
-                             pPrintBleAddress(pBleDevice->address, addressString),
-                             pResponse->len, pResponse->data);
-        } else {
-            BLE_DEBUG_PRINTF("Found one of our BLE devices: %s, with name \"%.*s\".\n",
-                             pPrintBleAddress(pBleDevice->address, addressString),
-                             pResponse->len, pResponse->data);
-            // Save the device name
-            pBleDevice->pDeviceName = (char *) malloc(pResponse->len + 1);
-            if (pBleDevice->pDeviceName != NULL) {
-                memcpy (pBleDevice->pDeviceName, pResponse->data, pResponse->len);
-                *(pBleDevice->pDeviceName + pResponse->len) = 0;  // Add terminator
+    if (pDeviceName == NULL) {
+        gDefaultReadPeriodMs = periodMs;
+        for (int x = 0; x < gNumBleDevicesInList; x++) {
+            if (gBleDeviceList[x].pDetail != NULL) {
+                gBleDeviceList[x].pDetail->readPeriodMs = periodMs;
             }
-            // Free up the Device Name characteristic to save RAM
-            if (pBleDevice->pDeviceNameCharacteristic != NULL) {
-                free(pBleDevice->pDeviceNameCharacteristic);
-                pBleDevice->pDeviceNameCharacteristic = NULL;
-            }
-            pBleDevice->deviceState = BLE_DEVICE_STATE_IS_WANTED;
+        }
+        success = true;
+    } else {
+        pBleDevice = pFindBleDeviceInListByDeviceNamePtr(pDeviceName);
+        if (pBleDevice != NULL) {
+            pBleDevice->pDetail->readPeriodMs = periodMs;
+            success = true;
         }
     }
     UNLOCK();
 
-    // Disconnect immediately to save time if we can, noting that
-    // this might fail if we're already disconnecting anyway
-    BLE::Instance().gap().disconnect(pResponse->connHandle, Gap::LOCAL_HOST_TERMINATED_CONNECTION);
+    return success;
 }
 
-// Take a reading from the wanted characteristic.
-static void readWantedValueCallback(const GattReadCallbackParams *pResponse)
+// Shutdown.
+void bleDeinit()
 {
-    BleDevice *pBleDevice;
-    char buf[32];
-    int numItems;
+    bleStop();
+    // If BLE never started the device list holds nothing
+    // from the discovery cache, which must then be kept as it is
+    if (gBleDiscoveryCacheRestored) {
+        LOCK();
+        saveBleDeviceListToDiscoveryCache();
+        UNLOCK();
+        gBleDiscoveryCacheRestored = false;
+    }
+    clearBleDeviceList();
+    BLE::Instance().shutdown();
+    gBleTimer.stop();
+    gpBleEventQueue = NULL;
+    freeBleStorage();
+}
 
-    LOCK();
-    pBleDevice = pFindBleConnectionInList(pResponse->connHandle);
-    if (pBleDevice != NULL) {
-        BLE_DEBUG_PRINTF("Read from BLE device %s of characteristic 0x%04x",
-                         pPrintBleAddress(pBleDevice->address, buf), gWantedCharacteristicUuid);
-        if (pResponse->len > 0) {
-            BLE_DEBUG_PRINTF(" returned %d byte(s): 0x%.*s", pResponse->len,
-                             bytesToHexString((const char *) pResponse->data, pResponse->len, buf, sizeof(buf)), buf);
-            numItems = addBleData(pBleDevice->address, pBleDevice->addressType, (const char *) pResponse->data, pResponse->len);
-            BLE_DEBUG_PRINTF(", %d data item(s) now in its list.\n", numItems);
-        } else {
-            BLE_DEBUG_PRINTF(" returned 0 byte(s) of data.\n");
-        }
+// Start BLE running on the event queue and return.
+bool bleStart(int durationMs, BleDoneCallback pDoneCallback, void *pContext)
+{
+    bool success = false;
 
-        // Disconnect immediately to save time if we can, noting that
-        // this might fail if we're already disconnecting anyway
-        BLE::Instance().gap().disconnect(pResponse->connHandle, Gap::LOCAL_HOST_TERMINATED_CONNECTION);
+    if ((gpBleEventQueue != NULL) && !gBleRunning) {
+        // What is left of the last run counts towards it
+        DATA_LOCK();
+        drainBleReadingQueue(true);
+        for (int x = 0; x < gMaxNumBleWantedDevices; x++) {
+            gpBleDataStore[x].numBytesStored = 0;
+        }
+        DATA_UNLOCK();
+        memset(&gBleStats, 0, sizeof(gBleStats));
+        gBleStats.maxMemoryBytes = gBleMemoryUsed;
+        gScanYield = 0;
+        gNumScanIntervalsWithoutYield = 0;
+        gScanTimeSavedMs = 0;
+        for (int x = 0; x < gNumBleDevicesInList; x++) {
+            if (gBleDeviceList[x].pDetail != NULL) {
+                memset(&(gBleDeviceList[x].pDetail->stats), 0, sizeof(gBleDeviceList[x].pDetail->stats));
+            }
+        }
+        if (!gBleDiscoveryCacheRestored) {
+            // Start from what we learnt last time
+            LOCK();
+            restoreBleDeviceListFromDiscoveryCache();
+            UNLOCK();
+            gBleDiscoveryCacheRestored = true;
+        }
+        gBleRunStartMs = gBleTimer.read_ms();
+        gBleRunDurationMs = -1;
+        gLastNewDeviceMs = gBleRunStartMs;
+        gpBleDoneCallback = pDoneCallback;
+        gpBleDoneCallbackContext = pContext;
+        gBleRunning = true;
+        if (durationMs >= 0) {
+            gBleStopEventId = gpBleEventQueue->call_in(durationMs, bleStop);
+        }
+        BLE::Instance().onEventsToProcess(scheduleBleEventsProcessing);
+        BLE::Instance().init(bleInitComplete);
+        success = true;
     }
-    UNLOCK();
+
+    return success;
 }
 
-// Handle BLE initialisation error.
-static void onBleInitError(BLE &ble, ble_error_t error)
+// Stop BLE running and call the done callback.
+void bleStop()
 {
-   BLE_DEBUG_PRINTF("!!! BLE Error %d !!!\n", error);
+    BleDoneCallback pDoneCallback = gpBleDoneCallback;
+
+    if (gBleRunning) {
+        LOCK();
+        gBleRunning = false;
+        gBleRunDurationMs = gBleTimer.read_ms() - gBleRunStartMs;
+        BLE_DEBUG_PRINTF("BLE ran for %d ms.\n", gBleRunDurationMs);
+        cancelBleEvent(&gBleStopEventId);
+        cancelBleEvent(&gBleReadingsEventId);
+        cancelBleEvent(&gBleScanEventId);
+        for (int x = 0; x < gNumBleDevicesInList; x++) {
+            if (gBleDeviceList[x].pDetail != NULL) {
+                cancelBleEvent(&(gBleDeviceList[x].pDetail->eventId));
+            }
+        }
+        BLE::Instance().gap().stopScan();
+        // So that the data stores are up to date for the done callback
+        tryDrainBleReadingQueue(true);
+        gpBleDoneCallback = NULL;
+        UNLOCK();
+        // Call this outside the lock as it will probably
+        // want to call bleDeinit()
+        if (pDoneCallback != NULL) {
+            pDoneCallback(gpBleDoneCallbackContext);
+        }
+    }
 }
 
-// Handle BLE being initialised, finish configuration here.
-static void bleInitComplete(BLE::InitializationCompleteCallbackContext *pParams)
+// Run BLE for a given time; use -1 for infinity, in which
+// case this function will never return.
+bool bleRun(int durationMs)
 {
-    BLE& ble = pParams->ble;
-    ble_error_t error = pParams->error;
-    Gap::AddressType_t addr_type;
-    Gap::Address_t address;
-    BLE::Instance().gap().getAddress(&addr_type, address);
-    char addressString[BLE_ADDRESS_STRING_SIZE];
+    bool success = false;
 
-    if (error != BLE_ERROR_NONE) {
-        /* In case of error, forward the error handling to onBleInitError */
-        onBleInitError(ble, error);
-        return;
+    if ((gpBleEventQueue != NULL) && bleStart(durationMs, bleRunDoneCallback, NULL)) {
+        gpBleEventQueue->dispatch(durationMs);
+        // Stop without the callback since a break_dispatch() that
+        // is not consumed here would end the next dispatch early
+        gpBleDoneCallback = NULL;
+        bleStop();
+        success = true;
     }
 
-    /* Ensure that it is the default instance of BLE */
-    if (ble.getInstanceID() != BLE::DEFAULT_INSTANCE) {
-        return;
+    return success;
+}
+
+#if DEVICE_FLASH
+// Get the flash address of the discovery cache.
+static uint32_t bleDiscoveryCacheFlashAddress(FlashIAP *pFlash)
+{
+#ifdef BLE_DISCOVERY_CACHE_FLASH_ADDRESS
+    return BLE_DISCOVERY_CACHE_FLASH_ADDRESS;
+#else
+    uint32_t end = pFlash->get_flash_start() + pFlash->get_flash_size();
+    return end - pFlash->get_sector_size(end - 1);
+#endif
+}
+
+// Save the discovery cache to flash.
+bool bleSaveDiscoveryCache()
+{
+    FlashIAP flash;
+    BleDiscoveryCache *pCache = &gBleDiscoveryCache;
+    uint32_t header[5];
+    uint32_t address;
+    bool success = false;
+
+    if (flash.init() == 0) {
+        address = bleDiscoveryCacheFlashAddress(&flash);
+        if ((sizeof(*pCache) <= flash.get_sector_size(address)) &&
+            (sizeof(*pCache) % flash.get_page_size() == 0)) {
+            LOCK();
+            if ((flash.read(header, address, sizeof(header)) == 0) &&
+                (header[0] == pCache->magic) && (header[2] == pCache->uuidChecksum) &&
+                (header[3] == pCache->wantedChecksum)) {
+                // Nothing we care about has changed, save the wear
+                success = true;
+            } else {
+                success = (flash.erase(address, flash.get_sector_size(address)) == 0) &&
+                          (flash.program(pCache, address, sizeof(*pCache)) == 0);
+            }
+            UNLOCK();
+        }
+        flash.deinit();
     }
 
-    BLE_DEBUG_PRINTF("This device's BLE address is %s.\n", pPrintBleAddress((char *) address, addressString));
+    return success;
+}
 
-    ble.gap().onDisconnection(disconnectionCallback);
-    ble.gap().onConnection(connectionCallback);
-    ble.gap().onTimeout(timeoutCallback);
+// Load the discovery cache from flash.
+bool bleLoadDiscoveryCache()
+{
+    FlashIAP flash;
+    BleDiscoveryCache *pCache = &gBleDiscoveryCache;
+    uint32_t address;
+    bool success = false;
 
-    // scan interval: 1000 ms and scan window: 500 ms.
-    // Every 1000 ms the device will scan for 500 ms
-    // This means that the device will scan continuously.
-    ble.gap().setScanParams(1000, 500);
-    ble.gap().startScan(advertisementCallback);
+    if (flash.init() == 0) {
+        address = bleDiscoveryCacheFlashAddress(&flash);
+        LOCK();
+        if ((flash.read(pCache, address, sizeof(*pCache)) == 0) &&
+            (pCache->magic == BLE_DISCOVERY_CACHE_MAGIC) &&
+            (pCache->numEntries <= MAX_NUM_BLE_DISCOVERY_CACHE_ENTRIES) &&
+            (pCache->checksum == bleChecksum((const char *) pCache->entry,
+                                             pCache->numEntries * sizeof(pCache->entry[0]),
+                                             2166136261UL))) {
+            success = true;
+        } else {
+            pCache->numEntries = 0;
+        }
+        memset(gBleDiscoveryCacheMissedCycles, 0, sizeof(gBleDiscoveryCacheMissedCycles));
+        UNLOCK();
+        flash.deinit();
+    }
 
-    // Try to get readings.
-    MBED_ASSERT(gpBleEventQueue != NULL);
-    gpBleEventQueue->call_every(BLE_READ_INTERVAL_SECONDS * 1000, getBleReadingsCallback);
+    return success;
 }
+#endif
 
-// Throw a BLE event onto the BLE event queue.
-static void scheduleBleEventsProcessing(BLE::OnEventsToProcessCallbackContext* pContext)
+// Get the number of connections saved by advertised names.
+int bleGetNumConnectionsSaved()
 {
-    BLE &ble = BLE::Instance();
-    MBED_ASSERT(gpBleEventQueue != NULL);
-    gpBleEventQueue->call(Callback<void()>(&ble, &BLE::processEvents));
+    return gBleStats.numConnectionsSaved;
 }
 
-/**************************************************************************
- * PUBLIC FUNCTIONS
- *************************************************************************/
+// Get the radio-on time saved by adaptive scanning.
+int bleGetScanTimeSavedMs()
+{
+    return gScanTimeSavedMs;
+}
 
-// Initialise.
-void bleInit(const char *gpDeviceNamePrefix, int wantedCharacteristicUuid,
-             int maxNumDataItemsPerDevice, EventQueue *pEventQueue, bool debugOn)
+// Get the counters for BLE as a whole.
+void bleGetStats(BleStats *pStats)
 {
-    gpDeviceNamePrefix = gpDeviceNamePrefix;
-    gWantedCharacteristicUuid = wantedCharacteristicUuid;
-    gMaxNumDataItemsPerDevice = maxNumDataItemsPerDevice;
-    gpBleEventQueue = pEventQueue;
-    gDebugOn = debugOn;
-    gNumBleDevicesInList = 0;
-    gBleGetNextDeviceIndex = 0;
+    int durationMs = bleGetRunDurationMs();
 
-    // TODO treat gMaxNumDataItemsPerDevice
+    LOCK();
+    *pStats = gBleStats;
+    pStats->numMemoryBytes = gBleMemoryUsed;
+    UNLOCK();
+    pStats->advertisementsPerSecond = 0;
+    if (durationMs > 0) {
+        pStats->advertisementsPerSecond = (int) (((int64_t) pStats->numAdvertisements * 1000) / durationMs);
+    }
 }
 
-// Shutdown.
-void bleDeinit()
+// Get the counters for a BLE device.
+bool bleGetDeviceStats(const char *pDeviceName, BleDeviceStats *pStats)
 {
-    clearBleDeviceList();
-    BLE::Instance().shutdown();
-    gpBleEventQueue = NULL;
+    BleDevice *pBleDevice;
+    BleDataStore *pDataStore = NULL;
+    bool found = false;
+
+    // numBytesStored is counted by the data store as readings
+    // are written into it, so bring that up to date first
+    DATA_LOCK();
+    drainBleReadingQueue(false);
+    LOCK();
+    pBleDevice = pFindBleDeviceInListByDeviceNamePtr(pDeviceName);
+    if (pBleDevice != NULL) {
+        *pStats = pBleDevice->pDetail->stats;
+        pDataStore = pBleDevice->pDetail->pDataStore;
+        found = true;
+    }
+    UNLOCK();
+    if (found) {
+        pStats->numBytesStored = 0;
+        if (pDataStore != NULL) {
+            checkBleDataStore(pDataStore);
+            pStats->numBytesStored = pDataStore->numBytesStored;
+        }
+    }
+    DATA_UNLOCK();
+
+    return found;
 }
 
-// Run BLE for a given time; use -1 for infinity, in which
-// case this function will never return.
-bool bleRun(int durationMs)
+// Get how long the last run of BLE lasted.
+int bleGetRunDurationMs()
 {
-    bool success = false;
+    int durationMs = gBleRunDurationMs;
 
-    if (gpBleEventQueue != NULL) {
-        gNextBleDeviceToRead = 0;
-        BLE::Instance().onEventsToProcess(scheduleBleEventsProcessing);
-        BLE::Instance().init(bleInitComplete);
-        gpBleEventQueue->dispatch(durationMs);
-        success = true;
+    if (gBleRunning) {
+        durationMs = gBleTimer.read_ms() - gBleRunStartMs;
     }
 
-    return success;
+    return durationMs;
 }
 
 // Get the number of devices in the list.
@@ -1277,10 +5010,12 @@ const char *pBleGetNextDeviceName()
     const char *pDeviceName = NULL;
 
     LOCK();
-    // Find the next wanted device
-    while ((pDeviceName == NULL) && (gBleGetNextDeviceIndex < gNumBleDevicesInList)) {
-        if (gBleDeviceList[gBleGetNextDeviceIndex].deviceState == BLE_DEVICE_STATE_IS_WANTED) {
-            pDeviceName = gBleDeviceList[gBleGetNextDeviceIndex].pDeviceName;
+    // Find the details of the next wanted device, the only
+    // ones to have both a data store and a name
+    while ((pDeviceName == NULL) && (gBleGetNextDeviceIndex < gNumBleDeviceDetails)) {
+        if (gpBleDeviceDetail[gBleGetNextDeviceIndex].inUse &&
+            (gpBleDeviceDetail[gBleGetNextDeviceIndex].pDataStore != NULL)) {
+            pDeviceName = gpBleDeviceDetail[gBleGetNextDeviceIndex].pDeviceName;
         }
         gBleGetNextDeviceIndex++;
     }
@@ -1294,20 +5029,17 @@ const char *pBleGetNextDeviceName()
 int bleGetNumDataItems(const char *pDeviceName)
 {
     int numDataItems = -1;
-    BleDevice *pBleDevice;
-    BleDataContainer *pThis;
+    BleDataStore *pDataStore;
 
-    LOCK();
-    pBleDevice = pFindBleDeviceInListByDeviceNamePtr(pDeviceName);
-    if (pBleDevice != NULL) {
+    DATA_LOCK();
+    drainBleReadingQueue(true);
+    if (findBleDataStoreByDeviceName(pDeviceName, &pDataStore)) {
         numDataItems = 0;
-        pThis = pBleDevice->pDataContainer;
-        while (pThis != NULL) {
-            pThis = pThis->pNext;
-            numDataItems++;
+        if (pDataStore != NULL) {
+            numDataItems = pDataStore->numItems;
         }
     }
-    UNLOCK();
+    DATA_UNLOCK();
 
     return numDataItems;
 }
@@ -1316,23 +5048,19 @@ int bleGetNumDataItems(const char *pDeviceName)
 BleData *pBleGetFirstDataItem(const char *pDeviceName, bool andDelete)
 {
     BleData *pDataItem = NULL;
-    BleDevice *pBleDevice;
-    BleDataContainer *pTmp;
+    BleDataStore *pDataStore;
 
-    LOCK();
-    pBleDevice = pFindBleDeviceInListByDeviceNamePtr(pDeviceName);
-    if (pBleDevice != NULL) {
-        pBleDevice->pNextDataItemToRead = pBleDevice->pDataContainer;
-        pDataItem = pGetNextDataItemCopy(pBleDevice);
+    DATA_LOCK();
+    drainBleReadingQueue(true);
+    if (findBleDataStoreByDeviceName(pDeviceName, &pDataStore) && (pDataStore != NULL)) {
+        startBleDataCursor(pDataStore, &(pDataStore->nextItemToRead));
+        pDataItem = pGetNextDataItemCopy(pDataStore);
         if ((pDataItem != NULL) && andDelete) {
-            pTmp = pBleDevice->pDataContainer->pNext;
-            freeBleDataItem(pBleDevice->pDataContainer);
-            pBleDevice->pDataContainer = pTmp;
-            pBleDevice->pNextDataItemToRead = pBleDevice->pDataContainer;
-
+            freeOldestBleDataItem(pDataStore);
+            startBleDataCursor(pDataStore, &(pDataStore->nextItemToRead));
         }
     }
-    UNLOCK();
+    DATA_UNLOCK();
 
     return pDataItem;
 }
@@ -1341,16 +5069,161 @@ BleData *pBleGetFirstDataItem(const char *pDeviceName, bool andDelete)
 BleData *pBleGetNextDataItem(const char *pDeviceName)
 {
     BleData *pDataItem = NULL;
-    BleDevice *pBleDevice;
+    BleDataStore *pDataStore;
 
-    LOCK();
-    pBleDevice = pFindBleDeviceInListByDeviceNamePtr(pDeviceName);
-    if (pBleDevice != NULL) {
-        pDataItem = pGetNextDataItemCopy(pBleDevice);
+    DATA_LOCK();
+    if (findBleDataStoreByDeviceName(pDeviceName, &pDataStore) && (pDataStore != NULL)) {
+        pDataItem = pGetNextDataItemCopy(pDataStore);
     }
-    UNLOCK();
+    DATA_UNLOCK();
 
     return pDataItem;
 }
 
+// Drain the data items of all devices into a buffer.
+int bleDrainAll(char *pBuf, int lenBuf, bool *pAllDrained)
+{
+    BleDataStore *pDataStore;
+    BleDataCursor cursor;
+    BleDataSlot slot;
+    BleDataSlot *pSlot = &slot;
+    int baseTimestamp = 0;
+    bool haveData = false;
+    bool allDrained = true;
+    int delta;
+    int x = 0;
+    int y;
+    int y2;
+
+    DATA_LOCK();
+    drainBleReadingQueue(true);
+    // Find the oldest timestamp to use as the base
+    for (int z = 0; z < gMaxNumBleWantedDevices; z++) {
+        pDataStore = &(gpBleDataStore[z]);
+        if (pDataStore->inUse && (pDataStore->numItems > 0)) {
+            if (!haveData || (pDataStore->oldestTimestamp < baseTimestamp)) {
+                baseTimestamp = pDataStore->oldestTimestamp;
+            }
+            haveData = true;
+        }
+    }
+
+    if (haveData) {
+        if (lenBuf >= BLE_DRAIN_HEADER_SIZE) {
+            for (y = 0; y < BLE_DRAIN_HEADER_SIZE; y++) {
+                *(pBuf + x) = (char) (baseTimestamp >> (y * 8));
+                x++;
+            }
+            for (int z = 0; z < gMaxNumBleWantedDevices; z++) {
+                pDataStore = &(gpBleDataStore[z]);
+                while (pDataStore->inUse && (pDataStore->numItems > 0) && allDrained) {
+                    startBleDataCursor(pDataStore, &cursor);
+                    readBleDataItem(pDataStore, &cursor, pSlot);
+                    delta = pSlot->timestamp - baseTimestamp;
+                    if (delta < 0) {
+                        delta = 0;
+                    }
+                    // Write the record, only moving x on if it all fits;
+                    // y is the length of the record so far, zero if
+                    // it has not fitted
+                    y = 0;
+                    if (x < lenBuf) {
+                        *(pBuf + x) = (char) z;
+                        y = writeVarint(pBuf + x + 1, lenBuf - x - 1, delta);
+                    }
+                    if ((y > 0) && (x + 1 + y < lenBuf)) {
+                        y++;
+                        *(pBuf + x + y) = pSlot->dataLen | (pSlot->characteristicIndex << 4);
+                        y++;
+                        if (pSlot->numRepeats > 0) {
+                            *(pBuf + x + y - 1) |= BLE_DRAIN_FLAG_REPEATS;
+                            y2 = writeVarint(pBuf + x + y, lenBuf - x - y, pSlot->numRepeats);
+                            y = (y2 > 0) ? y + y2 : 0;
+                        }
+                    } else {
+                        y = 0;
+                    }
+                    if ((y > 0) && (x + y + pSlot->dataLen <= lenBuf)) {
+                        memcpy(pBuf + x + y, pSlot->data, pSlot->dataLen);
+                        x += y + pSlot->dataLen;
+                        freeOldestBleDataItem(pDataStore);
+                        startBleDataCursor(pDataStore, &(pDataStore->nextItemToRead));
+                    } else {
+                        allDrained = false;
+                    }
+                }
+            }
+            if (x == BLE_DRAIN_HEADER_SIZE) {
+                // Not even one record would fit
+                x = 0;
+            }
+        } else {
+            allDrained = false;
+        }
+    }
+    DATA_UNLOCK();
+
+    if (pAllDrained != NULL) {
+        *pAllDrained = allDrained;
+    }
+
+    return x;
+}
+
+// Get the device name for a device index.
+const char *pBleGetDeviceNameByIndex(int deviceIndex)
+{
+    const char *pDeviceName = NULL;
+
+    if ((deviceIndex >= 0) && (deviceIndex < gMaxNumBleWantedDevices)) {
+        LOCK();
+        for (int x = 0; (x < gNumBleDevicesInList) && (pDeviceName == NULL); x++) {
+            if ((gBleDeviceList[x].pDetail != NULL) &&
+                (gBleDeviceList[x].pDetail->pDataStore == &(gpBleDataStore[deviceIndex]))) {
+                pDeviceName = gBleDeviceList[x].pDetail->pDeviceName;
+            }
+        }
+        UNLOCK();
+    }
+
+    return pDeviceName;
+}
+
+// Call a callback for each of the data items of the given device name.
+int bleForEachDataItem(const char *pDeviceName, BleDataItemCallback pCallback,
+                       void *pContext, bool andDelete)
+{
+    int numDataItems = -1;
+    BleDataStore *pDataStore;
+    BleDataCursor cursor;
+    BleDataSlot slot;
+    bool keepGoing = true;
+
+    DATA_LOCK();
+    drainBleReadingQueue(true);
+    if (findBleDataStoreByDeviceName(pDeviceName, &pDataStore)) {
+        numDataItems = 0;
+        if (pDataStore != NULL) {
+            startBleDataCursor(pDataStore, &cursor);
+            while (keepGoing && (cursor.index < pDataStore->numItems)) {
+                readBleDataItem(pDataStore, &cursor, &slot);
+                keepGoing = pCallback(pDeviceName, slot.timestamp,
+                                      gWantedCharacteristic[slot.characteristicIndex].getShortUUID(),
+                                      slot.data, slot.dataLen, slot.numRepeats, pContext);
+                numDataItems++;
+                if (andDelete) {
+                    freeOldestBleDataItem(pDataStore);
+                    startBleDataCursor(pDataStore, &cursor);
+                }
+            }
+            if (andDelete) {
+                startBleDataCursor(pDataStore, &(pDataStore->nextItemToRead));
+            }
+        }
+    }
+    DATA_UNLOCK();
+
+    return numDataItems;
+}
+
 // End of file
\ No newline at end of file
@@ -30,10 +30,81 @@
  */
 typedef struct {
     int timestamp; /// Unix timestamp.
+    int characteristicUuid; /// The 16-bit UUID of the characteristic the reading is from.
     char *pData; /// This will be malloc()ed; it is up to the caller to free()
     int dataLen;
+    int numRepeats; /// If not zero, this data item stands for that many readings just like the last data item from the same characteristic, the timestamp being that of the last of them, see bleSetDeadband().
 } BleData;
 
+/** Callback used by bleForEachDataItem() to give a consumer
+ * access to a data item in place.
+ *
+ * @param pDeviceName        the device name, as passed to
+ *                           bleForEachDataItem().
+ * @param timestamp          the Unix timestamp of the data item.
+ * @param characteristicUuid the 16-bit UUID of the characteristic
+ *                           the data item is from.
+ * @param pData              a pointer to the data; this points into
+ *                           the data store and is valid only for the
+ *                           duration of the callback.
+ * @param dataLen            the length of the data pointed to by pData.
+ * @param numRepeats         the number of readings this data item
+ *                           stands for, as in BleData, zero if
+ *                           it is a single reading.
+ * @param pContext           the context pointer passed to
+ *                           bleForEachDataItem().
+ * @return                   true to continue with the next data item,
+ *                           false to stop.
+ */
+typedef bool (*BleDataItemCallback)(const char *pDeviceName, int timestamp,
+                                    int characteristicUuid,
+                                    const char *pData, int dataLen,
+                                    int numRepeats, void *pContext);
+
+/** Counters kept for a BLE device during a run of BLE, see
+ * bleGetDeviceStats().  Latencies and durations are summed so
+ * that the average is the total divided by the count.
+ */
+typedef struct {
+    int numAdvertisements; /// Advertisements seen from the device while it was in the list.
+    int numConnectAttempts; /// Connections initiated to the device.
+    int numConnects; /// Connections to the device that were made.
+    int totalConnectLatencyMs; /// From initiating a connection to it being made, summed over numConnects.
+    int numDiscoveries; /// Service discoveries of the device that completed.
+    int totalDiscoveryMs; /// From connecting to the end of service discovery, summed over numDiscoveries.
+    int numReadings; /// Readings taken from the device, by connection, advertisement or notification.
+    int numConnectedReadings; /// Readings taken by connecting to the device.
+    int totalReadLatencyMs; /// From initiating a connection to the last read, summed over numConnectedReadings.
+    int numTimeoutFailures; /// Connections or readings that failed because they took too long.
+    int numDisconnectFailures; /// Readings that failed because the device disconnected.
+    int numGattErrorFailures; /// Readings that failed because of an error from the device.
+    int numBytesStored; /// Bytes written to the data store of the device, once packed; readings counted as repeats add nothing, see bleSetDeadband().
+} BleDeviceStats;
+
+/** Counters kept for BLE as a whole during a run of BLE, see
+ * bleGetStats().
+ */
+typedef struct {
+    int numAdvertisements; /// Advertisements seen.
+    int advertisementsPerSecond; /// numAdvertisements divided by the duration of the run.
+    int numListFullRejections; /// Devices not added to the list because it was full of wanted devices.
+    int numConnectionsSaved; /// See bleGetNumConnectionsSaved().
+    int numReadingsDropped; /// Readings dropped because the reading queue was full.
+    int numReadingsTooLong; /// Readings not stored because they were longer than the eight bytes of a data item.
+    int numLocks; /// The number of times the BLE list was locked.
+    int maxLockHoldUs; /// The longest time for which the BLE list was locked.
+    uint64_t totalLockHoldUs; /// The total time for which the BLE list was locked.
+    int numMemoryBytes; /// The memory currently allocated by BLE, see bleSetMemoryBudget().
+    int maxMemoryBytes; /// The most memory that was allocated by BLE at any one time.
+    int numAllocationFailures; /// Allocations that failed or would have gone over the memory budget.
+} BleStats;
+
+/** Callback used by bleStart() to signal that BLE has stopped.
+ *
+ * @param pContext the context pointer passed to bleStart().
+ */
+typedef void (*BleDoneCallback)(void *pContext);
+
 /**********************************************************************
  * FUNCTIONS
  **********************************************************************/
@@ -49,22 +120,304 @@ typedef struct {
  *                                 BLE_UUID_GAP_CHARACTERISTIC_DEVICE_NAME.
  * @param wantedCharacteristicUuid the UUID of the characteristic to read
  *                                 from the wanted devices.
- * @param maxNumDataItemsPerDevice the maximum number of data items to collect,
- *                                 older items will be lost when the maximum
- *                                 number of data items is reached.
+ * @param maxNumWantedDevices      the most wanted devices to gather data
+ *                                 from; a data store, and the details
+ *                                 kept for a wanted device, are allocated
+ *                                 here for each of them.  A device found
+ *                                 once they are all taken is not wanted
+ *                                 for now and is tried again later.
+ * @param maxNumDataItemsPerDevice sets the storage for data items: enough
+ *                                 for this many data items, for each of the
+ *                                 wanted devices, with their timestamps, is
+ *                                 allocated here.  Data items are packed,
+ *                                 with the seconds since the previous data
+ *                                 item in place of a timestamp, so several
+ *                                 times as many small readings taken every
+ *                                 few seconds will usually fit; older items
+ *                                 are lost when the storage is full.
  * @param pEventQueue              an event queue to use for BLE events, should
  *                                 have headroom of 16 * EVENTS_EVENT_SIZE.
  * @param debugOn                  true to switch on debug printf()s.
+ *
+ * Devices that were found during previous runs of BLE are put
+ * straight back into the device list from the discovery cache
+ * by the first bleStart() after this, wanted devices with the
+ * handle of their wanted characteristic, so that they can be read
+ * from without service discovery; if the wanted UUIDs are not
+ * those the discovery cache was written with it is ignored.
+ * Devices that are not ours are kept out of the device list
+ * altogether: they are remembered, by address only, in a
+ * negative cache which also survives between runs, until the
+ * rejection expires (after an hour, or sooner for devices that
+ * were dropped because of a failure which may be transient).
+ * When the device list is full, the device that has gone unseen
+ * the longest is evicted; wanted devices, and devices whose data
+ * has yet to be read, are never evicted.
  */
  void bleInit(const char *pDeviceNamePrefix, int wantedCharacteristicUuid,
-              int maxNumDataItemsPerDevice, EventQueue *pEventQueue,
-              bool debugOn);
+              int maxNumWantedDevices, int maxNumDataItemsPerDevice,
+              EventQueue *pEventQueue, bool debugOn);
+
+/** Switch on observer mode: readings are then also taken from
+ * the advertisements of devices, without connecting to them,
+ * where the advertisement contains a SERVICE_DATA record for
+ * the given 16-bit service UUID or a MANUFACTURER_SPECIFIC_DATA
+ * record where the two bytes following the company identifier
+ * are the given UUID (little-endian); in both cases the reading
+ * is the data that follows the UUID.  A device found in this
+ * way is wanted if it advertises no local name or if its
+ * advertised local name begins with the Device Name prefix
+ * passed to bleInit(); if it has no local name its BLE address
+ * is used as its device name.  Must be called after bleInit(),
+ * which switches observer mode off.
+ *
+ * @param serviceUuid the 16-bit service UUID to look for, e.g.
+ *                    TEMP_SRV_UUID; use zero to switch
+ *                    observer mode off.
+ */
+void bleSetObserverUuid(int serviceUuid);
+
+/** Store all data items with the same length, e.g. the two bytes
+ * of a temperature reading, so that no length need be stored
+ * with each one; longer readings are truncated and shorter ones
+ * padded with zeroes.  Any data items already stored are lost.
+ * Must be called after bleInit(), which switches this off, and
+ * from the same thread as the data item functions below.
+ *
+ * @param dataLen the length of all data items, at most eight
+ *                bytes; use zero to store data items with
+ *                their own length.
+ */
+void bleSetFixedDataLength(int dataLen);
+
+/** Set a budget for the memory that BLE allocates: the data
+ * stores and details of the wanted devices and the storage for
+ * their data items, allocated by bleInit(), and the Device Names
+ * of devices, allocated as they are found, so that BLE leaves
+ * the rest of the heap alone (e.g. for the cellular driver).
+ * The storage for data items is cut down, if need be, to leave
+ * room in the budget for the rest; when a data store is full its oldest data item
+ * is lost.  A device whose Device Name would take BLE over the
+ * budget is not taken on as wanted; it is tried again later,
+ * when it may fit.  Nothing is freed to make room for a Device
+ * Name: every Device Name belongs to a wanted device with a data
+ * store, which is never evicted.  The data items returned by
+ * pBleGetFirstDataItem() and pBleGetNextDataItem() belong to
+ * the caller and are not counted.
+ * If the storage for data items changes size, any data items
+ * already stored are lost.  Must be called after bleInit(),
+ * which removes the budget, while BLE is not running and from
+ * the same thread as the data item functions below.
+ *
+ * @param maxBytes the budget in bytes, 0 for no budget.
+ * @return         true if successful, false if BLE is running
+ *                 or the budget is too small to store at least
+ *                 one data item for each wanted device.
+ */
+bool bleSetMemoryBudget(int maxBytes);
+
+/** Store only the readings from a wanted device (or from all of
+ * them) that have changed: a reading is not stored if it is
+ * within a deadband of the data item last stored from the same
+ * characteristic, unless a maximum silent interval has gone by
+ * since that data item was stored.  Readings are compared as
+ * little-endian signed 16-bit values (the last byte on its own
+ * if there is an odd one); a reading is within the deadband if
+ * none of its values differs by more than the deadband.  The
+ * readings that were not stored are counted and, when a reading
+ * that is stored ends the run of them, or the data items are
+ * next read or BLE stops, a summary data item is stored: the
+ * data of the data item they were just like, the timestamp of
+ * the last of them and their number in numRepeats, see BleData
+ * and bleDrainAll().  Must be called after bleInit(),
+ * which switches this off for all devices, and from the same
+ * thread as the data item functions below.
+ *
+ * @param pDeviceName      a pointer to the name of the device, as
+ *                         returned by pBleGetFirstDeviceName() or
+ *                         pBleGetNextDeviceName(), or NULL to set
+ *                         this for all devices, including those
+ *                         found later.
+ * @param deadband         the deadband, 0 to leave out only
+ *                         readings that are the same as the last
+ *                         one stored, negative to store all
+ *                         readings.
+ * @param maxSilentSeconds the most time that may go by without
+ *                         a reading being stored, 0 for no limit.
+ * @return                 true if successful, false if the
+ *                         device was not found or has nowhere
+ *                         to store data.
+ */
+bool bleSetDeadband(const char *pDeviceName, int deadband, int maxSilentSeconds);
+
+/** Set the period at which readings are taken from a wanted
+ * device (or from all of them).  Readings are scheduled per
+ * device: a device is due one period after its last reading
+ * was started and is connected to early enough, given how long
+ * its last reading took, to complete by then; the most urgent
+ * device is read first.  A failed reading is retried after a
+ * delay that doubles with each consecutive failure.  Must be
+ * called after bleInit(), which sets the period for all devices
+ * to two seconds.
+ *
+ * @param pDeviceName a pointer to the name of the device, as
+ *                    returned by pBleGetFirstDeviceName() or
+ *                    pBleGetNextDeviceName(), or NULL to set
+ *                    the period for all devices, including
+ *                    those found later.
+ * @param periodMs    the period in milliseconds.
+ * @return            true if successful, false if the device
+ *                    was not found.
+ */
+bool bleSetReadPeriod(const char *pDeviceName, int periodMs);
+
+/** Set the number of connections, for discovery or for readings,
+ * that may be in flight at the same time (connections held open
+ * for notifications, see bleSetMaxNumHeldConnections(), are not
+ * counted).  Only one connection is initiated at a time but, as
+ * soon as one is up, the next may be initiated while the first
+ * is being discovered or read.  Each connection is given at most
+ * a few seconds before it is dropped.  Note that the BLE stack
+ * must be configured to support this number of central
+ * connections.  Must be called after bleInit(), which sets
+ * this to one.
+ *
+ * @param maxNumConnections the maximum number of connections
+ *                          in flight, at least one.
+ */
+void bleSetMaxNumConnections(int maxNumConnections);
+
+/** Switch adaptive scanning on or off.  Scanning normally has
+ * the radio on for 500 ms in every second.  With adaptive scanning,
+ * once five seconds go by without a new device appearing, or a
+ * wanted device appearing for the first time in this run, that
+ * window is halved, and so on down to 50 ms; it goes back to
+ * 500 ms as soon as something new does appear.  Must be called
+ * after bleInit(), which switches adaptive scanning off.
+ *
+ * @param onNotOff true to switch adaptive scanning on, false
+ *                 to switch it off.
+ */
+void bleSetAdaptiveScan(bool onNotOff);
+
+/** Set when a run of BLE may end before its duration is up:
+ * either once every wanted device has given a given number of
+ * readings (by connection, advertisement or notification) during
+ * the run or once a given period has gone by without a new device
+ * appearing, or a wanted device appearing for the first time in
+ * the run, whichever comes first.  Must be called after bleInit(),
+ * which switches both off.
+ *
+ * @param minNumReadings the number of readings each wanted device
+ *                       must have given, 0 for no limit.
+ * @param quietPeriodMs  the period without a new device in ms,
+ *                       0 for no limit.
+ */
+void bleSetEarlyStop(int minNumReadings, int quietPeriodMs);
+
+/** Set the characteristics to read from each wanted device, e.g.
+ * TEMP_SRV_UUID_TEMP_CHAR, ACC_SRV_UUID_XYZ_CHAR and
+ * GYRO_SRV_UUID_XYZ_CHAR, in place of the one passed to
+ * bleInit().  All of them are read, one after the other, over
+ * the same connection and each data item records which of them
+ * it is from; readings taken in observer mode are recorded as
+ * being from the first.  A device is wanted if it has any of
+ * them; only the first is subscribed to for notifications.
+ * Service discovery can only be targeted, see
+ * bleSetWantedServiceUuid(), if they are all in the same service.
+ * This and bleSetWantedLongUuids() both set the wanted
+ * characteristics: whichever is called last wins.  Must be called
+ * after bleInit() and before bleRun().
+ *
+ * @param pCharacteristicUuids   a pointer to the 16-bit UUIDs of
+ *                               the characteristics.
+ * @param numCharacteristicUuids the number of UUIDs, at most four.
+ */
+void bleSetWantedCharacteristicUuids(const int *pCharacteristicUuids,
+                                     int numCharacteristicUuids);
+
+/** Set the 16-bit UUID of the service that contains the wanted
+ * characteristic.  Service discovery is then targeted: rather than
+ * finding every service and characteristic of a new device, only
+ * the Device Name characteristic of the GAP service and the wanted
+ * characteristic of this service are looked for, and discovery
+ * stops as soon as they have been found.  Must be called after
+ * bleInit(), which switches targeted discovery off.
+ *
+ * @param serviceUuid the 16-bit UUID of the service, e.g.
+ *                    TEMP_SRV_UUID, or 0 to discover all services.
+ */
+void bleSetWantedServiceUuid(int serviceUuid);
+
+/** As bleSetWantedServiceUuid() but for a device where the wanted
+ * service and/or the wanted characteristic have 128-bit UUIDs;
+ * the characteristic given here becomes the only wanted
+ * characteristic, replacing the one passed to bleInit() or any
+ * given to bleSetWantedCharacteristicUuids(), and its 16-bit
+ * alias (bytes 2 and 3, most significant byte first) is what is
+ * reported as its UUID, e.g. in BleData.  This and
+ * bleSetWantedCharacteristicUuids() both set the wanted
+ * characteristics: whichever is called last wins.  Must be called
+ * after bleInit().
+ *
+ * @param pServiceUuid        a pointer to the 16 bytes of the service
+ *                            UUID, most significant byte first, or
+ *                            NULL to discover all services.
+ * @param pCharacteristicUuid a pointer to the 16 bytes of the wanted
+ *                            characteristic UUID, most significant
+ *                            byte first, or NULL to leave the wanted
+ *                            characteristics as they are.
+ */
+void bleSetWantedLongUuids(const uint8_t *pServiceUuid, const uint8_t *pCharacteristicUuid);
 
- /* Shutdown.
+/** Set the number of connections to wanted devices that may be
+ * held open in order to receive notifications of the wanted
+ * characteristic rather than polling it: once the first reading
+ * has been taken from a wanted device whose wanted characteristic
+ * supports notifications, and if fewer than this number of
+ * connections are already held open, notifications are enabled,
+ * by writing to the CCCD found among its descriptors when it was
+ * discovered, and once the peer has accepted that the connection
+ * is held open; readings then arrive at the rate the peer sends
+ * them.  All other wanted devices continue
+ * to be polled.  Note that the BLE stack must be configured to
+ * support this number of central connections plus one.  Must
+ * be called after bleInit(), which sets this to zero.
+ *
+ * @param maxNumHeldConnections the maximum number of connections
+ *                              to hold open, zero to always poll.
+ */
+void bleSetMaxNumHeldConnections(int maxNumHeldConnections);
+
+ /* Shutdown, calling bleStop() first if BLE is running.
   */
  void bleDeinit();
 
-/** Run BLE for a given time.
+#if DEVICE_FLASH
+/** Save the discovery cache, what has been learnt about the
+ * BLE devices around us, to internal flash (by default the
+ * last sector, define BLE_DISCOVERY_CACHE_FLASH_ADDRESS to
+ * put it elsewhere).  The discovery cache is kept in RAM
+ * across bleDeinit()/bleInit() anyway, this is only necessary
+ * to survive a reset.  To save wear the flash is only written
+ * if the wanted devices have changed since the last save.
+ * Call this when BLE is not running, e.g. after bleDeinit().
+ *
+ * @return true on success, otherwise false.
+ */
+bool bleSaveDiscoveryCache();
+
+/** Load the discovery cache from internal flash, e.g. after
+ * a reset; should be called before bleInit().
+ *
+ * @return true if a valid discovery cache was loaded,
+ *         otherwise false.
+ */
+bool bleLoadDiscoveryCache();
+#endif
+
+/** Run BLE for a given time, or until it stops early, see
+ * bleSetEarlyStop().
  *
  * @param durationMs the duration to run for in ms;
  *                   use -1 for infinity, in which
@@ -74,6 +427,78 @@ typedef struct {
  */
 bool bleRun(int durationMs);
 
+/** Start BLE running on the event queue passed to bleInit()
+ * and return without waiting: BLE processing is done as events
+ * on that queue, so it shares the queue with the application,
+ * which must be dispatching it (e.g. with dispatch_forever()).
+ * Event handlers of the application should not block for long
+ * while BLE is running as BLE is starved while they do.
+ *
+ * @param durationMs    the duration to run for in ms, after which
+ *                      bleStop() is called; use -1 for infinity,
+ *                      in which case BLE runs until bleStop()
+ *                      is called.
+ * @param pDoneCallback the callback to call, from the event queue
+ *                      or from bleStop(), when BLE has stopped;
+ *                      may be NULL.  bleDeinit() may be called
+ *                      from this callback.
+ * @param pContext      a context pointer that will be passed to
+ *                      pDoneCallback.
+ * @return              true on success, false if BLE has not been
+ *                      initialised or is already running.
+ */
+bool bleStart(int durationMs, BleDoneCallback pDoneCallback, void *pContext);
+
+/** Stop BLE running: scanning and the taking of readings stop,
+ * links that are up are left to finish, and the done callback
+ * passed to bleStart() is called.  Does nothing if BLE is not
+ * running.
+ */
+void bleStop();
+
+/** Get the number of connections that were not made during
+ * the last bleRun() because the local name advertised by a
+ * device showed that it did not have the Device Name prefix.
+ *
+ * @return the number of connections saved.
+ */
+int bleGetNumConnectionsSaved();
+
+/** Get the radio-on time saved by adaptive scanning during the
+ * last bleRun(), compared with scanning for 500 ms in every
+ * second throughout, see bleSetAdaptiveScan().
+ *
+ * @return the radio-on time saved in milliseconds.
+ */
+int bleGetScanTimeSavedMs();
+
+/** Get how long the last run of BLE lasted, which may be less
+ * than the duration asked for, see bleSetEarlyStop(); if BLE is
+ * running this is how long it has been running for.
+ *
+ * @return the duration of the run in milliseconds.
+ */
+int bleGetRunDurationMs();
+
+/** Get the counters kept for BLE as a whole during the last,
+ * or current, run of BLE; they are reset by bleStart().
+ *
+ * @param pStats a place to put the counters.
+ */
+void bleGetStats(BleStats *pStats);
+
+/** Get the counters kept for a BLE device during the last, or
+ * current, run of BLE; they are reset by bleStart().
+ *
+ * @param pDeviceName the Device Name, as returned by
+ *                    pBleGetFirstDeviceName() or
+ *                    pBleGetNextDeviceName().
+ * @param pStats      a place to put the counters.
+ * @return            true if the device was found, otherwise
+ *                    false.
+ */
+bool bleGetDeviceStats(const char *pDeviceName, BleDeviceStats *pStats);
+
 /** Get the number of devices in the list.
  *
  * @return the number of devices in the list.
@@ -87,7 +512,9 @@ int bleGetNumDevices();
  */
 const char *pBleGetFirstDeviceName();
 
-/** Get the next device name in the list.
+/** Get the next device name in the list; devices found or
+ * lost since pBleGetFirstDeviceName() was called do not cause
+ * any other device to be skipped or returned twice.
  *
  * @return  pointer to the next device name or
  *          NULL if the end of the list has been
@@ -98,6 +525,14 @@ const char *pBleGetNextDeviceName();
 /** Get the number of data items that have been
  * read from a given device.
  *
+ * Note that this and the other data item functions below
+ * must all be called from the same thread: readings are
+ * handed to them by the BLE callbacks through a lock-free
+ * queue, which the BLE callbacks also empty into the data
+ * stores when none of these functions is running (they never
+ * wait for them to do so), and the BLE list lock is only
+ * taken to find the device.
+ *
  * @param  pDeviceName a pointer to the device name
  *                     string that the data items
  *                     are from, as returned by
@@ -168,4 +603,75 @@ BleData *pBleGetFirstDataItem(const char *pDeviceName,
  */
 BleData *pBleGetNextDataItem(const char *pDeviceName);
 
+/** Call a callback for each of the data items of the given
+ * device name, oldest first, without copying them.  The BLE
+ * list is not locked while the callback runs but the callback
+ * must not call any of the other data item functions here.
+ *
+ * @param  pDeviceName a pointer to the device name
+ *                     string that the data items are
+ *                     from, as returned by
+ *                     pGetFirstDeviceName() or
+ *                     pGetNextDeviceName() (not a copy,
+ *                     the address is the important thing).
+ * @param  pCallback   the callback to call for each data item.
+ * @param  pContext    a context pointer that will be passed
+ *                     to the callback, may be NULL.
+ * @param  andDelete   if true, each data item is deleted from
+ *                     the data store once it has been passed
+ *                     to the callback.
+ * @return             the number of data items passed to the
+ *                     callback or -1 if pDeviceName cannot
+ *                     be found.
+ */
+int bleForEachDataItem(const char *pDeviceName,
+                       BleDataItemCallback pCallback,
+                       void *pContext, bool andDelete);
+
+/** Drain the data items of all devices into a buffer without
+ * taking the BLE list lock.  The buffer is filled as
+ * follows:
+ *
+ * - 4 bytes: base Unix timestamp, little-endian,
+ *
+ * ...followed by zero or more records, each being:
+ *
+ * - 1 byte:  device index, see pBleGetDeviceNameByIndex(),
+ * - 1 to 5 bytes: seconds since the base timestamp, as an
+ *   unsigned varint (7 bits per byte, least significant
+ *   first, top bit set on all but the last byte),
+ * - 1 byte:  length of the data in the bottom four bits and,
+ *   in the next three bits, the index of the characteristic the
+ *   data is from in the list given to
+ *   bleSetWantedCharacteristicUuids() (zero if there is only one);
+ *   the top bit is set if a repeat count follows,
+ * - if the top bit of the byte above is set, 1 to 5 bytes: the
+ *   repeat count, as an unsigned varint; the record is then the
+ *   summary of that many readings just like the record before it
+ *   from the same characteristic, see numRepeats in BleData,
+ * - the data.
+ *
+ * Data items that are written to the buffer are deleted, those
+ * that do not fit are left in place; call this function again
+ * to carry on from where it left off.
+ *
+ * @param  pBuf        a pointer to the buffer.
+ * @param  lenBuf      the length of the buffer.
+ * @param  pAllDrained if not NULL, set to true if all data
+ *                     items have been drained, otherwise false.
+ * @return             the number of bytes written to pBuf, zero
+ *                     if there were no data items or the buffer
+ *                     is too small to hold even one record.
+ */
+int bleDrainAll(char *pBuf, int lenBuf, bool *pAllDrained);
+
+/** Get the device name for a device index, as used in the
+ * records written by bleDrainAll().
+ *
+ * @param  deviceIndex the device index.
+ * @return             a pointer to the device name or NULL
+ *                     if there is no device with that index.
+ */
+const char *pBleGetDeviceNameByIndex(int deviceIndex);
+
 #endif // _BLE_DATA_GATHER_
@@ -0,0 +1,209 @@
+/* mbed Microcontroller Library
+ * Copyright (c) 2006-2018 u-blox Limited
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Time the lookups of the BLE device list, by address and by
+ * connection handle, through the hash indexes against the linear
+ * scans of the list that they replaced, with the list full.  Every
+ * lookup is also made both ways and the answers compared.
+ *
+ * The static functions of ble_data_gather are needed, hence it
+ * is included rather than linked.
+ */
+
+#include <chrono>
+#include "../ble_data_gather.cpp"
+
+/**************************************************************************
+ * MACROS
+ *************************************************************************/
+
+/** The number of addresses looked up, half of which are in the
+ * list, as advertisements come as often from devices that are
+ * not in it.
+ */
+#define BENCH_NUM_ADDRESSES (MAX_NUM_BLE_DEVICES * 2)
+
+/** The number of times each lookup is made.
+ */
+#define BENCH_NUM_ROUNDS 2000
+
+/** The number of devices that are connected.
+ */
+#define BENCH_NUM_CONNECTIONS 4
+
+/**************************************************************************
+ * LOCAL VARIABLES
+ *************************************************************************/
+
+/** The addresses looked up; the first MAX_NUM_BLE_DEVICES are
+ * in the list.
+ */
+static char gAddress[BENCH_NUM_ADDRESSES][BLE_ADDRESS_SIZE];
+
+/** Somewhere to put the results so that the lookups are not
+ * optimised away.
+ */
+static volatile uintptr_t gSink = 0;
+
+/**************************************************************************
+ * STATIC FUNCTIONS
+ *************************************************************************/
+
+// Find a BLE device by address as it was done before the index.
+static BleDevice *pFindBleDeviceInListByAddressLinear(const char *pAddress, int addressType)
+{
+    BleDevice *pBleDevice = NULL;
+
+    for (int x = 0; (x < gNumBleDevicesInList) && (pBleDevice == NULL); x++) {
+        if (bleAddressTypesMatch(gBleDeviceList[x].addressType, addressType) &&
+           (memcmp (pAddress, gBleDeviceList[x].address, sizeof (gBleDeviceList[x].address)) == 0)) {
+            pBleDevice = &(gBleDeviceList[x]);
+        }
+    }
+
+    return pBleDevice;
+}
+
+// Find a connected BLE device as it was done before the index.
+static BleDevice *pFindBleConnectionInListLinear(Gap::Handle_t connectionHandle)
+{
+    BleDevice *pBleDevice = NULL;
+
+    for (int x = 0; (x < gNumBleDevicesInList) && (pBleDevice == NULL); x++) {
+        if ((gBleDeviceList[x].connectionState == BLE_CONNECTION_STATE_CONNECTED) &&
+            (gBleDeviceList[x].pDetail->connectionHandle == connectionHandle)) {
+            pBleDevice = &(gBleDeviceList[x]);
+        }
+    }
+
+    return pBleDevice;
+}
+
+// Get the time in nanoseconds.
+static int64_t nowNs()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Time lookups by address, returning the nanoseconds per lookup.
+static double timeAddressLookups(bool linear)
+{
+    int64_t startNs = nowNs();
+    uintptr_t sink = 0;
+
+    for (int x = 0; x < BENCH_NUM_ROUNDS; x++) {
+        for (int y = 0; y < BENCH_NUM_ADDRESSES; y++) {
+            if (linear) {
+                sink += (uintptr_t) pFindBleDeviceInListByAddressLinear(gAddress[y], 0);
+            } else {
+                sink += (uintptr_t) pFindBleDeviceInListByAddress(gAddress[y], 0);
+            }
+        }
+    }
+    gSink = sink;
+
+    return (double) (nowNs() - startNs) / ((double) BENCH_NUM_ROUNDS * BENCH_NUM_ADDRESSES);
+}
+
+// Time lookups by connection handle, returning the nanoseconds
+// per lookup.
+static double timeConnectionLookups(bool linear)
+{
+    int64_t startNs = nowNs();
+    uintptr_t sink = 0;
+
+    for (int x = 0; x < BENCH_NUM_ROUNDS * 100; x++) {
+        for (int y = 0; y < BENCH_NUM_CONNECTIONS; y++) {
+            if (linear) {
+                sink += (uintptr_t) pFindBleConnectionInListLinear(y);
+            } else {
+                sink += (uintptr_t) pFindBleConnectionInList(y);
+            }
+        }
+    }
+    gSink = sink;
+
+    return (double) (nowNs() - startNs) / ((double) BENCH_NUM_ROUNDS * 100 * BENCH_NUM_CONNECTIONS);
+}
+
+/**************************************************************************
+ * PUBLIC FUNCTIONS
+ *************************************************************************/
+
+int main()
+{
+    BleDevice *pBleDevice;
+    double linearNs;
+    double hashedNs;
+    bool success = true;
+
+    bleInit("BENCH", 0xFFE1, BENCH_NUM_CONNECTIONS, 10, NULL, false);
+
+    // Distinct random public addresses, the first
+    // MAX_NUM_BLE_DEVICES of which go in the list
+    srand(1);
+    for (int x = 0; x < BENCH_NUM_ADDRESSES; x++) {
+        do {
+            for (int y = 0; y < BLE_ADDRESS_SIZE; y++) {
+                gAddress[x][y] = (char) rand();
+            }
+        } while (pFindBleDeviceInListByAddressLinear(gAddress[x], 0) != NULL);
+        if (x < MAX_NUM_BLE_DEVICES) {
+            success = success && (pAddBleDeviceToList(gAddress[x], 0) != NULL);
+        }
+    }
+
+    // A few of them connected, spread through the list, as
+    // connectionCallback() would leave them
+    for (int x = 0; (x < BENCH_NUM_CONNECTIONS) && success; x++) {
+        pBleDevice = &(gBleDeviceList[(x + 1) * MAX_NUM_BLE_DEVICES / (BENCH_NUM_CONNECTIONS + 1)]);
+        success = allocBleDeviceDetail(pBleDevice);
+        if (success) {
+            pBleDevice->pDetail->connectionHandle = x;
+            setBleConnectionState(pBleDevice, BLE_CONNECTION_STATE_CONNECTED);
+            addBleConnectionToIndex(pBleDevice);
+        }
+    }
+    if (!success) {
+        printf("Unable to fill the device list.\n");
+    }
+
+    // Both ways must give the same answers
+    for (int x = 0; (x < BENCH_NUM_ADDRESSES) && success; x++) {
+        success = (pFindBleDeviceInListByAddress(gAddress[x], 0) == pFindBleDeviceInListByAddressLinear(gAddress[x], 0));
+    }
+    for (int x = 0; (x < BENCH_NUM_CONNECTIONS + 1) && success; x++) {
+        success = (pFindBleConnectionInList(x) == pFindBleConnectionInListLinear(x));
+    }
+
+    if (success) {
+        printf("%d device(s) in the list, %d connected.\n", gNumBleDevicesInList, BENCH_NUM_CONNECTIONS);
+        linearNs = timeAddressLookups(true);
+        hashedNs = timeAddressLookups(false);
+        printf("By address (half not in the list): linear %.1f ns, hashed %.1f ns, %.1f times faster.\n",
+               linearNs, hashedNs, linearNs / hashedNs);
+        linearNs = timeConnectionLookups(true);
+        hashedNs = timeConnectionLookups(false);
+        printf("By connection handle: linear %.1f ns, hashed %.1f ns, %.1f times faster.\n",
+               linearNs, hashedNs, linearNs / hashedNs);
+    } else {
+        printf("The index and the list do not agree.\n");
+    }
+
+    return success ? 0 : 1;
+}
+
+// End Of File
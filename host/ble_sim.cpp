@@ -0,0 +1,888 @@
+/* mbed Microcontroller Library
+ * Copyright (c) 2006-2018 u-blox Limited
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Run ble_data_gather on the host against simulated peripherals
+ * described by a trace file, in wake-up cycles as main.cpp does,
+ * and report what it achieved; see "Host Simulation" in README.md
+ * for the trace file format.  Exits with 1 if any "expect" line of the
+ * trace file is not met, 2 if the trace file cannot be read.
+ */
+
+#include <getopt.h>
+#include <map>
+#include <string>
+#include <events/mbed_events.h>
+#include <mbed.h>
+#include "ble_data_gather.h"
+#include "ble_uuids.h"
+#include "utilities.h"
+#include "sim_ble.h"
+
+/**************************************************************************
+ * MACROS
+ *************************************************************************/
+
+/** The longest line in a trace file.
+ */
+#define MAX_LINE_LENGTH 256
+
+/** The most words on a line of a trace file.
+ */
+#define MAX_NUM_WORDS 16
+
+/** The most device groups, see "device ... count=".
+ */
+#define MAX_NUM_GROUPS 256
+
+/** The most expectations in a trace file.
+ */
+#define MAX_NUM_EXPECTATIONS 32
+
+/** The most wanted characteristics.
+ */
+#define MAX_NUM_CHARACTERISTICS 4
+
+/**************************************************************************
+ * TYPES
+ *************************************************************************/
+
+/** A group of peripherals added by one "device" line.
+ */
+typedef struct {
+    uint8_t address[BLEProtocol::ADDR_LEN];
+    int firstIndex;
+    int count;
+} Group;
+
+/** An "expect" line.
+ */
+typedef struct {
+    char quantity[MAX_LINE_LENGTH];
+    char op[3];
+    long long value;
+    int lineNumber;
+} Expectation;
+
+/** What ble_data_gather is set up with in each cycle.
+ */
+typedef struct {
+    char prefix[SIM_MAX_NAME_LENGTH + 1];
+    int characteristicUuid[MAX_NUM_CHARACTERISTICS];
+    int numCharacteristics;
+    int serviceUuid;
+    int observerUuid;
+    int maxNumWantedDevices;
+    int maxNumDataItemsPerDevice;
+    bool adaptiveScanOn;
+    int earlyStopNumReadings;
+    int earlyStopQuietPeriodMs;
+    int memoryBudget;
+    int deadband;
+    int maxSilentSeconds;
+    int maxNumHeldConnections;
+    int maxNumConnections;
+    int readPeriodMs;
+    int windowMs;
+    int sleepMs;
+    int numCycles;
+} Config;
+
+/** Totals over all cycles.
+ */
+typedef struct {
+    int numAdvertisementsSent;
+    int numAdvertisementsDelivered;
+    int64_t advertisementCallbackNs;
+    int numReadings;
+    int numItems;
+    int numBytesStored;
+    int numWanted;
+    int numDropped;
+    int numTooLong;
+    int numConnects;
+    int numDiscoveries;
+    int numNotifications;
+    int64_t scanRadioOnUs;
+    int runMs;
+} Totals;
+
+/**************************************************************************
+ * LOCAL VARIABLES
+ *************************************************************************/
+
+/** The event queue, sized as in main.cpp.
+ */
+static EventQueue gEventQueue(20 * EVENTS_EVENT_SIZE);
+
+/** The configuration, main.cpp's unless the trace file says
+ * otherwise.
+ */
+static Config gConfig = {"NINA-B1", {TEMP_SRV_UUID_TEMP_CHAR, ACC_SRV_UUID_XYZ_CHAR,
+                         GYRO_SRV_UUID_XYZ_CHAR}, 3, 0, TEMP_SRV_UUID, 16, 100, true, 3, 15000, 12288, 0, 300, 0, 0,
+                         0, 30000, 60000, 1};
+
+/** The device groups.
+ */
+static Group gGroup[MAX_NUM_GROUPS];
+static int gNumGroups = 0;
+
+/** The expectations.
+ */
+static Expectation gExpectation[MAX_NUM_EXPECTATIONS];
+static int gNumExpectations = 0;
+
+/** Totals, over all cycles and for the cycle in progress.
+ */
+static Totals gTotals;
+
+/** Readings per device, by Device Name, summed over all cycles.
+ */
+static std::map<std::string, int> gDeviceReadings;
+
+/** Options.
+ */
+static bool gDebugOn = false;
+static bool gVerbose = false;
+
+/** Whether BLE is running and the periodic consumer event.
+ */
+static bool gBleRunning = false;
+static int gConsumeEventId = 0;
+
+/**************************************************************************
+ * STATIC FUNCTIONS: TRACE FILE
+ *************************************************************************/
+
+// Split a line into words, returning the number of words.
+static int splitLine(char *pLine, char **ppWord, int maxNumWords)
+{
+    int numWords = 0;
+    char *pSave = NULL;
+
+    for (char *pWord = strtok_r(pLine, " \t\r\n", &pSave); (pWord != NULL) && (*pWord != '#') &&
+         (numWords < maxNumWords); pWord = strtok_r(NULL, " \t\r\n", &pSave)) {
+        ppWord[numWords] = pWord;
+        numWords++;
+    }
+
+    return numWords;
+}
+
+// Parse a 6 byte address.
+static bool parseAddress(const char *pString, uint8_t *pAddress)
+{
+    return (strlen(pString) == BLEProtocol::ADDR_LEN * 2) &&
+           (hexStringToBleAddress(pString, strlen(pString), (char *) pAddress, BLEProtocol::ADDR_LEN) ==
+            BLEProtocol::ADDR_LEN);
+}
+
+// Parse a hex string, returning the number of bytes.
+static int parseHex(const char *pString, uint8_t *pBuf, int lenBuf)
+{
+    int len = -1;
+
+    if (strlen(pString) % 2 == 0) {
+        len = hexStringToBytes(pString, strlen(pString), (char *) pBuf, lenBuf);
+    }
+
+    return len;
+}
+
+// Parse a 16-bit or a 128-bit UUID, the latter with or without
+// dashes, most significant byte first.
+static bool parseUuid(const char *pString, UUID *pUuid)
+{
+    char hex[UUID::LENGTH_OF_LONG_UUID * 2 + 1];
+    UUID::LongUUIDBytes_t longUuid;
+    int len = 0;
+    bool success = false;
+
+    for (const char *p = pString; (*p != 0) && (len < (int) sizeof(hex) - 1); p++) {
+        if (*p != '-') {
+            hex[len] = *p;
+            len++;
+        }
+    }
+    hex[len] = 0;
+    if (len == 4) {
+        *pUuid = UUID((UUID::ShortUUIDBytes_t) strtol(hex, NULL, 16));
+        success = true;
+    } else if ((len == UUID::LENGTH_OF_LONG_UUID * 2) &&
+               (hexStringToBytes(hex, len, (char *) longUuid, sizeof(longUuid)) == sizeof(longUuid))) {
+        *pUuid = UUID(longUuid, UUID::MSB);
+        success = true;
+    }
+
+    return success;
+}
+
+// Find a group by the address on its "device" line.
+static Group *pFindGroup(const uint8_t *pAddress)
+{
+    Group *pGroup = NULL;
+
+    for (int x = 0; (x < gNumGroups) && (pGroup == NULL); x++) {
+        if (memcmp(gGroup[x].address, pAddress, sizeof(gGroup[x].address)) == 0) {
+            pGroup = &(gGroup[x]);
+        }
+    }
+
+    return pGroup;
+}
+
+// Get the next address after this one; addresses are stored
+// least significant byte first, as they are by mbed.
+static void nextAddress(uint8_t *pAddress)
+{
+    bool carry = true;
+
+    for (int x = 0; (x < (int) BLEProtocol::ADDR_LEN) && carry; x++) {
+        pAddress[x]++;
+        carry = (pAddress[x] == 0);
+    }
+}
+
+// Apply a key=value setting to a peripheral.
+static bool applyDeviceSetting(SimPeripheral *pPeripheral, const char *pKey, const char *pValue)
+{
+    int value = atoi(pValue);
+    bool success = true;
+
+    if (strcmp(pKey, "type") == 0) {
+        pPeripheral->addressType = (strcmp(pValue, "random") == 0) ? BLEProtocol::AddressType::RANDOM_STATIC :
+                                                                     BLEProtocol::AddressType::PUBLIC;
+    } else if (strcmp(pKey, "advint") == 0) {
+        pPeripheral->advertisingIntervalMs = (value > 20) ? value : 20;
+    } else if (strcmp(pKey, "rssi") == 0) {
+        pPeripheral->rssi = value;
+    } else if (strcmp(pKey, "loss") == 0) {
+        pPeripheral->lossPercent = value;
+    } else if (strcmp(pKey, "latency") == 0) {
+        pPeripheral->connectLatencyMs = value;
+    } else if (strcmp(pKey, "connfail") == 0) {
+        pPeripheral->connectFailPercent = value;
+    } else if (strcmp(pKey, "drop") == 0) {
+        pPeripheral->dropPercent = value;
+    } else if (strcmp(pKey, "zeroread") == 0) {
+        pPeripheral->zeroReadMs = value;
+    } else if (strcmp(pKey, "connectable") == 0) {
+        pPeripheral->isConnectable = (value != 0);
+    } else if (strcmp(pKey, "advname") == 0) {
+        pPeripheral->nameIsAdvertised = (value != 0);
+    } else if (strcmp(pKey, "present") == 0) {
+        pPeripheral->isPresent = (value != 0);
+    } else if (strcmp(pKey, "change") == 0) {
+        pPeripheral->changePeriodMs = value;
+    } else if (strcmp(pKey, "handlebase") == 0) {
+        simSetHandleBase(pPeripheral, (GattAttribute::Handle_t) strtol(pValue, NULL, 0));
+    } else if (strcmp(pKey, "advdata") == 0) {
+        pPeripheral->advertisingDataLen = parseHex(pValue, pPeripheral->advertisingData,
+                                                   sizeof(pPeripheral->advertisingData));
+        success = (pPeripheral->advertisingDataLen >= 0);
+    } else if (strcmp(pKey, "count") != 0) {
+        success = false;
+    }
+
+    return success;
+}
+
+// Handle a "device" line.
+static bool parseDevice(char **ppWord, int numWords)
+{
+    uint8_t address[BLEProtocol::ADDR_LEN];
+    char name[SIM_MAX_NAME_LENGTH + 1];
+    SimPeripheral *pPeripheral;
+    Group *pGroup;
+    const char *pValue;
+    int count = 1;
+    bool success = (numWords >= 3) && parseAddress(ppWord[1], address) && (gNumGroups < MAX_NUM_GROUPS);
+
+    for (int x = 3; success && (x < numWords); x++) {
+        pValue = strchr(ppWord[x], '=');
+        success = (pValue != NULL);
+        if (success && (strncmp(ppWord[x], "count=", 6) == 0)) {
+            count = atoi(pValue + 1);
+        }
+    }
+    if (success) {
+        pGroup = &(gGroup[gNumGroups]);
+        gNumGroups++;
+        memcpy(pGroup->address, address, sizeof(pGroup->address));
+        pGroup->firstIndex = simGetNumPeripherals();
+        pGroup->count = 0;
+        for (int x = 0; success && (x < count); x++) {
+            if (count > 1) {
+                snprintf(name, sizeof(name), "%s-%04d", ppWord[2], x);
+            } else {
+                snprintf(name, sizeof(name), "%s", ppWord[2]);
+            }
+            pPeripheral = pSimAddPeripheral(address, BLEProtocol::AddressType::PUBLIC, name);
+            success = (pPeripheral != NULL);
+            for (int y = 3; success && (y < numWords); y++) {
+                pValue = strchr(ppWord[y], '=');
+                std::string key(ppWord[y], pValue - ppWord[y]);
+                success = applyDeviceSetting(pPeripheral, key.c_str(), pValue + 1);
+            }
+            pGroup->count++;
+            nextAddress(address);
+        }
+    }
+
+    return success;
+}
+
+// Handle a "service" line.
+static bool parseService(char **ppWord, int numWords)
+{
+    uint8_t address[BLEProtocol::ADDR_LEN];
+    uint8_t value[SIM_MAX_VALUE_LENGTH];
+    char word[MAX_LINE_LENGTH];
+    Group *pGroup = NULL;
+    SimService *pService;
+    UUID uuid;
+    char *pValue;
+    int valueLen;
+    bool canNotify;
+    bool hasDescription;
+    bool success = (numWords >= 3) && parseAddress(ppWord[1], address);
+
+    if (success) {
+        pGroup = pFindGroup(address);
+        success = (pGroup != NULL);
+    }
+    for (int x = 0; success && (x < pGroup->count); x++) {
+        success = parseUuid(ppWord[2], &uuid);
+        pService = NULL;
+        if (success) {
+            pService = pSimAddService(pSimFindPeripheral(address) + x, uuid);
+            success = (pService != NULL);
+        }
+        for (int y = 3; success && (y < numWords); y++) {
+            // <uuid>[:notify][:described][=<hex value>]
+            snprintf(word, sizeof(word), "%s", ppWord[y]);
+            valueLen = 2;
+            memset(value, 0, sizeof(value));
+            pValue = strchr(word, '=');
+            if (pValue != NULL) {
+                *pValue = 0;
+                valueLen = parseHex(pValue + 1, value, sizeof(value));
+            }
+            canNotify = (strstr(word, ":notify") != NULL);
+            hasDescription = (strstr(word, ":described") != NULL);
+            if (strchr(word, ':') != NULL) {
+                *strchr(word, ':') = 0;
+            }
+            success = (valueLen >= 0) && parseUuid(word, &uuid) &&
+                      (pSimAddCharacteristic(pService, uuid, canNotify, hasDescription, value, valueLen) != NULL);
+        }
+    }
+
+    return success;
+}
+
+// Handle an "at" line, scheduling the event.
+static bool parseAt(char **ppWord, int numWords)
+{
+    uint8_t address[BLEProtocol::ADDR_LEN];
+    std::vector<uint8_t> data(SIM_MAX_ADVERTISING_DATA_LENGTH);
+    SimPeripheral *pPeripheral = NULL;
+    BLEProtocol::AddressType_t addressType;
+    int64_t atUs;
+    int len;
+    int number;
+    UUID uuid;
+    bool success = (numWords >= 4) && parseAddress(ppWord[3], address);
+
+    if (success) {
+        atUs = (int64_t) atoll(ppWord[1]) * 1000;
+        pPeripheral = pSimFindPeripheral(address);
+        if (strcmp(ppWord[2], "adv") == 0) {
+            // at <ms> adv <address> <public|random> <rssi> <hex data>
+            success = (numWords == 7);
+            if (success) {
+                addressType = (strcmp(ppWord[4], "random") == 0) ? BLEProtocol::AddressType::RANDOM_STATIC :
+                                                                   BLEProtocol::AddressType::PUBLIC;
+                number = atoi(ppWord[5]);
+                len = parseHex(ppWord[6], data.data(), data.size());
+                success = (len >= 0);
+                data.resize(len >= 0 ? len : 0);
+                std::vector<uint8_t> peerAddress(address, address + sizeof(address));
+                simSchedule(atUs, 0, [peerAddress, addressType, number, data]() {
+                    simAdvertise(peerAddress.data(), addressType, number, data.data(), data.size());
+                }, NULL);
+            }
+        } else if (pPeripheral == NULL) {
+            success = false;
+        } else if ((strcmp(ppWord[2], "appear") == 0) || (strcmp(ppWord[2], "disappear") == 0)) {
+            bool isPresent = (strcmp(ppWord[2], "appear") == 0);
+            simSchedule(atUs, 0, [pPeripheral, isPresent]() {simSetPresent(pPeripheral, isPresent);}, NULL);
+        } else if ((strcmp(ppWord[2], "value") == 0) && (numWords == 6)) {
+            len = parseHex(ppWord[5], data.data(), data.size());
+            success = (len >= 0) && parseUuid(ppWord[4], &uuid);
+            data.resize(len >= 0 ? len : 0);
+            simSchedule(atUs, 0, [pPeripheral, uuid, data]() {
+                simSetValue(pPeripheral, uuid, data.data(), data.size());
+            }, NULL);
+        } else if ((strcmp(ppWord[2], "readerror") == 0) && (numWords == 5)) {
+            number = atoi(ppWord[4]);
+            simSchedule(atUs, 0, [pPeripheral, number]() {pPeripheral->numReadErrors += number;}, NULL);
+        } else if ((strcmp(ppWord[2], "handlebase") == 0) && (numWords == 5)) {
+            number = (int) strtol(ppWord[4], NULL, 0);
+            simSchedule(atUs, 0, [pPeripheral, number]() {
+                simSetHandleBase(pPeripheral, (GattAttribute::Handle_t) number);
+            }, NULL);
+        } else {
+            success = false;
+        }
+    }
+
+    return success;
+}
+
+// Handle a "config" line.
+static bool parseConfig(char **ppWord, int numWords)
+{
+    const char *pKey = ppWord[1];
+    int value = (numWords > 2) ? atoi(ppWord[2]) : 0;
+    char *pSave = NULL;
+    bool success = (numWords >= 3);
+
+    if (!success) {
+        // Nothing to do
+    } else if (strcmp(pKey, "prefix") == 0) {
+        snprintf(gConfig.prefix, sizeof(gConfig.prefix), "%s", ppWord[2]);
+    } else if (strcmp(pKey, "characteristics") == 0) {
+        gConfig.numCharacteristics = 0;
+        for (char *pUuid = strtok_r(ppWord[2], ",", &pSave);
+             (pUuid != NULL) && (gConfig.numCharacteristics < MAX_NUM_CHARACTERISTICS);
+             pUuid = strtok_r(NULL, ",", &pSave)) {
+            gConfig.characteristicUuid[gConfig.numCharacteristics] = (int) strtol(pUuid, NULL, 16);
+            gConfig.numCharacteristics++;
+        }
+        success = (gConfig.numCharacteristics > 0);
+    } else if (strcmp(pKey, "service") == 0) {
+        gConfig.serviceUuid = (int) strtol(ppWord[2], NULL, 16);
+    } else if (strcmp(pKey, "observer") == 0) {
+        gConfig.observerUuid = (int) strtol(ppWord[2], NULL, 16);
+    } else if (strcmp(pKey, "wanted") == 0) {
+        gConfig.maxNumWantedDevices = value;
+    } else if (strcmp(pKey, "items") == 0) {
+        gConfig.maxNumDataItemsPerDevice = value;
+    } else if (strcmp(pKey, "adaptivescan") == 0) {
+        gConfig.adaptiveScanOn = (strcmp(ppWord[2], "on") == 0);
+    } else if ((strcmp(pKey, "earlystop") == 0) && (numWords == 4)) {
+        gConfig.earlyStopNumReadings = value;
+        gConfig.earlyStopQuietPeriodMs = atoi(ppWord[3]);
+    } else if (strcmp(pKey, "budget") == 0) {
+        gConfig.memoryBudget = value;
+    } else if ((strcmp(pKey, "deadband") == 0) && (numWords == 4)) {
+        gConfig.deadband = value;
+        gConfig.maxSilentSeconds = atoi(ppWord[3]);
+    } else if (strcmp(pKey, "held") == 0) {
+        gConfig.maxNumHeldConnections = value;
+    } else if (strcmp(pKey, "connections") == 0) {
+        gConfig.maxNumConnections = value;
+    } else if (strcmp(pKey, "stackconnections") == 0) {
+        simSetMaxNumConnections(value);
+    } else if (strcmp(pKey, "readperiod") == 0) {
+        gConfig.readPeriodMs = value;
+    } else if (strcmp(pKey, "window") == 0) {
+        gConfig.windowMs = value;
+    } else if (strcmp(pKey, "sleep") == 0) {
+        gConfig.sleepMs = value;
+    } else if (strcmp(pKey, "cycles") == 0) {
+        gConfig.numCycles = value;
+    } else {
+        success = false;
+    }
+
+    return success;
+}
+
+// Handle an "expect" line.
+static bool parseExpect(char **ppWord, int numWords, int lineNumber)
+{
+    Expectation *pExpectation;
+    bool success = (numWords == 4) && (gNumExpectations < MAX_NUM_EXPECTATIONS) &&
+                   ((strcmp(ppWord[2], ">=") == 0) || (strcmp(ppWord[2], "<=") == 0) ||
+                    (strcmp(ppWord[2], "==") == 0) || (strcmp(ppWord[2], ">") == 0) ||
+                    (strcmp(ppWord[2], "<") == 0));
+
+    if (success) {
+        pExpectation = &(gExpectation[gNumExpectations]);
+        gNumExpectations++;
+        snprintf(pExpectation->quantity, sizeof(pExpectation->quantity), "%s", ppWord[1]);
+        snprintf(pExpectation->op, sizeof(pExpectation->op), "%s", ppWord[2]);
+        pExpectation->value = atoll(ppWord[3]);
+        pExpectation->lineNumber = lineNumber;
+    }
+
+    return success;
+}
+
+// Read a trace file.
+static bool readTraceFile(const char *pFileName)
+{
+    char line[MAX_LINE_LENGTH];
+    char *pWord[MAX_NUM_WORDS];
+    int numWords;
+    int lineNumber = 0;
+    bool success = true;
+    FILE *pFile = fopen(pFileName, "r");
+
+    if (pFile == NULL) {
+        fprintf(stderr, "Unable to open trace file \"%s\".\n", pFileName);
+        success = false;
+    }
+    while (success && (fgets(line, sizeof(line), pFile) != NULL)) {
+        lineNumber++;
+        numWords = splitLine(line, pWord, MAX_NUM_WORDS);
+        if (numWords == 0) {
+            // Blank line or comment
+        } else if (strcmp(pWord[0], "device") == 0) {
+            success = parseDevice(pWord, numWords);
+        } else if (strcmp(pWord[0], "service") == 0) {
+            success = parseService(pWord, numWords);
+        } else if (strcmp(pWord[0], "at") == 0) {
+            success = parseAt(pWord, numWords);
+        } else if (strcmp(pWord[0], "config") == 0) {
+            success = parseConfig(pWord, numWords);
+        } else if (strcmp(pWord[0], "expect") == 0) {
+            success = parseExpect(pWord, numWords, lineNumber);
+        } else {
+            success = false;
+        }
+        if (!success) {
+            fprintf(stderr, "%s:%d: not understood.\n", pFileName, lineNumber);
+        }
+    }
+    if (pFile != NULL) {
+        fclose(pFile);
+    }
+
+    return success;
+}
+
+/**************************************************************************
+ * STATIC FUNCTIONS: RUNNING BLE
+ *************************************************************************/
+
+// Take a data item, printing it if verbose, called by
+// bleForEachDataItem().
+static bool takeDataItem(const char *pDeviceName, int timestamp, int characteristicUuid,
+                          const char *pData, int dataLen, int numRepeats, void *pContext)
+{
+    char buf[SIM_MAX_VALUE_LENGTH * 2 + 1];
+
+    (void) pDeviceName;
+    (void) pContext;
+    if (gVerbose) {
+        printf(" %d:%04x:0x%.*s", timestamp - SIM_START_UNIX_TIME, characteristicUuid,
+               bytesToHexString(pData, dataLen, buf, sizeof(buf)), buf);
+        if (numRepeats > 0) {
+            printf("(x%d)", numRepeats);
+        }
+    }
+
+    return true;
+}
+
+// Consume the data items of every device, as main.cpp does.
+static void consumeDataItems()
+{
+    int numItems;
+
+    for (const char *pDeviceName = pBleGetFirstDeviceName(); pDeviceName != NULL;
+         pDeviceName = pBleGetNextDeviceName()) {
+        if (gVerbose && (bleGetNumDataItems(pDeviceName) > 0)) {
+            printf("  %s:", pDeviceName);
+        }
+        numItems = bleForEachDataItem(pDeviceName, takeDataItem, NULL, true);
+        if (gVerbose && (numItems > 0)) {
+            printf("\n");
+        }
+        gTotals.numItems += numItems;
+    }
+}
+
+// Called when BLE has stopped: gather the results, shut BLE
+// down and save the discovery cache, as main.cpp does.
+static void bleDoneCallback(void *pContext)
+{
+    BleStats stats;
+    BleDeviceStats deviceStats;
+    int numWanted = 0;
+
+    (void) pContext;
+    gEventQueue.cancel(gConsumeEventId);
+    consumeDataItems();
+    bleGetStats(&stats);
+    gTotals.numDropped += stats.numReadingsDropped;
+    gTotals.numTooLong += stats.numReadingsTooLong;
+    for (const char *pDeviceName = pBleGetFirstDeviceName(); pDeviceName != NULL;
+         pDeviceName = pBleGetNextDeviceName()) {
+        numWanted++;
+        if (bleGetDeviceStats(pDeviceName, &deviceStats)) {
+            gTotals.numReadings += deviceStats.numReadings;
+            gTotals.numConnects += deviceStats.numConnects;
+            gTotals.numDiscoveries += deviceStats.numDiscoveries;
+            gTotals.numBytesStored += deviceStats.numBytesStored;
+            gDeviceReadings[pDeviceName] += deviceStats.numReadings;
+        }
+    }
+    if (numWanted > gTotals.numWanted) {
+        gTotals.numWanted = numWanted;
+    }
+    gTotals.runMs += bleGetRunDurationMs();
+    bleDeinit();
+    bleSaveDiscoveryCache();
+    gBleRunning = false;
+    gEventQueue.break_dispatch();
+}
+
+// Run one wake-up cycle.
+static bool runCycle(int cycle)
+{
+    Totals before = gTotals;
+    SimStats simStats;
+    bool success;
+
+    bleInit(gConfig.prefix, gConfig.characteristicUuid[0], gConfig.maxNumWantedDevices,
+            gConfig.maxNumDataItemsPerDevice, &gEventQueue, gDebugOn);
+    if (gConfig.observerUuid != 0) {
+        bleSetObserverUuid(gConfig.observerUuid);
+    }
+    bleSetWantedCharacteristicUuids(gConfig.characteristicUuid, gConfig.numCharacteristics);
+    if (gConfig.serviceUuid != 0) {
+        bleSetWantedServiceUuid(gConfig.serviceUuid);
+    }
+    bleSetAdaptiveScan(gConfig.adaptiveScanOn);
+    bleSetEarlyStop(gConfig.earlyStopNumReadings, gConfig.earlyStopQuietPeriodMs);
+    if (gConfig.memoryBudget > 0) {
+        bleSetMemoryBudget(gConfig.memoryBudget);
+    }
+    if (gConfig.deadband >= 0) {
+        bleSetDeadband(NULL, gConfig.deadband, gConfig.maxSilentSeconds);
+    }
+    if (gConfig.maxNumHeldConnections > 0) {
+        bleSetMaxNumHeldConnections(gConfig.maxNumHeldConnections);
+    }
+    if (gConfig.maxNumConnections > 0) {
+        bleSetMaxNumConnections(gConfig.maxNumConnections);
+    }
+    if (gConfig.readPeriodMs > 0) {
+        bleSetReadPeriod(NULL, gConfig.readPeriodMs);
+    }
+    simResetStats();
+    gConsumeEventId = gEventQueue.call_every(1000, consumeDataItems);
+    gBleRunning = bleStart(gConfig.windowMs, bleDoneCallback, NULL);
+    success = gBleRunning;
+    if (success) {
+        // Give it twice as long as it should need
+        gEventQueue.dispatch(gConfig.windowMs * 2 + 1000);
+        success = !gBleRunning;
+        if (!success) {
+            printf("cycle %d: BLE did not stop.\n", cycle);
+            bleStop();
+        }
+    } else {
+        printf("cycle %d: unable to start BLE.\n", cycle);
+        gEventQueue.cancel(gConsumeEventId);
+        bleDeinit();
+    }
+    simGetStats(&simStats);
+    gTotals.numAdvertisementsSent += simStats.numAdvertisementsSent;
+    gTotals.numAdvertisementsDelivered += simStats.numAdvertisementsDelivered;
+    gTotals.advertisementCallbackNs += simStats.advertisementCallbackNs;
+    gTotals.numNotifications += simStats.numNotifications;
+    gTotals.scanRadioOnUs += simStats.scanRadioOnUs;
+    printf("cycle %d: ran %d ms, %d/%d advertisement(s) heard (%lld ns each), %d wanted device(s),"
+           " %d reading(s), %d data item(s), %d connection(s) (%d attempted, %d timed out, %d dropped),"
+           " %d discover(ies), %d/%d read error(s), scan radio on %lld ms.\n",
+           cycle, gTotals.runMs - before.runMs, simStats.numAdvertisementsDelivered, simStats.numAdvertisementsSent,
+           (long long) ((simStats.numAdvertisementsDelivered > 0) ?
+                        simStats.advertisementCallbackNs / simStats.numAdvertisementsDelivered : 0),
+           gTotals.numWanted, gTotals.numReadings - before.numReadings, gTotals.numItems - before.numItems,
+           simStats.numConnects, simStats.numConnectAttempts, simStats.numConnectTimeouts, simStats.numDrops,
+           simStats.numDiscoveries, simStats.numReadErrors, simStats.numReads,
+           (long long) (simStats.scanRadioOnUs / 1000));
+
+    return success;
+}
+
+// Get the value of a quantity for an expectation.
+static bool getQuantity(const char *pQuantity, long long *pValue)
+{
+    bool success = true;
+
+    if (strcmp(pQuantity, "wanted") == 0) {
+        *pValue = gTotals.numWanted;
+    } else if (strcmp(pQuantity, "readings") == 0) {
+        *pValue = gTotals.numReadings;
+    } else if (strcmp(pQuantity, "items") == 0) {
+        *pValue = gTotals.numItems;
+    } else if (strcmp(pQuantity, "bytes") == 0) {
+        *pValue = gTotals.numBytesStored;
+    } else if (strcmp(pQuantity, "dropped") == 0) {
+        *pValue = gTotals.numDropped;
+    } else if (strcmp(pQuantity, "toolong") == 0) {
+        *pValue = gTotals.numTooLong;
+    } else if (strcmp(pQuantity, "connects") == 0) {
+        *pValue = gTotals.numConnects;
+    } else if (strcmp(pQuantity, "discoveries") == 0) {
+        *pValue = gTotals.numDiscoveries;
+    } else if (strcmp(pQuantity, "notifications") == 0) {
+        *pValue = gTotals.numNotifications;
+    } else if (strcmp(pQuantity, "heard") == 0) {
+        *pValue = gTotals.numAdvertisementsDelivered;
+    } else if (strncmp(pQuantity, "readings:", 9) == 0) {
+        *pValue = gDeviceReadings[pQuantity + 9];
+    } else {
+        success = false;
+    }
+
+    return success;
+}
+
+// Check the expectations, returning the number not met.
+static int checkExpectations(const char *pFileName)
+{
+    Expectation *pExpectation;
+    long long value = 0;
+    bool met;
+    int numFailed = 0;
+
+    for (int x = 0; x < gNumExpectations; x++) {
+        pExpectation = &(gExpectation[x]);
+        met = getQuantity(pExpectation->quantity, &value);
+        if (met) {
+            if (strcmp(pExpectation->op, ">=") == 0) {
+                met = (value >= pExpectation->value);
+            } else if (strcmp(pExpectation->op, "<=") == 0) {
+                met = (value <= pExpectation->value);
+            } else if (strcmp(pExpectation->op, "==") == 0) {
+                met = (value == pExpectation->value);
+            } else if (strcmp(pExpectation->op, ">") == 0) {
+                met = (value > pExpectation->value);
+            } else {
+                met = (value < pExpectation->value);
+            }
+        }
+        if (!met) {
+            printf("%s:%d: FAILED: expected %s %s %lld, got %lld.\n", pFileName, pExpectation->lineNumber,
+                   pExpectation->quantity, pExpectation->op, pExpectation->value, value);
+            numFailed++;
+        }
+    }
+
+    return numFailed;
+}
+
+// Print how to use this.
+static void printUsage(const char *pProgramName)
+{
+    printf("Usage: %s [-c cycles] [-w window ms] [-s sleep ms] [-r seed] [-d] [-v] <trace file>\n"
+           "  -c  the number of wake-up cycles, overriding \"config cycles\".\n"
+           "  -w  the BLE window in each cycle, overriding \"config window\".\n"
+           "  -s  the time asleep between cycles, overriding \"config sleep\".\n"
+           "  -r  the random seed.\n"
+           "  -d  switch on BLE debug prints.\n"
+           "  -v  print the data items.\n", pProgramName);
+}
+
+/**************************************************************************
+ * PUBLIC FUNCTIONS
+ *************************************************************************/
+
+int main(int argc, char *argv[])
+{
+    int numCycles = -1;
+    int windowMs = -1;
+    int sleepMs = -1;
+    int option;
+    int numFailed = 0;
+    int exitCode = 0;
+
+    while ((option = getopt(argc, argv, "c:w:s:r:dv")) != -1) {
+        switch (option) {
+            case 'c':
+                numCycles = atoi(optarg);
+            break;
+            case 'w':
+                windowMs = atoi(optarg);
+            break;
+            case 's':
+                sleepMs = atoi(optarg);
+            break;
+            case 'r':
+                simSeedRandom(strtoul(optarg, NULL, 0));
+            break;
+            case 'd':
+                gDebugOn = true;
+            break;
+            case 'v':
+                gVerbose = true;
+            break;
+            default:
+                exitCode = 2;
+            break;
+        }
+    }
+    if ((exitCode != 0) || (optind != argc - 1)) {
+        printUsage(argv[0]);
+        exitCode = 2;
+    } else if (!readTraceFile(argv[optind])) {
+        exitCode = 2;
+    } else {
+        if (numCycles >= 0) {
+            gConfig.numCycles = numCycles;
+        }
+        if (windowMs >= 0) {
+            gConfig.windowMs = windowMs;
+        }
+        if (sleepMs >= 0) {
+            gConfig.sleepMs = sleepMs;
+        }
+        printf("%s: %d peripheral(s), %d cycle(s) of %d ms every %d ms.\n", argv[optind],
+               simGetNumPeripherals(), gConfig.numCycles, gConfig.windowMs, gConfig.windowMs + gConfig.sleepMs);
+        simStart();
+        for (int cycle = 1; (cycle <= gConfig.numCycles) && (exitCode == 0); cycle++) {
+            if (!runCycle(cycle)) {
+                exitCode = 1;
+            }
+            // Asleep: the world goes on without us
+            gEventQueue.dispatch(gConfig.sleepMs);
+        }
+        printf("total: %d ms of BLE, %d/%d advertisement(s) heard (%lld ns each), %d reading(s)"
+               " (%d per minute), %d data item(s) in %d byte(s), %d reading(s) dropped, %d too long, scan radio on %lld ms.\n",
+               gTotals.runMs, gTotals.numAdvertisementsDelivered, gTotals.numAdvertisementsSent,
+               (long long) ((gTotals.numAdvertisementsDelivered > 0) ?
+                            gTotals.advertisementCallbackNs / gTotals.numAdvertisementsDelivered : 0),
+               gTotals.numReadings, (gTotals.runMs > 0) ? (int) ((int64_t) gTotals.numReadings * 60000 / gTotals.runMs) : 0,
+               gTotals.numItems, gTotals.numBytesStored, gTotals.numDropped, gTotals.numTooLong,
+               (long long) (gTotals.scanRadioOnUs / 1000));
+        numFailed = checkExpectations(argv[optind]);
+        if (numFailed > 0) {
+            exitCode = 1;
+        } else if (gNumExpectations > 0) {
+            printf("%d expectation(s) met.\n", gNumExpectations);
+        }
+    }
+
+    return exitCode;
+}
+
+// End Of File
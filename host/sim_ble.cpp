@@ -0,0 +1,1384 @@
+/* mbed Microcontroller Library
+ * Copyright (c) 2006-2018 u-blox Limited
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* A simulated BLE stack, behind the host stand-in for the mbed
+ * BLE API, and the peripherals around it.
+ *
+ * Things happen in the simulated world at their simulated time,
+ * scheduled with simSchedule(); what the application gets to hear
+ * about is then queued as a stack event and, as with the real
+ * stack, BLE asks for processEvents() to be called, which
+ * ble_data_gather does from its event queue, and the callbacks
+ * run from there.  The stack is modelled on the Nordic one in
+ * NINA-B1: one connection attempt at a time, which stops the
+ * scanner, a limited number of central connections, one GATT
+ * request per connection and one service discovery at a time,
+ * each GATT exchange taking a connection interval.
+ */
+
+#include <deque>
+#include <vector>
+#include "sim_ble.h"
+
+/**************************************************************************
+ * MACROS
+ *************************************************************************/
+
+/** The most connections the simulated stack could support.
+ */
+#define SIM_MAX_NUM_CONNECTIONS 8
+
+/** The handles of the GAP service, which every simulated
+ * peripheral has first.
+ */
+#define SIM_GAP_START_HANDLE 1
+#define SIM_GAP_DEVICE_NAME_HANDLE 3
+#define SIM_GAP_APPEARANCE_HANDLE 5
+#define SIM_GAP_END_HANDLE 5
+
+/** The longest time after being connected at which a peripheral
+ * with dropPercent set may drop the connection.
+ */
+#define SIM_MAX_DROP_DELAY_US 500000
+
+/** The random delay added to each advertising interval, as
+ * required by the Bluetooth specification.
+ */
+#define SIM_MAX_ADVERTISING_DELAY_US 10000
+
+/**************************************************************************
+ * TYPES
+ *************************************************************************/
+
+/** The service discovery in progress, if any.
+ */
+typedef struct {
+    bool isActive;
+    unsigned serial; /// Incremented for each discovery.
+    SimPeripheral *pPeripheral;
+    Gap::Handle_t connectionHandle;
+    int64_t intervalUs;
+    std::vector<std::function<void()> > steps;
+    size_t nextStep;
+    int eventId;
+} SimDiscovery;
+
+/**************************************************************************
+ * LOCAL VARIABLES
+ *************************************************************************/
+
+/** The peripherals.
+ */
+static SimPeripheral gPeripheral[SIM_MAX_NUM_PERIPHERALS];
+static int gNumPeripherals = 0;
+
+/** The only instance of BLE.
+ */
+static BLE gBle;
+
+/** Whether BLE is initialised and the number of times it has been
+ * shut down, so that what was scheduled before a shutdown can be
+ * recognised and ignored.
+ */
+static bool gInitialised = false;
+static unsigned gEpoch = 0;
+
+/** Owner of the events that the simulated world schedules.
+ */
+static const char gWorldOwner = 0;
+
+/** Stack events waiting for BLE::processEvents().
+ */
+static std::deque<std::function<void()> > gStackEvents;
+
+/** The scanner.
+ */
+static bool gScanning = false;
+static int64_t gScanStartUs = 0;
+static int gScanIntervalMs = 100;
+static int gScanWindowMs = 100;
+static int gActiveScanIntervalMs = 100;
+static int gActiveScanWindowMs = 100;
+static Gap::AdvertisementCallback_t gpScanCallback = NULL;
+
+/** The connection attempt in progress, if any.
+ */
+static bool gConnecting = false;
+static SimPeripheral *gpConnectingPeripheral = NULL;
+static int gConnectEventId = 0;
+static int64_t gConnectDeadlineUs = -1;
+
+/** The connections, by handle, and their connection intervals
+ * and supervision timeouts.
+ */
+static SimPeripheral *gpConnection[SIM_MAX_NUM_CONNECTIONS];
+static int64_t gConnectionIntervalUs[SIM_MAX_NUM_CONNECTIONS];
+static int64_t gSupervisionTimeoutUs[SIM_MAX_NUM_CONNECTIONS];
+static unsigned gConnectionSerial[SIM_MAX_NUM_CONNECTIONS];
+static unsigned gNextConnectionSerial = 1;
+static int gMaxNumConnections = 4;
+
+/** The service discovery, if any.
+ */
+static SimDiscovery gDiscovery;
+
+/** Counters.
+ */
+static SimStats gStats;
+
+/** The state of simRandom().
+ */
+static unsigned gRandom = 1;
+
+/** Whether simStart() has been called.
+ */
+static bool gStarted = false;
+
+/**************************************************************************
+ * STATIC FUNCTIONS: STACK EVENTS
+ *************************************************************************/
+
+// Queue an event for BLE::processEvents() and ask for that
+// to be called.
+static void deliverStackEvent(std::function<void()> event)
+{
+    BLE::OnEventsToProcessCallbackContext context = {gBle};
+
+    gStackEvents.push_back(event);
+    gStats.numEventsToProcess++;
+    if (gBle._eventsToProcessCallback != NULL) {
+        gBle._eventsToProcessCallback(&context);
+    }
+}
+
+// Schedule something for the stack to do after a delay, which is
+// forgotten if BLE is shut down before then.
+static int scheduleStackAction(int64_t delayUs, std::function<void()> action)
+{
+    unsigned epoch = gEpoch;
+
+    return simSchedule(simNowUs() + delayUs, 0, [epoch, action]() {
+        if (gInitialised && (epoch == gEpoch)) {
+            action();
+        }
+    }, &gWorldOwner);
+}
+
+// Check that a connection is still the one it was.
+static bool isConnection(Gap::Handle_t connectionHandle, unsigned serial)
+{
+    return (connectionHandle < SIM_MAX_NUM_CONNECTIONS) && (gpConnection[connectionHandle] != NULL) &&
+           (gConnectionSerial[connectionHandle] == serial);
+}
+
+// Get the peripheral on a connection that can take a request.
+static SimPeripheral *pConnectedPeripheral(Gap::Handle_t connectionHandle)
+{
+    SimPeripheral *pPeripheral = NULL;
+
+    if (gInitialised && (connectionHandle < SIM_MAX_NUM_CONNECTIONS) &&
+        (gpConnection[connectionHandle] != NULL) && !gpConnection[connectionHandle]->isDisconnecting) {
+        pPeripheral = gpConnection[connectionHandle];
+    }
+
+    return pPeripheral;
+}
+
+/**************************************************************************
+ * STATIC FUNCTIONS: SCANNING
+ *************************************************************************/
+
+// The time for which a scanner that started at zero has listened
+// by a given time.
+static int64_t scanOnUs(int64_t atUs)
+{
+    int64_t intervalUs = (int64_t) gActiveScanIntervalMs * 1000;
+    int64_t windowUs = (int64_t) gActiveScanWindowMs * 1000;
+    int64_t phaseUs = atUs % intervalUs;
+
+    return (atUs / intervalUs) * windowUs + ((phaseUs < windowUs) ? phaseUs : windowUs);
+}
+
+// Stop the scanner, accounting for the time it was listening.
+static void stopScanner()
+{
+    if (gScanning) {
+        gStats.scanRadioOnUs += scanOnUs(simNowUs() - gScanStartUs);
+        gScanning = false;
+    }
+}
+
+// Check if the scanner is listening right now.
+static bool scannerIsListening()
+{
+    return gInitialised && gScanning &&
+           ((simNowUs() - gScanStartUs) % ((int64_t) gActiveScanIntervalMs * 1000) <
+            (int64_t) gActiveScanWindowMs * 1000);
+}
+
+// Pass an advertisement to the scan callback, if the scanner
+// is listening.
+static bool deliverAdvertisement(const uint8_t *pAddress, BLEProtocol::AddressType_t addressType,
+                                 int rssi, bool isConnectable, const uint8_t *pData, int dataLen)
+{
+    bool delivered = false;
+    std::vector<uint8_t> address(pAddress, pAddress + BLEProtocol::ADDR_LEN);
+    std::vector<uint8_t> data(pData, pData + dataLen);
+
+    if (scannerIsListening()) {
+        gStats.numAdvertisementsDelivered++;
+        deliverStackEvent([address, addressType, rssi, isConnectable, data]() {
+            Gap::AdvertisementCallbackParams_t params;
+            struct timespec start;
+            struct timespec end;
+
+            if (gScanning && (gpScanCallback != NULL)) {
+                memcpy(params.peerAddr, address.data(), sizeof(params.peerAddr));
+                params.rssi = (int8_t) rssi;
+                params.isScanResponse = false;
+                params.type = isConnectable ? GapAdvertisingParams::ADV_CONNECTABLE_UNDIRECTED :
+                                              GapAdvertisingParams::ADV_NON_CONNECTABLE_UNDIRECTED;
+                params.advertisingDataLen = (uint8_t) data.size();
+                params.advertisingData = data.data();
+                params.addressType = addressType;
+                clock_gettime(CLOCK_MONOTONIC, &start);
+                gpScanCallback(&params);
+                clock_gettime(CLOCK_MONOTONIC, &end);
+                gStats.advertisementCallbackNs += (int64_t) (end.tv_sec - start.tv_sec) * 1000000000 +
+                                                  end.tv_nsec - start.tv_nsec;
+            }
+        });
+        delivered = true;
+    }
+
+    return delivered;
+}
+
+/**************************************************************************
+ * STATIC FUNCTIONS: PERIPHERALS
+ *************************************************************************/
+
+// Give the attributes of a peripheral their handles.
+static void assignHandles(SimPeripheral *pPeripheral)
+{
+    GattAttribute::Handle_t handle = pPeripheral->handleBase;
+    SimService *pService;
+    SimCharacteristic *pCharacteristic;
+
+    for (int x = 0; x < pPeripheral->numServices; x++) {
+        pService = &(pPeripheral->service[x]);
+        pService->startHandle = handle;
+        for (int y = 0; y < pService->numCharacteristics; y++) {
+            pCharacteristic = &(pService->characteristic[y]);
+            // Declaration, then value, then User Description if
+            // it has one, then CCCD if it can notify
+            pCharacteristic->valueHandle = handle + 2;
+            handle = pCharacteristic->valueHandle;
+            if (pCharacteristic->hasDescription) {
+                handle++;
+            }
+            pCharacteristic->cccdHandle = 0;
+            if (pCharacteristic->canNotify) {
+                handle++;
+                pCharacteristic->cccdHandle = handle;
+            }
+            pCharacteristic->lastHandle = handle;
+        }
+        pService->endHandle = handle;
+        handle++;
+    }
+}
+
+// Find the characteristic with a given value handle.
+static SimCharacteristic *pFindCharacteristic(SimPeripheral *pPeripheral, GattAttribute::Handle_t valueHandle)
+{
+    SimCharacteristic *pFound = NULL;
+
+    for (int x = 0; (x < pPeripheral->numServices) && (pFound == NULL); x++) {
+        for (int y = 0; (y < pPeripheral->service[x].numCharacteristics) && (pFound == NULL); y++) {
+            if (pPeripheral->service[x].characteristic[y].valueHandle == valueHandle) {
+                pFound = &(pPeripheral->service[x].characteristic[y]);
+            }
+        }
+    }
+
+    return pFound;
+}
+
+// Find the characteristic with a given CCCD handle.
+static SimCharacteristic *pFindCharacteristicByCccd(SimPeripheral *pPeripheral, GattAttribute::Handle_t cccdHandle)
+{
+    SimCharacteristic *pFound = NULL;
+
+    for (int x = 0; (x < pPeripheral->numServices) && (pFound == NULL); x++) {
+        for (int y = 0; (y < pPeripheral->service[x].numCharacteristics) && (pFound == NULL); y++) {
+            if ((cccdHandle != 0) && (pPeripheral->service[x].characteristic[y].cccdHandle == cccdHandle)) {
+                pFound = &(pPeripheral->service[x].characteristic[y]);
+            }
+        }
+    }
+
+    return pFound;
+}
+
+// Build the advertising data of a peripheral.
+static int buildAdvertisingData(const SimPeripheral *pPeripheral, uint8_t *pBuf)
+{
+    int len = 0;
+    int nameLen;
+
+    pBuf[len++] = 2;
+    pBuf[len++] = GapAdvertisingData::FLAGS;
+    pBuf[len++] = GapAdvertisingData::LE_GENERAL_DISCOVERABLE | GapAdvertisingData::BREDR_NOT_SUPPORTED;
+    if (pPeripheral->nameIsAdvertised) {
+        nameLen = strlen(pPeripheral->name);
+        if (nameLen > SIM_MAX_ADVERTISING_DATA_LENGTH - len - 2 - pPeripheral->advertisingDataLen) {
+            nameLen = SIM_MAX_ADVERTISING_DATA_LENGTH - len - 2 - pPeripheral->advertisingDataLen;
+        }
+        if (nameLen > 0) {
+            pBuf[len++] = nameLen + 1;
+            pBuf[len++] = (nameLen == (int) strlen(pPeripheral->name)) ? GapAdvertisingData::COMPLETE_LOCAL_NAME :
+                                                                         GapAdvertisingData::SHORTENED_LOCAL_NAME;
+            memcpy(pBuf + len, pPeripheral->name, nameLen);
+            len += nameLen;
+        }
+    }
+    memcpy(pBuf + len, pPeripheral->advertisingData, pPeripheral->advertisingDataLen);
+    len += pPeripheral->advertisingDataLen;
+
+    return len;
+}
+
+// Send an advertisement from a peripheral and schedule the next.
+static void advertise(SimPeripheral *pPeripheral)
+{
+    uint8_t data[SIM_MAX_ADVERTISING_DATA_LENGTH];
+    int64_t delayUs;
+
+    if (pPeripheral->isPresent && (pPeripheral->connectionHandle < 0)) {
+        gStats.numAdvertisementsSent++;
+        if (simRandom(100) >= pPeripheral->lossPercent) {
+            deliverAdvertisement(pPeripheral->address, pPeripheral->addressType,
+                                 pPeripheral->rssi - simRandom(5), pPeripheral->isConnectable,
+                                 data, buildAdvertisingData(pPeripheral, data));
+        }
+    }
+    delayUs = (int64_t) pPeripheral->advertisingIntervalMs * 1000 + simRandom(SIM_MAX_ADVERTISING_DELAY_US);
+    pPeripheral->nextAdvertisementUs = simNowUs() + delayUs;
+    simSchedule(pPeripheral->nextAdvertisementUs, 0, [pPeripheral]() {advertise(pPeripheral);}, &gWorldOwner);
+}
+
+// Make every value of a peripheral go up by one and schedule
+// the next change.
+static void changeValues(SimPeripheral *pPeripheral)
+{
+    SimCharacteristic *pCharacteristic;
+    uint8_t value[SIM_MAX_VALUE_LENGTH];
+    int number;
+
+    for (int x = 0; x < pPeripheral->numServices; x++) {
+        for (int y = 0; y < pPeripheral->service[x].numCharacteristics; y++) {
+            pCharacteristic = &(pPeripheral->service[x].characteristic[y]);
+            if (pCharacteristic->valueLen >= 2) {
+                memcpy(value, pCharacteristic->value, pCharacteristic->valueLen);
+                number = (int16_t) (value[0] | (value[1] << 8)) + 1;
+                value[0] = (uint8_t) number;
+                value[1] = (uint8_t) (number >> 8);
+                simSetValue(pPeripheral, pCharacteristic->uuid, value, pCharacteristic->valueLen);
+            }
+        }
+    }
+}
+
+/**************************************************************************
+ * STATIC FUNCTIONS: CONNECTIONS
+ *************************************************************************/
+
+// End a connection attempt by timing out.
+static void timeOutConnect()
+{
+    Gap::TimeoutSource_t source = Gap::TIMEOUT_SRC_CONN;
+
+    gConnecting = false;
+    gConnectEventId = 0;
+    if (gpConnectingPeripheral != NULL) {
+        gpConnectingPeripheral->isConnecting = false;
+        gpConnectingPeripheral = NULL;
+    }
+    gStats.numConnectTimeouts++;
+    deliverStackEvent([source]() {
+        std::vector<Gap::TimeoutCallback_t> callbacks = gBle._gap._timeoutCallbacks;
+        for (size_t x = 0; x < callbacks.size(); x++) {
+            callbacks[x](source);
+        }
+    });
+}
+
+// Drop a connection, telling the application.
+static void dropConnection(Gap::Handle_t connectionHandle, Gap::DisconnectionReason_t reason)
+{
+    SimPeripheral *pPeripheral = gpConnection[connectionHandle];
+    GattClient::TerminationCallback_t terminationCallback;
+
+    if (gDiscovery.isActive && (gDiscovery.connectionHandle == connectionHandle)) {
+        gDiscovery.isActive = false;
+        simCancel(gDiscovery.eventId);
+        terminationCallback = gBle._gattClient._terminationCallback;
+        deliverStackEvent([terminationCallback, connectionHandle]() {
+            if (terminationCallback != NULL) {
+                terminationCallback(connectionHandle);
+            }
+        });
+    }
+    pPeripheral->connectionHandle = -1;
+    pPeripheral->isDisconnecting = false;
+    pPeripheral->attBusy = false;
+    for (int x = 0; x < pPeripheral->numServices; x++) {
+        for (int y = 0; y < pPeripheral->service[x].numCharacteristics; y++) {
+            pPeripheral->service[x].characteristic[y].notificationsOn = false;
+        }
+    }
+    gpConnection[connectionHandle] = NULL;
+    deliverStackEvent([connectionHandle, reason]() {
+        Gap::DisconnectionCallbackParams_t params = {connectionHandle, reason};
+        std::vector<Gap::DisconnectionCallback_t> callbacks = gBle._gap._disconnectionCallbacks;
+        for (size_t x = 0; x < callbacks.size(); x++) {
+            callbacks[x](&params);
+        }
+    });
+}
+
+// Drop a connection if the peripheral is still out of range
+// when the supervision timeout expires.
+static void scheduleSupervisionTimeout(SimPeripheral *pPeripheral)
+{
+    Gap::Handle_t connectionHandle = pPeripheral->connectionHandle;
+    unsigned serial = gConnectionSerial[connectionHandle];
+
+    scheduleStackAction(gSupervisionTimeoutUs[connectionHandle], [pPeripheral, connectionHandle, serial]() {
+        if (isConnection(connectionHandle, serial) && !pPeripheral->isPresent) {
+            gStats.numDrops++;
+            dropConnection(connectionHandle, Gap::CONNECTION_TIMEOUT);
+        }
+    });
+}
+
+// Complete a connection attempt.
+static void completeConnect(SimPeripheral *pPeripheral, int64_t intervalUs, int64_t supervisionTimeoutUs)
+{
+    Gap::Handle_t connectionHandle = SIM_MAX_NUM_CONNECTIONS;
+    unsigned serial;
+
+    gConnectEventId = 0;
+    for (int x = 0; (x < gMaxNumConnections) && (connectionHandle == SIM_MAX_NUM_CONNECTIONS); x++) {
+        if (gpConnection[x] == NULL) {
+            connectionHandle = x;
+        }
+    }
+    if (!pPeripheral->isPresent || (connectionHandle == SIM_MAX_NUM_CONNECTIONS)) {
+        // It has gone away in the meantime: no connection
+        if (gConnectDeadlineUs >= 0) {
+            gConnectEventId = scheduleStackAction(gConnectDeadlineUs - simNowUs(), timeOutConnect);
+        }
+    } else {
+        gConnecting = false;
+        gpConnectingPeripheral = NULL;
+        pPeripheral->isConnecting = false;
+        pPeripheral->connectionHandle = connectionHandle;
+        pPeripheral->connectedUs = simNowUs();
+        gpConnection[connectionHandle] = pPeripheral;
+        gConnectionIntervalUs[connectionHandle] = intervalUs;
+        gSupervisionTimeoutUs[connectionHandle] = supervisionTimeoutUs;
+        serial = gNextConnectionSerial++;
+        gConnectionSerial[connectionHandle] = serial;
+        gStats.numConnects++;
+        if (simRandom(100) < pPeripheral->dropPercent) {
+            scheduleStackAction(simRandom(SIM_MAX_DROP_DELAY_US), [connectionHandle, serial]() {
+                if (isConnection(connectionHandle, serial)) {
+                    gStats.numDrops++;
+                    dropConnection(connectionHandle, Gap::REMOTE_USER_TERMINATED_CONNECTION);
+                }
+            });
+        }
+        deliverStackEvent([pPeripheral, connectionHandle]() {
+            Gap::ConnectionCallbackParams_t params;
+            std::vector<Gap::ConnectionCallback_t> callbacks = gBle._gap._connectionCallbacks;
+            params.handle = connectionHandle;
+            params.role = Gap::CENTRAL;
+            params.peerAddrType = pPeripheral->addressType;
+            memcpy(params.peerAddr, pPeripheral->address, sizeof(params.peerAddr));
+            params.ownAddrType = BLEProtocol::AddressType::PUBLIC;
+            gBle._gap.getAddress(&params.ownAddrType, params.ownAddr);
+            params.connectionParams = NULL;
+            for (size_t x = 0; x < callbacks.size(); x++) {
+                callbacks[x](&params);
+            }
+        });
+    }
+}
+
+/**************************************************************************
+ * STATIC FUNCTIONS: GATT
+ *************************************************************************/
+
+// Run the next step of service discovery.
+static void runDiscoveryStep(unsigned serial)
+{
+    Gap::Handle_t connectionHandle = gDiscovery.connectionHandle;
+    GattClient::TerminationCallback_t terminationCallback;
+
+    if (gDiscovery.isActive && (gDiscovery.serial == serial)) {
+        if (gDiscovery.nextStep < gDiscovery.steps.size()) {
+            std::function<void()> step = gDiscovery.steps[gDiscovery.nextStep];
+            gDiscovery.nextStep++;
+            deliverStackEvent([step, serial]() {
+                // Not if discovery was terminated in the meantime
+                if (gDiscovery.isActive && (gDiscovery.serial == serial)) {
+                    step();
+                }
+            });
+            gDiscovery.eventId = scheduleStackAction(gDiscovery.intervalUs, [serial]() {runDiscoveryStep(serial);});
+        } else {
+            gDiscovery.isActive = false;
+            gDiscovery.pPeripheral->attBusy = false;
+            terminationCallback = gBle._gattClient._terminationCallback;
+            deliverStackEvent([terminationCallback, connectionHandle]() {
+                if (terminationCallback != NULL) {
+                    terminationCallback(connectionHandle);
+                }
+            });
+        }
+    }
+}
+
+// Add the steps for one service, and its characteristics, to
+// the service discovery.
+static void addDiscoverySteps(Gap::Handle_t connectionHandle, const UUID &serviceUuid,
+                              GattAttribute::Handle_t startHandle, GattAttribute::Handle_t endHandle,
+                              const UUID *pCharacteristicUuid, const GattAttribute::Handle_t *pValueHandle,
+                              const GattAttribute::Handle_t *pLastHandle, const bool *pCanNotify,
+                              int numCharacteristics,
+                              GattClient::ServiceCallback_t serviceCallback,
+                              GattClient::CharacteristicCallback_t characteristicCallback,
+                              const UUID &matchingCharacteristicUuid)
+{
+    DiscoveredService service;
+    DiscoveredCharacteristic characteristic;
+    bool anyCharacteristic = (matchingCharacteristicUuid == UUID(UUID::ShortUUIDBytes_t(BLE_UUID_UNKNOWN)));
+
+    if (serviceCallback != NULL) {
+        service.setup(serviceUuid, startHandle, endHandle);
+        gDiscovery.steps.push_back([serviceCallback, service]() {serviceCallback(&service);});
+    }
+    if (characteristicCallback != NULL) {
+        for (int x = 0; x < numCharacteristics; x++) {
+            if (anyCharacteristic || (pCharacteristicUuid[x] == matchingCharacteristicUuid)) {
+                characteristic._uuid = pCharacteristicUuid[x];
+                characteristic._connectionHandle = connectionHandle;
+                characteristic._declHandle = pValueHandle[x] - 1;
+                characteristic._valueHandle = pValueHandle[x];
+                characteristic._lastHandle = pLastHandle[x];
+                memset(&characteristic._properties, 0, sizeof(characteristic._properties));
+                characteristic._properties._read = 1;
+                characteristic._properties._notify = pCanNotify[x];
+                gDiscovery.steps.push_back([characteristicCallback, characteristic]() {
+                    characteristicCallback(&characteristic);
+                });
+            }
+        }
+    }
+}
+
+/**************************************************************************
+ * PUBLIC FUNCTIONS: THE MBED BLE API
+ *************************************************************************/
+
+// Get the instance of BLE.
+BLE &BLE::Instance(InstanceID_t id)
+{
+    (void) id;
+    return gBle;
+}
+
+// Initialise BLE; as with the Nordic stack, this completes
+// straight away.
+ble_error_t BLE::init(InitializationCompleteCallback_t callback)
+{
+    InitializationCompleteCallbackContext context = {*this, BLE_ERROR_NONE};
+
+    if (gInitialised) {
+        context.error = BLE_ERROR_ALREADY_INITIALIZED;
+    } else {
+        gInitialised = true;
+        gScanIntervalMs = 100;
+        gScanWindowMs = 100;
+    }
+    if (callback != NULL) {
+        callback(&context);
+    }
+
+    return context.error;
+}
+
+// Check if BLE is initialised.
+bool BLE::hasInitialized() const
+{
+    return gInitialised;
+}
+
+// Shut BLE down, dropping everything.
+ble_error_t BLE::shutdown()
+{
+    ble_error_t bleError = BLE_ERROR_INITIALIZATION_INCOMPLETE;
+
+    if (gInitialised) {
+        stopScanner();
+        gpScanCallback = NULL;
+        if (gConnectEventId != 0) {
+            simCancel(gConnectEventId);
+            gConnectEventId = 0;
+        }
+        if (gpConnectingPeripheral != NULL) {
+            gpConnectingPeripheral->isConnecting = false;
+            gpConnectingPeripheral = NULL;
+        }
+        gConnecting = false;
+        for (int x = 0; x < SIM_MAX_NUM_CONNECTIONS; x++) {
+            if (gpConnection[x] != NULL) {
+                gpConnection[x]->connectionHandle = -1;
+                gpConnection[x]->isDisconnecting = false;
+                gpConnection[x]->attBusy = false;
+                gpConnection[x] = NULL;
+            }
+        }
+        for (int x = 0; x < gNumPeripherals; x++) {
+            for (int y = 0; y < gPeripheral[x].numServices; y++) {
+                for (int z = 0; z < gPeripheral[x].service[y].numCharacteristics; z++) {
+                    gPeripheral[x].service[y].characteristic[z].notificationsOn = false;
+                }
+            }
+        }
+        if (gDiscovery.isActive) {
+            simCancel(gDiscovery.eventId);
+            gDiscovery.isActive = false;
+        }
+        gStackEvents.clear();
+        _gap._connectionCallbacks.clear();
+        _gap._disconnectionCallbacks.clear();
+        _gap._timeoutCallbacks.clear();
+        _gattClient._terminationCallback = NULL;
+        _gattClient._readCallbacks.clear();
+        _gattClient._writeCallbacks.clear();
+        _gattClient._hvxCallbacks.clear();
+        gEpoch++;
+        gInitialised = false;
+        bleError = BLE_ERROR_NONE;
+    }
+
+    return bleError;
+}
+
+// Run the stack events that are waiting.
+void BLE::processEvents()
+{
+    std::function<void()> event;
+
+    while (!gStackEvents.empty()) {
+        event = gStackEvents.front();
+        gStackEvents.pop_front();
+        event();
+    }
+}
+
+// Get the name of an error.
+const char *BLE::errorToString(ble_error_t error)
+{
+    const char *pString = "Unknown error";
+
+    switch (error) {
+        case BLE_ERROR_NONE:
+            pString = "BLE_ERROR_NONE: No error";
+        break;
+        case BLE_ERROR_PARAM_OUT_OF_RANGE:
+            pString = "BLE_ERROR_PARAM_OUT_OF_RANGE: Argument out of range";
+        break;
+        case BLE_ERROR_INVALID_PARAM:
+            pString = "BLE_ERROR_INVALID_PARAM: Invalid parameter";
+        break;
+        case BLE_STACK_BUSY:
+            pString = "BLE_STACK_BUSY: The stack is busy";
+        break;
+        case BLE_ERROR_INVALID_STATE:
+            pString = "BLE_ERROR_INVALID_STATE: Invalid state";
+        break;
+        case BLE_ERROR_NO_MEM:
+            pString = "BLE_ERROR_NO_MEM: Out of Memory";
+        break;
+        case BLE_ERROR_INITIALIZATION_INCOMPLETE:
+            pString = "BLE_ERROR_INITIALIZATION_INCOMPLETE";
+        break;
+        case BLE_ERROR_ALREADY_INITIALIZED:
+            pString = "BLE_ERROR_ALREADY_INITIALIZED";
+        break;
+        case BLE_ERROR_UNSPECIFIED:
+            pString = "BLE_ERROR_UNSPECIFIED: Unknown error";
+        break;
+        default:
+        break;
+    }
+
+    return pString;
+}
+
+// Get our own address.
+ble_error_t Gap::getAddress(AddressType_t *pType, Address_t address)
+{
+    static const uint8_t ownAddress[BLEProtocol::ADDR_LEN] = {0xd4, 0xca, 0x6e, 0x00, 0x00, 0x01};
+
+    *pType = BLEProtocol::AddressType::PUBLIC;
+    memcpy(address, ownAddress, sizeof(ownAddress));
+
+    return BLE_ERROR_NONE;
+}
+
+// Set the scan parameters, which apply from the next startScan().
+ble_error_t Gap::setScanParams(uint16_t interval, uint16_t window, uint16_t timeout, bool activeScanning)
+{
+    ble_error_t bleError = BLE_ERROR_PARAM_OUT_OF_RANGE;
+
+    (void) timeout;
+    (void) activeScanning;
+    if ((interval > 0) && (window > 0) && (window <= interval)) {
+        gScanIntervalMs = interval;
+        gScanWindowMs = window;
+        bleError = BLE_ERROR_NONE;
+    }
+
+    return bleError;
+}
+
+// Start scanning; as with the Nordic stack, starting a scan that
+// is already running fails but leaves it running.
+ble_error_t Gap::startScan(AdvertisementCallback_t callback)
+{
+    ble_error_t bleError = BLE_ERROR_INITIALIZATION_INCOMPLETE;
+
+    if (gInitialised) {
+        gpScanCallback = callback;
+        bleError = BLE_ERROR_PARAM_OUT_OF_RANGE;
+        if (!gScanning) {
+            gScanning = true;
+            gScanStartUs = simNowUs();
+            gActiveScanIntervalMs = gScanIntervalMs;
+            gActiveScanWindowMs = gScanWindowMs;
+            bleError = BLE_ERROR_NONE;
+        }
+    }
+
+    return bleError;
+}
+
+// Stop scanning.
+ble_error_t Gap::stopScan()
+{
+    stopScanner();
+
+    return BLE_ERROR_NONE;
+}
+
+// Connect to a peripheral; the scanner is stopped while connecting.
+ble_error_t Gap::connect(const BLEProtocol::AddressBytes_t peerAddr, AddressType_t peerAddrType,
+                         const ConnectionParams_t *pConnectionParams,
+                         const GapScanningParams *pScanParams)
+{
+    ble_error_t bleError = BLE_ERROR_INITIALIZATION_INCOMPLETE;
+    SimPeripheral *pPeripheral;
+    int64_t intervalUs = 50000;
+    int64_t supervisionTimeoutUs = 4000000;
+    int64_t delayUs;
+    int numConnections = 0;
+
+    (void) peerAddrType;
+    for (int x = 0; x < SIM_MAX_NUM_CONNECTIONS; x++) {
+        if (gpConnection[x] != NULL) {
+            numConnections++;
+        }
+    }
+    if (!gInitialised) {
+        // bleError already set
+    } else if (gConnecting) {
+        bleError = BLE_ERROR_INVALID_STATE;
+    } else if (numConnections >= gMaxNumConnections) {
+        bleError = BLE_ERROR_NO_MEM;
+    } else {
+        stopScanner();
+        gStats.numConnectAttempts++;
+        if (pConnectionParams != NULL) {
+            intervalUs = (int64_t) pConnectionParams->minConnectionInterval * 1250;
+            supervisionTimeoutUs = (int64_t) pConnectionParams->connectionSupervisionTimeout * 10000;
+        }
+        gConnectDeadlineUs = -1;
+        if ((pScanParams != NULL) && (pScanParams->getTimeout() > 0)) {
+            gConnectDeadlineUs = simNowUs() + (int64_t) pScanParams->getTimeout() * 1000000;
+        }
+        gConnecting = true;
+        pPeripheral = pSimFindPeripheral(peerAddr);
+        if ((pPeripheral != NULL) && pPeripheral->isPresent && pPeripheral->isConnectable &&
+            (pPeripheral->connectionHandle < 0) && (simRandom(100) >= pPeripheral->connectFailPercent)) {
+            // It connects once it next advertises
+            delayUs = pPeripheral->nextAdvertisementUs - simNowUs();
+            if (delayUs < 0) {
+                delayUs = 0;
+            }
+            delayUs += (int64_t) pPeripheral->connectLatencyMs * 1000;
+            if ((gConnectDeadlineUs < 0) || (simNowUs() + delayUs <= gConnectDeadlineUs)) {
+                gpConnectingPeripheral = pPeripheral;
+                pPeripheral->isConnecting = true;
+                gConnectEventId = scheduleStackAction(delayUs, [pPeripheral, intervalUs, supervisionTimeoutUs]() {
+                    completeConnect(pPeripheral, intervalUs, supervisionTimeoutUs);
+                });
+            }
+        }
+        if ((gpConnectingPeripheral == NULL) && (gConnectDeadlineUs >= 0)) {
+            gConnectEventId = scheduleStackAction(gConnectDeadlineUs - simNowUs(), timeOutConnect);
+        }
+        bleError = BLE_ERROR_NONE;
+    }
+
+    return bleError;
+}
+
+// Disconnect.
+ble_error_t Gap::disconnect(Handle_t connectionHandle, DisconnectionReason_t reason)
+{
+    ble_error_t bleError = BLE_ERROR_INVALID_STATE;
+    SimPeripheral *pPeripheral = pConnectedPeripheral(connectionHandle);
+    unsigned serial;
+
+    if (pPeripheral != NULL) {
+        pPeripheral->isDisconnecting = true;
+        serial = gConnectionSerial[connectionHandle];
+        scheduleStackAction(gConnectionIntervalUs[connectionHandle], [connectionHandle, serial, reason]() {
+            if (isConnection(connectionHandle, serial)) {
+                dropConnection(connectionHandle, reason);
+            }
+        });
+        bleError = BLE_ERROR_NONE;
+    }
+
+    return bleError;
+}
+
+// Discover the services and characteristics of a peripheral.
+ble_error_t GattClient::launchServiceDiscovery(Gap::Handle_t connectionHandle,
+                                               ServiceCallback_t serviceCallback,
+                                               CharacteristicCallback_t characteristicCallback,
+                                               const UUID &matchingServiceUuid,
+                                               const UUID &matchingCharacteristicUuid)
+{
+    ble_error_t bleError = BLE_ERROR_INVALID_STATE;
+    SimPeripheral *pPeripheral = pConnectedPeripheral(connectionHandle);
+    const UUID gapUuid((UUID::ShortUUIDBytes_t) BLE_UUID_GAP);
+    const UUID gapCharacteristicUuid[] = {UUID((UUID::ShortUUIDBytes_t) BLE_UUID_GAP_CHARACTERISTIC_DEVICE_NAME),
+                                          UUID((UUID::ShortUUIDBytes_t) 0x2A01)};
+    const GattAttribute::Handle_t gapValueHandle[] = {SIM_GAP_DEVICE_NAME_HANDLE, SIM_GAP_APPEARANCE_HANDLE};
+    const bool gapCanNotify[] = {false, false};
+    bool anyService = (matchingServiceUuid == UUID(UUID::ShortUUIDBytes_t(BLE_UUID_UNKNOWN)));
+    UUID characteristicUuid[SIM_MAX_NUM_CHARACTERISTICS];
+    GattAttribute::Handle_t valueHandle[SIM_MAX_NUM_CHARACTERISTICS];
+    GattAttribute::Handle_t lastHandle[SIM_MAX_NUM_CHARACTERISTICS];
+    bool canNotify[SIM_MAX_NUM_CHARACTERISTICS];
+    SimService *pService;
+
+    if (pPeripheral == NULL) {
+        // bleError already set
+    } else if (gDiscovery.isActive || pPeripheral->attBusy) {
+        bleError = BLE_STACK_BUSY;
+    } else {
+        gStats.numDiscoveries++;
+        gDiscovery.isActive = true;
+        gDiscovery.serial++;
+        gDiscovery.pPeripheral = pPeripheral;
+        gDiscovery.connectionHandle = connectionHandle;
+        gDiscovery.intervalUs = gConnectionIntervalUs[connectionHandle];
+        gDiscovery.steps.clear();
+        gDiscovery.nextStep = 0;
+        pPeripheral->attBusy = true;
+        if (anyService || (matchingServiceUuid == gapUuid)) {
+            addDiscoverySteps(connectionHandle, gapUuid, SIM_GAP_START_HANDLE, SIM_GAP_END_HANDLE,
+                              gapCharacteristicUuid, gapValueHandle, gapValueHandle, gapCanNotify, 2,
+                              serviceCallback, characteristicCallback, matchingCharacteristicUuid);
+        }
+        for (int x = 0; x < pPeripheral->numServices; x++) {
+            pService = &(pPeripheral->service[x]);
+            if (anyService || (matchingServiceUuid == pService->uuid)) {
+                for (int y = 0; y < pService->numCharacteristics; y++) {
+                    characteristicUuid[y] = pService->characteristic[y].uuid;
+                    valueHandle[y] = pService->characteristic[y].valueHandle;
+                    lastHandle[y] = pService->characteristic[y].lastHandle;
+                    canNotify[y] = pService->characteristic[y].canNotify;
+                }
+                addDiscoverySteps(connectionHandle, pService->uuid, pService->startHandle, pService->endHandle,
+                                  characteristicUuid, valueHandle, lastHandle, canNotify, pService->numCharacteristics,
+                                  serviceCallback, characteristicCallback, matchingCharacteristicUuid);
+            }
+        }
+        unsigned serial = gDiscovery.serial;
+        gDiscovery.eventId = scheduleStackAction(gDiscovery.intervalUs, [serial]() {runDiscoveryStep(serial);});
+        bleError = BLE_ERROR_NONE;
+    }
+
+    return bleError;
+}
+
+// Stop service discovery; the termination callback is still called.
+void GattClient::terminateServiceDiscovery()
+{
+    Gap::Handle_t connectionHandle = gDiscovery.connectionHandle;
+    TerminationCallback_t terminationCallback = _terminationCallback;
+
+    if (gDiscovery.isActive) {
+        gDiscovery.isActive = false;
+        gDiscovery.pPeripheral->attBusy = false;
+        simCancel(gDiscovery.eventId);
+        deliverStackEvent([terminationCallback, connectionHandle]() {
+            if (terminationCallback != NULL) {
+                terminationCallback(connectionHandle);
+            }
+        });
+    }
+}
+
+// Check if service discovery is running.
+bool GattClient::isServiceDiscoveryActive() const
+{
+    return gDiscovery.isActive;
+}
+
+// Read an attribute of a peripheral.
+ble_error_t GattClient::read(Gap::Handle_t connectionHandle, GattAttribute::Handle_t attributeHandle,
+                             uint16_t offset) const
+{
+    ble_error_t bleError = BLE_ERROR_INVALID_STATE;
+    SimPeripheral *pPeripheral = pConnectedPeripheral(connectionHandle);
+    unsigned serial;
+
+    (void) offset;
+    if (pPeripheral == NULL) {
+        // bleError already set
+    } else if (pPeripheral->attBusy) {
+        bleError = BLE_STACK_BUSY;
+    } else {
+        pPeripheral->attBusy = true;
+        gStats.numReads++;
+        serial = gConnectionSerial[connectionHandle];
+        scheduleStackAction(gConnectionIntervalUs[connectionHandle], [pPeripheral, connectionHandle, serial, attributeHandle]() {
+            SimCharacteristic *pCharacteristic;
+            std::vector<uint8_t> value;
+            ble_error_t status = BLE_ERROR_NONE;
+
+            // No response from a peripheral that has gone away
+            if (isConnection(connectionHandle, serial) && pPeripheral->isPresent) {
+                pPeripheral->attBusy = false;
+                pCharacteristic = pFindCharacteristic(pPeripheral, attributeHandle);
+                if (pPeripheral->numReadErrors > 0) {
+                    pPeripheral->numReadErrors--;
+                    status = BLE_ERROR_UNSPECIFIED;
+                } else if (attributeHandle == SIM_GAP_DEVICE_NAME_HANDLE) {
+                    value.assign(pPeripheral->name, pPeripheral->name + strlen(pPeripheral->name));
+                } else if (attributeHandle == SIM_GAP_APPEARANCE_HANDLE) {
+                    value.assign(2, 0);
+                } else if (pCharacteristic == NULL) {
+                    status = BLE_ERROR_INVALID_PARAM;
+                } else if (simNowUs() - pPeripheral->connectedUs >= (int64_t) pPeripheral->zeroReadMs * 1000) {
+                    value.assign(pCharacteristic->value, pCharacteristic->value + pCharacteristic->valueLen);
+                }
+                if (status != BLE_ERROR_NONE) {
+                    gStats.numReadErrors++;
+                }
+                deliverStackEvent([connectionHandle, attributeHandle, value, status]() {
+                    GattReadCallbackParams params;
+                    std::vector<GattClient::ReadCallback_t> callbacks = gBle._gattClient._readCallbacks;
+                    params.connHandle = connectionHandle;
+                    params.handle = attributeHandle;
+                    params.offset = 0;
+                    params.len = (uint16_t) value.size();
+                    params.data = value.data();
+                    params.status = status;
+                    for (size_t x = 0; x < callbacks.size(); x++) {
+                        callbacks[x](&params);
+                    }
+                });
+            }
+        });
+        bleError = BLE_ERROR_NONE;
+    }
+
+    return bleError;
+}
+
+// Write to an attribute of a peripheral: only writes to a CCCD,
+// switching notifications on or off, are allowed, anything else
+// getting an error in the response to a write request.
+ble_error_t GattClient::write(WriteOp_t cmd, Gap::Handle_t connectionHandle,
+                              GattAttribute::Handle_t attributeHandle,
+                              size_t length, const uint8_t *pValue) const
+{
+    ble_error_t bleError = BLE_ERROR_INVALID_STATE;
+    SimPeripheral *pPeripheral = pConnectedPeripheral(connectionHandle);
+    SimCharacteristic *pCharacteristic;
+    ble_error_t status = BLE_ERROR_NONE;
+    unsigned serial;
+
+    if (pPeripheral == NULL) {
+        // bleError already set
+    } else if (pPeripheral->attBusy) {
+        bleError = BLE_STACK_BUSY;
+    } else {
+        pCharacteristic = pFindCharacteristicByCccd(pPeripheral, attributeHandle);
+        if ((pCharacteristic != NULL) && (length > 0)) {
+            pCharacteristic->notificationsOn = ((pValue[0] & BLE_HVX_NOTIFICATION) != 0);
+        } else {
+            status = BLE_ERROR_UNSPECIFIED;
+        }
+        pPeripheral->attBusy = true;
+        serial = gConnectionSerial[connectionHandle];
+        scheduleStackAction(gConnectionIntervalUs[connectionHandle], [pPeripheral, connectionHandle, serial,
+                                                                      cmd, attributeHandle, status]() {
+            if (isConnection(connectionHandle, serial)) {
+                pPeripheral->attBusy = false;
+                if (cmd == GATT_OP_WRITE_REQ) {
+                    deliverStackEvent([connectionHandle, attributeHandle, status]() {
+                        GattWriteCallbackParams params;
+                        std::vector<GattClient::WriteCallback_t> callbacks = gBle._gattClient._writeCallbacks;
+                        params.connHandle = connectionHandle;
+                        params.handle = attributeHandle;
+                        params.writeOp = GattWriteCallbackParams::OP_WRITE_REQ;
+                        params.offset = 0;
+                        params.status = status;
+                        // Write Not Permitted
+                        params.error_code = (status == BLE_ERROR_NONE) ? 0 : 0x03;
+                        for (size_t x = 0; x < callbacks.size(); x++) {
+                            callbacks[x](&params);
+                        }
+                    });
+                }
+            }
+        });
+        bleError = BLE_ERROR_NONE;
+    }
+
+    return bleError;
+}
+
+// Discover the descriptors of a characteristic, all of which
+// come back in a single exchange.
+ble_error_t DiscoveredCharacteristic::discoverDescriptors(const CharacteristicDescriptorDiscovery::DiscoveryCallback_t &onDescriptorDiscovered,
+                                                          const CharacteristicDescriptorDiscovery::TerminationCallback_t &onTermination) const
+{
+    ble_error_t bleError = BLE_ERROR_INVALID_STATE;
+    SimPeripheral *pPeripheral = pConnectedPeripheral(_connectionHandle);
+    SimCharacteristic *pCharacteristic;
+    std::vector<GattAttribute::Handle_t> descriptorHandles;
+    Gap::Handle_t connectionHandle = _connectionHandle;
+    DiscoveredCharacteristic characteristic = *this;
+    CharacteristicDescriptorDiscovery::DiscoveryCallback_t discoveryCallback = onDescriptorDiscovered;
+    CharacteristicDescriptorDiscovery::TerminationCallback_t terminationCallback = onTermination;
+    unsigned serial;
+
+    if (pPeripheral == NULL) {
+        // bleError already set
+    } else if (pPeripheral->attBusy) {
+        bleError = BLE_STACK_BUSY;
+    } else {
+        pCharacteristic = pFindCharacteristic(pPeripheral, _valueHandle);
+        if (pCharacteristic != NULL) {
+            for (GattAttribute::Handle_t x = pCharacteristic->valueHandle + 1; x <= pCharacteristic->lastHandle; x++) {
+                descriptorHandles.push_back(x);
+            }
+        }
+        pPeripheral->attBusy = true;
+        serial = gConnectionSerial[connectionHandle];
+        scheduleStackAction(gConnectionIntervalUs[connectionHandle], [pPeripheral, connectionHandle, serial, characteristic,
+                                                                      descriptorHandles, discoveryCallback, terminationCallback]() {
+            // No response from a peripheral that has gone away
+            if (isConnection(connectionHandle, serial) && pPeripheral->isPresent) {
+                pPeripheral->attBusy = false;
+                deliverStackEvent([pPeripheral, connectionHandle, characteristic, descriptorHandles,
+                                   discoveryCallback, terminationCallback]() {
+                    SimCharacteristic *pCharacteristic = pFindCharacteristic(pPeripheral, characteristic.getValueHandle());
+                    UUID uuid;
+                    for (size_t x = 0; (x < descriptorHandles.size()) && (discoveryCallback != NULL); x++) {
+                        uuid = UUID((UUID::ShortUUIDBytes_t) BLE_UUID_DESCRIPTOR_CHAR_USER_DESC);
+                        if ((pCharacteristic != NULL) && (descriptorHandles[x] == pCharacteristic->cccdHandle)) {
+                            uuid = UUID((UUID::ShortUUIDBytes_t) BLE_UUID_DESCRIPTOR_CLIENT_CHAR_CONFIG);
+                        }
+                        DiscoveredCharacteristicDescriptor descriptor(connectionHandle, descriptorHandles[x], uuid);
+                        CharacteristicDescriptorDiscovery::DiscoveryCallbackParams_t params = {characteristic, descriptor};
+                        discoveryCallback(&params);
+                    }
+                    if (terminationCallback != NULL) {
+                        CharacteristicDescriptorDiscovery::TerminationCallbackParams_t params = {characteristic,
+                                                                                                 BLE_ERROR_NONE, 0};
+                        terminationCallback(&params);
+                    }
+                });
+            }
+        });
+        bleError = BLE_ERROR_NONE;
+    }
+
+    return bleError;
+}
+
+/**************************************************************************
+ * PUBLIC FUNCTIONS: THE SIMULATED WORLD
+ *************************************************************************/
+
+// Add a peripheral.
+SimPeripheral *pSimAddPeripheral(const uint8_t *pAddress, BLEProtocol::AddressType_t addressType,
+                                 const char *pName)
+{
+    SimPeripheral *pPeripheral = NULL;
+
+    if (gNumPeripherals < SIM_MAX_NUM_PERIPHERALS) {
+        pPeripheral = &(gPeripheral[gNumPeripherals]);
+        gNumPeripherals++;
+        *pPeripheral = SimPeripheral();
+        memcpy(pPeripheral->address, pAddress, sizeof(pPeripheral->address));
+        pPeripheral->addressType = addressType;
+        strncpy(pPeripheral->name, pName, sizeof(pPeripheral->name) - 1);
+        pPeripheral->isPresent = true;
+        pPeripheral->isConnectable = true;
+        pPeripheral->nameIsAdvertised = true;
+        pPeripheral->advertisingIntervalMs = 100;
+        pPeripheral->rssi = -60;
+        pPeripheral->connectLatencyMs = 30;
+        pPeripheral->handleBase = 10;
+        pPeripheral->connectionHandle = -1;
+    }
+
+    return pPeripheral;
+}
+
+// Add a service to a peripheral.
+SimService *pSimAddService(SimPeripheral *pPeripheral, const UUID &uuid)
+{
+    SimService *pService = NULL;
+
+    if (pPeripheral->numServices < SIM_MAX_NUM_SERVICES) {
+        pService = &(pPeripheral->service[pPeripheral->numServices]);
+        pPeripheral->numServices++;
+        pService->uuid = uuid;
+        pService->numCharacteristics = 0;
+        assignHandles(pPeripheral);
+    }
+
+    return pService;
+}
+
+// Add a characteristic to a service.
+SimCharacteristic *pSimAddCharacteristic(SimService *pService, const UUID &uuid, bool canNotify,
+                                         bool hasDescription, const uint8_t *pValue, int valueLen)
+{
+    SimCharacteristic *pCharacteristic = NULL;
+
+    if (pService->numCharacteristics < SIM_MAX_NUM_CHARACTERISTICS) {
+        pCharacteristic = &(pService->characteristic[pService->numCharacteristics]);
+        pService->numCharacteristics++;
+        pCharacteristic->uuid = uuid;
+        pCharacteristic->canNotify = canNotify;
+        pCharacteristic->hasDescription = hasDescription;
+        if (valueLen > SIM_MAX_VALUE_LENGTH) {
+            valueLen = SIM_MAX_VALUE_LENGTH;
+        }
+        memcpy(pCharacteristic->value, pValue, valueLen);
+        pCharacteristic->valueLen = valueLen;
+        pCharacteristic->notificationsOn = false;
+        // Handles are given out across the whole peripheral
+        for (int x = 0; x < gNumPeripherals; x++) {
+            for (int y = 0; y < gPeripheral[x].numServices; y++) {
+                if (&(gPeripheral[x].service[y]) == pService) {
+                    assignHandles(&(gPeripheral[x]));
+                }
+            }
+        }
+    }
+
+    return pCharacteristic;
+}
+
+// Find a peripheral.
+SimPeripheral *pSimFindPeripheral(const uint8_t *pAddress)
+{
+    SimPeripheral *pPeripheral = NULL;
+
+    for (int x = 0; (x < gNumPeripherals) && (pPeripheral == NULL); x++) {
+        if (memcmp(gPeripheral[x].address, pAddress, sizeof(gPeripheral[x].address)) == 0) {
+            pPeripheral = &(gPeripheral[x]);
+        }
+    }
+
+    return pPeripheral;
+}
+
+// Get the number of peripherals.
+int simGetNumPeripherals()
+{
+    return gNumPeripherals;
+}
+
+// Start the peripherals advertising, each at a random point
+// in its advertising interval.
+void simStart()
+{
+    SimPeripheral *pPeripheral;
+
+    MBED_ASSERT(!gStarted);
+    gStarted = true;
+    for (int x = 0; x < gNumPeripherals; x++) {
+        pPeripheral = &(gPeripheral[x]);
+        pPeripheral->nextAdvertisementUs = simNowUs() + simRandom(pPeripheral->advertisingIntervalMs * 1000);
+        simSchedule(pPeripheral->nextAdvertisementUs, 0, [pPeripheral]() {advertise(pPeripheral);}, &gWorldOwner);
+        if (pPeripheral->changePeriodMs > 0) {
+            simSchedule(simNowUs() + (int64_t) pPeripheral->changePeriodMs * 1000,
+                        (int64_t) pPeripheral->changePeriodMs * 1000,
+                        [pPeripheral]() {changeValues(pPeripheral);}, &gWorldOwner);
+        }
+    }
+}
+
+// Bring a peripheral into or out of range.
+void simSetPresent(SimPeripheral *pPeripheral, bool isPresent)
+{
+    if (pPeripheral->isPresent && !isPresent && (pPeripheral->connectionHandle >= 0)) {
+        scheduleSupervisionTimeout(pPeripheral);
+    }
+    pPeripheral->isPresent = isPresent;
+}
+
+// Set the value of a characteristic, notifying it if required.
+bool simSetValue(SimPeripheral *pPeripheral, const UUID &uuid, const uint8_t *pValue, int valueLen)
+{
+    SimCharacteristic *pCharacteristic = NULL;
+    Gap::Handle_t connectionHandle;
+    GattAttribute::Handle_t valueHandle;
+    unsigned serial;
+
+    for (int x = 0; (x < pPeripheral->numServices) && (pCharacteristic == NULL); x++) {
+        for (int y = 0; (y < pPeripheral->service[x].numCharacteristics) && (pCharacteristic == NULL); y++) {
+            if (pPeripheral->service[x].characteristic[y].uuid == uuid) {
+                pCharacteristic = &(pPeripheral->service[x].characteristic[y]);
+            }
+        }
+    }
+    if (pCharacteristic != NULL) {
+        if (valueLen > SIM_MAX_VALUE_LENGTH) {
+            valueLen = SIM_MAX_VALUE_LENGTH;
+        }
+        memcpy(pCharacteristic->value, pValue, valueLen);
+        pCharacteristic->valueLen = valueLen;
+        if (pCharacteristic->notificationsOn && pPeripheral->isPresent && (pPeripheral->connectionHandle >= 0)) {
+            std::vector<uint8_t> value(pValue, pValue + valueLen);
+            connectionHandle = pPeripheral->connectionHandle;
+            valueHandle = pCharacteristic->valueHandle;
+            serial = gConnectionSerial[connectionHandle];
+            gStats.numNotifications++;
+            scheduleStackAction(gConnectionIntervalUs[connectionHandle] / 2, [connectionHandle, serial, valueHandle, value]() {
+                if (isConnection(connectionHandle, serial)) {
+                    deliverStackEvent([connectionHandle, valueHandle, value]() {
+                        GattHVXCallbackParams params;
+                        std::vector<GattClient::HVXCallback_t> callbacks = gBle._gattClient._hvxCallbacks;
+                        params.connHandle = connectionHandle;
+                        params.handle = valueHandle;
+                        params.type = BLE_HVX_NOTIFICATION;
+                        params.len = (uint16_t) value.size();
+                        params.data = value.data();
+                        for (size_t x = 0; x < callbacks.size(); x++) {
+                            callbacks[x](&params);
+                        }
+                    });
+                }
+            });
+        }
+    }
+
+    return pCharacteristic != NULL;
+}
+
+// Give the attributes of a peripheral new handles.
+void simSetHandleBase(SimPeripheral *pPeripheral, GattAttribute::Handle_t handleBase)
+{
+    pPeripheral->handleBase = handleBase;
+    assignHandles(pPeripheral);
+}
+
+// Deliver one advertisement.
+bool simAdvertise(const uint8_t *pAddress, BLEProtocol::AddressType_t addressType, int rssi,
+                  const uint8_t *pData, int dataLen)
+{
+    gStats.numAdvertisementsSent++;
+    return deliverAdvertisement(pAddress, addressType, rssi, true, pData, dataLen);
+}
+
+// Set the number of central connections.
+void simSetMaxNumConnections(int maxNumConnections)
+{
+    if (maxNumConnections > SIM_MAX_NUM_CONNECTIONS) {
+        maxNumConnections = SIM_MAX_NUM_CONNECTIONS;
+    }
+    gMaxNumConnections = maxNumConnections;
+}
+
+// Get the counters.
+void simGetStats(SimStats *pStats)
+{
+    *pStats = gStats;
+    if (gScanning) {
+        pStats->scanRadioOnUs += scanOnUs(simNowUs() - gScanStartUs);
+    }
+}
+
+// Reset the counters.
+void simResetStats()
+{
+    memset(&gStats, 0, sizeof(gStats));
+    if (gScanning) {
+        // Count only from now
+        gStats.scanRadioOnUs = -scanOnUs(simNowUs() - gScanStartUs);
+    }
+}
+
+// Get a pseudo-random number.
+int simRandom(int range)
+{
+    int number = 0;
+
+    gRandom = gRandom * 1103515245 + 12345;
+    if (range > 0) {
+        number = (int) ((gRandom >> 8) % (unsigned) range);
+    }
+
+    return number;
+}
+
+// Seed simRandom().
+void simSeedRandom(unsigned seed)
+{
+    gRandom = seed;
+}
+
+// End Of File
@@ -0,0 +1,275 @@
+/* mbed Microcontroller Library
+ * Copyright (c) 2006-2018 u-blox Limited
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _SIM_BLE_H_
+#define _SIM_BLE_H_
+
+/* The simulated BLE world behind the host stand-in for the mbed
+ * BLE API: a stack that delivers its events through
+ * BLE::processEvents(), as the real one does, and the peripherals
+ * around it, which advertise, accept connections, can be
+ * discovered, read and subscribed to, with the latencies and the
+ * failures that they are given.
+ */
+
+#include "ble/BLE.h"
+
+/**********************************************************************
+ * MACROS
+ **********************************************************************/
+
+/** The most peripherals that can be simulated.
+ */
+#define SIM_MAX_NUM_PERIPHERALS 4096
+
+/** The most services a simulated peripheral can have, not
+ * counting the GAP service which they all have.
+ */
+#define SIM_MAX_NUM_SERVICES 4
+
+/** The most characteristics a simulated service can have.
+ */
+#define SIM_MAX_NUM_CHARACTERISTICS 4
+
+/** The longest Device Name of a simulated peripheral.
+ */
+#define SIM_MAX_NAME_LENGTH 29
+
+/** The longest value of a simulated characteristic.
+ */
+#define SIM_MAX_VALUE_LENGTH 20
+
+/** The most advertising data a peripheral sends.
+ */
+#define SIM_MAX_ADVERTISING_DATA_LENGTH 31
+
+/**********************************************************************
+ * TYPES
+ **********************************************************************/
+
+/** A characteristic of a simulated peripheral.
+ */
+typedef struct {
+    UUID uuid;
+    bool canNotify;
+    bool hasDescription; /// True if it has a Characteristic User Description, which comes before its CCCD.
+    uint8_t value[SIM_MAX_VALUE_LENGTH];
+    int valueLen;
+    GattAttribute::Handle_t valueHandle; /// Set by the simulation.
+    GattAttribute::Handle_t lastHandle; /// Set by the simulation, that of its last descriptor.
+    GattAttribute::Handle_t cccdHandle; /// Set by the simulation, zero if it can't notify.
+    bool notificationsOn; /// Set by the simulation.
+} SimCharacteristic;
+
+/** A service of a simulated peripheral.
+ */
+typedef struct {
+    UUID uuid;
+    SimCharacteristic characteristic[SIM_MAX_NUM_CHARACTERISTICS];
+    int numCharacteristics;
+    GattAttribute::Handle_t startHandle; /// Set by the simulation.
+    GattAttribute::Handle_t endHandle; /// Set by the simulation.
+} SimService;
+
+/** A simulated peripheral.  Everything down to the state is set
+ * up by pSimAddPeripheral() with defaults and may be changed
+ * before simStart().
+ */
+typedef struct {
+    uint8_t address[BLEProtocol::ADDR_LEN];
+    BLEProtocol::AddressType_t addressType;
+    char name[SIM_MAX_NAME_LENGTH + 1];
+    bool isPresent; /// False if the peripheral is out of range.
+    bool isConnectable;
+    bool nameIsAdvertised; /// True to put the Device Name in advertisements.
+    int advertisingIntervalMs;
+    int rssi;
+    int lossPercent; /// The chance of an advertisement being missed.
+    int connectLatencyMs; /// Once the next advertisement is sent.
+    int connectFailPercent; /// The chance of a connection attempt timing out.
+    int dropPercent; /// The chance of a connection being dropped soon after it is made.
+    int zeroReadMs; /// For this long after connecting, reads of a characteristic are empty.
+    int numReadErrors; /// The number of reads still to fail.
+    int changePeriodMs; /// If not zero, every value goes up by one this often.
+    GattAttribute::Handle_t handleBase; /// Where the first service after GAP starts.
+    uint8_t advertisingData[SIM_MAX_ADVERTISING_DATA_LENGTH]; /// Sent after flags and name.
+    int advertisingDataLen;
+    SimService service[SIM_MAX_NUM_SERVICES];
+    int numServices;
+    // State
+    int connectionHandle; /// -1 if not connected.
+    bool isConnecting;
+    bool isDisconnecting;
+    int64_t connectedUs;
+    int64_t nextAdvertisementUs;
+    bool attBusy; /// True while a GATT request is outstanding.
+} SimPeripheral;
+
+/** Counters kept by the simulation.
+ */
+typedef struct {
+    int numAdvertisementsSent; /// By the peripherals, while present.
+    int numAdvertisementsDelivered; /// To the scan callback.
+    int numConnectAttempts;
+    int numConnects;
+    int numConnectTimeouts;
+    int numDrops; /// Connections dropped by the peripheral.
+    int numDiscoveries;
+    int numReads;
+    int numReadErrors;
+    int numNotifications;
+    int numEventsToProcess; /// The number of times BLE asked for processEvents() to be called.
+    int64_t scanRadioOnUs; /// Time for which the scanner was listening.
+    int64_t advertisementCallbackNs; /// Host time spent in the scan callback.
+} SimStats;
+
+/**********************************************************************
+ * FUNCTIONS
+ **********************************************************************/
+
+/** Add a simulated peripheral, with a Device Name but no services
+ * other than GAP, present, connectable, advertising its name every
+ * 100 ms with a connection latency of 30 ms and no failures.
+ *
+ * @param pAddress    the 6 byte address.
+ * @param addressType the address type.
+ * @param pName       the Device Name.
+ * @return            a pointer to the peripheral, NULL if there
+ *                    are already SIM_MAX_NUM_PERIPHERALS.
+ */
+SimPeripheral *pSimAddPeripheral(const uint8_t *pAddress, BLEProtocol::AddressType_t addressType,
+                                 const char *pName);
+
+/** Add a service to a simulated peripheral.
+ *
+ * @param pPeripheral the peripheral.
+ * @param uuid        the UUID of the service.
+ * @return            a pointer to the service, NULL if the
+ *                    peripheral has SIM_MAX_NUM_SERVICES already.
+ */
+SimService *pSimAddService(SimPeripheral *pPeripheral, const UUID &uuid);
+
+/** Add a characteristic to a service of a simulated peripheral;
+ * it can be read and, optionally, subscribed to.
+ *
+ * @param pService  the service.
+ * @param uuid      the UUID of the characteristic.
+ * @param canNotify true if the characteristic supports notifications.
+ * @param hasDescription true if the characteristic has a User
+ *                  Description descriptor, which is put between
+ *                  its value and its CCCD.
+ * @param pValue    the initial value.
+ * @param valueLen  the length of the initial value.
+ * @return          a pointer to the characteristic, NULL if the service
+ *                  has SIM_MAX_NUM_CHARACTERISTICS already.
+ */
+SimCharacteristic *pSimAddCharacteristic(SimService *pService, const UUID &uuid, bool canNotify,
+                                         bool hasDescription, const uint8_t *pValue, int valueLen);
+
+/** Find a simulated peripheral.
+ *
+ * @param pAddress the 6 byte address.
+ * @return         a pointer to the peripheral or NULL.
+ */
+SimPeripheral *pSimFindPeripheral(const uint8_t *pAddress);
+
+/** Get the number of simulated peripherals.
+ *
+ * @return the number of peripherals.
+ */
+int simGetNumPeripherals();
+
+/** Start the peripherals advertising; call once they have all
+ * been added.
+ */
+void simStart();
+
+/** Bring a peripheral into or out of range.  A peripheral that
+ * goes out of range stops advertising and its connection, if
+ * any, times out.
+ *
+ * @param pPeripheral the peripheral.
+ * @param isPresent   true if it is in range.
+ */
+void simSetPresent(SimPeripheral *pPeripheral, bool isPresent);
+
+/** Set the value of a characteristic of a simulated peripheral,
+ * notifying it if notifications are on.
+ *
+ * @param pPeripheral the peripheral.
+ * @param uuid        the UUID of the characteristic.
+ * @param pValue      the value.
+ * @param valueLen    the length of the value.
+ * @return            true if the characteristic was found.
+ */
+bool simSetValue(SimPeripheral *pPeripheral, const UUID &uuid, const uint8_t *pValue, int valueLen);
+
+/** Give the attributes of a simulated peripheral new handles,
+ * as happens when its firmware is updated.
+ *
+ * @param pPeripheral the peripheral.
+ * @param handleBase  where the first service after GAP starts.
+ */
+void simSetHandleBase(SimPeripheral *pPeripheral, GattAttribute::Handle_t handleBase);
+
+/** Deliver one advertisement, e.g. from a recorded trace, as if
+ * it had been received now; it is only delivered if the scanner
+ * is listening.
+ *
+ * @param pAddress    the 6 byte address of the advertiser.
+ * @param addressType the address type of the advertiser.
+ * @param rssi        the RSSI.
+ * @param pData       the advertising data.
+ * @param dataLen     the length of the advertising data.
+ * @return            true if it was delivered.
+ */
+bool simAdvertise(const uint8_t *pAddress, BLEProtocol::AddressType_t addressType, int rssi,
+                  const uint8_t *pData, int dataLen);
+
+/** Set the number of central connections the simulated stack
+ * supports, 4 by default.
+ *
+ * @param maxNumConnections the number of connections.
+ */
+void simSetMaxNumConnections(int maxNumConnections);
+
+/** Get the counters kept by the simulation.
+ *
+ * @param pStats a place to put them.
+ */
+void simGetStats(SimStats *pStats);
+
+/** Reset the counters kept by the simulation.
+ */
+void simResetStats();
+
+/** Get a pseudo-random number, reproducible from one run of the
+ * simulation to the next.
+ *
+ * @param range the number returned is from zero to range - 1.
+ * @return      the number.
+ */
+int simRandom(int range);
+
+/** Seed simRandom().
+ *
+ * @param seed the seed.
+ */
+void simSeedRandom(unsigned seed);
+
+#endif // _SIM_BLE_H_
+
+// End Of File
@@ -0,0 +1,290 @@
+/* mbed Microcontroller Library
+ * Copyright (c) 2006-2018 u-blox Limited
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* The simulated clock, and the parts of the mbed platform that
+ * are more than a line or two, for the host build.
+ */
+
+#include <map>
+#include <mbed.h>
+
+/**************************************************************************
+ * MACROS
+ *************************************************************************/
+
+/** The size of the simulated internal flash.
+ */
+#define SIM_FLASH_SIZE (64 * 1024)
+
+/**************************************************************************
+ * TYPES
+ *************************************************************************/
+
+/** The order in which scheduled events run: by time and then
+ * in the order in which they were scheduled.
+ */
+typedef std::pair<int64_t, uint64_t> SimEventKey;
+
+/** A scheduled event.
+ */
+typedef struct {
+    int id;
+    int64_t periodUs;
+    const void *pOwner;
+    std::function<void()> function;
+} SimEvent;
+
+/**************************************************************************
+ * LOCAL VARIABLES
+ *************************************************************************/
+
+/** The simulated time in microseconds.
+ */
+static int64_t gNowUs = 0;
+
+/** The scheduled events, in the order in which they will run.
+ */
+static std::map<SimEventKey, SimEvent> gEvents;
+
+/** Where each event is in gEvents, by ID.
+ */
+static std::map<int, SimEventKey> gEventKeys;
+
+/** The number of events scheduled by each owner.
+ */
+static std::map<const void *, int> gNumEventsByOwner;
+
+/** The next event ID and sequence number.
+ */
+static int gNextEventId = 1;
+static uint64_t gNextEventSequence = 0;
+
+/** The simulated internal flash, erased.
+ */
+static uint8_t gFlash[SIM_FLASH_SIZE];
+static bool gFlashErased = false;
+
+/**************************************************************************
+ * STATIC FUNCTIONS
+ *************************************************************************/
+
+// Erase the simulated flash the first time it is used.
+static void eraseFlashOnce()
+{
+    if (!gFlashErased) {
+        memset(gFlash, 0xFF, sizeof(gFlash));
+        gFlashErased = true;
+    }
+}
+
+// Check that an area is within the simulated flash.
+static bool isInFlash(uint32_t address, uint32_t size)
+{
+    return (address <= SIM_FLASH_SIZE) && (size <= SIM_FLASH_SIZE - address);
+}
+
+/**************************************************************************
+ * PUBLIC FUNCTIONS: SIMULATED CLOCK
+ *************************************************************************/
+
+// Get the simulated time.
+int64_t simNowUs()
+{
+    return gNowUs;
+}
+
+// Schedule a function.
+int simSchedule(int64_t dueUs, int64_t periodUs, std::function<void()> function,
+                const void *pOwner)
+{
+    SimEventKey key(dueUs < gNowUs ? gNowUs : dueUs, gNextEventSequence++);
+    SimEvent event;
+
+    event.id = gNextEventId++;
+    if (gNextEventId <= 0) {
+        gNextEventId = 1;
+    }
+    event.periodUs = periodUs;
+    event.pOwner = pOwner;
+    event.function = function;
+    gEvents[key] = event;
+    gEventKeys[event.id] = key;
+    gNumEventsByOwner[pOwner]++;
+
+    return event.id;
+}
+
+// Cancel a scheduled function.
+bool simCancel(int id)
+{
+    std::map<int, SimEventKey>::iterator keyIterator = gEventKeys.find(id);
+    bool found = false;
+
+    if (keyIterator != gEventKeys.end()) {
+        std::map<SimEventKey, SimEvent>::iterator eventIterator = gEvents.find(keyIterator->second);
+        gNumEventsByOwner[eventIterator->second.pOwner]--;
+        gEvents.erase(eventIterator);
+        gEventKeys.erase(keyIterator);
+        found = true;
+    }
+
+    return found;
+}
+
+// Get the number of events belonging to an owner.
+int simNumEvents(const void *pOwner)
+{
+    return gNumEventsByOwner[pOwner];
+}
+
+// Run events for a period of simulated time.
+void simRunFor(int durationMs, volatile bool *pStop)
+{
+    int64_t endUs = INT64_MAX;
+    std::map<SimEventKey, SimEvent>::iterator eventIterator;
+    std::function<void()> function;
+    SimEvent *pEvent;
+    bool stopped = false;
+    bool done = false;
+
+    if (durationMs >= 0) {
+        endUs = gNowUs + (int64_t) durationMs * 1000;
+    }
+    while (!done) {
+        stopped = (pStop != NULL) && *pStop;
+        eventIterator = gEvents.begin();
+        if (stopped || (eventIterator == gEvents.end()) || (eventIterator->first.first > endUs)) {
+            done = true;
+        } else {
+            pEvent = &(eventIterator->second);
+            gNowUs = eventIterator->first.first;
+            function = pEvent->function;
+            if (pEvent->periodUs > 0) {
+                // Put it back for next time before running it, so
+                // that it can cancel itself
+                SimEventKey key(gNowUs + pEvent->periodUs, gNextEventSequence++);
+                gEventKeys[pEvent->id] = key;
+                gEvents[key] = *pEvent;
+            } else {
+                gEventKeys.erase(pEvent->id);
+                gNumEventsByOwner[pEvent->pOwner]--;
+            }
+            gEvents.erase(eventIterator);
+            function();
+        }
+    }
+
+    // As with a real event queue, the time passes even if
+    // there is nothing to do
+    if (!stopped && (endUs != INT64_MAX) && (endUs > gNowUs)) {
+        gNowUs = endUs;
+    }
+}
+
+// Move the simulated clock on without running events.
+void simWaitUs(int64_t durationUs)
+{
+    if (durationUs > 0) {
+        gNowUs += durationUs;
+    }
+}
+
+// Throw away every event and start the clock again.
+void simReset()
+{
+    gEvents.clear();
+    gEventKeys.clear();
+    gNumEventsByOwner.clear();
+    gNowUs = 0;
+}
+
+// Block for a while.
+void wait_ms(int ms)
+{
+    simWaitUs((int64_t) ms * 1000);
+}
+
+// time() from the C library, replaced so that timestamps
+// follow the simulated clock.
+extern "C" time_t time(time_t *pTime) __THROW
+{
+    time_t now = (time_t) (SIM_START_UNIX_TIME + gNowUs / 1000000);
+
+    if (pTime != NULL) {
+        *pTime = now;
+    }
+
+    return now;
+}
+
+/**************************************************************************
+ * PUBLIC FUNCTIONS: FLASH
+ *************************************************************************/
+
+// Get the size of the simulated flash.
+uint32_t FlashIAP::get_flash_size()
+{
+    return SIM_FLASH_SIZE;
+}
+
+// Read from the simulated flash.
+int FlashIAP::read(void *pBuffer, uint32_t address, uint32_t size)
+{
+    int result = -1;
+
+    eraseFlashOnce();
+    if (isInFlash(address, size)) {
+        memcpy(pBuffer, gFlash + address, size);
+        result = 0;
+    }
+
+    return result;
+}
+
+// Program the simulated flash: as with real flash, bits can
+// only be cleared.
+int FlashIAP::program(const void *pBuffer, uint32_t address, uint32_t size)
+{
+    int result = -1;
+
+    eraseFlashOnce();
+    if (isInFlash(address, size) && (address % get_page_size() == 0) &&
+        (size % get_page_size() == 0)) {
+        for (uint32_t x = 0; x < size; x++) {
+            gFlash[address + x] &= ((const uint8_t *) pBuffer)[x];
+        }
+        result = 0;
+    }
+
+    return result;
+}
+
+// Erase sectors of the simulated flash.
+int FlashIAP::erase(uint32_t address, uint32_t size)
+{
+    int result = -1;
+
+    eraseFlashOnce();
+    if (isInFlash(address, size) && (address % get_sector_size(address) == 0) &&
+        (size % get_sector_size(address) == 0)) {
+        memset(gFlash + address, 0xFF, size);
+        result = 0;
+    }
+
+    return result;
+}
+
+// End Of File
@@ -0,0 +1,189 @@
+/* mbed Microcontroller Library
+ * Copyright (c) 2006-2018 u-blox Limited
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Stress the reading queue between BLE and the data stores from
+ * two threads: a BLE thread adds readings, as the BLE callbacks
+ * do, while a consumer thread takes them out through the data
+ * functions of the API.  Each reading is a sequence number, so
+ * the consumer can check that none arrive out of order; then,
+ * with the consumer idle, the BLE side must empty the queue by
+ * itself so that no reading is dropped.
+ *
+ * The static functions of ble_data_gather are needed, hence it
+ * is included rather than linked.
+ */
+
+#include <pthread.h>
+#include <sched.h>
+#include "../ble_data_gather.cpp"
+
+/**************************************************************************
+ * MACROS
+ *************************************************************************/
+
+/** The number of readings the BLE thread adds while the consumer
+ * is taking them out.
+ */
+#ifndef STRESS_NUM_READINGS
+#define STRESS_NUM_READINGS 1000000
+#endif
+
+/** The number of readings the BLE thread adds with the consumer idle.
+ */
+#define STRESS_NUM_IDLE_READINGS (BLE_READING_QUEUE_SIZE * 10)
+
+/** The data store size, in data items.
+ */
+#define STRESS_MAX_NUM_DATA_ITEMS 1000
+
+/**************************************************************************
+ * LOCAL VARIABLES
+ *************************************************************************/
+
+/** The address of the one device.
+ */
+static const char gAddress[BLEProtocol::ADDR_LEN] = {1, 2, 3, 4, 5, 6};
+
+/** The name of the one device.
+ */
+static const char *gpName = "STRESS";
+
+/** The Device Name pointer of the one device, as the data
+ * functions of the API want it.
+ */
+static const char *gpDeviceName = NULL;
+
+/**************************************************************************
+ * STATIC FUNCTIONS
+ *************************************************************************/
+
+// Add readings from the BLE side, waiting while the queue is
+// full as the consumer will empty it.
+static void *bleThread(void *pContext)
+{
+    int numReadings = *(int *) pContext;
+    uint32_t value;
+    int numQueued;
+
+    for (int x = 0; x < numReadings; x++) {
+        value = x;
+        do {
+            LOCK();
+            numQueued = addBleData(gAddress, 0, 0, (const char *) &value, sizeof(value));
+            UNLOCK();
+            if (numQueued == 0) {
+                sched_yield();
+            }
+        } while (numQueued == 0);
+    }
+
+    return NULL;
+}
+
+// Take readings out until the last one has been seen, checking
+// that they are in order.
+static bool consume(int numReadings)
+{
+    BleData *pDataItem;
+    int64_t last = -1;
+    uint32_t value;
+    int numGaps = 0;
+    bool success = true;
+
+    while (success && (last < numReadings - 1)) {
+        pDataItem = pBleGetFirstDataItem(gpDeviceName, true);
+        if (pDataItem != NULL) {
+            memcpy(&value, pDataItem->pData, sizeof(value));
+            if ((int64_t) value <= last) {
+                printf("Reading %u came after reading %lld.\n", (unsigned) value, (long long) last);
+                success = false;
+            }
+            if ((int64_t) value != last + 1) {
+                numGaps++;
+            }
+            last = value;
+            free(pDataItem->pData);
+            free(pDataItem);
+        } else {
+            sched_yield();
+        }
+    }
+    printf("%d reading(s) in order, %d gap(s) where the data store was full.\n",
+           (int) (last + 1), numGaps);
+
+    return success;
+}
+
+/**************************************************************************
+ * PUBLIC FUNCTIONS
+ *************************************************************************/
+
+int main()
+{
+    BleDevice *pBleDevice;
+    pthread_t thread;
+    int numReadings = STRESS_NUM_READINGS;
+    int numDataItems;
+    int numDropped;
+    bool success;
+
+    bleInit(gpName, 0xFFE1, 1, STRESS_MAX_NUM_DATA_ITEMS, NULL, false);
+
+    // One wanted device with a data store, as actOnObservedData()
+    // would leave it
+    pBleDevice = pAddBleDeviceToList(gAddress, 0);
+    success = (pBleDevice != NULL) && allocBleDeviceDetail(pBleDevice);
+    if (success) {
+        pBleDevice->pDetail->pDataStore = pAllocBleDataStore();
+        pBleDevice->pDetail->pDeviceName = pAllocBleDeviceName(gpName, strlen(gpName));
+        pBleDevice->deviceState = BLE_DEVICE_STATE_IS_WANTED;
+        gpDeviceName = pBleGetFirstDeviceName();
+        success = (pBleDevice->pDetail->pDataStore != NULL) && (gpDeviceName != NULL);
+    }
+    if (!success) {
+        printf("Unable to set up the device.\n");
+    }
+
+    // Both sides at once
+    if (success) {
+        pthread_create(&thread, NULL, bleThread, &numReadings);
+        success = consume(numReadings);
+        pthread_join(thread, NULL);
+    }
+
+    // The BLE side alone: the queue fills many times over and
+    // must be emptied from the BLE side without dropping anything
+    if (success) {
+        numReadings = STRESS_NUM_IDLE_READINGS;
+        numDropped = gBleStats.numReadingsDropped;
+        bleThread(&numReadings);
+        numDropped = gBleStats.numReadingsDropped - numDropped;
+        numDataItems = bleGetNumDataItems(gpDeviceName);
+        printf("%d reading(s) with the consumer idle, %d data item(s) stored, %d reading(s) dropped.\n",
+               numReadings, numDataItems, numDropped);
+        success = (numDropped == 0) && (numDataItems == numReadings);
+    }
+
+    if (success) {
+        printf("Passed.\n");
+    } else {
+        printf("FAILED.\n");
+    }
+
+    return success ? 0 : 1;
+}
+
+// End Of File
@@ -0,0 +1,444 @@
+/* mbed Microcontroller Library
+ * Copyright (c) 2006-2018 u-blox Limited
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Host stand-in for the mbed BLE API, as far as ble_data_gather
+ * uses it.  The types follow mbed OS 5.8; the behaviour is that
+ * of a simulated stack and the peripherals around it, see
+ * host/sim_ble.h.
+ */
+
+#ifndef _HOST_BLE_BLE_H_
+#define _HOST_BLE_BLE_H_
+
+#include "mbed.h"
+#include <vector>
+
+/**********************************************************************
+ * MACROS
+ **********************************************************************/
+
+#define BLE_HVX_NOTIFICATION 0x01
+#define BLE_HVX_INDICATION 0x02
+
+/**********************************************************************
+ * TYPES
+ **********************************************************************/
+
+// As in mbed, an enum rather than macros, so that
+// BLE_UUID_UNKNOWN is never taken for a null pointer
+enum {
+    BLE_UUID_UNKNOWN = 0x0000,
+    BLE_UUID_GAP = 0x1800,
+    BLE_UUID_GAP_CHARACTERISTIC_DEVICE_NAME = 0x2A00,
+    BLE_UUID_DESCRIPTOR_CHAR_USER_DESC = 0x2901,
+    BLE_UUID_DESCRIPTOR_CLIENT_CHAR_CONFIG = 0x2902
+};
+
+typedef enum {
+    BLE_ERROR_NONE = 0,
+    BLE_ERROR_BUFFER_OVERFLOW = 1,
+    BLE_ERROR_NOT_IMPLEMENTED = 2,
+    BLE_ERROR_PARAM_OUT_OF_RANGE = 3,
+    BLE_ERROR_INVALID_PARAM = 4,
+    BLE_STACK_BUSY = 5,
+    BLE_ERROR_INVALID_STATE = 6,
+    BLE_ERROR_NO_MEM = 7,
+    BLE_ERROR_OPERATION_NOT_PERMITTED = 8,
+    BLE_ERROR_INITIALIZATION_INCOMPLETE = 9,
+    BLE_ERROR_ALREADY_INITIALIZED = 10,
+    BLE_ERROR_UNSPECIFIED = 11,
+    BLE_ERROR_INTERNAL_STACK_FAILURE = 12
+} ble_error_t;
+
+namespace BLEProtocol {
+    namespace AddressType {
+        enum Type {
+            PUBLIC = 0,
+            RANDOM_STATIC,
+            RANDOM_PRIVATE_RESOLVABLE,
+            RANDOM_PRIVATE_NON_RESOLVABLE
+        };
+    }
+    typedef AddressType::Type AddressType_t;
+    static const size_t ADDR_LEN = 6;
+    typedef uint8_t AddressBytes_t[ADDR_LEN];
+}
+
+/** A 16-bit or a 128-bit UUID; as in mbed, a 128-bit UUID is
+ * held least significant byte first and its bytes 12 and 13
+ * are its 16-bit alias.
+ */
+class UUID {
+public:
+    enum UUID_Type_t {UUID_TYPE_SHORT = 0, UUID_TYPE_LONG = 1};
+    enum ByteOrder_t {MSB, LSB};
+    typedef uint16_t ShortUUIDBytes_t;
+    static const unsigned LENGTH_OF_LONG_UUID = 16;
+    typedef uint8_t LongUUIDBytes_t[LENGTH_OF_LONG_UUID];
+
+    UUID() : _type(UUID_TYPE_SHORT), _shortUuid(BLE_UUID_UNKNOWN) {memset(_baseUuid, 0, sizeof(_baseUuid));}
+    UUID(ShortUUIDBytes_t shortUuid) : _type(UUID_TYPE_SHORT), _shortUuid(shortUuid) {memset(_baseUuid, 0, sizeof(_baseUuid));}
+    UUID(const LongUUIDBytes_t longUuid, ByteOrder_t order = MSB) : _type(UUID_TYPE_LONG) {
+        for (unsigned x = 0; x < LENGTH_OF_LONG_UUID; x++) {
+            _baseUuid[x] = (order == MSB) ? longUuid[LENGTH_OF_LONG_UUID - 1 - x] : longUuid[x];
+        }
+        _shortUuid = (uint16_t) ((_baseUuid[13] << 8) | _baseUuid[12]);
+    }
+    UUID_Type_t shortOrLong() const {return _type;}
+    const uint8_t *getBaseUUID() const {return (_type == UUID_TYPE_SHORT) ? (const uint8_t *) &_shortUuid : _baseUuid;}
+    ShortUUIDBytes_t getShortUUID() const {return _shortUuid;}
+    uint8_t getLen() const {return (_type == UUID_TYPE_SHORT) ? sizeof(ShortUUIDBytes_t) : LENGTH_OF_LONG_UUID;}
+    bool operator==(const UUID &other) const {
+        return (_type == other._type) &&
+               (((_type == UUID_TYPE_SHORT) && (_shortUuid == other._shortUuid)) ||
+                ((_type == UUID_TYPE_LONG) && (memcmp(_baseUuid, other._baseUuid, LENGTH_OF_LONG_UUID) == 0)));
+    }
+    bool operator!=(const UUID &other) const {return !(*this == other);}
+private:
+    UUID_Type_t _type;
+    LongUUIDBytes_t _baseUuid;
+    ShortUUIDBytes_t _shortUuid;
+};
+
+class GattAttribute {
+public:
+    typedef uint16_t Handle_t;
+};
+
+class GapAdvertisingData {
+public:
+    enum DataType_t {
+        FLAGS = 0x01,
+        INCOMPLETE_LIST_16BIT_SERVICE_IDS = 0x02,
+        COMPLETE_LIST_16BIT_SERVICE_IDS = 0x03,
+        SHORTENED_LOCAL_NAME = 0x08,
+        COMPLETE_LOCAL_NAME = 0x09,
+        SERVICE_DATA = 0x16,
+        MANUFACTURER_SPECIFIC_DATA = 0xFF
+    };
+    enum Flags_t {
+        LE_LIMITED_DISCOVERABLE = 0x01,
+        LE_GENERAL_DISCOVERABLE = 0x02,
+        BREDR_NOT_SUPPORTED = 0x04
+    };
+};
+
+class GapAdvertisingParams {
+public:
+    enum AdvertisingType_t {
+        ADV_CONNECTABLE_UNDIRECTED,
+        ADV_CONNECTABLE_DIRECTED,
+        ADV_SCANNABLE_UNDIRECTED,
+        ADV_NON_CONNECTABLE_UNDIRECTED
+    };
+};
+
+class GapScanningParams {
+public:
+    GapScanningParams(uint16_t interval = 0x4000, uint16_t window = 0x4000,
+                      uint16_t timeout = 0, bool activeScanning = false) :
+        _interval(interval), _window(window), _timeout(timeout), _activeScanning(activeScanning) {}
+    uint16_t getInterval() const {return _interval;}
+    uint16_t getWindow() const {return _window;}
+    uint16_t getTimeout() const {return _timeout;}
+    bool getActiveScanning() const {return _activeScanning;}
+private:
+    uint16_t _interval;
+    uint16_t _window;
+    uint16_t _timeout;
+    bool _activeScanning;
+};
+
+class Gap {
+public:
+    typedef uint16_t Handle_t;
+    typedef BLEProtocol::AddressType_t AddressType_t;
+    typedef BLEProtocol::AddressBytes_t Address_t;
+
+    enum Role_t {PERIPHERAL = 0x1, CENTRAL = 0x2};
+    enum DisconnectionReason_t {
+        CONNECTION_TIMEOUT = 0x08,
+        REMOTE_USER_TERMINATED_CONNECTION = 0x13,
+        LOCAL_HOST_TERMINATED_CONNECTION = 0x16
+    };
+    enum TimeoutSource_t {
+        TIMEOUT_SRC_ADVERTISING = 0x00,
+        TIMEOUT_SRC_SECURITY_REQUEST = 0x01,
+        TIMEOUT_SRC_SCAN = 0x02,
+        TIMEOUT_SRC_CONN = 0x03
+    };
+
+    typedef struct {
+        uint16_t minConnectionInterval; /// In 1.25 ms units.
+        uint16_t maxConnectionInterval; /// In 1.25 ms units.
+        uint16_t slaveLatency;
+        uint16_t connectionSupervisionTimeout; /// In 10 ms units.
+    } ConnectionParams_t;
+
+    struct AdvertisementCallbackParams_t {
+        BLEProtocol::AddressBytes_t peerAddr;
+        int8_t rssi;
+        bool isScanResponse;
+        GapAdvertisingParams::AdvertisingType_t type;
+        uint8_t advertisingDataLen;
+        const uint8_t *advertisingData;
+        AddressType_t addressType;
+    };
+
+    struct ConnectionCallbackParams_t {
+        Handle_t handle;
+        Role_t role;
+        AddressType_t peerAddrType;
+        BLEProtocol::AddressBytes_t peerAddr;
+        AddressType_t ownAddrType;
+        BLEProtocol::AddressBytes_t ownAddr;
+        const ConnectionParams_t *connectionParams;
+    };
+
+    struct DisconnectionCallbackParams_t {
+        Handle_t handle;
+        DisconnectionReason_t reason;
+    };
+
+    typedef void (*AdvertisementCallback_t)(const AdvertisementCallbackParams_t *pParams);
+    typedef void (*ConnectionCallback_t)(const ConnectionCallbackParams_t *pParams);
+    typedef void (*DisconnectionCallback_t)(const DisconnectionCallbackParams_t *pParams);
+    typedef void (*TimeoutCallback_t)(TimeoutSource_t source);
+
+    ble_error_t getAddress(AddressType_t *pType, Address_t address);
+    ble_error_t setScanParams(uint16_t interval, uint16_t window, uint16_t timeout = 0,
+                              bool activeScanning = false);
+    ble_error_t startScan(AdvertisementCallback_t callback);
+    ble_error_t stopScan();
+    ble_error_t connect(const BLEProtocol::AddressBytes_t peerAddr, AddressType_t peerAddrType,
+                        const ConnectionParams_t *pConnectionParams,
+                        const GapScanningParams *pScanParams);
+    ble_error_t disconnect(Handle_t connectionHandle, DisconnectionReason_t reason);
+    // As in mbed, these add to a chain of callbacks rather than replace
+    void onConnection(ConnectionCallback_t callback) {_connectionCallbacks.push_back(callback);}
+    void onDisconnection(DisconnectionCallback_t callback) {_disconnectionCallbacks.push_back(callback);}
+    void onTimeout(TimeoutCallback_t callback) {_timeoutCallbacks.push_back(callback);}
+
+    // For the host stack only
+    std::vector<ConnectionCallback_t> _connectionCallbacks;
+    std::vector<DisconnectionCallback_t> _disconnectionCallbacks;
+    std::vector<TimeoutCallback_t> _timeoutCallbacks;
+};
+
+struct GattReadCallbackParams {
+    Gap::Handle_t connHandle;
+    GattAttribute::Handle_t handle;
+    uint16_t offset;
+    uint16_t len;
+    const uint8_t *data;
+    ble_error_t status;
+};
+
+struct GattHVXCallbackParams {
+    Gap::Handle_t connHandle;
+    GattAttribute::Handle_t handle;
+    uint8_t type;
+    uint16_t len;
+    const uint8_t *data;
+};
+
+// As in mbed, a GATT client gets the status of a write in
+// place of its length and data
+struct GattWriteCallbackParams {
+    enum WriteOp_t {
+        OP_INVALID = 0x00,
+        OP_WRITE_REQ = 0x01,
+        OP_WRITE_CMD = 0x02
+    };
+    Gap::Handle_t connHandle;
+    GattAttribute::Handle_t handle;
+    WriteOp_t writeOp;
+    uint16_t offset;
+    union {
+        uint16_t len;
+        ble_error_t status;
+    };
+    union {
+        const uint8_t *data;
+        uint8_t error_code;
+    };
+};
+
+class DiscoveredService {
+public:
+    DiscoveredService() : _startHandle(0), _endHandle(0) {}
+    void setup(const UUID &uuid, GattAttribute::Handle_t startHandle, GattAttribute::Handle_t endHandle) {
+        _uuid = uuid;
+        _startHandle = startHandle;
+        _endHandle = endHandle;
+    }
+    const UUID &getUUID() const {return _uuid;}
+    GattAttribute::Handle_t getStartHandle() const {return _startHandle;}
+    GattAttribute::Handle_t getEndHandle() const {return _endHandle;}
+private:
+    UUID _uuid;
+    GattAttribute::Handle_t _startHandle;
+    GattAttribute::Handle_t _endHandle;
+};
+
+class DiscoveredCharacteristic;
+
+class DiscoveredCharacteristicDescriptor {
+public:
+    DiscoveredCharacteristicDescriptor(Gap::Handle_t connectionHandle, GattAttribute::Handle_t attributeHandle,
+                                       const UUID &uuid) :
+        _connectionHandle(connectionHandle), _attributeHandle(attributeHandle), _uuid(uuid) {}
+    const UUID &getUUID() const {return _uuid;}
+    GattAttribute::Handle_t getAttributeHandle() const {return _attributeHandle;}
+    Gap::Handle_t getConnectionHandle() const {return _connectionHandle;}
+private:
+    Gap::Handle_t _connectionHandle;
+    GattAttribute::Handle_t _attributeHandle;
+    UUID _uuid;
+};
+
+class CharacteristicDescriptorDiscovery {
+public:
+    struct DiscoveryCallbackParams_t {
+        const DiscoveredCharacteristic &characteristic;
+        const DiscoveredCharacteristicDescriptor &descriptor;
+    };
+    struct TerminationCallbackParams_t {
+        const DiscoveredCharacteristic &characteristic;
+        ble_error_t status;
+        uint8_t error_code;
+    };
+    // In mbed these are FunctionPointerWithContext, which a
+    // pointer to a function converts to
+    typedef void (*DiscoveryCallback_t)(const DiscoveryCallbackParams_t *pParams);
+    typedef void (*TerminationCallback_t)(const TerminationCallbackParams_t *pParams);
+};
+
+class DiscoveredCharacteristic {
+public:
+    struct Properties_t {
+        uint8_t _broadcast :1;
+        uint8_t _read :1;
+        uint8_t _writeWoResp :1;
+        uint8_t _write :1;
+        uint8_t _notify :1;
+        uint8_t _indicate :1;
+        uint8_t _authSignedWrite :1;
+        bool broadcast() const {return _broadcast;}
+        bool read() const {return _read;}
+        bool writeWoResp() const {return _writeWoResp;}
+        bool write() const {return _write;}
+        bool notify() const {return _notify;}
+        bool indicate() const {return _indicate;}
+        bool authSignedWrite() const {return _authSignedWrite;}
+    };
+    DiscoveredCharacteristic() : _connectionHandle(0), _declHandle(0), _valueHandle(0), _lastHandle(0) {
+        memset(&_properties, 0, sizeof(_properties));
+    }
+    const UUID &getUUID() const {return _uuid;}
+    const Properties_t &getProperties() const {return _properties;}
+    GattAttribute::Handle_t getDeclHandle() const {return _declHandle;}
+    GattAttribute::Handle_t getValueHandle() const {return _valueHandle;}
+    GattAttribute::Handle_t getLastHandle() const {return _lastHandle;}
+    Gap::Handle_t getConnectionHandle() const {return _connectionHandle;}
+    ble_error_t discoverDescriptors(const CharacteristicDescriptorDiscovery::DiscoveryCallback_t &onDescriptorDiscovered,
+                                    const CharacteristicDescriptorDiscovery::TerminationCallback_t &onTermination) const;
+
+    // For the host stack only
+    UUID _uuid;
+    Properties_t _properties;
+    Gap::Handle_t _connectionHandle;
+    GattAttribute::Handle_t _declHandle;
+    GattAttribute::Handle_t _valueHandle;
+    GattAttribute::Handle_t _lastHandle;
+};
+
+class GattClient {
+public:
+    enum WriteOp_t {
+        GATT_OP_WRITE_REQ = 0x01,
+        GATT_OP_WRITE_CMD = 0x02
+    };
+
+    typedef void (*ServiceCallback_t)(const DiscoveredService *pService);
+    typedef void (*CharacteristicCallback_t)(const DiscoveredCharacteristic *pCharacteristic);
+    typedef void (*TerminationCallback_t)(Gap::Handle_t connectionHandle);
+    typedef void (*ReadCallback_t)(const GattReadCallbackParams *pParams);
+    typedef void (*HVXCallback_t)(const GattHVXCallbackParams *pParams);
+    typedef void (*WriteCallback_t)(const GattWriteCallbackParams *pParams);
+
+    ble_error_t launchServiceDiscovery(Gap::Handle_t connectionHandle,
+                                       ServiceCallback_t serviceCallback = NULL,
+                                       CharacteristicCallback_t characteristicCallback = NULL,
+                                       const UUID &matchingServiceUuid = UUID::ShortUUIDBytes_t(BLE_UUID_UNKNOWN),
+                                       const UUID &matchingCharacteristicUuid = UUID::ShortUUIDBytes_t(BLE_UUID_UNKNOWN));
+    void terminateServiceDiscovery();
+    bool isServiceDiscoveryActive() const;
+    ble_error_t read(Gap::Handle_t connectionHandle, GattAttribute::Handle_t attributeHandle,
+                     uint16_t offset) const;
+    ble_error_t write(WriteOp_t cmd, Gap::Handle_t connectionHandle, GattAttribute::Handle_t attributeHandle,
+                      size_t length, const uint8_t *pValue) const;
+    // As in mbed, onDataRead(), onDataWritten() and onHVX() add to a chain of callbacks
+    void onServiceDiscoveryTermination(TerminationCallback_t callback) {_terminationCallback = callback;}
+    void onDataRead(ReadCallback_t callback) {_readCallbacks.push_back(callback);}
+    void onDataWritten(WriteCallback_t callback) {_writeCallbacks.push_back(callback);}
+    void onHVX(HVXCallback_t callback) {_hvxCallbacks.push_back(callback);}
+
+    // For the host stack only
+    GattClient() : _terminationCallback(NULL) {}
+    TerminationCallback_t _terminationCallback;
+    std::vector<ReadCallback_t> _readCallbacks;
+    std::vector<WriteCallback_t> _writeCallbacks;
+    std::vector<HVXCallback_t> _hvxCallbacks;
+};
+
+class BLE {
+public:
+    typedef unsigned InstanceID_t;
+    static const InstanceID_t DEFAULT_INSTANCE = 0;
+    static const InstanceID_t NUM_INSTANCES = 1;
+
+    struct InitializationCompleteCallbackContext {
+        BLE &ble;
+        ble_error_t error;
+    };
+    struct OnEventsToProcessCallbackContext {
+        BLE &ble;
+    };
+    typedef void (*InitializationCompleteCallback_t)(InitializationCompleteCallbackContext *pContext);
+    typedef void (*OnEventsToProcessCallback_t)(OnEventsToProcessCallbackContext *pContext);
+
+    static BLE &Instance(InstanceID_t id = DEFAULT_INSTANCE);
+    ble_error_t init(InitializationCompleteCallback_t callback);
+    bool hasInitialized() const;
+    ble_error_t shutdown();
+    InstanceID_t getInstanceID() const {return DEFAULT_INSTANCE;}
+    Gap &gap() {return _gap;}
+    GattClient &gattClient() {return _gattClient;}
+    void onEventsToProcess(OnEventsToProcessCallback_t callback) {_eventsToProcessCallback = callback;}
+    void processEvents();
+    static const char *errorToString(ble_error_t error);
+
+    // For the host stack only
+    BLE() : _eventsToProcessCallback(NULL) {}
+    Gap _gap;
+    GattClient _gattClient;
+    OnEventsToProcessCallback_t _eventsToProcessCallback;
+};
+
+#endif // _HOST_BLE_BLE_H_
+
+// End Of File
@@ -0,0 +1,11 @@
+/* Host stand-in: everything is declared in ble/BLE.h.
+ */
+
+#ifndef _HOST_BLE_DISCOVEREDSERVICE_H_
+#define _HOST_BLE_DISCOVEREDSERVICE_H_
+
+#include "ble/BLE.h"
+
+#endif // _HOST_BLE_DISCOVEREDSERVICE_H_
+
+// End Of File
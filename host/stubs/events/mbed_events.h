@@ -0,0 +1,11 @@
+/* Host stand-in: everything is declared in mbed.h.
+ */
+
+#ifndef _HOST_EVENTS_MBED_EVENTS_H_
+#define _HOST_EVENTS_MBED_EVENTS_H_
+
+#include "mbed.h"
+
+#endif // _HOST_EVENTS_MBED_EVENTS_H_
+
+// End Of File
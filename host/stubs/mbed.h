@@ -0,0 +1,225 @@
+/* mbed Microcontroller Library
+ * Copyright (c) 2006-2018 u-blox Limited
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Host stand-in for the parts of mbed OS that ble_data_gather uses.
+ * Everything runs in virtual time: Timer, time() and the event
+ * queue all follow one simulated clock, which only moves forward
+ * when EventQueue::dispatch() (or simRunFor()) runs events, so a
+ * 30 second BLE window takes as long as its callbacks take to run.
+ */
+
+#ifndef _HOST_MBED_H_
+#define _HOST_MBED_H_
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <assert.h>
+#include <pthread.h>
+#include <functional>
+
+/**********************************************************************
+ * MACROS
+ **********************************************************************/
+
+#define DEVICE_FLASH 1
+#define MBED_ASSERT(expr) assert(expr)
+#define __DMB() __sync_synchronize()
+
+/** As in mbed events, the size of an event, used to size the queue.
+ */
+#define EVENTS_EVENT_SIZE 64
+
+/** The Unix time at which the simulated clock starts.
+ */
+#define SIM_START_UNIX_TIME 1514764800
+
+/**********************************************************************
+ * SIMULATED CLOCK
+ **********************************************************************/
+
+/** Get the simulated time.
+ *
+ * @return the microseconds since the simulation started.
+ */
+int64_t simNowUs();
+
+/** Schedule a function to run at a given simulated time; this is
+ * how the event queue and the simulated BLE world both keep time.
+ *
+ * @param dueUs    the simulated time at which to run the function.
+ * @param periodUs if greater than zero, the function is run again
+ *                 every periodUs until it is cancelled.
+ * @param function the function.
+ * @param pOwner   the owner of the event (e.g. an EventQueue), so
+ *                 that events can be counted per owner, may be NULL.
+ * @return         the ID of the event, never zero.
+ */
+int simSchedule(int64_t dueUs, int64_t periodUs, std::function<void()> function,
+                const void *pOwner);
+
+/** Cancel a scheduled function.
+ *
+ * @param id the ID returned by simSchedule().
+ * @return   true if the event was found, else false.
+ */
+bool simCancel(int id);
+
+/** Get the number of scheduled events belonging to an owner.
+ *
+ * @param pOwner the owner.
+ * @return       the number of events.
+ */
+int simNumEvents(const void *pOwner);
+
+/** Run events, in order of simulated time, for a period of
+ * simulated time or until *pStop becomes true.
+ *
+ * @param durationMs the period, -1 to run until *pStop becomes true
+ *                   or there are no more events.
+ * @param pStop      a flag to stop early, may be NULL.
+ */
+void simRunFor(int durationMs, volatile bool *pStop);
+
+/** Move the simulated clock on without running events, as a
+ * blocking wait would.
+ *
+ * @param durationUs the time to move on by.
+ */
+void simWaitUs(int64_t durationUs);
+
+/** Throw away every scheduled event and set the simulated
+ * clock back to zero.
+ */
+void simReset();
+
+/** Block for a number of milliseconds (of simulated time).
+ *
+ * @param ms the number of milliseconds.
+ */
+void wait_ms(int ms);
+
+/**********************************************************************
+ * CLASSES
+ **********************************************************************/
+
+template <typename F> class Callback;
+
+/** Just enough of mbed's Callback to bind an object and a method.
+ */
+template <typename R> class Callback<R()> {
+public:
+    template <typename T, typename M>
+    Callback(T *pObject, M method) : _function(std::bind(method, pObject)) {}
+    R operator()() const {return _function();}
+private:
+    std::function<R()> _function;
+};
+
+/** A timer that reads the simulated clock.
+ */
+class Timer {
+public:
+    Timer() : _running(false), _startUs(0), _elapsedUs(0) {}
+    void start() {if (!_running) {_startUs = simNowUs(); _running = true;}}
+    void stop() {if (_running) {_elapsedUs += simNowUs() - _startUs; _running = false;}}
+    void reset() {_startUs = simNowUs(); _elapsedUs = 0;}
+    int read_us() {return (int) readUs();}
+    int read_ms() {return (int) (readUs() / 1000);}
+    float read() {return (float) readUs() / 1000000;}
+private:
+    int64_t readUs() {return _elapsedUs + (_running ? simNowUs() - _startUs : 0);}
+    bool _running;
+    int64_t _startUs;
+    int64_t _elapsedUs;
+};
+
+/** A recursive mutex, as rtos::Mutex is.
+ */
+class Mutex {
+public:
+    Mutex() {
+        pthread_mutexattr_t attr;
+        pthread_mutexattr_init(&attr);
+        pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+        pthread_mutex_init(&_mutex, &attr);
+        pthread_mutexattr_destroy(&attr);
+    }
+    ~Mutex() {pthread_mutex_destroy(&_mutex);}
+    void lock() {pthread_mutex_lock(&_mutex);}
+    bool trylock() {return pthread_mutex_trylock(&_mutex) == 0;}
+    void unlock() {pthread_mutex_unlock(&_mutex);}
+private:
+    pthread_mutex_t _mutex;
+};
+
+/** Internal flash, held in RAM for the life of the process so
+ * that what is saved in one BLE cycle can be loaded in the next.
+ */
+class FlashIAP {
+public:
+    int init() {return 0;}
+    int deinit() {return 0;}
+    uint32_t get_flash_start() {return 0;}
+    uint32_t get_flash_size();
+    uint32_t get_sector_size(uint32_t address) {(void) address; return 4096;}
+    uint32_t get_page_size() {return 4;}
+    int read(void *pBuffer, uint32_t address, uint32_t size);
+    int program(const void *pBuffer, uint32_t address, uint32_t size);
+    int erase(uint32_t address, uint32_t size);
+};
+
+/** An event queue that runs its events in simulated time.  As
+ * with mbed events, an event can only be queued if there is room
+ * for it, zero being returned otherwise, and a break_dispatch()
+ * that arrives while the queue is not being dispatched ends the
+ * next dispatch() straight away.
+ */
+class EventQueue {
+public:
+    EventQueue(unsigned size = 32 * EVENTS_EVENT_SIZE) :
+        _maxNumEvents(size / EVENTS_EVENT_SIZE), _break(false) {}
+    template <typename F>
+    int call(F function) {return post(0, 0, [=]() mutable {function();});}
+    template <typename F, typename A>
+    int call(F function, A a) {return post(0, 0, [=]() mutable {function(a);});}
+    template <typename F>
+    int call_in(int ms, F function) {return post(ms, 0, [=]() mutable {function();});}
+    template <typename F, typename A>
+    int call_in(int ms, F function, A a) {return post(ms, 0, [=]() mutable {function(a);});}
+    template <typename F>
+    int call_every(int ms, F function) {return post(ms, ms, [=]() mutable {function();});}
+    void cancel(int id) {simCancel(id);}
+    void dispatch(int ms = -1) {simRunFor(ms, &_break); _break = false;}
+    void dispatch_forever() {dispatch(-1);}
+    void break_dispatch() {_break = true;}
+private:
+    int post(int ms, int periodMs, std::function<void()> function) {
+        int id = 0;
+        if (simNumEvents(this) < _maxNumEvents) {
+            id = simSchedule(simNowUs() + (int64_t) ms * 1000, (int64_t) periodMs * 1000, function, this);
+        }
+        return id;
+    }
+    int _maxNumEvents;
+    volatile bool _break;
+};
+
+#endif // _HOST_MBED_H_
+
+// End Of File
@@ -78,6 +78,12 @@
 // The prefix for BLE peer devices we want to connect to
 #define BLE_PEER_DEVICE_NAME_PREFIX "NINA-B1"
 
+// The most BLE peer devices to gather data from
+#define BLE_MAX_NUM_WANTED_DEVICES 16
+
+// The most heap that BLE may take
+#define BLE_MEMORY_BUDGET_BYTES 12288
+
 // Debug LED
 #define LONG_PULSE_MS        500
 #define SHORT_PULSE_MS       50
@@ -121,8 +127,16 @@ static DigitalOut debugLedBar(LED1, 1);
 // Flag to indicate the modem that is attached
 static bool useR4Modem = false;
 
-// The wake-up event queue
-static EventQueue wakeUpEventQueue(/* event count */ 10 * EVENTS_EVENT_SIZE);
+// The wake-up event queue, which BLE also runs on
+static EventQueue wakeUpEventQueue(/* event count */ 20 * EVENTS_EVENT_SIZE);
+
+#ifdef ENABLE_BLE
+// The ID of the event that prints BLE status while BLE is running
+static int bleStatusEventId = 0;
+
+// Flag to indicate that BLE is running
+static bool bleRunning = false;
+#endif
 
 #ifdef ENABLE_RAM_STATS
 // Storage for heap stats
@@ -240,14 +254,29 @@ static bool powerIsGood()
     return !vBatSecOnBar;
 }
 
-// Print the BLE status
-static void printBleStatus(void)
+// Print a BLE data item, called by bleForEachDataItem()
+static bool printBleDataItem(const char *pDeviceName, int timestamp,
+                             int characteristicUuid, const char *pData,
+                             int dataLen, int numRepeats, void *pContext)
 {
-    const char *pDeviceName;
-    BleData *pBleData;
 #ifdef ENABLE_PRINTF
     char buf[32];
 #endif
+
+    victoryDebugLed(10);
+    PRINTF("%04x:0x%.*s", characteristicUuid, bytesToHexString(pData, dataLen, buf, sizeof(buf)), buf);
+    if (numRepeats > 0) {
+        PRINTF("(x%d)", numRepeats);
+    }
+    PRINTF(" ");
+
+    return true;
+}
+
+// Print the BLE status
+static void printBleStatus(void)
+{
+    const char *pDeviceName;
     int numDataItems;
     int numDevices = 0;
     
@@ -257,12 +286,7 @@ static void printBleStatus(void)
         PRINTF("** BLE device %d: %s, %d data item(s)", numDevices, pDeviceName, numDataItems);
         if (numDataItems > 0) {
             PRINTF(": ");
-            while ((pBleData = pBleGetFirstDataItem(pDeviceName, true)) != NULL) {
-                victoryDebugLed(10);
-                PRINTF("0x%.*s ", bytesToHexString(pBleData->pData, pBleData->dataLen, buf, sizeof(buf)), buf);
-                free(pBleData->pData);
-                free(pBleData);
-            }
+            bleForEachDataItem(pDeviceName, printBleDataItem, NULL, true);
         }
         PRINTF("\n");
     }
@@ -394,6 +418,41 @@ static void ramStats()
 }
 #endif
 
+// Do the cellular part of the wake-up event
+static void cellularWakeUp()
+{
+    getUdpResponse();
+    // Make sure the modem module is definitely off
+    onboard_modem_power_down();
+}
+
+#ifdef ENABLE_BLE
+// Called from the event queue when BLE has finished running
+static void bleDoneCallback(void *pContext)
+{
+    BleStats stats;
+
+    (void) pContext;
+
+    PRINTF("BLE ran for %d ms, scan radio-on time saved: %d ms.\n",
+           bleGetRunDurationMs(), bleGetScanTimeSavedMs());
+    bleGetStats(&stats);
+    PRINTF("BLE saw %d advertisement(s) (%d per second), %d device(s) turned away as the list was full,"
+           " %d reading(s) dropped, %d too long to store, longest lock %d us, most memory %d byte(s).\n",
+           stats.numAdvertisements, stats.advertisementsPerSecond, stats.numListFullRejections,
+           stats.numReadingsDropped, stats.numReadingsTooLong, stats.maxLockHoldUs, stats.maxMemoryBytes);
+    wakeUpEventQueue.cancel(bleStatusEventId);
+    bleDeinit();
+# if DEVICE_FLASH
+    bleSaveDiscoveryCache();
+# endif
+    // This blocks for a while, which is why it is done
+    // after BLE rather than alongside it
+    cellularWakeUp();
+    bleRunning = false;
+}
+#endif
+
 // Perform the wake-up event
 static void wakeUpTickCallback(void)
 {
@@ -401,22 +460,46 @@ static void wakeUpTickCallback(void)
     ramStats();
 #endif
 
-    if (powerIsGood()) {
 #ifdef ENABLE_BLE
+    if (bleRunning) {
+        PRINTF("BLE still running, skipping this wake-up.\n");
+    } else if (powerIsGood()) {
         PRINTF("BLE Scanning... (if you don't see dots appear below, try restarting your serial terminal).\n");
-        bleInit(BLE_PEER_DEVICE_NAME_PREFIX, TEMP_SRV_UUID_TEMP_CHAR, 100, &wakeUpEventQueue, false);
-        int x = wakeUpEventQueue.call_every(1000, printBleStatus);
-        bleRun(30000);
-        wait_ms(30000);
-        wakeUpEventQueue.cancel(x);
-        bleDeinit();
-#endif
-        getUdpResponse();
-        // Make sure the modem module is definitely off
-        onboard_modem_power_down();
+        bleInit(BLE_PEER_DEVICE_NAME_PREFIX, TEMP_SRV_UUID_TEMP_CHAR, BLE_MAX_NUM_WANTED_DEVICES, 100,
+                &wakeUpEventQueue, false);
+        bleSetObserverUuid(TEMP_SRV_UUID);
+        // These are in different services, so service discovery
+        // can't be targeted at just one of them
+        int bleCharacteristicUuids[] = {TEMP_SRV_UUID_TEMP_CHAR, ACC_SRV_UUID_XYZ_CHAR, GYRO_SRV_UUID_XYZ_CHAR};
+        bleSetWantedCharacteristicUuids(bleCharacteristicUuids, sizeof(bleCharacteristicUuids) / sizeof(bleCharacteristicUuids[0]));
+        bleSetAdaptiveScan(true);
+        // Stop once each sensor has given a few readings, or when
+        // there has been nothing new to find for a while
+        bleSetEarlyStop(3, 15000);
+        // Keep BLE out of the way of the cellular driver
+        bleSetMemoryBudget(BLE_MEMORY_BUDGET_BYTES);
+        // The sensors change slowly, only store what is new but
+        // at least one reading every five minutes
+        bleSetDeadband(NULL, 0, 300);
+        bleStatusEventId = wakeUpEventQueue.call_every(1000, printBleStatus);
+        // BLE runs on this event queue, bleDoneCallback() carries
+        // on with the rest of the wake-up event when it is done
+        bleRunning = bleStart(30000, bleDoneCallback, NULL);
+        if (!bleRunning) {
+            wakeUpEventQueue.cancel(bleStatusEventId);
+            bleDeinit();
+            cellularWakeUp();
+        }
     } else {
         bad(1);
     }
+#else
+    if (powerIsGood()) {
+        cellularWakeUp();
+    } else {
+        bad(1);
+    }
+#endif
 }
 
 /**************************************************************************
@@ -438,6 +521,11 @@ int main()
         useR4Modem = true;
     }
 
+#if defined(ENABLE_BLE) && DEVICE_FLASH
+    // Pick up what we knew about the BLE devices around us before the reset
+    bleLoadDiscoveryCache();
+#endif
+
     // Call this directly once at the start since I'm an impatient sort
     wakeUpTickCallback();
 